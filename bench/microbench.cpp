@@ -0,0 +1,896 @@
+/**
+ * @file bench/microbench.cpp
+ *
+ * @brief Microbenchmarks for the building blocks on the request path:
+ * hashing, message construction, message serialization/parsing, ring
+ * lookup, the transports, the server store, its eviction policies, its key sampler and its snapshots. Every benchmark runs
+ * in isolation. Only the reconnect storm and store per core benchmarks start a server. Each result is printed as one JSON object per line
+ * so that two runs can be diffed or fed to a script for A/B comparison.
+ *
+ * Usage: ./microbench [name-filter] [repetitions]
+ */
+
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+#include <string>
+#include "../src/client/client.hpp"
+#include "../src/hash/hash.hpp"
+#include "../src/server/keysampler.hpp"
+#include "../src/server/server.hpp"
+#include "../src/store/store.hpp"
+#include "../src/utils/compress.hpp"
+#include "../src/utils/conn.hpp"
+#include "../src/utils/message.hpp"
+#include "../src/utils/shmring.hpp"
+
+using namespace std;
+
+/* Ring members listen on consecutive ports starting here */
+#define RING_BASE_PORT 30000
+
+/* Port of the server of the reconnect storm benchmarks */
+#define STORM_PORT 29990
+
+/* Port of the server of the store per core benchmark */
+#define CORES_PORT 29980
+
+static string filter = "";
+static int repetitions = 5;
+
+/* Defeats dead code elimination of benchmarked results */
+static volatile unsigned long sink;
+
+/**
+ * @brief Exposes the ring of a `Client` to the benchmarks
+ */
+class BenchClient : public Client
+{
+    using Client::Client;
+
+public:
+    Connection *successor(const string &key)
+    {
+        return select_successor_server(key);
+    }
+
+    int ring_size()
+    {
+        return server_pool.size();
+    }
+};
+
+/**
+ * @brief Build `n` keys of length `len`
+ */
+static vector<string> make_keys(int n, int len)
+{
+    vector<string> keys;
+    for (int i = 0; i < n; i++)
+    {
+        string k = "key:" + to_string(i);
+        k.resize(max<size_t>(len, k.size()), 'x');
+        keys.push_back(k);
+    }
+    return keys;
+}
+
+/**
+ * @brief Run `fn` `repetitions` times and print the result as JSON.
+ *
+ * @param[in] name Name of the benchmark
+ * @param[in] param Parameter the benchmark was run with
+ * @param[in] threads Number of threads `fn` runs on
+ * @param[in] fn Runs the benchmark once and returns the number of
+ * operations it performed
+ */
+static void run(const string &name, const string &param, int threads,
+                function<long()> fn)
+{
+    if (name.find(filter) == string::npos)
+        return;
+
+    vector<double> ns_per_op;
+    long ops = 0;
+    for (int r = 0; r < repetitions; r++)
+    {
+        auto start = chrono::steady_clock::now();
+        ops = fn();
+        auto end = chrono::steady_clock::now();
+        double ns = chrono::duration<double, nano>(end - start).count();
+        ns_per_op.push_back(ns / ops);
+    }
+    sort(ns_per_op.begin(), ns_per_op.end());
+    double median = ns_per_op[ns_per_op.size() / 2];
+
+    printf("{\"bench\":\"%s\",\"param\":\"%s\",\"threads\":%d,\"ops\":%ld,"
+           "\"reps\":%d,\"ns_per_op_min\":%.2f,\"ns_per_op_median\":%.2f,"
+           "\"ops_per_sec\":%.0f}\n",
+           name.c_str(), param.c_str(), threads, ops, repetitions,
+           ns_per_op[0], median, 1e9 / median);
+    fflush(stdout);
+}
+
+static void bench_hash()
+{
+    for (int len : {8, 32, 100})
+    {
+        vector<string> keys = make_keys(1024, len);
+        run("get_hash", "key_len=" + to_string(len), 1, [&]()
+            {
+                long ops = 1000000;
+                for (long i = 0; i < ops; i++)
+                    sink += get_hash(keys[i & 1023]);
+                return ops; });
+    }
+}
+
+/**
+ * @brief compress and decompress JSON-like values of a few sizes
+ */
+static void bench_compress()
+{
+    for (int len : {1024, 16384, 262144})
+    {
+        string json, out, back;
+        for (int i = 0; (int)json.size() < len; i++)
+            json += "{\"id\":" + to_string(i) + ",\"name\":\"item\",\"tags\":[\"a\",\"b\"]},";
+        json.resize(len);
+        long ops = (16L << 20) / len;
+        compress_value(json, out); // also when compress_value is filtered out
+
+        run("compress_value", "v=" + to_string(len), 1, [&]()
+            {
+                for (long i = 0; i < ops; i++)
+                    sink += compress_value(json, out);
+                return ops; });
+        run("decompress_value", "v=" + to_string(len) + ",ratio=" +
+                                    to_string(json.size() / out.size()),
+            1, [&]()
+            {
+                for (long i = 0; i < ops; i++)
+                    sink += decompress_value(out.data(), out.size(), back);
+                return ops; });
+    }
+}
+
+static void bench_create_msgs()
+{
+    string key(32, 'k'), value(512, 'v');
+    long ops = 200000;
+
+    run("create_put_msg", "k=32,v=512", 1, [&]()
+        {
+            for (long i = 0; i < ops; i++)
+            {
+                msg_t *m = create_put_msg(key, value);
+                sink += m->type;
+                free(m);
+            }
+            return ops; });
+    run("create_get_msg", "k=32", 1, [&]()
+        {
+            for (long i = 0; i < ops; i++)
+            {
+                msg_t *m = create_get_msg(key);
+                sink += m->type;
+                free(m);
+            }
+            return ops; });
+    run("create_hit_msg", "v=512", 1, [&]()
+        {
+            for (long i = 0; i < ops; i++)
+            {
+                msg_t *m = create_hit_msg(value);
+                sink += m->type;
+                free(m);
+            }
+            return ops; });
+    run("create_ack_msg", "", 1, [&]()
+        {
+            for (long i = 0; i < ops; i++)
+            {
+                msg_t *m = create_ack_msg();
+                sink += m->type;
+                free(m);
+            }
+            return ops; });
+    run("create_miss_msg", "", 1, [&]()
+        {
+            for (long i = 0; i < ops; i++)
+            {
+                msg_t *m = create_miss_msg();
+                sink += m->type;
+                free(m);
+            }
+            return ops; });
+}
+
+/**
+ * @brief serialize a message with `send_msg` and parse it back
+ * with `read_msg` over a local socket pair
+ */
+static void bench_msg_roundtrip()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    {
+        perror("[bench] socketpair");
+        return;
+    }
+    msg_t *out = create_put_msg(string(32, 'k'), string(512, 'v'));
+    msg_t *in = make_msg_ref();
+
+    run("send_read_msg", "k=32,v=512", 1, [&]()
+        {
+            long ops = 50000;
+            for (long i = 0; i < ops; i++)
+            {
+                send_msg(fds[0], out);
+                read_msg(fds[1], in, -1);
+            }
+            sink += in->type;
+            return ops; });
+
+    // values past MAX_VSIZE are streamed after the message
+    string large(64 << 10, 'v');
+    vector<char> buf(large.size());
+    msg_t *out_large = create_put_msg(string(32, 'k'), large);
+    run("send_read_msg", "k=32,v=65536", 1, [&]()
+        {
+            long ops = 5000;
+            for (long i = 0; i < ops; i++)
+            {
+                send_msg(fds[0], out_large, large.data());
+                read_msg(fds[1], in, -1);
+                read_value(fds[1], buf.data(), in->vlen, -1);
+            }
+            sink += buf[0];
+            return ops; });
+
+    free(out_large);
+    free(out);
+    free(in);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/**
+ * @brief Request/response round trips of a get and a 512 byte hit
+ * between a client and an echoing peer, over loopback TCP on IPv4
+ * and IPv6, over a Unix domain socket and over shared memory rings
+ */
+static void bench_transport_roundtrip()
+{
+    if (string("transport_roundtrip").find(filter) == string::npos)
+        return;
+
+    vector<pair<string, endpoint_t>> transports = {
+        {"tcp", tcp_endpoint(RING_BASE_PORT - 1)},
+        {"tcp6", tcp_endpoint(RING_BASE_PORT - 2, "::1")},
+        {"unix", unix_endpoint("/tmp/memcached-mini-bench.sock")},
+        {"shm", unix_endpoint("/tmp/memcached-mini-bench.sock")},
+    };
+    transports.back().second.transport = TRANSPORT_SHM;
+    string value(512, 'v');
+
+    for (auto &t : transports)
+    {
+        int listenfd = start_listener(t.second);
+        if (listenfd < 0)
+        {
+            printf("[bench] %s: couldn't listen, skipped\n", t.first.c_str());
+            continue;
+        }
+
+        // answers every request with the same hit until the client leaves
+        thread peer([listenfd, &value]()
+                    {
+                        int fd = accept_client(listenfd);
+                        msg_t *req = make_msg_ref();
+                        msg_t *hit = create_hit_msg(value);
+                        msg_t *ack = create_ack_msg();
+                        while (fd >= 0 && read_msg(fd, req, -1) >= 0)
+                        {
+                            if (req->type != req_shm_attach_t)
+                            {
+                                send_msg(fd, hit);
+                                continue;
+                            }
+                            ShmChannel *ring = shm_accept(fd);
+                            send_msg(fd, ack);
+                            shm_bind(fd, ring);
+                        }
+                        free(ack);
+                        free(hit);
+                        free(req);
+                        shm_close(fd);
+                        close(fd); });
+
+        int fd = connect_server(t.second);
+        if (fd >= 0 && t.second.transport == TRANSPORT_SHM && shm_connect(fd, 1000) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        msg_t *get = create_get_msg(string(32, 'k'));
+        msg_t *in = make_msg_ref();
+        if (fd >= 0)
+            run("transport_roundtrip", "transport=" + t.first + ",v=512", 1, [&]()
+                {
+                    long ops = 20000;
+                    for (long i = 0; i < ops; i++)
+                    {
+                        send_msg(fd, get);
+                        read_msg(fd, in, -1);
+                    }
+                    sink += in->vlen;
+                    return ops; });
+
+        shm_close(fd);
+        close(fd);
+        shutdown(listenfd, SHUT_RDWR);
+        peer.join();
+        close(listenfd);
+        free(get);
+        free(in);
+        if (t.second.transport != TRANSPORT_TCP)
+            unlink(t.second.path.c_str());
+    }
+}
+
+/**
+ * @brief lookup the successor of a key on rings of different sizes.
+ * Every ring member is a bare listener that is never accepted from,
+ * so the client sees it as connected without any server running.
+ */
+static void bench_successor_server()
+{
+    if (string("select_successor_server").find(filter) == string::npos)
+        return;
+
+    // each ring member costs two descriptors
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    vector<string> keys = make_keys(4096, 16);
+    for (int n : {3, 10, 100, 1000})
+    {
+        vector<int> listeners, ports;
+        for (int port = RING_BASE_PORT; (int)ports.size() < n && port < 65535; port++)
+        {
+            int fd = start_listener(port);
+            if (fd < 0)
+                continue;
+            listeners.push_back(fd);
+            ports.push_back(port);
+        }
+
+        // intentionally leaked, the client's poll thread may outlive this scope
+        BenchClient *cl = new BenchClient(ports, false);
+        run("select_successor_server", "ring=" + to_string(cl->ring_size()), 1, [&]()
+            {
+                long ops = 200000;
+                for (long i = 0; i < ops; i++)
+                    sink += (unsigned long)cl->successor(keys[i & 4095]);
+                return ops; });
+        cl->close_client();
+        for (int fd : listeners)
+            close(fd);
+    }
+}
+
+/**
+ * @brief connect to a server, exchange a ping and close the connection
+ */
+static bool connect_once(int port, msg_t *ping, msg_t *pong)
+{
+    int fd = connect_server(port);
+    if (fd < 0)
+        return false;
+    bool ok = send_msg(fd, ping) > 0 && read_msg(fd, pong, 1000) > 0;
+    close(fd);
+    return ok;
+}
+
+/**
+ * @brief A reconnect storm against a server accepting on one and on
+ * several SO_REUSEPORT listeners: the rate at which connections are
+ * accepted and served, and the latency of gets on a connection that
+ * was already open, without and during the storm
+ */
+static void bench_reconnect_storm()
+{
+    if (string("reconnect_storm").find(filter) == string::npos)
+        return;
+
+    int storm_threads = max(8u, 2 * thread::hardware_concurrency());
+    unsigned int max_listeners = max(4u, thread::hardware_concurrency());
+    for (unsigned int listeners : {1u, max_listeners})
+    {
+        server_opts_t opts;
+        opts.listeners = listeners;
+        Server server(STORM_PORT, false, opts);
+        string param = "listeners=" + to_string(listeners);
+
+        run("reconnect_storm_accept", param, storm_threads, [&]()
+            {
+                long per_thread = 500;
+                atomic<long> accepted(0);
+                vector<thread> threads;
+                for (int t = 0; t < storm_threads; t++)
+                    threads.emplace_back([&]()
+                                         {
+                                             msg_t *ping = create_ping_msg(), *pong = make_msg_ref();
+                                             for (long i = 0; i < per_thread; i++)
+                                                 accepted += connect_once(STORM_PORT, ping, pong);
+                                             free(ping);
+                                             free(pong); });
+                for (thread &th : threads)
+                    th.join();
+                return accepted.load(); });
+
+        int fd = connect_server(STORM_PORT);
+        msg_t *put = create_put_msg("storm", string(64, 'v')), *get = create_get_msg("storm");
+        msg_t *in = make_msg_ref();
+        send_msg(fd, put);
+        read_msg(fd, in, 1000);
+        for (int storm : {0, storm_threads})
+        {
+            run("reconnect_storm_get_latency", param + ",storm=" + to_string(storm), 1, [&]()
+                {
+                    atomic<bool> stop(false);
+                    vector<thread> threads;
+                    for (int t = 0; t < storm; t++)
+                        threads.emplace_back([&]()
+                                             {
+                                                 msg_t *ping = create_ping_msg(), *pong = make_msg_ref();
+                                                 while (!stop)
+                                                     connect_once(STORM_PORT, ping, pong);
+                                                 free(ping);
+                                                 free(pong); });
+                    long ops = 5000;
+                    for (long i = 0; i < ops; i++)
+                    {
+                        send_msg(fd, get);
+                        read_msg(fd, in, 1000);
+                    }
+                    sink += in->vlen;
+                    stop = true;
+                    for (thread &th : threads)
+                        th.join();
+                    return ops; });
+        }
+        free(put);
+        free(get);
+        free(in);
+        close(fd);
+        server.close_server();
+    }
+}
+
+/**
+ * @brief Gets and puts from many connections against a server with
+ * one locked store served by a thread per connection, and against
+ * one with a store per core served by the core threads. Both use
+ * the same number of accepting threads.
+ */
+static void bench_store_per_core()
+{
+    if (string("store_per_core").find(filter) == string::npos)
+        return;
+
+    unsigned int ncores = max(4u, thread::hardware_concurrency());
+    int nclients = 2 * ncores;
+    int nkeys = 10000;
+    vector<string> keys = make_keys(nkeys, 20);
+    string value(64, 'v');
+
+    for (bool per_core : {false, true})
+    {
+        server_opts_t opts;
+        opts.listeners = ncores;
+        opts.cores = per_core ? ncores : 0;
+        Server server(CORES_PORT, false, opts);
+        string param = (per_core ? "cores=" : "locked,listeners=") + to_string(ncores);
+
+        // one put in ten
+        run("store_per_core_requests", param, nclients, [&]()
+            {
+                long per_client = 5000;
+                vector<thread> threads;
+                for (int c = 0; c < nclients; c++)
+                    threads.emplace_back([&, c]()
+                                         {
+                                             int fd = connect_server(CORES_PORT);
+                                             msg_t *in = make_msg_ref();
+                                             for (long i = 0; i < per_client; i++)
+                                             {
+                                                 const string &key = keys[(i * 7919 + c) % nkeys];
+                                                 msg_t *out = i % 10 == 0 ? create_put_msg(key, value)
+                                                                          : create_get_msg(key);
+                                                 send_msg(fd, out);
+                                                 read_msg(fd, in, 1000);
+                                                 free(out);
+                                             }
+                                             sink += in->vlen;
+                                             free(in);
+                                             close(fd); });
+                for (thread &th : threads)
+                    th.join();
+                return per_client * nclients; });
+        server.close_server();
+    }
+}
+
+/**
+ * @brief Store lookups into a populated store and inserts of new
+ * keys into an empty store, from 1 up to N threads
+ */
+static void bench_store()
+{
+    int max_threads = max(4u, thread::hardware_concurrency());
+    int nkeys = 100000;
+    vector<string> keys = make_keys(nkeys, 20);
+    vector<string> insert_keys = make_keys(max_threads * 50000, 20);
+    string value(50, 'v');
+
+    Store store;
+    for (string &k : keys)
+        store.put(k, value);
+
+    for (int t = 1; t <= max_threads; t *= 2)
+    {
+        long per_thread = 200000;
+
+        run("store_get", "keys=" + to_string(nkeys), t, [&]()
+            {
+                vector<thread> threads;
+                for (int i = 0; i < t; i++)
+                    threads.emplace_back([&, i]()
+                                         {
+                                             string v;
+                                             unsigned long hits = 0;
+                                             for (long j = 0; j < per_thread; j++)
+                                                 hits += store.get(keys[(j * 7919 + i) % nkeys], v);
+                                             sink += hits; });
+                for (thread &th : threads)
+                    th.join();
+                return per_thread * t; });
+
+        long inserts = 50000;
+        run("store_insert", "fresh_store", t, [&]()
+            {
+                Store fresh;
+                vector<thread> threads;
+                for (int i = 0; i < t; i++)
+                    threads.emplace_back([&, i]()
+                                         {
+                                             for (long j = 0; j < inserts; j++)
+                                                 fresh.put(insert_keys[i * inserts + j], value); });
+                for (thread &th : threads)
+                    th.join();
+                return inserts * t; });
+    }
+}
+
+/**
+ * @brief Throughput of gets looked up one at a time against batches
+ * of gets looked up with `Store::get_batch()`, in stores growing
+ * far beyond the CPU caches. Keys are read in random order, so
+ * nearly every bucket and item of a large store misses the cache.
+ */
+static void bench_store_batch_get()
+{
+    if (string("store_batch_get").find(filter) == string::npos)
+        return;
+
+    store_opts_t opts;
+    opts.memory_bytes = (size_t)1 << 30;
+    Store store(opts);
+    string value(32, 'v');
+    long lookups = 256 * 1024;
+    long filled = 0;
+    mt19937_64 rng(42);
+    for (long nkeys : {16L * 1024, 256L * 1024, 1024L * 1024, 4096L * 1024})
+    {
+        for (; filled < nkeys; filled++)
+            store.put("key:" + to_string(filled), value);
+        vector<string> trace;
+        for (long i = 0; i < lookups; i++)
+            trace.push_back("key:" + to_string(rng() % nkeys));
+
+        run("store_batch_get", "keys=" + to_string(nkeys) + ",batch=1", 1, [&]()
+            {
+                string v;
+                unsigned long hits = 0;
+                for (string &key : trace)
+                    hits += store.get(key, v);
+                sink += hits;
+                return lookups; });
+
+        for (size_t batch : {(size_t)STORE_BATCH_GROUP, (size_t)64})
+        {
+            vector<vector<store_lookup_t>> batches(lookups / batch, vector<store_lookup_t>(batch));
+            for (long i = 0; i < lookups; i++)
+                batches[i / batch][i % batch].key = trace[i];
+            run("store_batch_get", "keys=" + to_string(nkeys) + ",batch=" + to_string(batch), 1, [&]()
+                {
+                    unsigned long hits = 0;
+                    for (vector<store_lookup_t> &b : batches)
+                    {
+                        store.get_batch(b);
+                        for (store_lookup_t &l : b)
+                            hits += l.hit;
+                    }
+                    sink += hits;
+                    return lookups; });
+        }
+    }
+}
+
+/**
+ * @brief Memory taken per item for mixes of key and value sizes:
+ * a store is filled until it evicts, and its memory limit is split
+ * over the items it holds then, bucket array included
+ */
+static void bench_store_item_bytes()
+{
+    if (string("store_bytes_per_item").find(filter) == string::npos)
+        return;
+
+    store_opts_t opts;
+    opts.memory_bytes = 64 << 20;
+    for (pair<int, int> mix : vector<pair<int, int>>{{10, 10}, {20, 50}, {30, 100}, {40, 400}, {20, 1000}})
+    {
+        Store store(opts);
+        string value(mix.second, 'v');
+        for (long i = 0; store.evictions() == 0; i++)
+        {
+            string key = to_string(i);
+            key.resize(mix.first, 'k');
+            store.put(key, value);
+        }
+        size_t items = store.size();
+        printf("{\"bench\":\"store_bytes_per_item\",\"param\":\"key=%d,value=%d\","
+               "\"items\":%zu,\"payload_bytes\":%d,\"bytes_per_item\":%.1f}\n",
+               mix.first, mix.second, items, mix.first + mix.second,
+               (double)opts.memory_bytes / items);
+        fflush(stdout);
+    }
+}
+
+/**
+ * @brief Latency of single puts while a large store fills up, so the
+ * growth of its hash tables is included. Each range of insertions
+ * reports its own percentiles and worst case.
+ */
+static void bench_store_put_latency()
+{
+    if (string("store_put_latency").find(filter) == string::npos)
+        return;
+
+    store_opts_t opts;
+    opts.memory_bytes = (size_t)1 << 30;
+    Store store(opts);
+    string value(10, 'v');
+    long done = 0;
+    for (long upto : {250000L, 500000L, 1000000L, 2000000L, 4000000L})
+    {
+        vector<uint32_t> ns;
+        ns.reserve(upto - done);
+        for (; done < upto; done++)
+        {
+            string key = "key:" + to_string(done);
+            auto start = chrono::steady_clock::now();
+            store.put(key, value);
+            ns.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        }
+        double total = 0;
+        for (uint32_t n : ns)
+            total += n;
+        sort(ns.begin(), ns.end());
+        printf("{\"bench\":\"store_put_latency\",\"param\":\"keys=%ld\",\"puts\":%zu,"
+               "\"avg_ns\":%.0f,\"p50_ns\":%u,\"p99_ns\":%u,\"p9999_ns\":%u,\"max_ns\":%u}\n",
+               upto, ns.size(), total / ns.size(), ns[ns.size() / 2], ns[ns.size() * 99 / 100],
+               ns[ns.size() * 9999 / 10000], ns.back());
+        fflush(stdout);
+    }
+}
+
+/**
+ * @brief Hit ratio of a cache-aside client, which gets a key and puts
+ * it on a miss, replaying traces against a small store with plain LRU
+ * eviction and with admission. Keys are drawn from a Zipf distribution;
+ * the second trace also scans keys that are never requested again.
+ */
+static void bench_store_hit_ratio()
+{
+    if (string("store_hit_ratio").find(filter) == string::npos)
+        return;
+
+    int nkeys = 200000;
+    long requests = 2000000;
+    vector<double> cdf(nkeys);
+    double total = 0;
+    for (int i = 0; i < nkeys; i++)
+        cdf[i] = total += 1 / pow(i + 1, 0.9);
+
+    string value(100, 'v');
+    for (bool scans : {false, true})
+    {
+        // the same trace is replayed for both policies
+        mt19937_64 rng(42);
+        uniform_real_distribution<double> uniform(0, total);
+        vector<long> trace;
+        long next_scan_key = nkeys;
+        while ((long)trace.size() < requests)
+        {
+            if (scans && trace.size() % 100000 == 50000)
+                for (int i = 0; i < 20000; i++)
+                    trace.push_back(next_scan_key++);
+            trace.push_back(lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin());
+        }
+
+        for (bool admission : {false, true})
+        {
+            store_opts_t opts;
+            opts.memory_bytes = 4 << 20;
+            opts.admission = admission;
+            Store store(opts);
+            string got;
+            long hits = 0;
+            for (long id : trace)
+            {
+                string key = "key:" + to_string(id);
+                if (store.get(key, got))
+                    hits++;
+                else
+                    store.put(key, value);
+            }
+            printf("{\"bench\":\"store_hit_ratio\",\"param\":\"policy=%s,trace=%s\","
+                   "\"requests\":%zu,\"keys\":%d,\"hit_ratio\":%.4f}\n",
+                   admission ? "tinylfu" : "lru", scans ? "zipf+scans" : "zipf",
+                   trace.size(), nkeys, (double)hits / trace.size());
+            fflush(stdout);
+        }
+    }
+}
+
+/**
+ * @brief Store lookups with and without the key sampler the server
+ * feeds on every request, from 1 up to N threads. The difference is
+ * the overhead sampling adds to the get path.
+ */
+static void bench_key_sampler()
+{
+    int max_threads = max(4u, thread::hardware_concurrency());
+    int nkeys = 100000;
+    vector<string> keys = make_keys(nkeys, 20);
+    string value(50, 'v');
+
+    Store store;
+    KeySampler sampler;
+    for (string &k : keys)
+        store.put(k, value);
+
+    for (int t = 1; t <= max_threads; t *= 2)
+    {
+        long per_thread = 200000;
+        for (bool sampled : {false, true})
+        {
+            run("store_get_key_sampler", sampled ? "sampled" : "off", t, [&]()
+                {
+                    vector<thread> threads;
+                    for (int i = 0; i < t; i++)
+                        threads.emplace_back([&, i]()
+                                             {
+                                                 string v;
+                                                 unsigned long hits = 0;
+                                                 for (long j = 0; j < per_thread; j++)
+                                                 {
+                                                     const string &k = keys[(j * 7919 + i) % nkeys];
+                                                     hits += store.get(k, v);
+                                                     if (sampled)
+                                                         sampler.record(k, v.size());
+                                                 }
+                                                 sink += hits; });
+                    for (thread &th : threads)
+                        th.join();
+                    return per_thread * t; });
+        }
+    }
+}
+
+/**
+ * @brief Snapshot a populated store, then bulk load it into an
+ * empty store with 1 up to N loader threads
+ */
+static void bench_snapshot()
+{
+    int max_threads = max(4u, thread::hardware_concurrency());
+    int nkeys = 200000;
+    string path = "/tmp/memcached-mini-bench.snap";
+    vector<string> keys = make_keys(nkeys, 20);
+    string value(50, 'v');
+
+    Store store;
+    for (string &k : keys)
+        store.put(k, value);
+
+    run("store_save_snapshot", "keys=" + to_string(nkeys), 1, [&]()
+        { return store.save_snapshot(path); });
+
+    for (int t = 1; t <= max_threads; t *= 2)
+    {
+        run("store_load_snapshot", "keys=" + to_string(nkeys), t, [&]()
+            {
+                Store fresh;
+                snapshot_stats_t stats;
+                fresh.load_snapshot(path, t, &stats);
+                return (long)stats.items; });
+    }
+    unlink(path.c_str());
+}
+
+/**
+ * @brief Time for a new store to attach to a populated segment
+ * file and serve its first hit
+ */
+static void bench_segment_attach()
+{
+    int nkeys = 200000;
+    store_opts_t opts;
+    opts.segment_path = "/tmp/memcached-mini-bench.seg";
+    unlink(opts.segment_path.c_str());
+    vector<string> keys = make_keys(nkeys, 20);
+    string value(50, 'v');
+    {
+        Store store(opts);
+        for (string &k : keys)
+            store.put(k, value);
+    }
+
+    run("store_segment_attach", "keys=" + to_string(nkeys), 1, [&]()
+        {
+            Store store(opts);
+            string v;
+            sink += store.attached() && store.get(keys[0], v);
+            return 1L; });
+    unlink(opts.segment_path.c_str());
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc > 1)
+        filter = argv[1];
+    if (argc > 2)
+        repetitions = max(1, stoi(argv[2]));
+
+    bench_hash();
+    bench_compress();
+    bench_create_msgs();
+    bench_msg_roundtrip();
+    bench_transport_roundtrip();
+    bench_successor_server();
+    bench_reconnect_storm();
+    bench_store_per_core();
+    bench_store();
+    bench_store_item_bytes();
+    bench_store_put_latency();
+    bench_store_batch_get();
+    bench_store_hit_ratio();
+    bench_key_sampler();
+    bench_snapshot();
+    bench_segment_attach();
+    return 0;
+}
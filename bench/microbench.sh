@@ -0,0 +1,3 @@
+clear
+g++ -std=c++17 -O2 -pthread -o microbench ./microbench.cpp ../src/utils/message.cpp ../src/utils/logger.cpp ../src/utils/conn.cpp ../src/utils/shmring.cpp ../src/client/client.cpp ../src/utils/compress.cpp ../src/hash/hash.cpp ../src/client/connection.cpp ../src/client/hotkeys.cpp ../src/proxy/proxy.cpp ../src/server/server.cpp ../src/server/keysampler.cpp ../src/server/leases.cpp ../src/store/store.cpp ../src/store/snapshot.cpp ../src/store/extstore.cpp
+./microbench "$@"
\ No newline at end of file
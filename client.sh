@@ -1,3 +1,3 @@
 clear
-g++ -std=c++17 -o temp2 ./src/runclient.cpp ./src/utils/message.cpp ./src/utils/logger.cpp ./src/utils/conn.cpp ./src/client/client.cpp ./src/hash/hash.cpp ./src/client/connection.cpp
+g++ -std=c++17 -o temp2 ./src/runclient.cpp ./src/utils/message.cpp ./src/utils/logger.cpp ./src/utils/conn.cpp ./src/utils/shmring.cpp ./src/client/client.cpp ./src/utils/compress.cpp ./src/hash/hash.cpp ./src/client/connection.cpp ./src/client/hotkeys.cpp
 ./temp2 "$@"
\ No newline at end of file
@@ -0,0 +1,3 @@
+clear
+g++ -std=c++17 -o temp3 ./src/runproxy.cpp ./src/proxy/proxy.cpp ./src/utils/message.cpp ./src/utils/logger.cpp ./src/utils/conn.cpp ./src/utils/shmring.cpp ./src/client/client.cpp ./src/utils/compress.cpp ./src/hash/hash.cpp ./src/client/connection.cpp ./src/client/hotkeys.cpp
+./temp3 "$@"
\ No newline at end of file
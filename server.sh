@@ -1,3 +1,3 @@
 clear
-g++ -std=c++17 -o temp1 ./src/runserver.cpp ./src/utils/message.cpp ./src/utils/logger.cpp ./src/utils/conn.cpp ./src/server/server.cpp
-./temp1 "$1"
\ No newline at end of file
+g++ -std=c++17 -o temp1 ./src/runserver.cpp ./src/utils/message.cpp ./src/utils/logger.cpp ./src/utils/conn.cpp ./src/utils/shmring.cpp ./src/hash/hash.cpp ./src/server/server.cpp ./src/server/keysampler.cpp ./src/server/leases.cpp ./src/store/store.cpp ./src/store/snapshot.cpp ./src/store/extstore.cpp
+./temp1 "$@"
\ No newline at end of file
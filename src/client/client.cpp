@@ -6,136 +6,1361 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <thread>
 #include "client.hpp"
 #include "../utils/conn.hpp"
+#include "../utils/shmring.hpp"
 #include "../hash/hash.hpp"
 #include "../utils/logger.hpp"
 #include "../utils/message.hpp"
+#include "../utils/compress.hpp"
 
-/** The client will try to connect
- * with disconnected servers in
- * `POLL_INTERVAL` second intervals */
-unsigned int POLL_INTERVAL = 5;
+/** The client checks for disconnected servers whose
+ * backoff has passed every `POLL_INTERVAL_MS` milliseconds */
+unsigned int POLL_INTERVAL_MS = 50;
+
+/** Connection attempts are given up after
+ * `CONNECT_TIMEOUT` milliseconds */
+unsigned int CONNECT_TIMEOUT = 500;
+
+/** Connected servers are pinged every `HEARTBEAT_INTERVAL`
+ * milliseconds, and disconnected if they do not answer
+ * within `HEARTBEAT_TIMEOUT` milliseconds */
+unsigned int HEARTBEAT_INTERVAL = 1000;
+unsigned int HEARTBEAT_TIMEOUT = 500;
 
 /** Wait for `RESPONSE_TIMEOUT` milliseconds
- * before declaring the server disconnected */
+ * before declaring the server disconnected, until
+ * its response times are known */
 unsigned int RESPONSE_TIMEOUT = 2000;
 
+/** Most hedged requests the budget can save up for */
+#define HEDGE_BURST 10
+
+/** A lease get told to wait is retried every `LEASE_RETRY_MS`
+ * milliseconds, up to `LEASE_RETRIES` times */
+unsigned int LEASE_RETRY_MS = 10;
+unsigned int LEASE_RETRIES = 20;
+
+/** Keys handed to a joining server are put to it this many
+ * at a time before their acks are read */
+#define HANDOFF_BATCH 64
+
+/**
+ * @brief Endpoints of localhost TCP servers
+ */
+static std::vector<endpoint_t> tcp_endpoints(const std::vector<int> &ports)
+{
+    std::vector<endpoint_t> eps;
+    for (int port : ports)
+        eps.push_back(tcp_endpoint(port));
+    return eps;
+}
+
+/**
+ * @brief Client starts by connecting to a localhost servers listening
+ * at the ports passed
+ *
+ * @param[in] ports Ports of all servers in the server pool
+ * @param[in] print_logs Indicates if log should be printed
+ * @param[in] opts Optional client settings
+ */
+Client::Client(std::vector<int> ports, bool print_logs, client_opts_t opts)
+    : Client(tcp_endpoints(ports), print_logs, opts)
+{
+}
+
+/**
+ * @brief Client starts by connecting to the servers at the
+ * endpoints passed, over TCP or Unix domain sockets
+ *
+ * @param[in] servers Endpoints of all servers in the server pool
+ * @param[in] print_logs Indicates if log should be printed
+ * @param[in] opts Optional client settings
+ */
+Client::Client(std::vector<endpoint_t> servers, bool print_logs, client_opts_t opts)
+    : opts(opts)
+{
+    logger = new Logger(print_logs);
+    close_flag = false;
+    for (const endpoint_t &ep : servers)
+    {
+        Connection *s = new Connection(ep);
+        add_server_to_pool(s);
+    }
+
+    // the connections were started together, wait for them together
+    reconnect_servers(CONNECT_TIMEOUT, false);
+    monitor = std::thread(&Client::monitor_servers, this);
+}
+
+/**
+ * @brief sends a `put` request to the server it is connected to
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] value the value. Values longer than 1000 bytes
+ * are streamed from `value` without a copy, up to the limit
+ * the server was started with (1 MB by default)
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved
+ *
+ * @return true if request was successful, else false
+ */
+bool Client::send_put_req(std::string key, std::string value, msg_t *response)
+{
+    std::string compressed;
+    uint32_t flags = 0;
+    const std::string &payload = encode_value(value, compressed, &flags);
+
+    msg_t *put_msg = create_put_msg(key, payload, flags);
+    if (!put_msg)
+    {
+        return false;
+    }
+    bool stored = send_update(select_replicas(key), put_msg, payload.data(), response);
+    free(put_msg);
+    return stored;
+}
+
+/**
+ * @brief sends a `cas` request: a put that only succeeds if the
+ * value of the key is still at the version the caller read
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] value the new value, sent like the value of a put
+ * @param[in] cas the version from the `cas` field of the hit
+ * response to an earlier `get` request
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved, of type `resp_exists_t` if the value
+ * changed since it was read
+ *
+ * @return true if the value was replaced, else false
+ */
+bool Client::send_cas_req(std::string key, std::string value, uint64_t cas, msg_t *response)
+{
+    std::string compressed;
+    uint32_t flags = 0;
+    const std::string &payload = encode_value(value, compressed, &flags);
+
+    msg_t *cas_msg = create_cas_msg(key, payload, flags, cas);
+    if (!cas_msg)
+    {
+        return false;
+    }
+
+    // versions are per server, so only the primary compares them
+    bool stored = send_primary_update(key, cas_msg, payload, flags, response);
+    free(cas_msg);
+    return stored;
+}
+
+/**
+ * @brief sends a `lease put` request: a put that is only stored
+ * while the lease granted by `send_lease_get_req()` is valid
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] value the value, sent like the value of a put
+ * @param[in] lease the lease token
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved, of type `resp_exists_t` if the lease
+ * expired
+ *
+ * @return true if the value was stored, else false
+ */
+bool Client::send_lease_put_req(std::string key, std::string value, uint64_t lease, msg_t *response)
+{
+    std::string compressed;
+    uint32_t flags = 0;
+    const std::string &payload = encode_value(value, compressed, &flags);
+
+    msg_t *put_msg = create_lease_put_msg(key, payload, flags, lease);
+    if (!put_msg)
+    {
+        return false;
+    }
+
+    // leases are per server, the primary granted it
+    bool stored = send_primary_update(key, put_msg, payload, flags, response);
+    free(put_msg);
+    return stored;
+}
+
+/**
+ * @brief send a request that only the primary of the key may
+ * accept, then send the value it accepted to the other replicas
+ * as a put
+ *
+ * @return true if the primary accepted the request
+ */
+bool Client::send_primary_update(std::string key, msg_t *msg, const std::string &payload,
+                                 uint32_t flags, msg_t *response)
+{
+    std::vector<Connection *> replicas = select_replicas(key);
+    std::vector<Connection *> primary(replicas.begin(), replicas.begin() + std::min<size_t>(1, replicas.size()));
+    bool stored = send_update(primary, msg, payload.data(), response);
+    if (stored && replicas.size() > 1)
+    {
+        msg_t *put_msg = create_put_msg(key, payload, flags);
+        msg_t *reply = make_msg_ref();
+        send_update(std::vector<Connection *>(replicas.begin() + 1, replicas.end()),
+                    put_msg, payload.data(), reply);
+        free(reply);
+        free(put_msg);
+    }
+    return stored;
+}
+
+/**
+ * @brief sends an `incr` request, adding to a value that holds a
+ * decimal number in one round trip. Additions wrap around at 2^64.
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] delta the amount to add
+ * @param[out] result location where the new number is saved
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved
+ *
+ * @return true if the number was updated, false if the key is
+ * missing, does not hold a number, or in case of error
+ */
+bool Client::send_incr_req(std::string key, uint64_t delta, uint64_t *result, msg_t *response)
+{
+    return send_incr(key, delta, false, result, response);
+}
+
+/**
+ * @brief sends a `decr` request, subtracting from a value that
+ * holds a decimal number in one round trip. The number stops at 0.
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] delta the amount to subtract
+ * @param[out] result location where the new number is saved
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved
+ *
+ * @return true if the number was updated, false if the key is
+ * missing, does not hold a number, or in case of error
+ */
+bool Client::send_decr_req(std::string key, uint64_t delta, uint64_t *result, msg_t *response)
+{
+    return send_incr(key, delta, true, result, response);
+}
+
+/**
+ * @brief sends an `append` request, adding bytes at the end of
+ * a value in one round trip. The bytes are never compressed, so
+ * values stored compressed must not be appended to.
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] value the bytes to add
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved
+ *
+ * @return true if the value was updated, false if the key is
+ * missing or in case of error
+ */
+bool Client::send_append_req(std::string key, std::string value, msg_t *response)
+{
+    return send_append(key, value, false, response);
+}
+
+/**
+ * @brief sends a `prepend` request, adding bytes at the start of
+ * a value in one round trip. The bytes are never compressed, so
+ * values stored compressed must not be prepended to.
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] value the bytes to add
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved
+ *
+ * @return true if the value was updated, false if the key is
+ * missing or in case of error
+ */
+bool Client::send_prepend_req(std::string key, std::string value, msg_t *response)
+{
+    return send_append(key, value, true, response);
+}
+
+/**
+ * @brief sends a `delete` request to every replica of the key
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved
+ *
+ * @return true if at least one server removed the key, false
+ * if it was not found or in case of error
+ */
+bool Client::send_delete_req(std::string key, msg_t *response)
+{
+    msg_t *delete_msg = create_delete_msg(key);
+    if (!delete_msg)
+    {
+        return false;
+    }
+    bool deleted = send_update(delete_targets(key), delete_msg, NULL, response);
+    free(delete_msg);
+    return deleted;
+}
+
+/**
+ * @brief the replicas of a key and the previous owners of those
+ * in their migration window, which a delete must reach
+ */
+std::vector<Connection *> Client::delete_targets(std::string key)
+{
+    // the previous owner of the key must not serve it again
+    std::vector<Connection *> servers = select_replicas(key);
+    for (size_t i = 0, n = servers.size(); i < n; i++)
+    {
+        Connection *from = previous_owner(servers[i]);
+        if (from && from->is_connected() &&
+            std::find(servers.begin(), servers.end(), from) == servers.end())
+            servers.push_back(from);
+    }
+    return servers;
+}
+
+/**
+ * @brief sends a `flush_all` request to every connected server,
+ * removing all keys. Each server returns right away and reclaims
+ * the memory of the keys in the background.
+ *
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved
+ *
+ * @return true if at least one server was flushed, else false
+ */
+bool Client::send_flush_all_req(msg_t *response)
+{
+    std::vector<Connection *> servers;
+    for (Connection *s : server_pool)
+        if (s->is_connected())
+            servers.push_back(s);
+
+    state_mutex.lock();
+    local_copies.clear();
+    state_mutex.unlock();
+    flight_mutex.lock();
+    flights.clear();
+    flight_mutex.unlock();
+    msg_t *flush_msg = create_flush_all_msg();
+    bool flushed = send_update(servers, flush_msg, NULL, response);
+    free(flush_msg);
+    return flushed;
+}
+
+/**
+ * @brief sends a `get` request to the server it is connected to.
+ * Gets of a key issued by other threads while a get of it is in
+ * flight wait for its response instead of sending their own.
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved. On a hit, its `cas` field holds the
+ * version of the value for `send_cas_req()`.
+ *
+ * @return The value as a non-empty string, return "" if no
+ * value was received
+ */
+std::string Client::send_get_req(std::string key, msg_t *response)
+{
+    std::string value;
+    std::shared_ptr<flight_t> flight = join_flight(key, response, value);
+    if (!flight)
+        return value;
+
+    value = fetch_value(key, response);
+    land_flight(key, flight, response, value.data(), value.size());
+    return value;
+}
+
+/**
+ * @brief sends a `get` request to the server it is connected to,
+ * and reads the value straight into a caller buffer. Concurrent
+ * gets of the same key are merged like those of `send_get_req()`.
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[out] buf Location where the value is read to
+ * @param[in] buf_len Size of `buf`
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved
+ *
+ * @return length of the value, -1 on a miss, an error, or if
+ * the value is longer than `buf_len`
+ */
+long Client::send_get_req(std::string key, char *buf, size_t buf_len, msg_t *response)
+{
+    std::string value;
+    std::shared_ptr<flight_t> flight = join_flight(key, response, value);
+    if (!flight)
+    {
+        if (response->type != resp_hit_t || value.size() > buf_len)
+            return -1;
+        memcpy(buf, value.data(), value.size());
+        return value.size();
+    }
+
+    long n = fetch_value(key, buf, buf_len, response);
+    land_flight(key, flight, response, n >= 0 ? buf : NULL, n >= 0 ? n : 0);
+    return n;
+}
+
+/**
+ * @brief wait for the get of a key in flight, or start one
+ *
+ * @param[out] response Location where the response of the get
+ * waited for is copied
+ * @param[out] value Location where its value is copied
+ *
+ * @return the flight the caller must send the get for and then
+ * land, NULL if `response` and `value` hold the result of the
+ * get waited for
+ */
+std::shared_ptr<Client::flight_t> Client::join_flight(const std::string &key, msg_t *response,
+                                                      std::string &value)
+{
+    gets++;
+    std::unique_lock<std::mutex> lock(flight_mutex);
+    auto it = flights.find(key);
+    if (it != flights.end())
+    {
+        std::shared_ptr<flight_t> flight = it->second;
+        flight->waiters++;
+        flight->cv.wait(lock, [&flight]()
+                        { return flight->landed; });
+        if (flight->shared)
+        {
+            memcpy(response, &flight->response, sizeof(*response));
+            value = flight->value;
+            gets_coalesced++;
+            return NULL;
+        }
+        // the value could not be read, get it separately
+        return std::make_shared<flight_t>();
+    }
+
+    std::shared_ptr<flight_t> flight = std::make_shared<flight_t>();
+    flights[key] = flight;
+    return flight;
+}
+
+/**
+ * @brief hand the result of a get to the gets waiting for it
+ *
+ * @param[in] value The value, NULL if the get failed to read it
+ * @param[in] len Length of the value
+ */
+void Client::land_flight(const std::string &key, const std::shared_ptr<flight_t> &flight,
+                         const msg_t *response, const char *value, size_t len)
+{
+    std::lock_guard<std::mutex> lock(flight_mutex);
+    auto it = flights.find(key);
+    if (it != flights.end() && it->second == flight)
+        flights.erase(it);
+
+    // the value is only copied if some get waits for it
+    flight->landed = true;
+    flight->shared = value || response->type != resp_hit_t;
+    if (flight->waiters > 0)
+    {
+        memcpy(&flight->response, response, sizeof(*response));
+        if (value)
+            flight->value.assign(value, len);
+        flight->cv.notify_all();
+    }
+}
+
+/**
+ * @brief forget the get of a key in flight, so gets issued from
+ * now on do not wait for a response that may predate an update
+ */
+void Client::ground_flight(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(flight_mutex);
+    flights.erase(key);
+}
+
+/**
+ * @brief the body of `send_get_req()`, without merging
+ */
+std::string Client::fetch_value(std::string key, msg_t *response)
+{
+    std::string value;
+    if (!fetch_raw(key, response, value))
+        return "";
+    return decode_string(value, response);
+}
+
+/**
+ * @brief get the value of a key as received from the server,
+ * possibly compressed, or from its local copy if it is hot
+ *
+ * @param[out] value Location where the value is saved
+ *
+ * @return true on a hit, else false
+ */
+bool Client::fetch_raw(std::string key, msg_t *response, std::string &value)
+{
+    bool hot = track_key(key);
+    if (hot && find_local_copy(key, response, value))
+        return true;
+
+    std::unique_lock<std::mutex> io;
+    Connection *server_p = request_value(key, response, hot, io);
+    if (!server_p || response->type != resp_hit_t || !receive_value(server_p, response, value))
+        return false;
+    io.unlock();
+    if (hot)
+        keep_local_copy(key, value, response);
+    return true;
+}
+
+/**
+ * @brief sends a `lease get` request to the primary of the key.
+ * On a miss, only the first client is granted a lease and should
+ * compute the value and store it with `send_lease_put_req()`.
+ * The other clients are told to wait, and retry shortly until
+ * the value is stored, or are sent a value evicted a moment ago
+ * if the server still has it.
+ *
+ * @param[in] key the key (max length = 100 bytes)
+ * @param[out] lease location where the lease token is saved,
+ * 0 unless a lease was granted
+ * @param[in] response `msg_t` location where the server's
+ * reply can be saved, of type `resp_stale_hit_t` if the value
+ * is stale, or `resp_lease_wait_t` if the client gave up waiting
+ *
+ * @return The value as a non-empty string, return "" if no
+ * value was received
+ */
+std::string Client::send_lease_get_req(std::string key, uint64_t *lease, msg_t *response)
+{
+    msg_t *get_msg = create_lease_get_msg(key);
+    std::string value = "";
+    *lease = 0;
+
+    if (!get_msg)
+    {
+        return value;
+    }
+
+    for (unsigned int retries = 0;; retries++)
+    {
+        {
+            std::vector<Connection *> replicas = select_replicas(key);
+            if (replicas.empty())
+            {
+                logger->display_msg("[Client] No server alive at the moment for", get_msg);
+                break;
+            }
+
+            // leases are per server, so only the primary is asked
+            std::unique_lock<std::mutex> io;
+            Connection *server_p = await_get(replicas[0], NULL, get_msg, response, io);
+            if (!server_p)
+                break;
+            if (response->type == resp_hit_t || response->type == resp_stale_hit_t)
+            {
+                if (receive_value(server_p, response, value))
+                    value = decode_string(value, response);
+                break;
+            }
+            if (response->type == resp_lease_t)
+                *lease = response->cas;
+            if (response->type != resp_lease_wait_t || retries >= LEASE_RETRIES)
+                break;
+        }
+        // the lease holder is filling the key
+        std::this_thread::sleep_for(std::chrono::milliseconds(LEASE_RETRY_MS));
+    }
+
+    free(get_msg);
+    return value;
+}
+
+/**
+ * @brief the body of `send_get_req()` into a caller buffer,
+ * without merging
+ */
+long Client::fetch_value(std::string key, char *buf, size_t buf_len, msg_t *response)
+{
+    bool hot = track_key(key);
+    std::string local;
+
+    if (hot && find_local_copy(key, response, local))
+    {
+        if (response->flags & CLIENT_FLAG_COMPRESSED)
+            return decode_value(local.data(), local.size(), buf, buf_len);
+        if (local.size() > buf_len)
+            return -1;
+        memcpy(buf, local.data(), local.size());
+        return local.size();
+    }
+
+    std::unique_lock<std::mutex> io;
+    Connection *server_p = request_value(key, response, hot, io);
+
+    if (!server_p || response->type != resp_hit_t)
+        return -1;
+
+    // compressed values are read whole and decompressed into `buf`
+    if (response->flags & CLIENT_FLAG_COMPRESSED)
+    {
+        std::string compressed(response->vlen, '\0');
+        if (!msg_value_streamed(response))
+            memcpy(&compressed[0], response->value, response->vlen);
+        else if (read_value(server_p->get_fd(), &compressed[0], response->vlen, RESPONSE_TIMEOUT) < 0)
+        {
+            server_p->disconnect();
+            return -1;
+        }
+        io.unlock();
+        if (hot)
+            keep_local_copy(key, compressed, response);
+        return decode_value(compressed.data(), compressed.size(), buf, buf_len);
+    }
+
+    bool fits = response->vlen <= buf_len;
+    if (!msg_value_streamed(response))
+    {
+        if (fits)
+            memcpy(buf, response->value, response->vlen);
+    }
+    // a value that does not fit is still read, to keep the
+    // connection in step
+    else if (read_value(server_p->get_fd(), fits ? buf : NULL, response->vlen, RESPONSE_TIMEOUT) < 0)
+    {
+        server_p->disconnect();
+        return -1;
+    }
+    io.unlock();
+    if (hot && fits)
+        keep_local_copy(key, std::string(buf, response->vlen), response);
+    return fits ? (long)response->vlen : -1;
+}
+
+/**
+ * @brief compress a value if it is long enough and that makes
+ * it smaller, and account for the time taken
+ *
+ * @param[out] compressed Location where the compressed value
+ * is saved
+ * @param[out] flags `CLIENT_FLAG_COMPRESSED` is set if the value
+ * was compressed
+ *
+ * @return the value to send, `value` or `compressed`
+ */
+const std::string &Client::encode_value(const std::string &value, std::string &compressed,
+                                        uint32_t *flags)
+{
+    if (opts.compress_min == 0 || value.size() < opts.compress_min)
+        return value;
+
+    auto start = std::chrono::steady_clock::now();
+    bool smaller = compress_value(value, compressed);
+    compress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    compress_attempts++;
+    if (!smaller)
+        return value;
+
+    *flags |= CLIENT_FLAG_COMPRESSED;
+    values_compressed++;
+    bytes_raw += value.size();
+    bytes_compressed += compressed.size();
+    return compressed;
+}
+
+/**
+ * @brief send a request changing the value of a key to each of
+ * `servers` before any reply is awaited, so they apply it in
+ * parallel. The servers are held until all replies were read.
+ *
+ * @param[in] value The value to stream after the message, if any
+ * @param[out] response Location where the first successful reply,
+ * or the first reply if none succeeded, is saved
+ *
+ * @return true if at least one server applied the request
+ */
+bool Client::send_update(const std::vector<Connection *> &servers, msg_t *msg,
+                         const char *value, msg_t *response)
+{
+    // a local copy or a get in flight must not outlive an
+    // update of this client
+    state_mutex.lock();
+    local_copies.erase(msg->key);
+    state_mutex.unlock();
+    ground_flight(msg->key);
+
+    if (servers.empty())
+    {
+        logger->display_msg("[Client] No server alive at the moment for", msg);
+        return false;
+    }
+
+    std::vector<std::unique_lock<std::mutex>> io = lock_servers(servers);
+    std::vector<Connection *> sent;
+    for (Connection *server_p : servers)
+    {
+        if (!send_request(server_p, msg, value))
+        {
+            server_p->disconnect();
+            continue;
+        }
+        sent.push_back(server_p);
+    }
+
+    msg_t *reply = make_msg_ref();
+    int replies = 0, applied = 0;
+    for (Connection *server_p : sent)
+    {
+        if (read_msg(server_p->get_fd(), reply, RESPONSE_TIMEOUT) < 0)
+        {
+            server_p->disconnect();
+            continue;
+        }
+        logger->display_msg("[Client] Received Response", reply);
+        bool ok = reply->type == resp_ack_t || reply->type == resp_hit_t;
+        if (replies++ == 0 || (ok && applied == 0))
+            memcpy(response, reply, sizeof(*reply));
+        applied += ok;
+    }
+    free(reply);
+    return applied > 0;
+}
+
+/**
+ * @brief send an `incr` or `decr` request to every replica
+ * of the key
+ */
+bool Client::send_incr(std::string key, uint64_t delta, bool decr, uint64_t *result,
+                       msg_t *response)
+{
+    msg_t *incr_msg = create_incr_msg(key, delta, decr);
+    if (!incr_msg)
+    {
+        return false;
+    }
+    bool updated = send_update(select_replicas(key), incr_msg, NULL, response);
+    free(incr_msg);
+    if (updated)
+        *result = strtoull(response->value, NULL, 10);
+    return updated;
+}
+
+/**
+ * @brief send an `append` or `prepend` request to every replica
+ * of the key
+ */
+bool Client::send_append(std::string key, std::string value, bool prepend, msg_t *response)
+{
+    msg_t *append_msg = create_append_msg(key, value, prepend);
+    if (!append_msg)
+    {
+        return false;
+    }
+    bool updated = send_update(select_replicas(key), append_msg, value.data(), response);
+    free(append_msg);
+    return updated;
+}
+
+/**
+ * @brief forwards a request received from another client, as a
+ * proxy does. It is routed, replicated and failed over like the
+ * request of the same type sent through the other methods, but
+ * its value, flags, version and lease token are passed through
+ * as they are: values are never compressed or decompressed.
+ *
+ * @param[in] req The request
+ * @param[in] value The value of the request
+ * @param[out] response Location where the reply is saved, of
+ * type `resp_error_t` if no server replied
+ * @param[out] resp_value Location where the value of the reply
+ * is saved, as received from the server
+ */
+void Client::forward_req(msg_t *req, const std::string &value, msg_t *response,
+                         std::string &resp_value)
+{
+    std::string key(req->key, strnlen(req->key, MAX_KSIZE));
+    std::vector<Connection *> servers;
+    std::unique_lock<std::mutex> io;
+    Connection *server_p;
+    response->type = resp_error_t;
+    response->vlen = 0;
+    resp_value.clear();
+
+    switch (req->type)
+    {
+    case req_get_t:
+        // a hit whose value could not be read is an error
+        if (!fetch_raw(key, response, resp_value) && response->type == resp_hit_t)
+            response->type = resp_error_t;
+        return;
+    case req_lease_get_t:
+        // leases are per server, so only the primary is asked
+        servers = select_replicas(key);
+        server_p = servers.empty() ? NULL : await_get(servers[0], NULL, req, response, io);
+        if (server_p && (response->type == resp_hit_t || response->type == resp_stale_hit_t) &&
+            !receive_value(server_p, response, resp_value))
+            response->type = resp_error_t;
+        return;
+    case req_cas_t:
+    case req_lease_put_t:
+        send_primary_update(key, req, value, req->flags, response);
+        break;
+    case req_delete_t:
+        send_update(delete_targets(key), req, NULL, response);
+        break;
+    case req_flush_all_t:
+        for (Connection *s : server_pool)
+            if (s->is_connected())
+                servers.push_back(s);
+        state_mutex.lock();
+        local_copies.clear();
+        state_mutex.unlock();
+        send_update(servers, req, NULL, response);
+        break;
+    case req_put_t:
+    case req_incr_t:
+    case req_decr_t:
+    case req_append_t:
+    case req_prepend_t:
+        send_update(select_replicas(key), req, value.data(), response);
+        break;
+    default:
+        return;
+    }
+    // the replies to updates carry short values only
+    if (!msg_value_streamed(response))
+        resp_value.assign(response->value, response->vlen);
+}
+
 /**
- * @brief Client starts by connecting to a localhost servers listening
- * at the ports passed
+ * @brief forwards the `get` requests of several keys received
+ * from other clients, see `forward_req()`. The requests are sent
+ * to the primaries of the keys before any response is read, up to
+ * `FORWARD_GETS_WINDOW` at a time, so a batch waits about one
+ * round trip for all its keys instead of one for each.
  *
- * @param[in] ports Ports of all servers in the server pool
- * @param[in] print_logs Indicates if log should be printed
+ * @param[in] reqs The requests
+ * @param[out] responses Location where the reply to each request
+ * is saved
+ * @param[out] values Location where the value of each reply is
+ * saved, as received from the server
  */
-Client::Client(std::vector<int> ports, bool print_logs)
+void Client::forward_gets(const std::vector<msg_t *> &reqs, const std::vector<msg_t *> &responses,
+                          std::vector<std::string> &values)
 {
-    logger = new Logger(print_logs);
-    close_flag = false;
-    for (int port : ports)
+    size_t n = reqs.size();
+    std::vector<Connection *> sent_to(n);
+    std::vector<bool> answered(n, false);
+    values.assign(n, "");
+
+    for (size_t start = 0; start < n; start += FORWARD_GETS_WINDOW)
     {
-        Connection *s = new Connection(port);
-        add_server_to_pool(s);
+        size_t end = std::min(n, start + FORWARD_GETS_WINDOW);
+        std::vector<Connection *> primaries;
+        for (size_t i = start; i < end; i++)
+        {
+            std::vector<Connection *> replicas = select_replicas(reqs[i]->key);
+            sent_to[i] = replicas.empty() ? NULL : replicas[0];
+            if (sent_to[i])
+                primaries.push_back(sent_to[i]);
+        }
+
+        // the primaries are held until the window was answered
+        std::vector<std::unique_lock<std::mutex>> io = lock_servers(primaries);
+        for (size_t i = start; i < end; i++)
+        {
+            if (sent_to[i] && !send_request(sent_to[i], reqs[i]))
+            {
+                sent_to[i]->disconnect();
+                sent_to[i] = NULL;
+            }
+        }
+
+        // each connection answers in the order of its requests
+        for (size_t i = start; i < end; i++)
+        {
+            Connection *s = sent_to[i];
+            if (!s || !s->is_connected())
+                continue;
+            if (read_msg(s->get_fd(), responses[i], RESPONSE_TIMEOUT) < 0)
+            {
+                s->disconnect();
+                continue;
+            }
+            logger->display_msg("[Client] Received Response", responses[i]);
+            if (responses[i]->type == resp_hit_t && !receive_value(s, responses[i], values[i]))
+                continue;
+            s->mark_alive();
+            answered[i] = responses[i]->type != resp_miss_t || !previous_owner(s);
+        }
     }
 
-    std::thread poll_thread(&Client::poll_disconnected_servers, this);
-    poll_thread.detach();
+    // the keys left are fetched one by one, failing over to their
+    // replicas or their previous owner
+    for (size_t i = 0; i < n; i++)
+    {
+        if (answered[i])
+            continue;
+        responses[i]->type = resp_error_t;
+        responses[i]->vlen = 0;
+        std::string key(reqs[i]->key, strnlen(reqs[i]->key, MAX_KSIZE));
+        if (!fetch_raw(key, responses[i], values[i]) && responses[i]->type == resp_hit_t)
+            responses[i]->type = resp_error_t;
+    }
 }
 
 /**
- * @brief sends a `put` request to the server it is connected to
+ * @brief asks one server for its report of the keys that
+ * dominate its traffic and of the key and value sizes it sees
  *
- * @param[in] key the key (max length = 100 bytes)
- * @param[in] value the value (max length = 1000 bytes)
+ * @param[in] port The port of the server
  * @param[in] response `msg_t` location where the server's
  * reply can be saved
  *
- * @return true if request was successful, else false
+ * @return The report, "" if the server did not respond
  */
-bool Client::send_put_req(std::string key, std::string value, msg_t *response)
+std::string Client::send_stats_req(int port, msg_t *response)
 {
-    msg_t *put_msg = create_put_msg(key, value);
-    if (!put_msg)
+    auto it = std::find_if(server_pool.begin(), server_pool.end(), [port](Connection *s)
+                           { return s->get_port() == port; });
+    if (it == server_pool.end() || !(*it)->is_connected())
+        return "";
+
+    Connection *server_p = *it;
+    std::unique_lock<std::mutex> io = server_p->lock_io();
+    msg_t *stats_msg = create_stats_req_msg();
+    bool sent = send_request(server_p, stats_msg);
+    free(stats_msg);
+    if (!sent || read_msg(server_p->get_fd(), response, RESPONSE_TIMEOUT) < 0)
     {
-        return false;
+        server_p->disconnect();
+        return "";
+    }
+    logger->display_msg("[Client] Received Response", response);
+
+    std::string report(response->vlen, '\0');
+    if (!msg_value_streamed(response))
+        memcpy(&report[0], response->value, response->vlen);
+    else if (read_value(server_p->get_fd(), &report[0], response->vlen, RESPONSE_TIMEOUT) < 0)
+    {
+        server_p->disconnect();
+        return "";
     }
+    return response->type == resp_stats_t ? report : "";
+}
+
+/**
+ * @brief Compression, hedging and hot key figures since the
+ * client was created
+ *
+ * @return the figures
+ */
+client_stats_t Client::stats()
+{
+    client_stats_t st;
+    st.compress_attempts = compress_attempts;
+    st.values_compressed = values_compressed;
+    st.values_decompressed = values_decompressed;
+    st.bytes_raw = bytes_raw;
+    st.bytes_compressed = bytes_compressed;
+    st.compress_ns = compress_ns;
+    st.decompress_ns = decompress_ns;
+    st.compression_ratio = st.bytes_compressed ? (double)st.bytes_raw / st.bytes_compressed : 1;
+    st.hedges_sent = hedges_sent;
+    st.hedges_won = hedges_won;
+    st.hedges_denied = hedges_denied;
+    st.hot_gets = hot_gets;
+    st.local_hits = local_hits;
+    st.gets = gets;
+    st.gets_coalesced = gets_coalesced;
+    st.coalesce_rate = st.gets ? (double)st.gets_coalesced / st.gets : 0;
+    st.handoff_keys = handoff_keys;
+    st.handoff_hits = handoff_hits;
+    return st;
+}
+
+/**
+ * @brief The keys fetched most often in the recent window,
+ * with their estimated number of gets
+ *
+ * @return the keys, the most frequent first
+ */
+std::vector<hot_key_t> Client::hot_keys()
+{
+    return hot_sketch.top();
+}
 
-    Connection *server_p = select_successor_server(key);
-    if (!server_p)
+/**
+ * @brief count a get of a key in the hot key sketch
+ *
+ * @return true if the key is hot
+ */
+bool Client::track_key(const std::string &key)
+{
+    if (opts.hot_key_min == 0 || hot_sketch.record(key) < opts.hot_key_min)
+        return false;
+    hot_gets++;
+    return true;
+}
+
+/**
+ * @brief find an unexpired local copy of a hot key, and fill
+ * `response` as the server would have
+ *
+ * @param[out] value Location where the value is copied, as
+ * received from the server
+ *
+ * @return true if found, else false
+ */
+bool Client::find_local_copy(const std::string &key, msg_t *response, std::string &value)
+{
+    std::lock_guard<std::mutex> state_lock(state_mutex);
+    auto it = local_copies.find(key);
+    if (it == local_copies.end())
+        return false;
+    if (std::chrono::steady_clock::now() >= it->second.expires)
     {
-        logger->display_msg("[Client] No server alive at the moment for", put_msg);
+        local_copies.erase(it);
         return false;
     }
 
-    bool success = false;
+    response->type = resp_hit_t;
+    response->flags = it->second.flags;
+    response->cas = it->second.cas;
+    response->vlen = it->second.value.size();
+    if (!msg_value_streamed(response))
+    {
+        memcpy(response->value, it->second.value.data(), response->vlen);
+        response->value[response->vlen] = '\0';
+    }
+    value = it->second.value;
+    local_hits++;
+    return true;
+}
+
+/**
+ * @brief keep a local copy of the value of a hot key, with
+ * the flags and version in `response`, for
+ * `opts.hot_key_ttl_ms` milliseconds
+ */
+void Client::keep_local_copy(const std::string &key, const std::string &value,
+                             const msg_t *response)
+{
+    if (opts.hot_key_ttl_ms == 0)
+        return;
 
-    send_msg(server_p->get_fd(), put_msg);
-    logger->display_msg("[Client] Sent Request to server at port " + std::to_string(server_p->get_port()),
-                        put_msg);
+    // only about as many copies as tracked hot keys are kept
+    std::lock_guard<std::mutex> state_lock(state_mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (local_copies.size() >= HOT_KEYS_TOP_K)
+    {
+        for (auto it = local_copies.begin(); it != local_copies.end();)
+            it = now >= it->second.expires ? local_copies.erase(it) : std::next(it);
+        if (local_copies.size() >= HOT_KEYS_TOP_K)
+            return;
+    }
+    local_copies[key] = {value, response->flags, response->cas,
+                         now + std::chrono::milliseconds(opts.hot_key_ttl_ms)};
+}
 
-    // wait for acknowledgement
-    if (read_msg(server_p->get_fd(), response, RESPONSE_TIMEOUT) >= 0)
+/**
+ * @brief read the value of a hit response into `value`, as
+ * received from the server
+ *
+ * @return true if read, else false and the server is
+ * disconnected
+ */
+bool Client::receive_value(Connection *server_p, const msg_t *response, std::string &value)
+{
+    if (!msg_value_streamed(response))
     {
-        logger->display_msg("[Client] Received Response", response);
-        success = true;
+        value.assign(response->value, response->vlen);
+        return true;
     }
-    else
+    value.resize(response->vlen);
+    if (read_value(server_p->get_fd(), &value[0], response->vlen, RESPONSE_TIMEOUT) < 0)
     {
         server_p->disconnect();
-        success = false;
+        return false;
     }
-    free(put_msg);
-    return success;
+    return true;
 }
 
 /**
- * @brief sends a `get` request to the server it is connected to
+ * @brief decompress a value received with `CLIENT_FLAG_COMPRESSED`
  *
- * @param[in] key the key (max length = 100 bytes)
- * @param[in] response `msg_t` location where the server's
- * reply can be saved
+ * @return the value, "" if it is corrupt
+ */
+std::string Client::decode_string(const std::string &value, const msg_t *response)
+{
+    if (!(response->flags & CLIENT_FLAG_COMPRESSED))
+        return value;
+
+    long raw_len = decompressed_size(value.data(), value.size());
+    std::string raw(raw_len > 0 ? raw_len : 0, '\0');
+    if (raw_len < 0 || decode_value(value.data(), value.size(), &raw[0], raw.size()) < 0)
+        return "";
+    return raw;
+}
+
+/**
+ * @brief decompress a value received with `CLIENT_FLAG_COMPRESSED`
+ * into a caller buffer, and account for the time taken
  *
- * @return The value as a non-empty string, return "" if no
- * value was received
+ * @return length of the value, -1 if it is corrupt or does
+ * not fit `buf_len`
  */
-std::string Client::send_get_req(std::string key, msg_t *response)
+long Client::decode_value(const char *data, size_t len, char *buf, size_t buf_len)
+{
+    auto start = std::chrono::steady_clock::now();
+    long n = decompress_value(data, len, buf, buf_len);
+    decompress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    values_decompressed++;
+    return n;
+}
+
+/**
+ * @brief send a `get` request and wait for the response,
+ * trying the replicas of the key in order until one responds.
+ * Slow servers are hedged, see `await_get()`. Gets of a hot
+ * key start at the next replica each time.
+ * A streamed value is left on the connection.
+ *
+ * @param[out] io Location where the lock of the connection that
+ * responded is saved, held until its value was read
+ *
+ * @return the server that responded, NULL in case of error
+ */
+Connection *Client::request_value(std::string key, msg_t *response, bool hot,
+                                  std::unique_lock<std::mutex> &io)
 {
     msg_t *get_msg = create_get_msg(key);
 
     if (!get_msg)
     {
-        return "";
+        return NULL;
     }
 
-    Connection *server_p = select_successor_server(key);
-    if (!server_p)
+    // one server past the replicas is a hedge target only
+    std::vector<Connection *> servers = select_replicas(key, 1);
+    size_t nreplicas = std::min<size_t>(servers.size(), opts.replicas);
+    if (servers.empty())
     {
         logger->display_msg("[Client] No server alive at the moment for", get_msg);
-        return "";
+        free(get_msg);
+        return NULL;
     }
 
-    std::string value = "";
-    send_msg(server_p->get_fd(), get_msg);
-    logger->display_msg("[Client] Sent Request to server at port " + std::to_string(server_p->get_port()),
-                        get_msg);
+    // spread the gets of a hot key over its replicas, and earn
+    // the budget for hedged requests
+    state_mutex.lock();
+    if (hot && nreplicas > 1)
+        std::rotate(servers.begin(), servers.begin() + hot_rotation++ % nreplicas,
+                    servers.begin() + nreplicas);
+    hedge_tokens = std::min(hedge_tokens + opts.hedge_budget, (double)HEDGE_BURST);
+    state_mutex.unlock();
 
-    // wait for value
-    if (read_msg(server_p->get_fd(), response, RESPONSE_TIMEOUT) >= 0)
+    for (size_t i = 0; i < nreplicas; i++)
     {
-        logger->display_msg("[Client] Received Response", response);
+        Connection *hedge_p = i + 1 < servers.size() ? servers[i + 1] : NULL;
+        Connection *server_p = await_get(servers[i], hedge_p, get_msg, response, io);
+        Connection *from = server_p ? previous_owner(server_p) : NULL;
+        if (from && response->type == resp_miss_t && from->is_connected())
+        {
+            // the key may not have been handed over yet, a failed
+            // retry leaves the miss. A miss carries no value, so
+            // its connection is let go before the next is taken.
+            msg_t miss;
+            memcpy(&miss, response, sizeof(miss));
+            io.unlock();
+            Connection *prev_p = await_get(from, NULL, get_msg, response, io);
+            if (!prev_p)
+                memcpy(response, &miss, sizeof(miss));
+            else if (response->type == resp_hit_t)
+            {
+                handoff_hits++;
+                server_p = prev_p;
+            }
+        }
+        if (server_p)
+        {
+            free(get_msg);
+            return server_p;
+        }
+        // fall over to the next replica right away
+    }
+
+    free(get_msg);
+    return NULL;
+}
 
-        if (response->type == resp_hit_t)
-            value = response->value;
+/**
+ * @brief send a request, after dropping the responses to
+ * earlier requests that are no longer wanted
+ *
+ * @return true if sent, else false
+ */
+bool Client::send_request(Connection *server_p, msg_t *msg, const char *value)
+{
+    if (!server_p->drain_stale_responses(RESPONSE_TIMEOUT) ||
+        send_msg(server_p->get_fd(), msg, value) < 0)
+    {
+        return false;
     }
-    else
+    logger->display_msg("[Client] Sent Request to server at " + endpoint_str(server_p->get_endpoint()),
+                        msg);
+    return true;
+}
+
+/**
+ * @brief send a `get` request to a server and wait for the
+ * response. If the server takes longer than its p95, the
+ * request is also sent to `hedge_p` if the hedge budget allows,
+ * and the first hit wins. A miss from `hedge_p` is not taken
+ * while the server may still respond. A hedge target busy with
+ * a request of another thread is not waited for.
+ *
+ * @param[out] io Location where the lock of the connection that
+ * responded is saved, held until its value was read
+ *
+ * @return the server whose response is in `response`, NULL if
+ * the server failed or timed out
+ */
+Connection *Client::await_get(Connection *server_p, Connection *hedge_p,
+                              msg_t *get_msg, msg_t *response,
+                              std::unique_lock<std::mutex> &io)
+{
+    std::unique_lock<std::mutex> locks[2] = {server_p->lock_io(), std::unique_lock<std::mutex>()};
+    if (!send_request(server_p, get_msg))
     {
         server_p->disconnect();
+        return NULL;
     }
 
-    free(get_msg);
-    return value;
+    auto start = std::chrono::steady_clock::now();
+    long deadline_us = server_p->timeout_ms(RESPONSE_TIMEOUT) * 1000L;
+    long hedge_us = hedge_p && opts.hedge_budget > 0 ? server_p->hedge_delay_us() : -1;
+    Connection *from[2] = {server_p, NULL};
+    struct pollfd pfd[2] = {{server_p->get_fd(), POLLIN, 0}, {-1, POLLIN, 0}};
+
+    while (pfd[0].fd >= 0 || pfd[1].fd >= 0)
+    {
+        long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+        if (hedge_us >= 0 && elapsed >= hedge_us && pfd[0].fd >= 0)
+        {
+            hedge_us = -1;
+            if (!spend_hedge_token())
+            {
+                hedges_denied++;
+            }
+            // a hedge target busy with another request would be
+            // slow to answer as well
+            else if ((locks[1] = hedge_p->try_lock_io()) && send_request(hedge_p, get_msg))
+            {
+                hedges_sent++;
+                from[1] = hedge_p;
+                pfd[1].fd = hedge_p->get_fd();
+            }
+            else if (locks[1])
+            {
+                locks[1].unlock();
+            }
+        }
+        if (elapsed >= deadline_us)
+            break;
+
+        long wait_us = (hedge_us >= 0 ? hedge_us : deadline_us) - elapsed;
+        if (poll_msgs(pfd, 2, wait_us) < 0 && errno != EINTR)
+            break;
+
+        for (int k = 0; k < 2; k++)
+        {
+            if (pfd[k].fd < 0 || !pfd[k].revents)
+                continue;
+            Connection *s = from[k];
+            pfd[k].fd = -1;
+            if (read_msg(s->get_fd(), response, RESPONSE_TIMEOUT) < 0)
+            {
+                s->disconnect();
+                locks[k].unlock();
+                continue;
+            }
+            s->record_latency(std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count());
+            logger->display_msg("[Client] Received Response", response);
+
+            // the hedge target may not hold the key
+            if (k == 1 && response->type == resp_miss_t && pfd[0].fd >= 0)
+            {
+                locks[k].unlock();
+                continue;
+            }
+
+            // the other response is dropped when it arrives
+            if (pfd[1 - k].fd >= 0)
+                from[1 - k]->expect_stale_response();
+            if (k == 1)
+                hedges_won++;
+            io = std::move(locks[k]);
+            return s;
+        }
+    }
+
+    // timed out, a late response from the hedge target is dropped
+    if (pfd[0].fd >= 0)
+        server_p->disconnect();
+    if (pfd[1].fd >= 0)
+        hedge_p->expect_stale_response();
+    return NULL;
+}
+
+/**
+ * @brief take one request off the hedge budget
+ *
+ * @return true if the budget allowed it, else false
+ */
+bool Client::spend_hedge_token()
+{
+    std::lock_guard<std::mutex> state_lock(state_mutex);
+    if (hedge_tokens < 1)
+        return false;
+    hedge_tokens -= 1;
+    return true;
+}
+
+/**
+ * @brief take the connections of several servers for a request,
+ * each once and in the order of their addresses, so threads
+ * taking several never wait on each other in a cycle
+ *
+ * @return the locks, released when they go out of scope
+ */
+std::vector<std::unique_lock<std::mutex>> Client::lock_servers(std::vector<Connection *> servers)
+{
+    std::sort(servers.begin(), servers.end(), std::less<Connection *>());
+    servers.erase(std::unique(servers.begin(), servers.end()), servers.end());
+
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (Connection *s : servers)
+        locks.push_back(s->lock_io());
+    return locks;
 }
 
 /**
@@ -146,6 +1371,9 @@ void Client::close_client()
     close_mutex.lock();
     close_flag = true;
     close_mutex.unlock();
+    close_cv.notify_all();
+    if (monitor.joinable())
+        monitor.join();
 
     for (Connection *s : server_pool)
     {
@@ -199,7 +1427,7 @@ Connection *Client::select_successor_server(std::string key)
     for (Connection *s : server_pool)
     {
         // The first alive server that has >= hash value
-        if (s->is_connected())
+        if (s->is_connected() && !s->is_warming())
         {
             if (!first_alive)
                 first_alive = s;
@@ -212,30 +1440,336 @@ Connection *Client::select_successor_server(std::string key)
 }
 
 /**
- * @brief Try connecting to servers that have been
- * disconnected. This function is expected to run
- * in the background throughout while the client is
- * active
+ * @brief Selects the servers holding a key: its successor
+ * followed by the next alive servers on the ring
+ *
+ * @param[in] key The key to store/fetch
+ * @param[in] extra Number of further servers to select
+ * past the replicas
+ *
+ * @return up to `opts.replicas + extra` servers, the primary first
+ */
+std::vector<Connection *> Client::select_replicas(std::string key, unsigned int extra)
+{
+    unsigned int key_hash = get_hash(key);
+    std::vector<Connection *> replicas;
+    int n = server_pool.size(), start = 0;
+
+    // the ring is sorted by hash, start at the successor of the key
+    while (start < n && server_pool[start]->get_port_hash() < key_hash)
+        start++;
+
+    for (int i = 0; i < n && replicas.size() < opts.replicas + extra; i++)
+    {
+        Connection *s = server_pool[(start + i) % n];
+        if (s->is_connected() && !s->is_warming())
+            replicas.push_back(s);
+    }
+    return replicas;
+}
+
+/**
+ * @brief Reconnect servers that have been disconnected
+ * and send heartbeats to the connected ones. This function
+ * is expected to run in the background throughout while
+ * the client is active
  */
-void Client::poll_disconnected_servers()
+void Client::monitor_servers()
 {
+    auto last_heartbeat = std::chrono::steady_clock::now();
+
     while (true)
     {
-        sleep(POLL_INTERVAL);
+        {
+            std::unique_lock<std::shared_mutex> lock(close_mutex);
+            close_cv.wait_for(lock, std::chrono::milliseconds(POLL_INTERVAL_MS),
+                              [this]
+                              { return close_flag; });
+            if (close_flag)
+                return;
+        }
 
-        close_mutex.lock();
+        for (Connection *s : reconnect_servers(CONNECT_TIMEOUT, opts.migration_ms > 0))
+            warm_up(s);
 
-        if (close_flag)
+        if (std::chrono::steady_clock::now() - last_heartbeat >=
+            std::chrono::milliseconds(HEARTBEAT_INTERVAL))
         {
-            close_mutex.unlock();
-            return;
+            send_heartbeats();
+            last_heartbeat = std::chrono::steady_clock::now();
         }
+    }
+}
 
-        for (Connection *s : server_pool)
+/**
+ * @brief Start a connection attempt to every server whose
+ * backoff has passed, and wait for all of them together
+ *
+ * @param[in] timeout_ms The longest wait for the attempts
+ * @param[in] warm Indicates if the servers are kept out of the
+ * key ring once connected, until `warm_up()` was called
+ *
+ * @return the servers that connected and must be warmed up
+ */
+std::vector<Connection *> Client::reconnect_servers(int timeout_ms, bool warm)
+{
+    std::vector<Connection *> pending, joined;
+    std::vector<struct pollfd> pfds;
+
+    for (Connection *s : server_pool)
+    {
+        // set before the attempt, so no request is routed to the
+        // server between connecting and warming up
+        if (warm && s->get_pending_fd() < 0 && s->reconnect_due())
+            s->set_warming(true);
+        if (s->get_pending_fd() >= 0 || (s->reconnect_due() && s->start_connect()))
+        {
+            pending.push_back(s);
+            pfds.push_back({s->get_pending_fd(), POLLOUT, 0});
+        }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    size_t left = pending.size();
+    while (left > 0)
+    {
+        long wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           deadline - std::chrono::steady_clock::now())
+                           .count();
+        if (wait_ms < 0 || (poll(pfds.data(), pfds.size(), wait_ms) < 0 && errno != EINTR))
+            break;
+        for (size_t i = 0; i < pfds.size(); i++)
+        {
+            if (pfds[i].fd < 0 || !pfds[i].revents)
+                continue;
+            if (pending[i]->finish_connect(false) && pending[i]->is_warming())
+                joined.push_back(pending[i]);
+            pfds[i].fd = -1;
+            left--;
+        }
+    }
+
+    // attempts still in progress are given up
+    for (size_t i = 0; i < pfds.size(); i++)
+    {
+        if (pfds[i].fd >= 0)
+            pending[i]->finish_connect(true);
+    }
+    return joined;
+}
+
+/**
+ * @brief Copy the keys a server that just joined the ring owns
+ * from the next server on the ring, which owned them so far,
+ * then route requests to it and open its migration window.
+ * Requests to the previous owner wait while the keys are
+ * copied, and keys the joiner holds already are kept.
+ *
+ * @param[in] joiner The server
+ */
+void Client::warm_up(Connection *joiner)
+{
+    int n = server_pool.size();
+    int at = std::find(server_pool.begin(), server_pool.end(), joiner) - server_pool.begin();
+    Connection *from = NULL, *pred = NULL;
+
+    // the joiner takes over the keys after the server before it on
+    // the ring, up to its own hash, from the server after it
+    for (int i = 1; i < n && !from; i++)
+    {
+        Connection *s = server_pool[(at + i) % n];
+        if (s->is_connected() && !s->is_warming())
+            from = s;
+    }
+    for (int i = 1; i < n && !pred; i++)
+    {
+        Connection *s = server_pool[(at - i + n) % n];
+        if (s->is_connected() && !s->is_warming())
+            pred = s;
+    }
+
+    state_mutex.lock();
+    migrations.erase(std::remove_if(migrations.begin(), migrations.end(),
+                                    [joiner](const migration_t &m)
+                                    { return m.to == joiner || m.from == joiner; }),
+                     migrations.end());
+    state_mutex.unlock();
+    if (from)
+    {
+        long copied = copy_range(from, joiner, pred->get_port_hash(), joiner->get_port_hash());
+        *logger << "[Client] Handed " + std::to_string(copied) + " keys to server at " +
+                       endpoint_str(joiner->get_endpoint()) + "\n";
+        std::lock_guard<std::mutex> state_lock(state_mutex);
+        migrations.push_back({joiner, from, std::chrono::steady_clock::now() +
+                                                std::chrono::milliseconds(opts.migration_ms)});
+    }
+    joiner->set_warming(false);
+}
+
+/**
+ * @brief Stream the keys of an arc of the ring from one server
+ * to another. Both connections are held until it is done.
+ *
+ * @param[in] from The server holding the keys
+ * @param[in] to The server the keys are put to
+ * @param[in] lo The start of the arc, not included
+ * @param[in] hi The end of the arc
+ *
+ * @return the number of keys stored by `to`
+ */
+long Client::copy_range(Connection *from, Connection *to, uint32_t lo, uint32_t hi)
+{
+    std::vector<std::unique_lock<std::mutex>> io = lock_servers({from, to});
+    msg_t *scan_msg = create_scan_msg(lo, hi);
+    bool sent = send_request(from, scan_msg);
+    free(scan_msg);
+    if (!sent)
+    {
+        from->disconnect();
+        return 0;
+    }
+
+    msg_t *item = make_msg_ref(), *reply = make_msg_ref();
+    std::string value;
+    long copied = 0;
+    int unacked = 0;
+
+    // the keys are put as they arrive, and their acks read in
+    // batches so neither side waits for the other on every key
+    auto settle = [&]()
+    {
+        for (; unacked > 0; unacked--)
+        {
+            if (!to->is_connected())
+                continue;
+            if (read_msg(to->get_fd(), reply, RESPONSE_TIMEOUT) < 0)
+                to->disconnect();
+            else
+                copied += reply->type == resp_ack_t;
+        }
+    };
+
+    while (true)
+    {
+        if (read_msg(from->get_fd(), item, RESPONSE_TIMEOUT) < 0)
+        {
+            from->disconnect();
+            break;
+        }
+        // the ack, or an error if the server cannot scan, ends it
+        if (item->type != resp_scan_item_t)
+            break;
+        if (!receive_value(from, item, value))
+            break;
+
+        // a failed joiner is not sent to, the rest of the keys are
+        // still read to keep the connection in step
+        if (!to->is_connected())
+            continue;
+        // an add, so a value another client wrote to the joiner
+        // after its own handoff is never replaced by an older copy
+        item->type = req_add_t;
+        if (send_msg(to->get_fd(), item, value.data()) < 0)
+        {
+            to->disconnect();
+            continue;
+        }
+        if (++unacked == HANDOFF_BATCH)
+            settle();
+    }
+    settle();
+
+    free(item);
+    free(reply);
+    handoff_keys += copied;
+    return copied;
+}
+
+/**
+ * @brief the server that owned the keys of a server before it
+ * joined the ring, while its migration window is open
+ *
+ * @return the server, NULL if there is none
+ */
+Connection *Client::previous_owner(Connection *server_p)
+{
+    std::lock_guard<std::mutex> state_lock(state_mutex);
+    if (migrations.empty())
+        return NULL;
+
+    auto now = std::chrono::steady_clock::now();
+    migrations.erase(std::remove_if(migrations.begin(), migrations.end(),
+                                    [now](const migration_t &m)
+                                    { return now >= m.ends; }),
+                     migrations.end());
+    for (const migration_t &m : migrations)
+        if (m.to == server_p)
+            return m.from;
+    return NULL;
+}
+
+/**
+ * @brief Ping every connected server and disconnect those
+ * that do not answer in time. Servers with a request in
+ * flight are skipped, the request finds out by itself.
+ */
+void Client::send_heartbeats()
+{
+    msg_t *ping = create_ping_msg();
+    std::vector<Connection *> pinged;
+    std::vector<struct pollfd> pfds;
+    std::vector<std::unique_lock<std::mutex>> io;
+    for (Connection *s : server_pool)
+    {
+        if (!s->is_connected())
+            continue;
+        std::unique_lock<std::mutex> lock = s->try_lock_io();
+        if (!lock)
+            continue;
+        if (!s->drain_stale_responses(HEARTBEAT_TIMEOUT) ||
+            send_msg(s->get_fd(), ping) < 0)
+        {
+            s->disconnect();
+            continue;
+        }
+        pinged.push_back(s);
+        pfds.push_back({s->get_fd(), POLLIN, 0});
+        io.push_back(std::move(lock));
+    }
+    free(ping);
+
+    msg_t *pong = make_msg_ref();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HEARTBEAT_TIMEOUT);
+    size_t left = pinged.size();
+    while (left > 0)
+    {
+        long wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           deadline - std::chrono::steady_clock::now())
+                           .count();
+        if (wait_ms < 0 || (poll_msgs(pfds.data(), pfds.size(), wait_ms * 1000) < 0 && errno != EINTR))
+            break;
+        for (size_t i = 0; i < pfds.size(); i++)
+        {
+            if (pfds[i].fd < 0 || !pfds[i].revents)
+                continue;
+            if (read_msg(pfds[i].fd, pong, HEARTBEAT_TIMEOUT) < 0 || pong->type != resp_pong_t)
+                pinged[i]->disconnect();
+            else
+                pinged[i]->mark_alive();
+            pfds[i].fd = -1;
+            left--;
+        }
+    }
+    free(pong);
+
+    // a server that did not answer is considered failed
+    for (size_t i = 0; i < pfds.size(); i++)
+    {
+        if (pfds[i].fd >= 0)
         {
-            if (!s->is_connected())
-                s->connect();
+            *logger << "[Client] No heartbeat from server at " +
+                           endpoint_str(pinged[i]->get_endpoint()) + "\n";
+            pinged[i]->disconnect();
         }
-        close_mutex.unlock();
     }
-}
\ No newline at end of file
+}
@@ -11,10 +11,94 @@
 
 #include <unistd.h>
 #include <iostream>
+#include <atomic>
+#include <vector>
+#include <mutex>
 #include <shared_mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include <memory>
 #include "../utils/message.hpp"
 #include "../utils/logger.hpp"
 #include "connection.hpp"
+#include "hotkeys.hpp"
+
+/* Flag stored with values the client sent compressed */
+#define CLIENT_FLAG_COMPRESSED 0x1
+
+/* Default size from which values are compressed */
+#define COMPRESS_MIN_DEFAULT 512
+
+/* Most gets of a batch sent before their responses are read */
+#define FORWARD_GETS_WINDOW 32
+
+/**
+ * @brief Optional client settings
+ */
+struct client_opts_t
+{
+    /* Values of at least this many bytes are compressed before
+     * they are sent, 0 disables compression */
+    size_t compress_min = COMPRESS_MIN_DEFAULT;
+
+    /* Number of servers each key is stored on: its successor on
+     * the ring followed by the next distinct servers */
+    unsigned int replicas = 1;
+
+    /* Share of gets that may be sent a second time when the
+     * server takes longer than its p95, 0 disables hedging */
+    double hedge_budget = 0.05;
+
+    /* A key fetched at least this many times in the recent window
+     * of the hot key sketch is hot, 0 disables hot key detection.
+     * Gets of hot keys are spread over all their replicas. */
+    unsigned int hot_key_min = 100;
+
+    /* Hot keys are served from a local copy for this long after
+     * it was fetched, 0 disables local copies. Puts of this client
+     * drop the local copy, puts of other clients are seen once it
+     * expires. */
+    unsigned int hot_key_ttl_ms = 0;
+
+    /* When a server joins or rejoins the ring, the keys it now owns
+     * are copied to it from the server that owned them so far
+     * before any request is routed to it. For this long afterwards
+     * a get that misses on it is retried on the previous owner, and
+     * deletes are sent there too. 0 disables the handoff, a joining
+     * server then starts out empty. */
+    unsigned int migration_ms = 10000;
+};
+
+/**
+ * @brief Compression, hedging and hot key figures of a client
+ */
+struct client_stats_t
+{
+    uint64_t compress_attempts;
+    uint64_t values_compressed; // attempts that made the value smaller
+    uint64_t values_decompressed;
+    uint64_t bytes_raw;         // of the values sent compressed
+    uint64_t bytes_compressed;
+    uint64_t compress_ns;
+    uint64_t decompress_ns;
+    double compression_ratio;   // bytes_raw / bytes_compressed
+
+    uint64_t hedges_sent;
+    uint64_t hedges_won;    // answered before the first server
+    uint64_t hedges_denied; // over the hedge budget
+
+    uint64_t hot_gets;   // gets of keys found hot
+    uint64_t local_hits; // served from a local copy
+
+    uint64_t gets;
+    uint64_t gets_coalesced; // answered by the request of a concurrent get
+    double coalesce_rate;    // gets_coalesced / gets
+
+    uint64_t handoff_keys; // copied to servers that joined the ring
+    uint64_t handoff_hits; // misses answered by the previous owner
+};
 
 /**
  * @brief represents a single client. This class contains
@@ -29,33 +113,276 @@ public:
      *
      * @param[in] ports Ports of all servers in the server pool
      * @param[in] print_logs Indicates if log should be printed
+     * @param[in] opts Optional client settings
+     */
+    Client(std::vector<int> ports, bool print_logs, client_opts_t opts = client_opts_t());
+
+    /**
+     * @brief Client starts by connecting to the servers at the
+     * endpoints passed, over TCP or Unix domain sockets
+     *
+     * @param[in] servers Endpoints of all servers in the server pool
+     * @param[in] print_logs Indicates if log should be printed
+     * @param[in] opts Optional client settings
      */
-    Client(std::vector<int> ports, bool print_logs);
+    Client(std::vector<endpoint_t> servers, bool print_logs, client_opts_t opts = client_opts_t());
 
     /**
      * @brief sends a `put` request to the server it is connected to
      *
      * @param[in] key the key (max length = 100 bytes)
-     * @param[in] value the value (max length = 1000 bytes)
+     * @param[in] value the value. Values longer than 1000 bytes
+     * are streamed from `value` without a copy, up to the limit
+     * the server was started with (1 MB by default). Values of at
+     * least `opts.compress_min` bytes are sent compressed, and
+     * decompressed again by the `get` requests. The request is
+     * sent to all `opts.replicas` servers of the key before any
+     * reply is awaited.
      * @param[in] response `msg_t` location where the server's
      * reply can be saved
      *
-     * @return true if request was successful, else false
+     * @return true if at least one server stored the value,
+     * else false
      */
     bool send_put_req(std::string key, std::string value, msg_t *response);
 
     /**
-     * @brief sends a `get` request to the server it is connected to
+     * @brief sends a `cas` request: a put that only succeeds if the
+     * value of the key is still at the version the caller read.
+     * With replicas, the primary compares the version and the
+     * other replicas are sent the value once it was accepted.
      *
      * @param[in] key the key (max length = 100 bytes)
+     * @param[in] value the new value, sent like the value of a put
+     * @param[in] cas the version from the `cas` field of the hit
+     * response to an earlier `get` request
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved, of type `resp_exists_t` if the value
+     * changed since it was read
+     *
+     * @return true if the value was replaced, else false
+     */
+    bool send_cas_req(std::string key, std::string value, uint64_t cas, msg_t *response);
+
+    /**
+     * @brief sends an `incr` request, adding to a value that holds a
+     * decimal number in one round trip. Additions wrap around at 2^64.
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[in] delta the amount to add
+     * @param[out] result location where the new number is saved
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved
+     *
+     * @return true if the number was updated, false if the key is
+     * missing, does not hold a number, or in case of error
+     */
+    bool send_incr_req(std::string key, uint64_t delta, uint64_t *result, msg_t *response);
+
+    /**
+     * @brief sends a `decr` request, subtracting from a value that
+     * holds a decimal number in one round trip. The number stops at 0.
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[in] delta the amount to subtract
+     * @param[out] result location where the new number is saved
      * @param[in] response `msg_t` location where the server's
      * reply can be saved
      *
+     * @return true if the number was updated, false if the key is
+     * missing, does not hold a number, or in case of error
+     */
+    bool send_decr_req(std::string key, uint64_t delta, uint64_t *result, msg_t *response);
+
+    /**
+     * @brief sends an `append` request, adding bytes at the end of
+     * a value in one round trip. The bytes are never compressed, so
+     * values stored compressed must not be appended to.
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[in] value the bytes to add
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved
+     *
+     * @return true if the value was updated, false if the key is
+     * missing or in case of error
+     */
+    bool send_append_req(std::string key, std::string value, msg_t *response);
+
+    /**
+     * @brief sends a `prepend` request, adding bytes at the start of
+     * a value in one round trip. The bytes are never compressed, so
+     * values stored compressed must not be prepended to.
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[in] value the bytes to add
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved
+     *
+     * @return true if the value was updated, false if the key is
+     * missing or in case of error
+     */
+    bool send_prepend_req(std::string key, std::string value, msg_t *response);
+
+    /**
+     * @brief sends a `get` request to the server it is connected to.
+     * Gets of a key issued by other threads while a get of it is in
+     * flight wait for its response instead of sending their own.
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved. On a hit, its `cas` field holds the
+     * version of the value for `send_cas_req()`.
+     *
      * @return The value as a non-empty string, return "" if no
      * value was received
      */
     std::string send_get_req(std::string key, msg_t *response);
 
+    /**
+     * @brief sends a `get` request to the server it is connected to,
+     * and reads the value straight into a caller buffer. Concurrent
+     * gets of the same key are merged like those of `send_get_req()`.
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[out] buf Location where the value is read to
+     * @param[in] buf_len Size of `buf`
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved
+     *
+     * @return length of the value, -1 on a miss, an error, or if
+     * the value is longer than `buf_len`
+     */
+    long send_get_req(std::string key, char *buf, size_t buf_len, msg_t *response);
+
+    /**
+     * @brief sends a `delete` request to every replica of the key
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved
+     *
+     * @return true if at least one server removed the key, false
+     * if it was not found or in case of error
+     */
+    bool send_delete_req(std::string key, msg_t *response);
+
+    /**
+     * @brief sends a `flush_all` request to every connected server,
+     * removing all keys. Each server returns right away and reclaims
+     * the memory of the keys in the background.
+     *
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved
+     *
+     * @return true if at least one server was flushed, else false
+     */
+    bool send_flush_all_req(msg_t *response);
+
+    /**
+     * @brief sends a `lease get` request to the primary of the key.
+     * On a miss, only the first client is granted a lease and should
+     * compute the value and store it with `send_lease_put_req()`.
+     * The other clients are told to wait, and retry shortly until
+     * the value is stored, or are sent a value evicted a moment ago
+     * if the server still has it.
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[out] lease location where the lease token is saved,
+     * 0 unless a lease was granted
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved, of type `resp_stale_hit_t` if the value
+     * is stale, or `resp_lease_wait_t` if the client gave up waiting
+     *
+     * @return The value as a non-empty string, return "" if no
+     * value was received
+     */
+    std::string send_lease_get_req(std::string key, uint64_t *lease, msg_t *response);
+
+    /**
+     * @brief sends a `lease put` request: a put that is only stored
+     * while the lease granted by `send_lease_get_req()` is valid.
+     * The primary checks the lease and the other replicas are sent
+     * the value once it was accepted.
+     *
+     * @param[in] key the key (max length = 100 bytes)
+     * @param[in] value the value, sent like the value of a put
+     * @param[in] lease the lease token
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved, of type `resp_exists_t` if the lease
+     * expired
+     *
+     * @return true if the value was stored, else false
+     */
+    bool send_lease_put_req(std::string key, std::string value, uint64_t lease, msg_t *response);
+
+    /**
+     * @brief forwards a request received from another client, as a
+     * proxy does. It is routed, replicated and failed over like the
+     * request of the same type sent through the other methods, but
+     * its value, flags, version and lease token are passed through
+     * as they are: values are never compressed or decompressed. A
+     * `lease get` is tried once, its sender retries it. Only the
+     * requests changing or reading keys, and `flush_all`, can be
+     * forwarded.
+     *
+     * @param[in] req The request
+     * @param[in] value The value of the request
+     * @param[out] response Location where the reply is saved, of
+     * type `resp_error_t` if no server replied
+     * @param[out] resp_value Location where the value of the reply
+     * is saved, as received from the server
+     */
+    void forward_req(msg_t *req, const std::string &value, msg_t *response,
+                     std::string &resp_value);
+
+    /**
+     * @brief forwards the `get` requests of several keys received
+     * from other clients, see `forward_req()`. The requests are sent
+     * to the primaries of the keys before any response is read, up to
+     * `FORWARD_GETS_WINDOW` at a time, so a batch waits about one
+     * round trip for all its keys instead of one for each. A key whose
+     * server fails, or that missed on a server in its migration
+     * window, is fetched again as by `forward_req()`. Gets of a batch
+     * are not hedged.
+     *
+     * @param[in] reqs The requests
+     * @param[out] responses Location where the reply to each request
+     * is saved
+     * @param[out] values Location where the value of each reply is
+     * saved, as received from the server
+     */
+    void forward_gets(const std::vector<msg_t *> &reqs, const std::vector<msg_t *> &responses,
+                      std::vector<std::string> &values);
+
+    /**
+     * @brief asks one server for its report of the keys that
+     * dominate its traffic and of the key and value sizes it sees
+     *
+     * @param[in] port The port of the server
+     * @param[in] response `msg_t` location where the server's
+     * reply can be saved
+     *
+     * @return The report, "" if the server did not respond
+     */
+    std::string send_stats_req(int port, msg_t *response);
+
+    /**
+     * @brief Compression, hedging and hot key figures since the
+     * client was created
+     *
+     * @return the figures
+     */
+    client_stats_t stats();
+
+    /**
+     * @brief The keys fetched most often in the recent window,
+     * with their estimated number of gets
+     *
+     * @return the keys, the most frequent first
+     */
+    std::vector<hot_key_t> hot_keys();
+
     /**
      * @brief terminates connection with all servers
      */
@@ -78,18 +405,358 @@ protected:
      */
     Connection *select_successor_server(std::string key);
 
+    /**
+     * @brief Selects the servers holding a key: its successor
+     * followed by the next alive servers on the ring
+     *
+     * @param[in] key The key to store/fetch
+     * @param[in] extra Number of further servers to select
+     * past the replicas
+     *
+     * @return up to `opts.replicas + extra` servers, the primary first
+     */
+    std::vector<Connection *> select_replicas(std::string key, unsigned int extra = 0);
+
+    /**
+     * @brief Copy the keys a server that just joined the ring owns
+     * from the next server on the ring, which owned them so far,
+     * then route requests to it and open its migration window.
+     * Requests to the previous owner wait while the keys are
+     * copied, and keys the joiner holds already are kept.
+     *
+     * @param[in] joiner The server
+     */
+    void warm_up(Connection *joiner);
+
 private:
     std::shared_mutex close_mutex;
+    std::condition_variable_any close_cv;
     bool close_flag;
+    std::thread monitor;
+
+    // guards the local copies, the hedge budget and the migration
+    // windows. Held briefly, never while waiting on a server: each
+    // connection is guarded by its own lock, see `lock_io()`.
+    std::mutex state_mutex;
     Logger *logger;
+    client_opts_t opts;
+
+    std::atomic<uint64_t> compress_attempts = {0};
+    std::atomic<uint64_t> values_compressed = {0};
+    std::atomic<uint64_t> values_decompressed = {0};
+    std::atomic<uint64_t> bytes_raw = {0};
+    std::atomic<uint64_t> bytes_compressed = {0};
+    std::atomic<uint64_t> compress_ns = {0};
+    std::atomic<uint64_t> decompress_ns = {0};
+
+    double hedge_tokens = 0;
+    std::atomic<uint64_t> hedges_sent = {0};
+    std::atomic<uint64_t> hedges_won = {0};
+    std::atomic<uint64_t> hedges_denied = {0};
+
+    struct local_copy_t
+    {
+        std::string value; // as received, possibly compressed
+        uint32_t flags;
+        uint64_t cas;
+        std::chrono::steady_clock::time_point expires;
+    };
+    // a get in flight, that gets of the same key by other
+    // threads wait for
+    struct flight_t
+    {
+        std::condition_variable cv;
+        bool landed = false;
+        bool shared = false; // the value could be handed out
+        int waiters = 0;
+        std::string value;
+        msg_t response;
+    };
+    std::mutex flight_mutex;
+    std::unordered_map<std::string, std::shared_ptr<flight_t>> flights;
+    std::atomic<uint64_t> gets = {0};
+    std::atomic<uint64_t> gets_coalesced = {0};
+
+    // key ranges recently handed to a joining server, guarded
+    // by `state_mutex`
+    struct migration_t
+    {
+        Connection *to;
+        Connection *from; // the previous owner of the range
+        std::chrono::steady_clock::time_point ends;
+    };
+    std::vector<migration_t> migrations;
+    std::atomic<uint64_t> handoff_keys = {0};
+    std::atomic<uint64_t> handoff_hits = {0};
+
+    HotKeySketch hot_sketch;
+    std::unordered_map<std::string, local_copy_t> local_copies;
+    unsigned int hot_rotation = 0;
+    std::atomic<uint64_t> hot_gets = {0};
+    std::atomic<uint64_t> local_hits = {0};
 
     /**
-     * @brief Try connecting to servers that have been
-     * disconnected. This function is expected to run
-     * in the background throughout while the client is
-     * active
+     * @brief Reconnect servers that have been disconnected
+     * and send heartbeats to the connected ones. This function
+     * is expected to run in the background throughout while
+     * the client is active
+     */
+    void monitor_servers();
+
+    /**
+     * @brief Start a connection attempt to every server whose
+     * backoff has passed, and wait for all of them together
+     *
+     * @param[in] timeout_ms The longest wait for the attempts
+     * @param[in] warm Indicates if the servers are kept out of the
+     * key ring once connected, until `warm_up()` was called
+     *
+     * @return the servers that connected and must be warmed up
+     */
+    std::vector<Connection *> reconnect_servers(int timeout_ms, bool warm);
+
+    /**
+     * @brief Stream the keys of an arc of the ring from one server
+     * to another. Both connections are held until it is done.
+     *
+     * @param[in] from The server holding the keys
+     * @param[in] to The server the keys are put to
+     * @param[in] lo The start of the arc, not included
+     * @param[in] hi The end of the arc
+     *
+     * @return the number of keys stored by `to`
+     */
+    long copy_range(Connection *from, Connection *to, uint32_t lo, uint32_t hi);
+
+    /**
+     * @brief the server that owned the keys of a server before it
+     * joined the ring, while its migration window is open
+     *
+     * @return the server, NULL if there is none
+     */
+    Connection *previous_owner(Connection *server_p);
+
+    /**
+     * @brief Ping every connected server and disconnect those
+     * that do not answer in time. Servers with a request in
+     * flight are skipped, the request finds out by itself.
+     */
+    void send_heartbeats();
+
+    /**
+     * @brief wait for the get of a key in flight, or start one
+     *
+     * @param[out] response Location where the response of the get
+     * waited for is copied
+     * @param[out] value Location where its value is copied
+     *
+     * @return the flight the caller must send the get for and then
+     * land, NULL if `response` and `value` hold the result of the
+     * get waited for
+     */
+    std::shared_ptr<flight_t> join_flight(const std::string &key, msg_t *response,
+                                          std::string &value);
+
+    /**
+     * @brief hand the result of a get to the gets waiting for it
+     *
+     * @param[in] value The value, NULL if the get failed to read it
+     * @param[in] len Length of the value
+     */
+    void land_flight(const std::string &key, const std::shared_ptr<flight_t> &flight,
+                     const msg_t *response, const char *value, size_t len);
+
+    /**
+     * @brief forget the get of a key in flight, so gets issued from
+     * now on do not wait for a response that may predate an update
+     */
+    void ground_flight(const std::string &key);
+
+    /**
+     * @brief the body of `send_get_req()`, without merging
+     */
+    std::string fetch_value(std::string key, msg_t *response);
+
+    /**
+     * @brief get the value of a key as received from the server,
+     * possibly compressed, or from its local copy if it is hot
+     *
+     * @param[out] value Location where the value is saved
+     *
+     * @return true on a hit, else false
+     */
+    bool fetch_raw(std::string key, msg_t *response, std::string &value);
+
+    /**
+     * @brief the replicas of a key and the previous owners of those
+     * in their migration window, which a delete must reach
+     */
+    std::vector<Connection *> delete_targets(std::string key);
+
+    /**
+     * @brief the body of `send_get_req()` into a caller buffer,
+     * without merging
+     */
+    long fetch_value(std::string key, char *buf, size_t buf_len, msg_t *response);
+
+    /**
+     * @brief send a `get` request and wait for the response,
+     * trying the replicas of the key in order until one responds.
+     * Slow servers are hedged, see `await_get()`. Gets of a hot
+     * key start at the next replica each time.
+     * A streamed value is left on the connection.
+     *
+     * @param[out] io Location where the lock of the connection that
+     * responded is saved, held until its value was read
+     *
+     * @return the server that responded, NULL in case of error
+     */
+    Connection *request_value(std::string key, msg_t *response, bool hot,
+                              std::unique_lock<std::mutex> &io);
+
+    /**
+     * @brief compress a value if it is long enough and that makes
+     * it smaller, and account for the time taken
+     *
+     * @param[out] compressed Location where the compressed value
+     * is saved
+     * @param[out] flags `CLIENT_FLAG_COMPRESSED` is set if the value
+     * was compressed
+     *
+     * @return the value to send, `value` or `compressed`
+     */
+    const std::string &encode_value(const std::string &value, std::string &compressed,
+                                    uint32_t *flags);
+
+    /**
+     * @brief send a request changing the value of a key to each of
+     * `servers` before any reply is awaited, so they apply it in
+     * parallel. The servers are held until all replies were read.
+     *
+     * @param[in] value The value to stream after the message, if any
+     * @param[out] response Location where the first successful reply,
+     * or the first reply if none succeeded, is saved
+     *
+     * @return true if at least one server applied the request
+     */
+    bool send_update(const std::vector<Connection *> &servers, msg_t *msg,
+                     const char *value, msg_t *response);
+
+    /**
+     * @brief send a request that only the primary of the key may
+     * accept, then send the value it accepted to the other replicas
+     * as a put
+     *
+     * @return true if the primary accepted the request
+     */
+    bool send_primary_update(std::string key, msg_t *msg, const std::string &payload,
+                             uint32_t flags, msg_t *response);
+
+    /**
+     * @brief read the value of a hit response into `value`, as
+     * received from the server
+     *
+     * @return true if read, else false and the server is
+     * disconnected
+     */
+    bool receive_value(Connection *server_p, const msg_t *response, std::string &value);
+
+    /**
+     * @brief decompress a value received with `CLIENT_FLAG_COMPRESSED`
+     *
+     * @return the value, "" if it is corrupt
+     */
+    std::string decode_string(const std::string &value, const msg_t *response);
+
+    /**
+     * @brief send an `incr` or `decr` request to every replica
+     * of the key
+     */
+    bool send_incr(std::string key, uint64_t delta, bool decr, uint64_t *result,
+                   msg_t *response);
+
+    /**
+     * @brief send an `append` or `prepend` request to every replica
+     * of the key
+     */
+    bool send_append(std::string key, std::string value, bool prepend, msg_t *response);
+
+    /**
+     * @brief count a get of a key in the hot key sketch
+     *
+     * @return true if the key is hot
+     */
+    bool track_key(const std::string &key);
+
+    /**
+     * @brief find an unexpired local copy of a hot key, and fill
+     * `response` as the server would have
+     *
+     * @param[out] value Location where the value is copied, as
+     * received from the server
+     *
+     * @return true if found, else false
+     */
+    bool find_local_copy(const std::string &key, msg_t *response, std::string &value);
+
+    /**
+     * @brief keep a local copy of the value of a hot key, with
+     * the flags and version in `response`, for
+     * `opts.hot_key_ttl_ms` milliseconds
+     */
+    void keep_local_copy(const std::string &key, const std::string &value,
+                         const msg_t *response);
+
+    /**
+     * @brief send a request, after dropping the responses to
+     * earlier requests that are no longer wanted
+     *
+     * @return true if sent, else false
+     */
+    bool send_request(Connection *server_p, msg_t *msg, const char *value = NULL);
+
+    /**
+     * @brief send a `get` request to a server and wait for the
+     * response. If the server takes longer than its p95, the
+     * request is also sent to `hedge_p` if the hedge budget allows,
+     * and the first hit wins. A miss from `hedge_p` is not taken
+     * while the server may still respond. A hedge target busy with
+     * a request of another thread is not waited for.
+     *
+     * @param[out] io Location where the lock of the connection that
+     * responded is saved, held until its value was read
+     *
+     * @return the server whose response is in `response`, NULL if
+     * the server failed or timed out
+     */
+    Connection *await_get(Connection *server_p, Connection *hedge_p,
+                          msg_t *get_msg, msg_t *response,
+                          std::unique_lock<std::mutex> &io);
+
+    /**
+     * @brief take one request off the hedge budget
+     *
+     * @return true if the budget allowed it, else false
+     */
+    bool spend_hedge_token();
+
+    /**
+     * @brief take the connections of several servers for a request,
+     * each once and in the order of their addresses, so threads
+     * taking several never wait on each other in a cycle
+     *
+     * @return the locks, released when they go out of scope
+     */
+    static std::vector<std::unique_lock<std::mutex>> lock_servers(std::vector<Connection *> servers);
+
+    /**
+     * @brief decompress a value received with `CLIENT_FLAG_COMPRESSED`
+     * into a caller buffer, and account for the time taken
+     *
+     * @return length of the value, -1 if it is corrupt or does
+     * not fit `buf_len`
      */
-    void poll_disconnected_servers();
+    long decode_value(const char *data, size_t len, char *buf, size_t buf_len);
 };
 
 #endif
\ No newline at end of file
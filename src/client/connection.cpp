@@ -7,48 +7,193 @@
  */
 
 #include <unistd.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <iostream>
 #include <thread>
+#include <algorithm>
 #include "connection.hpp"
 #include "../utils/conn.hpp"
+#include "../utils/message.hpp"
+#include "../utils/shmring.hpp"
 #include "../hash/hash.hpp"
 
+/* Responses seen before the estimates are trusted */
+#define LATENCY_MIN_SAMPLES 20
+
+/* Weight of a new response time in the moving average */
+#define LATENCY_EWMA_ALPHA 0.1
+
+/* The timeout is this multiple of the estimated p99, but
+ * never less than `TIMEOUT_MIN_MS` */
+#define TIMEOUT_P99_FACTOR 4
+#define TIMEOUT_MIN_MS 50
+
+/* Wait before the next attempt to connect to a server doubles
+ * after every failure, from `BACKOFF_MIN_MS` up to `BACKOFF_MAX_MS`.
+ * The actual wait is drawn from the upper half of it so clients do
+ * not retry in step. */
+#define BACKOFF_MIN_MS 100
+#define BACKOFF_MAX_MS 5000
+
+/* Longest wait for a server to take over the rings of a
+ * shared memory endpoint */
+#define SHM_HANDSHAKE_MS 500
+
 /**
- * @brief Store server metadata and attempt to
+ * @brief Store server metadata and start to
  * establish a connection with the server at instantiation.
- * Should not block.
+ * Does not block, see `start_connect()`.
  *
  * @param[in] port The port of the localhost
  * server
  */
 Connection::Connection(int p)
+    : Connection(tcp_endpoint(p))
 {
-    hash = get_hash(p);
-    port = p;
-    connect();
+}
+
+/**
+ * @brief Store server metadata and start to
+ * establish a connection with the server at instantiation.
+ * Does not block, see `start_connect()`.
+ *
+ * @param[in] ep The endpoint of the server, TCP on any
+ * address, a Unix domain socket, or shared memory rings
+ * set up over one
+ */
+Connection::Connection(const endpoint_t &ep)
+{
+    // a Unix domain socket without a port is named by its path
+    hash = ep.port || ep.transport == TRANSPORT_TCP ? get_hash(ep.port) : get_hash(ep.path);
+    port = ep.port;
+    endpoint = ep;
+    clientfd = -1;
+    warming = false;
+    samples = 0;
+    ewma_us = p95_us = p99_us = 0;
+    stale_responses = 0;
+    pending_fd = -1;
+    backoff_ms = BACKOFF_MIN_MS;
+    next_attempt = std::chrono::steady_clock::now();
+    start_connect();
 }
 
 /**
  * @brief Attempt to connect to the server
- * and keep track of the client fd.
+ * and keep track of the client fd. Waits at most
+ * `timeout_ms` milliseconds.
+ *
+ * @return true if connected, else false
+ */
+bool Connection::connect(int timeout_ms)
+{
+    if (pending_fd < 0 && !start_connect())
+        return false;
+    struct pollfd pfd = {pending_fd, POLLOUT, 0};
+    return finish_connect(poll(&pfd, 1, timeout_ms) <= 0);
+}
+
+/**
+ * @brief Start a connection attempt without waiting for it.
+ * Once `get_pending_fd()` is writable the attempt must be
+ * completed with `finish_connect()`.
+ *
+ * @return true if the attempt is in progress, false if
+ * it failed right away
  */
-void Connection::connect()
+bool Connection::start_connect()
 {
-    int cfd = connect_server(port);
+    pending_fd = ::start_connect(endpoint);
+    if (pending_fd < 0)
+    {
+        finish_connect(true);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Complete the attempt started by `start_connect()`.
+ * A failed attempt, or one that timed out, schedules the
+ * next one after an exponential backoff with jitter.
+ *
+ * @param[in] timed_out Indicates if the attempt ran out
+ * of time
+ *
+ * @return true if connected, else false
+ */
+bool Connection::finish_connect(bool timed_out)
+{
+    int cfd = pending_fd;
+    pending_fd = -1;
+
+    if (cfd < 0 || timed_out || ::finish_connect(cfd) < 0 ||
+        (endpoint.transport == TRANSPORT_SHM && shm_connect(cfd, SHM_HANDSHAKE_MS) < 0))
+    {
+        if (cfd >= 0)
+            close(cfd);
+        mutex.lock();
+        schedule_retry();
+        mutex.unlock();
+        return false;
+    }
+
     mutex.lock();
     clientfd = cfd;
+    stale_responses = 0;
     mutex.unlock();
+    return true;
+}
+
+/**
+ * @brief Set the time of the next connection attempt and
+ * double the backoff. The mutex must be held.
+ */
+void Connection::schedule_retry()
+{
+    int wait_ms = backoff_ms / 2 + rand() % (backoff_ms / 2 + 1);
+    next_attempt = std::chrono::steady_clock::now() + std::chrono::milliseconds(wait_ms);
+    backoff_ms = std::min(backoff_ms * 2, BACKOFF_MAX_MS);
+}
+
+/**
+ * @brief FD of the connection attempt in progress
+ *
+ * @return The file descriptor, -1 if there is none
+ */
+int Connection::get_pending_fd()
+{
+    return pending_fd;
+}
+
+/**
+ * @brief Indicates if the server is disconnected and
+ * its backoff since the last failed attempt has passed
+ *
+ * @return true if a connection attempt is due, else false
+ */
+bool Connection::reconnect_due()
+{
+    mutex.lock_shared();
+    bool due = pending_fd < 0 && clientfd < 0 &&
+               std::chrono::steady_clock::now() >= next_attempt;
+    mutex.unlock_shared();
+    return due;
 }
 
 /**
  * @brief Disconnects and marks
- * this server dead
+ * this server dead, it is reconnected
+ * after a backoff
  */
 void Connection::disconnect()
 {
+    shm_close(clientfd);
     close(clientfd);
     mutex.lock();
     clientfd = -1;
+    schedule_retry();
     mutex.unlock();
 }
 
@@ -76,6 +221,28 @@ bool Connection::is_connected()
     return ret;
 }
 
+/**
+ * @brief Keep the server out of the key ring while the keys it
+ * owns are copied to it, or put it back
+ *
+ * @param[in] w Indicates if it is warming up
+ */
+void Connection::set_warming(bool w)
+{
+    warming = w;
+}
+
+/**
+ * @brief Indicates if the server is kept out of the key
+ * ring, see `set_warming()`
+ *
+ * @return true if so, else false
+ */
+bool Connection::is_warming()
+{
+    return warming;
+}
+
 /**
  * @brief Get the client file descriptor that
  * can be used to communicate with the server
@@ -99,4 +266,138 @@ int Connection::get_fd()
 int Connection::get_port()
 {
     return port;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief return the endpoint the server is
+ * connected on
+ *
+ * @return the endpoint
+ */
+const endpoint_t &Connection::get_endpoint()
+{
+    return endpoint;
+}
+
+/**
+ * @brief Note that the server answered, so a later
+ * failure is retried after the shortest backoff
+ */
+void Connection::mark_alive()
+{
+    mutex.lock();
+    backoff_ms = BACKOFF_MIN_MS;
+    mutex.unlock();
+}
+
+/**
+ * @brief Account for the time a server took to respond,
+ * see `mark_alive()`
+ *
+ * @param[in] us The response time in microseconds
+ */
+void Connection::record_latency(long us)
+{
+    mark_alive();
+    if (samples++ == 0)
+    {
+        ewma_us = p95_us = p99_us = us;
+        return;
+    }
+    ewma_us += LATENCY_EWMA_ALPHA * (us - ewma_us);
+
+    // stochastic quantile estimates: a quantile q settles where
+    // a share q of the responses is faster. Steps scale with the
+    // average so they fit any latency range.
+    double step = ewma_us / 4;
+    p95_us += us > p95_us ? 0.95 * step : -0.05 * step;
+    p99_us += us > p99_us ? 0.99 * step : -0.01 * step;
+    if (p95_us < 0)
+        p95_us = 0;
+    if (p99_us < p95_us)
+        p99_us = p95_us;
+}
+
+/**
+ * @brief How long to wait for a response before the server
+ * is considered failed, a multiple of its estimated p99
+ *
+ * @param[in] max_ms The timeout used until enough responses
+ * were seen, and the upper bound of the timeout
+ *
+ * @return the timeout in milliseconds
+ */
+int Connection::timeout_ms(int max_ms)
+{
+    if (samples < LATENCY_MIN_SAMPLES)
+        return max_ms;
+    int ms = TIMEOUT_P99_FACTOR * p99_us / 1000;
+    return ms < TIMEOUT_MIN_MS ? TIMEOUT_MIN_MS : ms > max_ms ? max_ms : ms;
+}
+
+/**
+ * @brief How long to wait for a response before a duplicate
+ * request is sent to another server, the estimated p95
+ *
+ * @return the delay in microseconds, -1 until enough
+ * responses were seen
+ */
+long Connection::hedge_delay_us()
+{
+    return samples < LATENCY_MIN_SAMPLES ? -1 : (long)p95_us;
+}
+
+/**
+ * @brief Note that the response to a request already sent
+ * is no longer wanted, it is dropped when it arrives
+ */
+void Connection::expect_stale_response()
+{
+    stale_responses++;
+}
+
+/**
+ * @brief Read and drop the responses no longer wanted,
+ * so the next response read is for the next request
+ *
+ * @param[in] timeout_ms The longest wait for each response
+ *
+ * @return true if the connection is in step, else false
+ */
+bool Connection::drain_stale_responses(int timeout_ms)
+{
+    msg_t stale;
+    for (; stale_responses > 0; stale_responses--)
+    {
+        if (read_msg(get_fd(), &stale, timeout_ms) < 0)
+            return false;
+        if (msg_value_streamed(&stale) &&
+            read_value(get_fd(), NULL, stale.vlen, timeout_ms) < 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Take the connection for a request until its response
+ * was read, so the messages of requests from other threads are
+ * not interleaved with it. Threads taking several connections
+ * must take them in a fixed order.
+ *
+ * @return the lock, released when it goes out of scope
+ */
+std::unique_lock<std::mutex> Connection::lock_io()
+{
+    return std::unique_lock<std::mutex>(io_mutex);
+}
+
+/**
+ * @brief Take the connection if no request is using it,
+ * see `lock_io()`
+ *
+ * @return the lock, not owned if the connection is busy
+ */
+std::unique_lock<std::mutex> Connection::try_lock_io()
+{
+    return std::unique_lock<std::mutex>(io_mutex, std::try_to_lock);
+}
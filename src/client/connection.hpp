@@ -6,7 +6,11 @@
  * connection. The implementation is present in /src/client/connection.cpp
  */
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <shared_mutex>
+#include "../utils/conn.hpp"
 
 /* A class with metadata about a connection
 between a client and a server, with methods
@@ -15,24 +19,76 @@ class Connection
 {
 public:
     /**
-     * @brief Store server metadata and attempt to
+     * @brief Store server metadata and start to
      * establish a connection with the server at instantiation.
-     * Should not block.
+     * Does not block, see `start_connect()`.
      *
      * @param[in] port The port of the localhost
      * server
      */
     Connection(int port);
 
+    /**
+     * @brief Store server metadata and start to
+     * establish a connection with the server at instantiation.
+     * Does not block, see `start_connect()`.
+     *
+     * @param[in] ep The endpoint of the server, TCP on any
+     * address, a Unix domain socket, or shared memory rings
+     * set up over one
+     */
+    Connection(const endpoint_t &ep);
+
     /**
      * @brief Attempt to connect to the server
-     * and keep track of the client fd.
+     * and keep track of the client fd. Waits at most
+     * `timeout_ms` milliseconds.
+     *
+     * @return true if connected, else false
+     */
+    bool connect(int timeout_ms);
+
+    /**
+     * @brief Start a connection attempt without waiting for it.
+     * Once `get_pending_fd()` is writable the attempt must be
+     * completed with `finish_connect()`.
+     *
+     * @return true if the attempt is in progress, false if
+     * it failed right away
+     */
+    bool start_connect();
+
+    /**
+     * @brief Complete the attempt started by `start_connect()`.
+     * A failed attempt, or one that timed out, schedules the
+     * next one after an exponential backoff with jitter.
+     *
+     * @param[in] timed_out Indicates if the attempt ran out
+     * of time
+     *
+     * @return true if connected, else false
+     */
+    bool finish_connect(bool timed_out);
+
+    /**
+     * @brief FD of the connection attempt in progress
+     *
+     * @return The file descriptor, -1 if there is none
      */
-    void connect();
+    int get_pending_fd();
+
+    /**
+     * @brief Indicates if the server is disconnected and
+     * its backoff since the last failed attempt has passed
+     *
+     * @return true if a connection attempt is due, else false
+     */
+    bool reconnect_due();
 
     /**
      * @brief Disconnects and marks
-     * this server dead
+     * this server dead, it is reconnected
+     * after a backoff
      */
     void disconnect();
 
@@ -51,6 +107,23 @@ public:
      */
     bool is_connected();
 
+    /**
+     * @brief Keep the server out of the key ring while the keys it
+     * owns are copied to it, or put it back. A server is only
+     * picked for keys while connected and not warming up.
+     *
+     * @param[in] warming Indicates if it is warming up
+     */
+    void set_warming(bool warming);
+
+    /**
+     * @brief Indicates if the server is kept out of the key
+     * ring, see `set_warming()`
+     *
+     * @return true if so, else false
+     */
+    bool is_warming();
+
     /**
      * @brief Get the client file descriptor that
      * can be used to communicate with the server
@@ -67,11 +140,112 @@ public:
      */
     int get_port();
 
+    /**
+     * @brief return the endpoint the server is
+     * connected on
+     *
+     * @return the endpoint
+     */
+    const endpoint_t &get_endpoint();
+
+    /**
+     * @brief Note that the server answered, so a later
+     * failure is retried after the shortest backoff
+     */
+    void mark_alive();
+
+    /**
+     * @brief Account for the time a server took to respond,
+     * see `mark_alive()`
+     *
+     * @param[in] us The response time in microseconds
+     */
+    void record_latency(long us);
+
+    /**
+     * @brief How long to wait for a response before the server
+     * is considered failed, a multiple of its estimated p99
+     *
+     * @param[in] max_ms The timeout used until enough responses
+     * were seen, and the upper bound of the timeout
+     *
+     * @return the timeout in milliseconds
+     */
+    int timeout_ms(int max_ms);
+
+    /**
+     * @brief How long to wait for a response before a duplicate
+     * request is sent to another server, the estimated p95
+     *
+     * @return the delay in microseconds, -1 until enough
+     * responses were seen
+     */
+    long hedge_delay_us();
+
+    /**
+     * @brief Note that the response to a request already sent
+     * is no longer wanted, it is dropped when it arrives
+     */
+    void expect_stale_response();
+
+    /**
+     * @brief Read and drop the responses no longer wanted,
+     * so the next response read is for the next request
+     *
+     * @param[in] timeout_ms The longest wait for each response
+     *
+     * @return true if the connection is in step, else false
+     */
+    bool drain_stale_responses(int timeout_ms);
+
+    /**
+     * @brief Take the connection for a request until its response
+     * was read, so the messages of requests from other threads are
+     * not interleaved with it. Threads taking several connections
+     * must take them in a fixed order.
+     *
+     * @return the lock, released when it goes out of scope
+     */
+    std::unique_lock<std::mutex> lock_io();
+
+    /**
+     * @brief Take the connection if no request is using it,
+     * see `lock_io()`
+     *
+     * @return the lock, not owned if the connection is busy
+     */
+    std::unique_lock<std::mutex> try_lock_io();
+
 private:
     unsigned int hash;
     int port;
+    endpoint_t endpoint;
     int clientfd;
+    std::atomic<bool> warming;
+
+    // response time estimates, in microseconds
+    long samples;
+    double ewma_us;
+    double p95_us;
+    double p99_us;
+    int stale_responses;
+
+    // connection attempts
+    int pending_fd;
+    int backoff_ms;
+    std::chrono::steady_clock::time_point next_attempt;
 
     // to manage exclusive access to clientfd
+    // and the connection attempt schedule
     std::shared_mutex mutex;
+
+    // held from sending a request until its response was read,
+    // guards the response time estimates and stale responses
+    std::mutex io_mutex;
+
+    /**
+     * @brief Set the time of the next connection attempt and
+     * double the backoff. The mutex must be held.
+     */
+    void schedule_retry();
 };
\ No newline at end of file
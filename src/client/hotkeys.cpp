@@ -0,0 +1,109 @@
+/**
+ * @file /src/client/hotkeys.cpp
+ *
+ * @brief This file contains the implementation of the `HotKeySketch`
+ * class declared in /src/client/hotkeys.hpp
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "hotkeys.hpp"
+#include "../hash/hash.hpp"
+
+/**
+ * @brief orders the heap so the least frequent key is at the front
+ */
+static bool more_frequent(const hot_key_t &a, const hot_key_t &b)
+{
+    return a.count > b.count;
+}
+
+/**
+ * @brief Create an empty sketch
+ *
+ * @param[in] k Number of most frequent keys to track
+ */
+HotKeySketch::HotKeySketch(size_t k) : k(k)
+{
+    memset(counters, 0, sizeof(counters));
+    recorded = 0;
+}
+
+/**
+ * @brief Count one access to a key
+ *
+ * @param[in] key The key accessed
+ *
+ * @return the estimated number of accesses to the key in
+ * the recent window, this one included
+ */
+uint32_t HotKeySketch::record(const std::string &key)
+{
+    // one 64 bit hash gives the counter of every row
+    uint64_t h = hash_bytes(key.data(), key.size());
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    uint32_t *row_counter[HOT_SKETCH_DEPTH];
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (++recorded >= HOT_SKETCH_WINDOW)
+        decay();
+
+    uint32_t est = UINT32_MAX;
+    for (int i = 0; i < HOT_SKETCH_DEPTH; i++)
+    {
+        row_counter[i] = &counters[i][(h1 + i * h2) % HOT_SKETCH_WIDTH];
+        est = std::min(est, *row_counter[i]);
+    }
+
+    // conservative update: only counters at the minimum grow, which
+    // keeps the overcount of keys sharing counters low
+    est++;
+    for (int i = 0; i < HOT_SKETCH_DEPTH; i++)
+        *row_counter[i] = std::max(*row_counter[i], est);
+
+    auto it = std::find_if(heap.begin(), heap.end(), [&key](const hot_key_t &hk)
+                           { return hk.key == key; });
+    if (it != heap.end())
+    {
+        it->count = est;
+        std::make_heap(heap.begin(), heap.end(), more_frequent);
+    }
+    else if (heap.size() < k)
+    {
+        heap.push_back({key, est});
+        std::push_heap(heap.begin(), heap.end(), more_frequent);
+    }
+    else if (k > 0 && est > heap.front().count)
+    {
+        std::pop_heap(heap.begin(), heap.end(), more_frequent);
+        heap.back() = {key, est};
+        std::push_heap(heap.begin(), heap.end(), more_frequent);
+    }
+    return est;
+}
+
+/**
+ * @brief The most frequent keys of the recent window
+ *
+ * @return up to `k` keys, the most frequent first
+ */
+std::vector<hot_key_t> HotKeySketch::top()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<hot_key_t> keys = heap;
+    std::sort(keys.begin(), keys.end(), more_frequent);
+    return keys;
+}
+
+/**
+ * @brief halve every count, the mutex must be held
+ */
+void HotKeySketch::decay()
+{
+    for (int i = 0; i < HOT_SKETCH_DEPTH; i++)
+        for (int j = 0; j < HOT_SKETCH_WIDTH; j++)
+            counters[i][j] >>= 1;
+    for (hot_key_t &hk : heap)
+        hk.count >>= 1;
+    recorded = 0;
+}
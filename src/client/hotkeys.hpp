@@ -0,0 +1,85 @@
+/**
+ * @file /src/client/hotkeys.hpp
+ *
+ * @brief This file contains the declaration of the `HotKeySketch`
+ * class. The client feeds it every key it fetches to find the few
+ * keys that take a large share of the traffic, in a fixed amount of
+ * memory. The implementation is present in /src/client/hotkeys.cpp
+ */
+
+#ifndef HOTKEYS_H
+#define HOTKEYS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+/* Rows and counters per row of the Count-Min sketch */
+#define HOT_SKETCH_DEPTH 4
+#define HOT_SKETCH_WIDTH 1024
+
+/* Counts are halved after this many keys, so keys that
+ * cool down leave the top list */
+#define HOT_SKETCH_WINDOW 10000
+
+/* Number of most frequent keys tracked by default */
+#define HOT_KEYS_TOP_K 16
+
+/**
+ * @brief A frequently accessed key and its estimated
+ * number of accesses in the recent window
+ */
+struct hot_key_t
+{
+    std::string key;
+    uint32_t count;
+};
+
+/**
+ * @brief Estimates key frequencies with a Count-Min sketch, and
+ * keeps the `k` keys with the highest estimates in a min-heap.
+ * Estimates never undercount, and overcount by little for the
+ * keys that matter here. Thread-safe.
+ */
+class HotKeySketch
+{
+public:
+    /**
+     * @brief Create an empty sketch
+     *
+     * @param[in] k Number of most frequent keys to track
+     */
+    HotKeySketch(size_t k = HOT_KEYS_TOP_K);
+
+    /**
+     * @brief Count one access to a key
+     *
+     * @param[in] key The key accessed
+     *
+     * @return the estimated number of accesses to the key in
+     * the recent window, this one included
+     */
+    uint32_t record(const std::string &key);
+
+    /**
+     * @brief The most frequent keys of the recent window
+     *
+     * @return up to `k` keys, the most frequent first
+     */
+    std::vector<hot_key_t> top();
+
+private:
+    uint32_t counters[HOT_SKETCH_DEPTH][HOT_SKETCH_WIDTH];
+    std::vector<hot_key_t> heap; // least frequent at the front
+    size_t k;
+    uint32_t recorded; // since the counts were last halved
+    std::mutex mutex;
+
+    /**
+     * @brief halve every count, the mutex must be held
+     */
+    void decay();
+};
+
+#endif
@@ -5,6 +5,7 @@
  */
 
 #include <iostream>
+#include <cstring>
 #include "hash.hpp"
 
 unsigned int get_hash(std::string s)
@@ -20,4 +21,65 @@ unsigned int get_hash(int num)
     std::string s = std::to_string(num);
     unsigned int hash_val = str_hash_func(s);
     return hash_val;
-}
\ No newline at end of file
+}
+
+bool in_ring_range(unsigned int hash, unsigned int lo, unsigned int hi)
+{
+    if (lo < hi)
+        return hash > lo && hash <= hi;
+    return hash > lo || hash <= hi;
+}
+
+/*
+ * MurmurHash64A by Austin Appleby, released to the public domain
+ * (https://github.com/aappleby/smhasher)
+ */
+uint64_t hash_bytes(const char *data, size_t len)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (len * m);
+
+    const char *end = data + (len & ~(size_t)7);
+    for (const char *p = data; p != end; p += 8)
+    {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const unsigned char *tail = (const unsigned char *)end;
+    switch (len & 7)
+    {
+    case 7:
+        h ^= uint64_t(tail[6]) << 48;
+        [[fallthrough]];
+    case 6:
+        h ^= uint64_t(tail[5]) << 40;
+        [[fallthrough]];
+    case 5:
+        h ^= uint64_t(tail[4]) << 32;
+        [[fallthrough]];
+    case 4:
+        h ^= uint64_t(tail[3]) << 24;
+        [[fallthrough]];
+    case 3:
+        h ^= uint64_t(tail[2]) << 16;
+        [[fallthrough]];
+    case 2:
+        h ^= uint64_t(tail[1]) << 8;
+        [[fallthrough]];
+    case 1:
+        h ^= uint64_t(tail[0]);
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
@@ -5,7 +5,11 @@
  * a string or int
  */
 
+#ifndef HASH_H
+#define HASH_H
+
 #include <iostream>
+#include <stdint.h>
 
 /**
  * Given a string, return its hash value
@@ -21,4 +25,29 @@ unsigned int get_hash(std::string str);
  * @param[in] num Input number
  * @return the hash value
  */
-unsigned int get_hash(int num);
\ No newline at end of file
+unsigned int get_hash(int num);
+
+/**
+ * Indicates if a hash lies on the arc of the ring after `lo` up
+ * to and including `hi`, wrapping around past the largest hash.
+ * The arc is the whole ring if `lo` equals `hi`.
+ *
+ * @param[in] hash The hash
+ * @param[in] lo The start of the arc, not included
+ * @param[in] hi The end of the arc
+ * @return true if so, else false
+ */
+bool in_ring_range(unsigned int hash, unsigned int lo, unsigned int hi);
+
+/**
+ * Given a byte buffer, return its 64 bit hash value. Unlike
+ * `get_hash`, the value does not depend on the standard library
+ * in use, so it can be persisted across processes and builds.
+ *
+ * @param[in] data Input bytes
+ * @param[in] len Number of bytes
+ * @return the hash value
+ */
+uint64_t hash_bytes(const char *data, size_t len);
+
+#endif
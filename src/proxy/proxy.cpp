@@ -0,0 +1,424 @@
+/**
+ * @file /src/proxy/proxy.cpp
+ *
+ * @brief This file contains the implementation of the `Proxy` class
+ * declared in /src/proxy/proxy.hpp
+ */
+
+#include <unistd.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include "proxy.hpp"
+#include "../utils/message.hpp"
+#include "../utils/shmring.hpp"
+#include "../utils/colors.hpp"
+
+/**
+ * @brief Connect to the servers and start to accept applications
+ *
+ * @param[in] port the port where the proxy should listen, on
+ * `opts.bind_addr` unless `opts.unix_path` is set
+ * @param[in] servers Endpoints of all servers in the server pool
+ * @param[in] print_logs Indicates if logs should be printed
+ * @param[in] opts Optional proxy settings
+ */
+Proxy::Proxy(int port, std::vector<endpoint_t> servers, bool print_logs, proxy_opts_t opts)
+    : opts(opts)
+{
+    logger = new Logger(print_logs);
+    closing = false;
+    stopping = false;
+
+    for (unsigned int i = 0; i < std::max(1u, opts.back_clients); i++)
+        back.push_back(new Client(servers, print_logs, opts.client));
+    for (Client *cl : back)
+        back_threads.emplace_back(&Proxy::forward_forever, this, cl);
+
+    if (opts.unix_path.empty())
+        listenfd = start_listener(tcp_endpoint(port, opts.bind_addr));
+    else
+        listenfd = start_listener(unix_endpoint(opts.unix_path, port));
+    if (listenfd < 0)
+        perror("[Proxy] Couldn't listen");
+    else
+        accept_thread = std::thread(&Proxy::accept_forever, this);
+}
+
+/**
+ * @brief closes the proxy if that was not done yet
+ */
+Proxy::~Proxy()
+{
+    close_proxy();
+    for (Client *cl : back)
+        delete cl;
+}
+
+/**
+ * @brief Stop accepting applications, disconnect those connected
+ * once their requests were answered, and disconnect from the
+ * servers
+ */
+void Proxy::close_proxy()
+{
+    if (closing.exchange(true))
+        return;
+
+    // wakes up the thread blocked in accept(), and only closes
+    // the descriptor once that thread can no longer use it
+    if (listenfd >= 0)
+    {
+        shutdown(listenfd, SHUT_RDWR);
+        accept_thread.join();
+        close(listenfd);
+    }
+    if (!opts.unix_path.empty())
+        unlink(opts.unix_path.c_str());
+
+    // the back clients still answer the batches of the front
+    // connections being shut down
+    std::unique_lock<std::mutex> lock(conns_mutex);
+    for (int connfd : conns)
+        shutdown(connfd, SHUT_RDWR);
+    conns_cv.wait(lock, [this]()
+                  { return conns.empty(); });
+    lock.unlock();
+
+    queue_mutex.lock();
+    stopping = true;
+    queue_mutex.unlock();
+    queue_cv.notify_all();
+    for (std::thread &th : back_threads)
+        th.join();
+    for (Client *cl : back)
+        cl->close_client();
+}
+
+/**
+ * @brief Figures since the proxy was started
+ *
+ * @return the figures
+ */
+proxy_stats_t Proxy::stats()
+{
+    proxy_stats_t st;
+    st.requests = requests;
+    st.batches = batches;
+    st.gets_batched = gets_batched;
+    st.gets_merged = gets_merged;
+    st.avg_batch = st.batches ? (double)st.requests / st.batches : 0;
+    return st;
+}
+
+/**
+ * @brief the report answering a `stats` request
+ */
+std::string Proxy::report()
+{
+    proxy_stats_t st = stats();
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "proxy requests %lu, batches %lu (avg %.1f requests), "
+             "gets batched %lu, gets merged %lu\n",
+             st.requests, st.batches, st.avg_batch, st.gets_batched, st.gets_merged);
+    return buf;
+}
+
+/**
+ * @brief keep accepting front connections and start a thread
+ * serving each
+ */
+void Proxy::accept_forever()
+{
+    int connfd;
+    while (true)
+    {
+        *logger << "\n[Proxy] Waiting for clients\n";
+        connfd = accept_client(listenfd);
+        if (connfd >= 0) // valid connection
+        {
+            *logger << GREEN << "\n[Proxy] Client connected\n"
+                    << RESET;
+            conns_mutex.lock();
+            conns.insert(connfd);
+            conns_mutex.unlock();
+            std::thread cl_thread(&Proxy::serve_front, this, connfd);
+            cl_thread.detach();
+        }
+        else if (connfd == -1 || closing) // listenfd closed
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief read requests from a front connection, have them
+ * forwarded and send back the responses until EOF is reached
+ *
+ * @param[in] connfd the fd to communicate with the application
+ */
+void Proxy::serve_front(int connfd)
+{
+    proxy_batch_t batch;
+    bool ok = true;
+
+    while (ok && read_request(connfd, &batch, -1) > 0)
+    {
+        // requests the application sent without waiting for the
+        // first one go along with it
+        struct pollfd pfd = {connfd, POLLIN, 0};
+        while (ok && batch.reqs.size() < PROXY_PIPELINE_MAX && poll_msgs(&pfd, 1, 0) > 0)
+            ok = read_request(connfd, &batch, -1) > 0;
+        requests += batch.reqs.size();
+
+        if (ok && !answer_locally(&batch))
+        {
+            queue_mutex.lock();
+            queue.push_back(&batch);
+            queue_mutex.unlock();
+            queue_cv.notify_one();
+
+            std::unique_lock<std::mutex> lock(batch.mutex);
+            batch.cv.wait(lock, [&batch]()
+                          { return batch.done; });
+            batch.done = false;
+        }
+
+        for (size_t i = 0; i < batch.reqs.size(); i++)
+        {
+            if (ok && batch.resps[i])
+            {
+                ok = send_msg(connfd, batch.resps[i], batch.values[i].data()) >= 0;
+                logger->display_msg("[Proxy] Sending Response", batch.resps[i]);
+            }
+            free(batch.reqs[i]);
+            free(batch.resps[i]);
+        }
+        batch.reqs.clear();
+        batch.req_values.clear();
+        batch.resps.clear();
+        batch.values.clear();
+    }
+    *logger << "\n[Proxy] EOF recieved from connfd\n";
+    for (size_t i = 0; i < batch.reqs.size(); i++)
+    {
+        free(batch.reqs[i]);
+        free(batch.resps[i]);
+    }
+
+    std::lock_guard<std::mutex> lock(conns_mutex);
+    close(connfd);
+    conns.erase(connfd);
+    conns_cv.notify_all();
+}
+
+/**
+ * @brief read one request from a front connection into a batch,
+ * a value over the limit is read and dropped
+ *
+ * @param[in] timeout_ms -1 to wait forever
+ *
+ * @return 1 if read, else -1
+ */
+int Proxy::read_request(int connfd, proxy_batch_t *batch, int timeout_ms)
+{
+    msg_t *req = make_msg_ref();
+    std::string value;
+    if (read_msg(connfd, req, timeout_ms) < 0)
+    {
+        free(req);
+        return -1;
+    }
+    logger->display_msg("[Proxy] Received Request", req);
+
+    bool too_large = req->vlen > opts.max_value_bytes;
+    if (!msg_value_streamed(req))
+        value.assign(req->value, req->vlen);
+    else
+    {
+        value.resize(too_large ? 0 : req->vlen);
+        if (read_value(connfd, too_large ? NULL : &value[0], req->vlen, timeout_ms) < 0)
+        {
+            free(req);
+            return -1;
+        }
+    }
+    batch->reqs.push_back(req);
+    batch->req_values.push_back(value);
+    batch->resps.push_back(too_large ? create_error_msg() : NULL);
+    batch->values.push_back("");
+    return 1;
+}
+
+/**
+ * @brief answer the requests of a batch that are not forwarded
+ * to the servers
+ *
+ * @return true if every request was answered
+ */
+bool Proxy::answer_locally(proxy_batch_t *batch)
+{
+    bool all = true;
+    for (size_t i = 0; i < batch->reqs.size(); i++)
+    {
+        if (batch->resps[i])
+            continue;
+        switch (batch->reqs[i]->type)
+        {
+        case req_get_t:
+        case req_put_t:
+        case req_cas_t:
+        case req_incr_t:
+        case req_decr_t:
+        case req_append_t:
+        case req_prepend_t:
+        case req_lease_get_t:
+        case req_lease_put_t:
+        case req_delete_t:
+        case req_flush_all_t:
+            all = false;
+            break;
+        case req_ping_t:
+            // the heartbeats of the applications check the proxy
+            batch->resps[i] = create_pong_msg();
+            break;
+        case req_stats_t:
+            batch->values[i] = report();
+            batch->resps[i] = create_stats_resp_msg(batch->values[i]);
+            break;
+        default:
+            // shared memory rings and scans are not proxied
+            batch->resps[i] = create_error_msg();
+        }
+    }
+    return all;
+}
+
+/**
+ * @brief take batches off the queue and forward them through
+ * a back client until the proxy is closed
+ *
+ * @param[in] cl The back client
+ */
+void Proxy::forward_forever(Client *cl)
+{
+    std::vector<proxy_batch_t *> taken;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this]()
+                          { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            // whatever piled up while this client was busy goes
+            // out together
+            size_t n = 0;
+            while (!queue.empty() &&
+                   (taken.empty() || n + queue.front()->reqs.size() <= PROXY_BATCH_MAX))
+            {
+                n += queue.front()->reqs.size();
+                taken.push_back(queue.front());
+                queue.pop_front();
+            }
+        }
+        batches++;
+        forward(cl, taken);
+
+        for (proxy_batch_t *batch : taken)
+        {
+            // notified under the lock: once `done` is seen the batch
+            // may leave the stack of its front connection
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            batch->done = true;
+            batch->cv.notify_one();
+        }
+        taken.clear();
+    }
+}
+
+/**
+ * @brief forward the requests of several batches through a back
+ * client. The gets at the front of every batch are forwarded
+ * together, then the next request of every batch that is not a
+ * get, and so on, so each batch keeps its order.
+ *
+ * @param[in] cl The back client
+ * @param[in] taken The batches
+ */
+void Proxy::forward(Client *cl, std::vector<proxy_batch_t *> &taken)
+{
+    std::vector<size_t> next(taken.size(), 0);
+    bool left = true;
+
+    while (left)
+    {
+        // the gets at the front of every batch, each key once
+        std::vector<msg_t *> reqs, resps;
+        std::vector<std::string> values;
+        std::vector<std::vector<std::pair<proxy_batch_t *, size_t>>> callers;
+        std::unordered_map<std::string, size_t> slot;
+        for (size_t b = 0; b < taken.size(); b++)
+        {
+            proxy_batch_t *batch = taken[b];
+            for (; next[b] < batch->reqs.size(); next[b]++)
+            {
+                size_t i = next[b];
+                if (batch->resps[i])
+                    continue;
+                if (batch->reqs[i]->type != req_get_t)
+                    break;
+                std::string key(batch->reqs[i]->key, strnlen(batch->reqs[i]->key, MAX_KSIZE));
+                auto it = slot.find(key);
+                if (it == slot.end())
+                {
+                    it = slot.emplace(key, reqs.size()).first;
+                    reqs.push_back(batch->reqs[i]);
+                    resps.push_back(make_msg_ref());
+                    callers.emplace_back();
+                }
+                else
+                {
+                    gets_merged++;
+                }
+                callers[it->second].push_back({batch, i});
+            }
+        }
+        if (!reqs.empty())
+        {
+            cl->forward_gets(reqs, resps, values);
+            if (reqs.size() > 1)
+                gets_batched += reqs.size();
+            for (size_t k = 0; k < reqs.size(); k++)
+            {
+                for (auto &caller : callers[k])
+                {
+                    msg_t *resp = make_msg_ref();
+                    memcpy(resp, resps[k], sizeof(*resp));
+                    caller.first->resps[caller.second] = resp;
+                    caller.first->values[caller.second] = values[k];
+                }
+                free(resps[k]);
+            }
+        }
+
+        // then the request each batch stopped at
+        left = false;
+        for (size_t b = 0; b < taken.size(); b++)
+        {
+            proxy_batch_t *batch = taken[b];
+            if (next[b] == batch->reqs.size())
+                continue;
+            size_t i = next[b]++;
+            batch->resps[i] = make_msg_ref();
+            cl->forward_req(batch->reqs[i], batch->req_values[i], batch->resps[i], batch->values[i]);
+            left = left || next[b] < batch->reqs.size();
+        }
+    }
+}
@@ -0,0 +1,208 @@
+/**
+ * @file /src/proxy/proxy.hpp
+ *
+ * @brief This file contains the declaration of the `Proxy` class.
+ * A proxy speaks the server protocol to the applications connecting
+ * to it, and forwards their requests to the server pool through a
+ * few `Client` instances, so every server sees a few connections
+ * per proxy instead of one per application process, and server
+ * failures are detected once per proxy. Requests waiting at the
+ * same time are forwarded together: the gets among them are sent to
+ * the servers back to back and gets of the same key are merged.
+ * The implementation is present in /src/proxy/proxy.cpp
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "../client/client.hpp"
+#include "../utils/conn.hpp"
+#include "../utils/logger.hpp"
+
+/* Requests a back client takes off the queue at a time */
+#define PROXY_BATCH_MAX 128
+
+/* Requests read from a front connection before their responses
+ * are sent, when the application sends them without waiting */
+#define PROXY_PIPELINE_MAX 32
+
+/**
+ * @brief Optional proxy settings
+ */
+struct proxy_opts_t
+{
+    /* Settings of the back clients, replication, hedging and the
+     * handoff to joining servers work as in an application */
+    client_opts_t client;
+
+    /* Clients forwarding the requests, each with one connection
+     * to every server and its own failure detection */
+    unsigned int back_clients = 2;
+
+    /* Numeric IPv4 or IPv6 address the proxy listens on */
+    std::string bind_addr = LOCALHOST;
+
+    /* File of a Unix domain socket the proxy listens on instead
+     * of TCP, for applications on the same host */
+    std::string unix_path = "";
+
+    /* Longest value accepted in a request */
+    size_t max_value_bytes = MAX_STREAM_VSIZE;
+};
+
+/**
+ * @brief Figures of a proxy since it was started
+ */
+struct proxy_stats_t
+{
+    uint64_t requests;     // read from the front connections
+    uint64_t batches;      // taken off the queue by a back client
+    uint64_t gets_batched; // forwarded together with other gets
+    uint64_t gets_merged;  // answered by the get of another caller
+    double avg_batch;      // requests / batches
+};
+
+/**
+ * @brief The requests read at once from a front connection, which
+ * are forwarded in order by one back client
+ */
+struct proxy_batch_t
+{
+    std::vector<msg_t *> reqs;
+    std::vector<std::string> req_values;
+    std::vector<msg_t *> resps;
+    std::vector<std::string> values; // of the responses
+
+    // set by the back client once every response is in
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+};
+
+/**
+ * @brief Represents a single proxy
+ */
+class Proxy
+{
+public:
+    /**
+     * @brief Connect to the servers and start to accept applications
+     *
+     * @param[in] port the port where the proxy should listen, on
+     * `opts.bind_addr` unless `opts.unix_path` is set
+     * @param[in] servers Endpoints of all servers in the server pool
+     * @param[in] print_logs Indicates if logs should be printed
+     * @param[in] opts Optional proxy settings
+     */
+    Proxy(int port, std::vector<endpoint_t> servers, bool print_logs,
+          proxy_opts_t opts = proxy_opts_t());
+
+    /**
+     * @brief closes the proxy if that was not done yet
+     */
+    ~Proxy();
+
+    /**
+     * @brief Stop accepting applications, disconnect those connected
+     * once their requests were answered, and disconnect from the
+     * servers
+     */
+    void close_proxy();
+
+    /**
+     * @brief Figures since the proxy was started
+     *
+     * @return the figures
+     */
+    proxy_stats_t stats();
+
+private:
+    int listenfd;
+    Logger *logger;
+    proxy_opts_t opts;
+    std::vector<Client *> back;
+    std::thread accept_thread;
+    std::vector<std::thread> back_threads;
+    std::atomic<bool> closing;
+
+    // batches waiting for a back client
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<proxy_batch_t *> queue;
+    bool stopping; // the back clients return once it is empty
+
+    // front connections being served, so none outlives the proxy
+    std::mutex conns_mutex;
+    std::condition_variable conns_cv;
+    std::unordered_set<int> conns;
+
+    std::atomic<uint64_t> requests = {0};
+    std::atomic<uint64_t> batches = {0};
+    std::atomic<uint64_t> gets_batched = {0};
+    std::atomic<uint64_t> gets_merged = {0};
+
+    /**
+     * @brief keep accepting front connections and start a thread
+     * serving each
+     */
+    void accept_forever();
+
+    /**
+     * @brief read requests from a front connection, have them
+     * forwarded and send back the responses until EOF is reached
+     *
+     * @param[in] connfd the fd to communicate with the application
+     */
+    void serve_front(int connfd);
+
+    /**
+     * @brief read one request from a front connection into a batch,
+     * a value over the limit is read and dropped
+     *
+     * @param[in] timeout_ms -1 to wait forever
+     *
+     * @return 1 if read, else -1
+     */
+    int read_request(int connfd, proxy_batch_t *batch, int timeout_ms);
+
+    /**
+     * @brief answer the requests of a batch that are not forwarded
+     * to the servers
+     *
+     * @return true if every request was answered
+     */
+    bool answer_locally(proxy_batch_t *batch);
+
+    /**
+     * @brief take batches off the queue and forward them through
+     * a back client until the proxy is closed
+     *
+     * @param[in] cl The back client
+     */
+    void forward_forever(Client *cl);
+
+    /**
+     * @brief forward the requests of several batches through a back
+     * client. The gets at the front of every batch are forwarded
+     * together, then the next request of every batch that is not a
+     * get, and so on, so each batch keeps its order.
+     *
+     * @param[in] cl The back client
+     * @param[in] taken The batches
+     */
+    void forward(Client *cl, std::vector<proxy_batch_t *> &taken);
+
+    /**
+     * @brief the report answering a `stats` request
+     */
+    std::string report();
+};
+
+#endif
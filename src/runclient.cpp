@@ -3,8 +3,9 @@
  *
  * @brief This program instantiates a `Client` instance as declared
  * in ./client/client.hpp. The client must be initialized with a pool
- * of localhost servers. Ports of servers in the pool are passed through
- * command line arguments to this programme. Once a `Client` is
+ * of servers. Servers in the pool are passed through command line
+ * arguments to this programme, as a localhost port, `address:port`,
+ * `[ipv6 address]:port`, `unix:socket_file` or `shm:socket_file`. Once a `Client` is
  * initialized, this program offers an command line interface to interact
  * with memcached servers via Get and Put requests.
  */
@@ -21,8 +22,8 @@ void start_client_interface(Client *cl);
 
 int main(int argc, char const *argv[])
 {
-    vector<int> ports;
-    int port;
+    vector<endpoint_t> servers;
+    endpoint_t ep;
     if (argc < 2)
     {
         printf("You must enter server pool ports as command line arguments\n");
@@ -30,16 +31,20 @@ int main(int argc, char const *argv[])
     }
 
     cout << YELLOW << "Client attempting to connect to " << argc - 1
-         << " localhost servers\n"
+         << " servers\n"
          << endl;
 
-    for (int port_idx = 1; port_idx < argc; port_idx++)
+    for (int idx = 1; idx < argc; idx++)
     {
-        port = stoi(argv[port_idx]);
-        ports.push_back(port);
+        if (parse_endpoint(argv[idx], &ep) < 0)
+        {
+            printf("Invalid server `%s`\n", argv[idx]);
+            exit(1);
+        }
+        servers.push_back(ep);
     }
 
-    Client *cl = new Client(ports, true);
+    Client *cl = new Client(servers, true);
     start_client_interface(cl);
 
     return 0;
@@ -53,10 +58,11 @@ int main(int argc, char const *argv[])
  */
 void start_client_interface(Client *cl)
 {
-    int op;
+    int op, port;
     bool success;
     string key, value, response_val;
     msg_t *resp = make_msg_ref();
+    client_stats_t stats;
 
     cout << GREEN << "========================" << RESET << endl;
     cout << GREEN << "Started Memcached Client" << RESET << endl;
@@ -68,6 +74,11 @@ void start_client_interface(Client *cl)
         cout << "\t1. Get" << endl;
         cout << "\t2. Put" << endl;
         cout << "\t3. Quit" << endl;
+        cout << "\t4. Compression stats" << endl;
+        cout << "\t5. Hot keys" << endl;
+        cout << "\t6. Server hot keys and sizes" << endl;
+        cout << "\t7. Delete" << endl;
+        cout << "\t8. Flush all" << endl;
         cout << "Choose an operation: ";
         cin >> op;
 
@@ -113,6 +124,55 @@ void start_client_interface(Client *cl)
             cl->close_client();
             return;
 
+        case 4:
+            stats = cl->stats();
+            cout << "\tValues compressed: " << stats.values_compressed
+                 << " of " << stats.compress_attempts
+                 << ", ratio " << stats.compression_ratio << endl;
+            cout << "\tCompress time: " << stats.compress_ns / 1000 << " us"
+                 << ", decompress time: " << stats.decompress_ns / 1000 << " us"
+                 << " (" << stats.values_decompressed << " values)" << endl;
+            cout << "\tHedged gets: " << stats.hedges_sent
+                 << ", won " << stats.hedges_won
+                 << ", over budget " << stats.hedges_denied << endl;
+            cout << "\tGets: " << stats.gets << ", coalesced: " << stats.gets_coalesced
+                 << " (" << stats.coalesce_rate * 100 << "% round trips saved)" << endl;
+            break;
+
+        case 5:
+            stats = cl->stats();
+            for (hot_key_t &hk : cl->hot_keys())
+                cout << "\t" << YELLOW << hk.key << RESET << ": ~" << hk.count << " gets" << endl;
+            cout << "\tGets of hot keys: " << stats.hot_gets
+                 << ", served from a local copy: " << stats.local_hits << endl;
+            break;
+
+        case 6:
+            cout << "Enter the port of the server: ";
+            cin >> port;
+            response_val = cl->send_stats_req(port, resp);
+            if (response_val.length() > 0)
+                cout << response_val;
+            else
+                cout << RED << "\tServer did not respond" << RESET << endl;
+            break;
+
+        case 7:
+            cout << "Enter the key to delete: ";
+            cin >> key;
+            if (cl->send_delete_req(key, resp))
+                cout << "\tDeleted key: " << GREEN << key << RESET << endl;
+            else
+                cout << RED << "\tKey not found" << RESET << endl;
+            break;
+
+        case 8:
+            if (cl->send_flush_all_req(resp))
+                cout << GREEN << "\tFlushed all servers" << RESET << endl;
+            else
+                cout << RED << "\tNo server responded" << RESET << endl;
+            break;
+
         default:
             break;
         }
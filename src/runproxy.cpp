@@ -0,0 +1,83 @@
+/**
+ * @file src/runproxy.cpp
+ *
+ * @brief This program instantiates a `Proxy` instance as declared
+ * in ./proxy/proxy.hpp, and starts it. The proxy listens on the port
+ * passed as the first argument, on localhost unless another address
+ * or a Unix domain socket is passed, and forwards the requests of its
+ * clients to the servers passed after it, written as for runclient.
+ *
+ * Usage: runproxy <port> <server>... [-b bind_address]
+ *                                    [-u unix_socket_file]
+ *                                    [-n back_clients] [-r replicas]
+ */
+
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+#include "proxy/proxy.hpp"
+
+int main(int argc, char *argv[])
+{
+    int port, opt;
+    proxy_opts_t opts;
+    std::vector<endpoint_t> servers;
+    endpoint_t ep;
+
+    while ((opt = getopt(argc, argv, "b:u:n:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            opts.bind_addr = optarg;
+            break;
+        case 'u':
+            opts.unix_path = optarg;
+            break;
+        case 'n':
+            opts.back_clients = std::stoi(optarg);
+            break;
+        case 'r':
+            opts.client.replicas = std::stoi(optarg);
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    if (optind + 1 >= argc)
+    {
+        printf("You must enter `port` and the server pool as arguments\n");
+        exit(1);
+    }
+
+    port = std::stoi(argv[optind]);
+    for (int idx = optind + 1; idx < argc; idx++)
+    {
+        if (parse_endpoint(argv[idx], &ep) < 0)
+        {
+            printf("Invalid server `%s`\n", argv[idx]);
+            exit(1);
+        }
+        servers.push_back(ep);
+    }
+    Proxy proxy(port, servers, true, opts);
+
+    while (1)
+    {
+        std::cout << "Enter 0 to Quit proxy, 1 for stats: " << std::endl;
+        std::cin >> opt;
+        if (opt == 0)
+        {
+            proxy.close_proxy();
+            break;
+        }
+        if (opt == 1)
+        {
+            proxy_stats_t st = proxy.stats();
+            printf("[Proxy] requests %lu, batches %lu (avg %.1f requests), "
+                   "gets batched %lu, gets merged %lu\n",
+                   st.requests, st.batches, st.avg_batch, st.gets_batched, st.gets_merged);
+        }
+    }
+}
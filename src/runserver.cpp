@@ -2,9 +2,18 @@
  * @file src/runserver.cpp
  *
  * @brief This program instantiates a `Server` instance as declared
- * in ./server/server.hpp, and starts it. The server will always run
- * on localhost and on the port passed as a command line argument to
- * this program.
+ * in ./server/server.hpp, and starts it. The server runs on the port
+ * passed as a command line argument to this program, on localhost
+ * unless another address or a Unix domain socket is passed.
+ *
+ * Usage: runserver <port> [-m memory_mb] [-e segment_file]
+ *                         [-s snapshot_file] [-i snapshot_interval_secs]
+ *                         [-t snapshot_load_threads]
+ *                         [-f ext_file] [-F ext_file_mb]
+ *                         [-v max_value_kb]
+ *                         [-b bind_address] [-u unix_socket_file]
+ *                         [-l listener_threads] [-p]
+ *                         [-c core_threads] [-a]
  */
 
 #include <unistd.h>
@@ -12,21 +21,74 @@
 #include <unordered_map>
 #include "server/server.hpp"
 
-int main(int argc, char const *argv[])
+int main(int argc, char *argv[])
 {
     int port, opt;
-    if (argc < 2)
+    server_opts_t opts;
+
+    while ((opt = getopt(argc, argv, "m:e:s:i:t:f:F:v:b:u:l:pc:a")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            opts.store.memory_bytes = (size_t)std::stoi(optarg) << 20;
+            break;
+        case 'e':
+            opts.store.segment_path = optarg;
+            break;
+        case 's':
+            opts.snapshot_path = optarg;
+            break;
+        case 'i':
+            opts.snapshot_interval = std::stoi(optarg);
+            break;
+        case 't':
+            opts.load_threads = std::stoi(optarg);
+            break;
+        case 'f':
+            opts.store.ext_path = optarg;
+            break;
+        case 'F':
+            opts.store.ext_bytes = (size_t)std::stoi(optarg) << 20;
+            break;
+        case 'v':
+            opts.max_value_bytes = (size_t)std::stoi(optarg) << 10;
+            break;
+        case 'b':
+            opts.bind_addr = optarg;
+            break;
+        case 'u':
+            opts.unix_path = optarg;
+            break;
+        case 'l':
+            opts.listeners = std::stoi(optarg);
+            break;
+        case 'p':
+            opts.pin_cpus = true;
+            break;
+        case 'c':
+            opts.cores = std::stoi(optarg);
+            break;
+        case 'a':
+            opts.store.admission = true;
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    if (optind >= argc)
     {
         printf("You must enter `port` as an argument\n");
         exit(1);
     }
 
-    port = std::stoi(argv[1]);
-    Server server(port, true);
+    port = std::stoi(argv[optind]);
+    Server server(port, true, opts);
 
     while (1)
     {
-        std::cout << "Enter 0 to Quit server: " << std::endl;
+        std::cout << "Enter 0 to Quit server, 1 to write a snapshot, 2 for stats: " << std::endl;
         std::cin >> opt;
         if (opt == 0)
         {
@@ -34,5 +96,13 @@ int main(int argc, char const *argv[])
             sleep(1);
             break;
         }
+        if (opt == 1 && server.save_snapshot() < 0)
+        {
+            std::cout << "No snapshot written, start the server with -s <file>" << std::endl;
+        }
+        if (opt == 2)
+        {
+            server.print_stats();
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,226 @@
+/**
+ * @file /src/server/keysampler.cpp
+ *
+ * @brief This file contains the implementation of the `KeySampler`
+ * class declared in /src/server/keysampler.hpp
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "keysampler.hpp"
+#include "../hash/hash.hpp"
+
+/**
+ * @brief record one size
+ */
+void size_hist_t::record(size_t size)
+{
+    int b = 0;
+    while (size && b < SIZE_HIST_BUCKETS - 1)
+    {
+        size >>= 1;
+        b++;
+    }
+    buckets[b].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief add `weight` to a key
+ *
+ * @return the estimated weight of the key
+ */
+uint64_t key_sketch_t::add(uint64_t hash, uint64_t weight)
+{
+    uint32_t h1 = hash, h2 = (hash >> 32) | 1;
+    uint64_t est = UINT64_MAX;
+    for (int i = 0; i < KEY_SKETCH_DEPTH; i++)
+    {
+        std::atomic<uint64_t> &c = counters[i][(h1 + i * h2) % KEY_SKETCH_WIDTH];
+        est = std::min(est, c.fetch_add(weight, std::memory_order_relaxed) + weight);
+    }
+    return est;
+}
+
+/**
+ * @brief halve every counter
+ */
+void key_sketch_t::decay()
+{
+    for (int i = 0; i < KEY_SKETCH_DEPTH; i++)
+        for (int j = 0; j < KEY_SKETCH_WIDTH; j++)
+            counters[i][j].store(counters[i][j].load(std::memory_order_relaxed) >> 1,
+                                 std::memory_order_relaxed);
+}
+
+/**
+ * @brief raise the weight of a key to `estimate`, taking
+ * the slot of the lightest key if it is not listed yet
+ */
+void top_keys_t::offer(const std::string &key, uint64_t hash, uint64_t estimate)
+{
+    slot_t *lightest = &slots[0];
+    for (slot_t &s : slots)
+    {
+        if (s.hash.load(std::memory_order_relaxed) == hash)
+        {
+            if (s.weight.load(std::memory_order_relaxed) < estimate)
+                s.weight.store(estimate, std::memory_order_relaxed);
+            return;
+        }
+        if (s.weight.load(std::memory_order_relaxed) < lightest->weight.load(std::memory_order_relaxed))
+            lightest = &s;
+    }
+    if (estimate <= lightest->weight.load(std::memory_order_relaxed))
+        return;
+
+    // another writer owns the slot, this sample is dropped
+    uint32_t seq = lightest->seq.load(std::memory_order_relaxed);
+    if (seq & 1 || !lightest->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+        return;
+    lightest->hash.store(hash, std::memory_order_relaxed);
+    lightest->weight.store(estimate, std::memory_order_relaxed);
+    lightest->klen = std::min<size_t>(key.size(), MAX_KSIZE);
+    memcpy(lightest->key, key.data(), lightest->klen);
+    lightest->seq.store(seq + 2, std::memory_order_release);
+}
+
+/**
+ * @brief halve the weight of every key
+ */
+void top_keys_t::decay()
+{
+    for (slot_t &s : slots)
+        s.weight.store(s.weight.load(std::memory_order_relaxed) >> 1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief append the keys listed and their weights to `keys`
+ */
+void top_keys_t::collect(std::vector<std::pair<uint64_t, std::string>> &keys)
+{
+    for (slot_t &s : slots)
+    {
+        uint32_t seq;
+        uint64_t weight;
+        std::string key;
+        do
+        {
+            seq = s.seq.load(std::memory_order_acquire);
+            weight = s.weight.load(std::memory_order_relaxed);
+            key.assign(s.key, s.klen);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (seq & 1 || seq != s.seq.load(std::memory_order_relaxed));
+        if (weight > 0)
+            keys.push_back({weight, key});
+    }
+}
+
+/**
+ * @brief record a sampled request
+ */
+void KeySampler::record_sample(const std::string &key, size_t vlen)
+{
+    if (samples.fetch_add(1, std::memory_order_relaxed) + 1 == KEY_SKETCH_WINDOW)
+    {
+        // halving races with concurrent samples, which only
+        // blurs the estimates a little
+        request_sketch.decay();
+        bytes_sketch.decay();
+        top_requests.decay();
+        top_bytes.decay();
+        samples.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t hash = hash_bytes(key.data(), key.size());
+    top_requests.offer(key, hash, request_sketch.add(hash, 1));
+    if (vlen > 0)
+        top_bytes.offer(key, hash, bytes_sketch.add(hash, vlen));
+    key_sizes.record(key.size());
+    if (vlen > 0)
+        value_sizes.record(vlen);
+}
+
+/**
+ * @brief append the heaviest `KEY_TOP_K` keys of the lists of
+ * several samplers to `out`, heaviest first
+ */
+static void report_top(std::string &out, const char *title,
+                       const std::vector<top_keys_t *> &lists, uint64_t scale)
+{
+    std::vector<std::pair<uint64_t, std::string>> keys;
+    for (top_keys_t *top : lists)
+        top->collect(keys);
+    std::sort(keys.rbegin(), keys.rend());
+    if (keys.size() > KEY_TOP_K)
+        keys.resize(KEY_TOP_K);
+
+    out += title;
+    out += "\n";
+    for (auto &k : keys)
+        out += "  " + k.second + " " + std::to_string(k.first * scale) + "\n";
+}
+
+/**
+ * @brief append the non-empty buckets of the sum of several
+ * histograms to `out`
+ */
+static void report_hist(std::string &out, const char *title,
+                        const std::vector<size_hist_t *> &hists, uint64_t scale)
+{
+    out += title;
+    out += "\n";
+    for (int b = 0; b < SIZE_HIST_BUCKETS; b++)
+    {
+        uint64_t n = 0;
+        for (size_hist_t *hist : hists)
+            n += hist->buckets[b].load(std::memory_order_relaxed);
+        if (n == 0)
+            continue;
+        uint64_t lo = b ? 1ULL << (b - 1) : 0;
+        std::string hi = b == SIZE_HIST_BUCKETS - 1 ? "inf" : std::to_string(1ULL << b);
+        out += "  [" + std::to_string(lo) + ", " + hi + ") " + std::to_string(n * scale) + "\n";
+    }
+}
+
+/**
+ * @brief A text report of the top keys and the size histograms,
+ * counts are scaled up to estimate the full traffic
+ *
+ * @return the report
+ */
+std::string KeySampler::report()
+{
+    return report({this});
+}
+
+/**
+ * @brief A report over several samplers, see `report()`. The
+ * samplers may keep recording while it is built.
+ *
+ * @param[in] samplers The samplers, each fed the requests of
+ * distinct keys
+ *
+ * @return the report
+ */
+std::string KeySampler::report(const std::vector<KeySampler *> &samplers)
+{
+    std::vector<top_keys_t *> requests, bytes;
+    std::vector<size_hist_t *> ksizes, vsizes;
+    for (KeySampler *ks : samplers)
+    {
+        requests.push_back(&ks->top_requests);
+        bytes.push_back(&ks->top_bytes);
+        ksizes.push_back(&ks->key_sizes);
+        vsizes.push_back(&ks->value_sizes);
+    }
+
+    // a key is only sampled by one of them, so its weights are not
+    // split between lists
+    std::string out = "sampled 1 in " + std::to_string(KEY_SAMPLE_RATE) + " requests\n";
+    report_top(out, "top keys by requests", requests, KEY_SAMPLE_RATE);
+    report_top(out, "top keys by value bytes", bytes, KEY_SAMPLE_RATE);
+    report_hist(out, "key sizes", ksizes, KEY_SAMPLE_RATE);
+    report_hist(out, "value sizes", vsizes, KEY_SAMPLE_RATE);
+    return out;
+}
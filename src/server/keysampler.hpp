@@ -0,0 +1,163 @@
+/**
+ * @file /src/server/keysampler.hpp
+ *
+ * @brief This file contains the declaration of the `KeySampler` class.
+ * A server feeds it a sample of the keys it serves to find the keys
+ * that dominate its traffic, and the sizes of the keys and values it
+ * sees. Recording never takes a lock, so connection threads do not
+ * wait on each other. Servers with a store per core give each core
+ * a sampler of its own, merged only when a report is asked for. The
+ * implementation is present in
+ * /src/server/keysampler.cpp
+ */
+
+#ifndef KEYSAMPLER_H
+#define KEYSAMPLER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "../utils/message.hpp"
+
+/* One request in `KEY_SAMPLE_RATE` per connection is recorded */
+#define KEY_SAMPLE_RATE 16
+
+/* Rows and counters per row of each Count-Min sketch */
+#define KEY_SKETCH_DEPTH 4
+#define KEY_SKETCH_WIDTH 4096
+
+/* Counts are halved after this many samples, so the
+ * reports follow the recent traffic */
+#define KEY_SKETCH_WINDOW 100000
+
+/* Number of top keys reported */
+#define KEY_TOP_K 16
+
+/* Buckets of the size histograms, bucket `b > 0` counts sizes
+ * in [2^(b-1), 2^b), the last one also counts larger sizes */
+#define SIZE_HIST_BUCKETS 24
+
+/**
+ * @brief Histogram of sizes with power of two buckets
+ */
+struct size_hist_t
+{
+    std::atomic<uint64_t> buckets[SIZE_HIST_BUCKETS] = {};
+
+    /**
+     * @brief record one size
+     */
+    void record(size_t size);
+};
+
+/**
+ * @brief Keys with the highest estimated weight seen so far. Each
+ * slot is written under its own sequence number: a writer that finds
+ * the slot busy skips the update instead of waiting, and readers
+ * retry until they copy the slot unchanged.
+ */
+struct top_keys_t
+{
+    struct slot_t
+    {
+        std::atomic<uint32_t> seq = {0}; // odd while written
+        std::atomic<uint64_t> hash = {0};
+        std::atomic<uint64_t> weight = {0};
+        uint8_t klen = 0;
+        char key[MAX_KSIZE];
+    };
+    slot_t slots[KEY_TOP_K];
+
+    /**
+     * @brief raise the weight of a key to `estimate`, taking
+     * the slot of the lightest key if it is not listed yet
+     */
+    void offer(const std::string &key, uint64_t hash, uint64_t estimate);
+
+    /**
+     * @brief halve the weight of every key
+     */
+    void decay();
+
+    /**
+     * @brief append the keys listed and their weights to `keys`
+     */
+    void collect(std::vector<std::pair<uint64_t, std::string>> &keys);
+};
+
+/**
+ * @brief Count-Min sketch with atomic counters
+ */
+struct key_sketch_t
+{
+    std::atomic<uint64_t> counters[KEY_SKETCH_DEPTH][KEY_SKETCH_WIDTH] = {};
+
+    /**
+     * @brief add `weight` to a key
+     *
+     * @return the estimated weight of the key
+     */
+    uint64_t add(uint64_t hash, uint64_t weight);
+
+    /**
+     * @brief halve every counter
+     */
+    void decay();
+};
+
+/**
+ * @brief Samples the requests of a server. Tracks the most requested
+ * keys, the keys moving the most value bytes, and the sizes of keys
+ * and values.
+ */
+class KeySampler
+{
+public:
+    /**
+     * @brief Account for a request, one in `KEY_SAMPLE_RATE` calls
+     * per thread is recorded
+     *
+     * @param[in] key The key of the request
+     * @param[in] vlen Length of the value stored or returned,
+     * 0 for a miss
+     */
+    inline void record(const std::string &key, size_t vlen)
+    {
+        static thread_local unsigned int calls = 0;
+        if (++calls % KEY_SAMPLE_RATE == 0)
+            record_sample(key, vlen);
+    }
+
+    /**
+     * @brief A text report of the top keys and the size histograms,
+     * counts are scaled up to estimate the full traffic
+     *
+     * @return the report
+     */
+    std::string report();
+
+    /**
+     * @brief A report over several samplers, see `report()`. The
+     * samplers may keep recording while it is built.
+     *
+     * @param[in] samplers The samplers, each fed the requests of
+     * distinct keys
+     *
+     * @return the report
+     */
+    static std::string report(const std::vector<KeySampler *> &samplers);
+
+private:
+    key_sketch_t request_sketch, bytes_sketch;
+    top_keys_t top_requests, top_bytes;
+    size_hist_t key_sizes, value_sizes;
+    std::atomic<uint64_t> samples = {0};
+
+    /**
+     * @brief record a sampled request
+     */
+    void record_sample(const std::string &key, size_t vlen);
+};
+
+#endif
@@ -0,0 +1,217 @@
+/**
+ * @file /src/server/leases.cpp
+ *
+ * @brief This file contains the implementation of the `LeaseTable`
+ * class declared in /src/server/leases.hpp
+ */
+
+#include <functional>
+#include "leases.hpp"
+
+/**
+ * @brief Create an empty table
+ *
+ * @param[in] lease_ms Milliseconds a lease stays valid
+ * @param[in] single_owner Indicates if only the thread that
+ * created the table changes it, so its shards are not locked.
+ * `stats()` may still be called from any thread.
+ */
+LeaseTable::LeaseTable(unsigned int lease_ms, bool single_owner)
+    : lease_ttl(lease_ms), single_owner(single_owner)
+{
+    for (shard_t &sh : shards)
+        sh.mutex.enabled = !single_owner;
+}
+
+LeaseTable::shard_t &LeaseTable::shard_of(const std::string &key)
+{
+    return shards[std::hash<std::string>()(key) % LEASE_SHARDS];
+}
+
+/**
+ * @brief drop the leases of a shard that expired by `now`,
+ * the shard must be locked
+ */
+void LeaseTable::expire(shard_t &sh, time_point now)
+{
+    while (!sh.expiry.empty() && sh.expiry.front().first <= now)
+    {
+        // the key may have been leased again since
+        auto it = sh.leases.find(sh.expiry.front().second);
+        if (it != sh.leases.end() && it->second.expires <= now)
+        {
+            sh.leases.erase(it);
+            add(held, -1);
+        }
+        sh.expiry.pop_front();
+    }
+}
+
+/**
+ * @brief Ask for a lease on a key that missed
+ *
+ * @param[in] key The key
+ * @param[out] token Location where the token is copied if
+ * the lease is granted
+ * @param[out] stale Location where a stale value is copied
+ * if one is known
+ * @param[out] flags Location where the flags of the stale
+ * value are copied
+ *
+ * @return `LEASE_GRANTED`, `LEASE_WAIT` or `LEASE_STALE`
+ */
+lease_status_t LeaseTable::acquire(const std::string &key, uint64_t *token, std::string &stale,
+                                   uint32_t *flags)
+{
+    if (!in_use.load(std::memory_order_relaxed))
+        in_use = true;
+
+    shard_t &sh = shard_of(key);
+    std::lock_guard<shard_mutex_t> lock(sh.mutex);
+    time_point now = std::chrono::steady_clock::now();
+    expire(sh, now);
+
+    if (sh.leases.count(key))
+    {
+        auto it = sh.stale.find(key);
+        if (it == sh.stale.end())
+        {
+            add(waits, 1);
+            return LEASE_WAIT;
+        }
+        stale = it->second.value;
+        *flags = it->second.flags;
+        add(stale_hits, 1);
+        return LEASE_STALE;
+    }
+
+    *token = add(next_token, 1);
+    sh.leases[key] = {*token, now + lease_ttl};
+    sh.expiry.emplace_back(now + lease_ttl, key);
+    add(held, 1);
+    add(granted, 1);
+    return LEASE_GRANTED;
+}
+
+/**
+ * @brief Check that a put may be stored: a put without a token
+ * only while no lease on its key is held, a put with a token
+ * only while that lease is held
+ *
+ * @param[in] key The key
+ * @param[in] token The token carried by the put, 0 for none
+ *
+ * @return true if the put may be stored, else false
+ */
+bool LeaseTable::may_put(const std::string &key, uint64_t token)
+{
+    // puts of a server nobody asked for leases do not lock
+    if (token == 0 && held.load(std::memory_order_relaxed) == 0)
+        return true;
+
+    shard_t &sh = shard_of(key);
+    std::lock_guard<shard_mutex_t> lock(sh.mutex);
+    expire(sh, std::chrono::steady_clock::now());
+
+    auto it = sh.leases.find(key);
+    bool ok = it == sh.leases.end() ? token == 0 : it->second.token == token;
+    if (!ok)
+        add(rejected_puts, 1);
+    return ok;
+}
+
+/**
+ * @brief End a lease once the put carrying its token was
+ * stored, and drop the stale value of its key
+ *
+ * @param[in] key The key
+ * @param[in] token The token of the lease
+ */
+void LeaseTable::release(const std::string &key, uint64_t token)
+{
+    shard_t &sh = shard_of(key);
+    std::lock_guard<shard_mutex_t> lock(sh.mutex);
+
+    auto it = sh.leases.find(key);
+    if (it != sh.leases.end() && it->second.token == token)
+    {
+        sh.leases.erase(it);
+        add(held, -1);
+    }
+    // its bytes are given back when its entry is dropped
+    sh.stale.erase(key);
+}
+
+/**
+ * @brief End the lease on a key whose value was deleted, so
+ * the value its holder computed before is not stored
+ *
+ * @param[in] key The key
+ */
+void LeaseTable::invalidate(const std::string &key)
+{
+    if (held.load(std::memory_order_relaxed) == 0)
+        return;
+
+    shard_t &sh = shard_of(key);
+    std::lock_guard<shard_mutex_t> lock(sh.mutex);
+    if (sh.leases.erase(key))
+        add(held, -1);
+}
+
+/**
+ * @brief Drop every stale value, once the store was flushed
+ */
+void LeaseTable::drop_stale()
+{
+    for (shard_t &sh : shards)
+    {
+        std::lock_guard<shard_mutex_t> lock(sh.mutex);
+        sh.stale.clear();
+        sh.stale_order.clear();
+        sh.stale_bytes = 0;
+    }
+}
+
+/**
+ * @brief Keep the value of an evicted or deleted item to serve
+ * it as a stale hit. Values are only kept once a lease was asked
+ * for, and the oldest are dropped past `LEASE_STALE_BYTES`.
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags The flags stored with the value
+ */
+void LeaseTable::keep_stale(const std::string &key, const std::string &value, uint32_t flags)
+{
+    size_t bytes = key.size() + value.size();
+    if (!in_use.load(std::memory_order_relaxed) || bytes > LEASE_STALE_BYTES / LEASE_SHARDS)
+        return;
+
+    shard_t &sh = shard_of(key);
+    std::lock_guard<shard_mutex_t> lock(sh.mutex);
+    uint64_t seq = ++sh.stale_seq;
+    sh.stale[key] = {value, flags, seq};
+    sh.stale_order.push_back({seq, bytes, key});
+    sh.stale_bytes += bytes;
+
+    while (sh.stale_bytes > LEASE_STALE_BYTES / LEASE_SHARDS)
+    {
+        stale_entry_t &oldest = sh.stale_order.front();
+        auto it = sh.stale.find(oldest.key);
+        if (it != sh.stale.end() && it->second.seq == oldest.seq)
+            sh.stale.erase(it);
+        sh.stale_bytes -= oldest.bytes;
+        sh.stale_order.pop_front();
+    }
+}
+
+/**
+ * @brief Leases handed out, waits, stale hits and rejected puts
+ *
+ * @return the figures
+ */
+lease_stats_t LeaseTable::stats()
+{
+    return {granted, waits, stale_hits, rejected_puts};
+}
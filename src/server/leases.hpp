@@ -0,0 +1,233 @@
+/**
+ * @file /src/server/leases.hpp
+ *
+ * @brief This file contains the declaration of the `LeaseTable` class.
+ * A server uses it to hand out leases on misses, so that only one
+ * of the clients missing on a key at the same time computes its
+ * value while the others wait or are served a value evicted a
+ * moment ago. The implementation is present in /src/server/leases.cpp
+ */
+
+#ifndef LEASES_H
+#define LEASES_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/* Number of independently locked partitions of the table */
+#define LEASE_SHARDS 16
+
+/* Memory kept for the values of evicted or deleted items, served as stale
+ * hits while a lease on their key is held */
+#define LEASE_STALE_BYTES (4 << 20)
+
+/**
+ * @brief Outcome of asking for a lease on a missing key
+ */
+enum lease_status_t
+{
+    LEASE_GRANTED, // the caller should fill the key
+    LEASE_WAIT,    // another client holds the lease
+    LEASE_STALE,   // another client holds the lease, a stale value is known
+};
+
+/**
+ * @brief Figures describing the leases handed out
+ */
+struct lease_stats_t
+{
+    uint64_t granted;
+    uint64_t waits;
+    uint64_t stale_hits;
+    uint64_t rejected_puts; // without the valid lease of their key
+};
+
+/**
+ * @brief Leases on missing keys and the recently evicted values
+ * served while a lease is held. A lease is valid until the put
+ * carrying its token is stored, or until it expires so a client
+ * that never fills its key does not block it for long.
+ */
+class LeaseTable
+{
+public:
+    /**
+     * @brief Create an empty table
+     *
+     * @param[in] lease_ms Milliseconds a lease stays valid
+     * @param[in] single_owner Indicates if only the thread that
+     * created the table changes it, so its shards are not locked.
+     * `stats()` may still be called from any thread.
+     */
+    LeaseTable(unsigned int lease_ms, bool single_owner = false);
+
+    /**
+     * @brief Ask for a lease on a key that missed
+     *
+     * @param[in] key The key
+     * @param[out] token Location where the token is copied if
+     * the lease is granted
+     * @param[out] stale Location where a stale value is copied
+     * if one is known
+     * @param[out] flags Location where the flags of the stale
+     * value are copied
+     *
+     * @return `LEASE_GRANTED`, `LEASE_WAIT` or `LEASE_STALE`
+     */
+    lease_status_t acquire(const std::string &key, uint64_t *token, std::string &stale,
+                           uint32_t *flags);
+
+    /**
+     * @brief Check that a put may be stored: a put without a token
+     * only while no lease on its key is held, a put with a token
+     * only while that lease is held
+     *
+     * @param[in] key The key
+     * @param[in] token The token carried by the put, 0 for none
+     *
+     * @return true if the put may be stored, else false
+     */
+    bool may_put(const std::string &key, uint64_t token);
+
+    /**
+     * @brief End a lease once the put carrying its token was
+     * stored, and drop the stale value of its key
+     *
+     * @param[in] key The key
+     * @param[in] token The token of the lease
+     */
+    void release(const std::string &key, uint64_t token);
+
+    /**
+     * @brief End the lease on a key whose value was deleted, so
+     * the value its holder computed before is not stored
+     *
+     * @param[in] key The key
+     */
+    void invalidate(const std::string &key);
+
+    /**
+     * @brief Drop every stale value, once the store was flushed
+     */
+    void drop_stale();
+
+    /**
+     * @brief Keep the value of an evicted or deleted item to serve
+     * it as a stale hit. Values are only kept once a lease was asked
+     * for, and the oldest are dropped past `LEASE_STALE_BYTES`.
+     *
+     * @param[in] key The key
+     * @param[in] value The value
+     * @param[in] flags The flags stored with the value
+     */
+    void keep_stale(const std::string &key, const std::string &value, uint32_t flags);
+
+    /**
+     * @brief Leases handed out, waits, stale hits and rejected puts
+     *
+     * @return the figures
+     */
+    lease_stats_t stats();
+
+private:
+    typedef std::chrono::steady_clock::time_point time_point;
+
+    struct lease_t
+    {
+        uint64_t token;
+        time_point expires;
+    };
+
+    struct stale_t
+    {
+        std::string value;
+        uint32_t flags;
+        uint64_t seq;
+    };
+
+    struct stale_entry_t
+    {
+        uint64_t seq;
+        size_t bytes;
+        std::string key;
+    };
+
+    /**
+     * @brief Lock of a shard, doing nothing in a table with a
+     * single owner
+     */
+    struct shard_mutex_t
+    {
+        std::mutex mutex;
+        bool enabled = true;
+
+        inline void lock()
+        {
+            if (enabled)
+                mutex.lock();
+        }
+
+        inline void unlock()
+        {
+            if (enabled)
+                mutex.unlock();
+        }
+    };
+
+    struct shard_t
+    {
+        shard_mutex_t mutex;
+        std::unordered_map<std::string, lease_t> leases;
+        // leases in the order they expire
+        std::deque<std::pair<time_point, std::string>> expiry;
+
+        std::unordered_map<std::string, stale_t> stale;
+        // stale values in the order they were kept, an entry is
+        // dropped with its value unless the key was kept again
+        std::deque<stale_entry_t> stale_order;
+        size_t stale_bytes = 0;
+        uint64_t stale_seq = 0;
+    };
+
+    shard_t shards[LEASE_SHARDS];
+    std::chrono::milliseconds lease_ttl;
+    bool single_owner;
+    std::atomic<uint64_t> next_token = {1};
+    std::atomic<uint64_t> held = {0};
+    std::atomic<bool> in_use = {false};
+
+    std::atomic<uint64_t> granted = {0};
+    std::atomic<uint64_t> waits = {0};
+    std::atomic<uint64_t> stale_hits = {0};
+    std::atomic<uint64_t> rejected_puts = {0};
+
+    shard_t &shard_of(const std::string &key);
+
+    /**
+     * @brief add to a counter, without a locked instruction if
+     * the table has a single owner
+     *
+     * @return the value of the counter before
+     */
+    inline uint64_t add(std::atomic<uint64_t> &counter, int64_t n)
+    {
+        if (!single_owner)
+            return counter.fetch_add(n, std::memory_order_relaxed);
+        uint64_t old = counter.load(std::memory_order_relaxed);
+        counter.store(old + n, std::memory_order_relaxed);
+        return old;
+    }
+
+    /**
+     * @brief drop the leases of a shard that expired by `now`,
+     * the shard must be locked
+     */
+    void expire(shard_t &sh, time_point now);
+};
+
+#endif
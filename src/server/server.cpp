@@ -6,37 +6,188 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <iostream>
+#include <algorithm>
 #include <thread>
 #include "server.hpp"
+#include "../hash/hash.hpp"
 #include "../utils/message.hpp"
 #include "../utils/conn.hpp"
+#include "../utils/shmring.hpp"
 #include "../utils/logger.hpp"
 #include "../utils/colors.hpp"
 
+/* Events a core handles per wait */
+#define CORE_EVENTS 64
+
+/**
+ * @brief settings of the store shared by the connection threads,
+ * which is left empty and small when every core owns a store
+ */
+static store_opts_t shared_store_opts(const server_opts_t &opts)
+{
+    if (opts.cores == 0)
+        return opts.store;
+    store_opts_t unused;
+    unused.memory_bytes = (size_t)1 << 20;
+    return unused;
+}
+
+/**
+ * @brief the CPUs the server may run on, empty unless they
+ * are to be pinned
+ */
+static std::vector<int> usable_cpus(bool pin)
+{
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+/**
+ * @brief run the calling thread, and the threads it starts,
+ * on one CPU only
+ */
+static void pin_to_cpu(int cpu)
+{
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
 /**
  * @brief an instance of this class represents a single
  * server. Instantiating a `Server` object will start
  * a localhost server that listens on the port passed
  *
- * @param[in] port The port where the server should listen
+ * @param[in] port The port where the server should listen, on
+ * `opts.bind_addr` unless `opts.unix_path` is set
  * @param[in] print_logs Indicates if logs should be printed
  * to console
+ * @param[in] opts Optional server settings. If the store could
+ * not attach to an existing segment file and a snapshot file
+ * exists at `opts.snapshot_path`, the snapshot is loaded before
+ * clients are accepted.
  */
-Server::Server(int port, bool print_logs)
+Server::Server(int port, bool print_logs, server_opts_t opts)
+    : kv_store(shared_store_opts(opts)), opts(opts)
 {
     logger = new Logger(print_logs);
-    listenfd = start_listener(port);
-    std::thread serve_thread(&Server::accept_and_serve_forever, this);
-    serve_thread.detach();
+    key_sampler = new KeySampler();
+    leases = new LeaseTable(opts.lease_ms);
+    kv_store.set_evict_listener([this](const std::string &key, const std::string &value, uint32_t flags)
+                                { leases->keep_stale(key, value, flags); });
+    closed = false;
+    closing = false;
+    listening_cores = 0;
+    stopping_cores = false;
+    if (opts.cores > 0 && (!opts.snapshot_path.empty() || !opts.store.ext_path.empty()))
+    {
+        printf("[Server] Snapshots and the ext file are not used with a store per core\n");
+        this->opts.snapshot_path = "";
+    }
+    if (kv_store.attached())
+    {
+        printf("[Server] Attached to %zu items in %s\n", kv_store.size(),
+               opts.store.segment_path.c_str());
+    }
+    else
+    {
+        load_snapshot();
+    }
+    if (opts.cores > 0)
+        start_cores(port);
+    else
+        start_listeners(port);
+
+    if (!this->opts.snapshot_path.empty() && opts.snapshot_interval > 0)
+    {
+        snapshot_thread = std::thread(&Server::snapshot_periodically, this);
+    }
+}
+
+/**
+ * @brief closes the server if that was not done yet, and
+ * waits for the connections still served to be shut down
+ */
+Server::~Server()
+{
+    close_server();
+
+    std::unique_lock<std::mutex> lock(conns_mutex);
+    for (int connfd : conns)
+        shutdown(connfd, SHUT_RDWR);
+    conns_cv.wait(lock, [this]()
+                  { return conns.empty(); });
+    lock.unlock();
+    stop_cores();
+    delete key_sampler;
+    delete leases;
+}
+
+/**
+ * @brief open the listener sockets and start a thread accepting
+ * connections from each
+ *
+ * @param[in] port The port to listen on
+ */
+void Server::start_listeners(int port)
+{
+    unsigned int n = std::max(1u, opts.listeners);
+    bool tcp = opts.unix_path.empty();
+
+    // the n-th thread is pinned to the n-th CPU the server may use
+    std::vector<int> cpus = usable_cpus(opts.pin_cpus);
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        int listenfd;
+        if (!tcp)
+            listenfd = i == 0 ? start_listener(unix_endpoint(opts.unix_path, port)) : listenfds[0];
+        else
+            listenfd = start_listener(tcp_endpoint(port, opts.bind_addr), n > 1);
+        if (listenfd < 0)
+        {
+            perror("[Server] Couldn't listen");
+            break;
+        }
+        if (tcp || i == 0)
+            listenfds.push_back(listenfd);
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        serve_threads.emplace_back(&Server::accept_and_serve_forever, this, listenfd, cpu);
+    }
 }
 
 /**
  * @brief continuously and sequentially keep accepting connections
  * serving requests
+ *
+ * @param[in] listenfd The socket to accept connections from
+ * @param[in] cpu The CPU to run on, -1 for any
  */
-void Server::accept_and_serve_forever()
+void Server::accept_and_serve_forever(int listenfd, int cpu)
 {
+    // threads started from here inherit the CPU
+    pin_to_cpu(cpu);
+
     int connfd;
     while (true)
     {
@@ -47,16 +198,33 @@ void Server::accept_and_serve_forever()
         {
             *logger << GREEN << "\n[Server] Client connected\n"
                     << RESET;
+            conns_mutex.lock();
+            conns.insert(connfd);
+            conns_mutex.unlock();
             std::thread cl_thread(&Server::process_requests, this, connfd);
             cl_thread.detach();
         }
-        else if (connfd == -1) // listenfd closed
+        else if (connfd == -1 || closing) // listenfd closed
         {
             break;
         }
     }
 }
 
+/**
+ * @brief parse the decimal delta of an `incr` or `decr` request
+ *
+ * @return true if `str` is a number that fits 64 bits
+ */
+static bool parse_number(const std::string &str, uint64_t *n)
+{
+    if (str.empty() || str.size() > 20 || str.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    errno = 0;
+    *n = strtoull(str.c_str(), NULL, 10);
+    return errno == 0;
+}
+
 /**
  * @brief process requests received from the client
  * and respond back until EOF is reached
@@ -66,54 +234,981 @@ void Server::accept_and_serve_forever()
 void Server::process_requests(int connfd)
 {
     msg_t *resp, *req_msg = make_msg_ref();
+    std::string value, req_value;
+    bool too_large;
+    int held = 0;
+    ShmChannel *ring = NULL;
 
     // keep reading until EOF/error
-    while (read_msg(connfd, req_msg, -1) != -1)
+    while (held || read_msg(connfd, req_msg, -1) != -1)
     {
-        logger->display_msg("[Server] Received Request", req_msg);
-        switch (req_msg->type)
+        if (!held)
+            logger->display_msg("[Server] Received Request", req_msg);
+        if (req_msg->type == req_get_t && !msg_value_streamed(req_msg))
         {
-        case req_put_t:
-            kv_store_mutex.lock(); // write
-            kv_store[req_msg->key] = req_msg->value;
-            kv_store_mutex.unlock();
-            resp = create_ack_msg();
-            print_kv_state();
-            break;
-        case req_get_t:
-            kv_store_mutex.lock_shared(); // read
-            resp = kv_store.count(req_msg->key) > 0
-                       ? create_hit_msg(kv_store[req_msg->key])
-                       : create_miss_msg();
-            kv_store_mutex.unlock_shared();
-            break;
-        default:
-            printf("[Server] Invalid message type received, type = %d", req_msg->type);
+            held = serve_gets(connfd, req_msg);
+            if (held < 0)
+                break;
+            continue;
+        }
+        held = 0;
+
+        // a streamed value is read straight into the request buffer,
+        // one over the limit is read and dropped to stay in step
+        too_large = req_msg->vlen > opts.max_value_bytes;
+        if (!msg_value_streamed(req_msg))
+            req_value.assign(req_msg->value, req_msg->vlen);
+        else
+        {
+            req_value.resize(too_large ? 0 : req_msg->vlen);
+            if (read_value(connfd, too_large ? NULL : &req_value[0], req_msg->vlen, -1) < 0)
+                break;
+        }
+
+        if (req_msg->type == req_shm_attach_t)
+        {
+            // acked on the socket, the rings are used from then on
+            ring = shm_accept(connfd);
+            resp = ring ? create_ack_msg() : create_error_msg();
+        }
+        else if (req_msg->type == req_scan_t)
+        {
+            // the ack carrying the count ends the stream of keys
+            long sent = send_range(connfd, req_msg->cas >> 32, (uint32_t)req_msg->cas);
+            if (sent < 0)
+                break;
+            resp = create_ack_msg(sent);
+        }
+        else
+        {
+            resp = execute(req_msg, req_value, too_large, kv_store, *leases, *key_sampler, value);
         }
 
         // respond back to the client
-        send_msg(connfd, resp);
+        send_msg(connfd, resp, value.data());
         logger->display_msg("[Server] Sending Response", resp);
         free(resp);
+        if (ring && shm_bind(connfd, ring) < 0)
+            delete ring;
+        ring = NULL;
     }
-    printf("\n[Server] EOF recieved from connfd\n");
+    *logger << "\n[Server] EOF recieved from connfd\n";
+    free(req_msg);
+
+    std::lock_guard<std::mutex> lock(conns_mutex);
+    shm_close(connfd);
     close(connfd);
+    conns.erase(connfd);
+    conns_cv.notify_all();
+}
+
+/**
+ * @brief answer a get together with the gets the client sent
+ * right behind it, looking them up with `Store::get_batch()`.
+ * Reading stops at the first other request, which is left in
+ * `req_msg` with its value not read yet.
+ *
+ * @param[in] connfd the fd to communicate with client
+ * @param[in,out] req_msg The get, then the request reading
+ * stopped at
+ *
+ * @return 1 if a request was left in `req_msg`, 0 if not, -1 if
+ * the client went away
+ */
+int Server::serve_gets(int connfd, msg_t *req_msg)
+{
+    std::vector<store_lookup_t> lookups(1);
+    struct pollfd pfd = {connfd, POLLIN, 0};
+    int held = 0;
+
+    lookups[0].key = req_msg->key;
+    while (lookups.size() < SERVER_GET_BATCH && poll_msgs(&pfd, 1, 0) > 0)
+    {
+        if (read_msg(connfd, req_msg, -1) < 0)
+            return -1;
+        logger->display_msg("[Server] Received Request", req_msg);
+        if (req_msg->type != req_get_t || msg_value_streamed(req_msg))
+        {
+            held = 1;
+            break;
+        }
+        lookups.emplace_back();
+        lookups.back().key = req_msg->key;
+    }
+    kv_store.get_batch(lookups);
+
+    for (store_lookup_t &l : lookups)
+    {
+        msg_t *resp = l.hit ? create_hit_msg(l.value, l.flags, l.cas) : create_miss_msg();
+        key_sampler->record(l.key, l.hit ? l.value.size() : 0);
+        send_msg(connfd, resp, l.value.data());
+        logger->display_msg("[Server] Sending Response", resp);
+        free(resp);
+    }
+    return held;
+}
+
+/**
+ * @brief apply a request to a store and build the response
+ *
+ * @param[in] req_msg The request
+ * @param[in] req_value The value of the request
+ * @param[in] too_large Indicates if the value was over the
+ * limit and dropped
+ * @param[in] store The store holding the key
+ * @param[in] lease_table The leases of the keys of `store`
+ * @param[in] sampler The sampler of the requests to `store`
+ * @param[out] value Location of the value of the response
+ *
+ * @return the response
+ */
+msg_t *Server::execute(msg_t *req_msg, const std::string &req_value, bool too_large,
+                       Store &store, LeaseTable &lease_table, KeySampler &sampler,
+                       std::string &value)
+{
+    msg_t *resp;
+    uint32_t flags;
+    uint64_t cas, number, lease;
+    store_status_t status;
+
+    switch (req_msg->type)
+    {
+    case req_put_t:
+    case req_lease_put_t:
+        // a put without a token is rejected while a lease is
+        // held on its key, a put with one unless it is that lease
+        lease = req_msg->type == req_lease_put_t ? req_msg->cas : 0;
+        if (!lease_table.may_put(req_msg->key, lease))
+            resp = create_exists_msg();
+        else if (!too_large && store.put(req_msg->key, req_value, req_msg->flags, &cas))
+            resp = create_ack_msg(cas);
+        else
+            resp = create_error_msg();
+        if (lease && resp->type == resp_ack_t)
+            lease_table.release(req_msg->key, lease);
+        sampler.record(req_msg->key, req_value.size());
+        print_kv_state(store);
+        break;
+    case req_add_t:
+        // a key handed over from its previous owner never replaces
+        // one written to it since, nor one a lease is held on
+        status = too_large || !lease_table.may_put(req_msg->key, 0)
+                     ? STORE_EXISTS
+                     : store.add(req_msg->key, req_value, req_msg->flags, &cas);
+        resp = status == STORE_OK       ? create_ack_msg(cas)
+               : status == STORE_EXISTS ? create_exists_msg()
+                                        : create_error_msg();
+        sampler.record(req_msg->key, req_value.size());
+        print_kv_state(store);
+        break;
+    case req_cas_t:
+        status = too_large ? STORE_NO_MEMORY
+                           : store.compare_and_swap(req_msg->key, req_value, req_msg->flags,
+                                                    req_msg->cas, &cas);
+        resp = status == STORE_OK          ? create_ack_msg(cas)
+               : status == STORE_EXISTS    ? create_exists_msg()
+               : status == STORE_NOT_FOUND ? create_miss_msg()
+                                           : create_error_msg();
+        sampler.record(req_msg->key, req_value.size());
+        break;
+    case req_incr_t:
+    case req_decr_t:
+        value.clear();
+        status = parse_number(req_value, &number)
+                     ? store.incr(req_msg->key, number, req_msg->type == req_decr_t, &number, &cas)
+                     : STORE_NOT_NUMBER;
+        if (status == STORE_OK)
+            value = std::to_string(number);
+        resp = status == STORE_OK          ? create_hit_msg(value, 0, cas)
+               : status == STORE_NOT_FOUND ? create_miss_msg()
+                                           : create_error_msg();
+        sampler.record(req_msg->key, value.size());
+        break;
+    case req_append_t:
+    case req_prepend_t:
+        status = too_large ? STORE_NO_MEMORY
+                           : store.append(req_msg->key, req_value,
+                                          req_msg->type == req_prepend_t, &cas);
+        resp = status == STORE_OK          ? create_ack_msg(cas)
+               : status == STORE_NOT_FOUND ? create_miss_msg()
+                                           : create_error_msg();
+        sampler.record(req_msg->key, req_value.size());
+        break;
+    case req_get_t:
+        resp = store.get(req_msg->key, value, &flags, &cas)
+                   ? create_hit_msg(value, flags, cas)
+                   : create_miss_msg();
+        sampler.record(req_msg->key, resp->type == resp_hit_t ? value.size() : 0);
+        break;
+    case req_lease_get_t:
+        resp = NULL;
+        if (!store.get(req_msg->key, value, &flags, &cas))
+        {
+            switch (lease_table.acquire(req_msg->key, &lease, value, &flags))
+            {
+            case LEASE_GRANTED:
+                // the holder of the last lease may have filled the
+                // key since the miss
+                if (!store.get(req_msg->key, value, &flags, &cas))
+                {
+                    resp = create_lease_msg(lease);
+                    break;
+                }
+                lease_table.release(req_msg->key, lease);
+                break;
+            case LEASE_STALE:
+                resp = create_stale_hit_msg(value, flags);
+                break;
+            default:
+                resp = create_lease_wait_msg();
+            }
+        }
+        if (!resp)
+            resp = create_hit_msg(value, flags, cas);
+        sampler.record(req_msg->key, resp->vlen);
+        break;
+    case req_delete_t:
+        // the deleted value is served stale while the key is
+        // refilled, and a lease taken before is no longer valid
+        lease_table.invalidate(req_msg->key);
+        if (store.remove(req_msg->key, &value, &flags))
+        {
+            lease_table.keep_stale(req_msg->key, value, flags);
+            resp = create_ack_msg();
+        }
+        else
+        {
+            resp = create_miss_msg();
+        }
+        sampler.record(req_msg->key, 0);
+        break;
+    case req_flush_all_t:
+        store.flush_all();
+        lease_table.drop_stale();
+        resp = create_ack_msg();
+        break;
+    case req_stats_t:
+        value = key_report();
+        resp = create_stats_resp_msg(value);
+        break;
+    case req_ping_t:
+        resp = create_pong_msg();
+        break;
+    default:
+        printf("[Server] Invalid message type received, type = %d", req_msg->type);
+        resp = create_error_msg();
+    }
+    return resp;
+}
+
+/**
+ * @brief the report of the sampled keys and sizes, over the
+ * samplers of all cores if each core has its own
+ *
+ * @return the report
+ */
+std::string Server::key_report()
+{
+    if (cores.empty())
+        return key_sampler->report();
+    std::vector<KeySampler *> samplers;
+    for (core_t *core : cores)
+        samplers.push_back(core->sampler);
+    return KeySampler::report(samplers);
+}
+
+/**
+ * @brief send a `resp_scan_item_t` message for every key of the
+ * store on an arc of the ring, see `create_scan_msg()`. The keys
+ * of a shard are gathered under its lock and sent after it was
+ * released.
+ *
+ * @param[in] connfd the fd to communicate with client
+ * @param[in] lo The start of the arc, not included
+ * @param[in] hi The end of the arc
+ *
+ * @return the number of keys sent, -1 if the client went away
+ */
+long Server::send_range(int connfd, uint32_t lo, uint32_t hi)
+{
+    struct scan_item_t
+    {
+        std::string key, value;
+        uint32_t flags;
+    };
+    std::vector<scan_item_t> items;
+    long sent = 0;
+
+    for (int shard = 0; shard < STORE_SHARDS; shard++)
+    {
+        items.clear();
+        kv_store.for_each_in_shard(shard, [&](const std::string &key, const std::string &value,
+                                              uint32_t flags)
+                                   {
+                                       if (in_ring_range(get_hash(key), lo, hi))
+                                           items.push_back({key, value, flags}); });
+        for (scan_item_t &item : items)
+        {
+            msg_t *msg = create_scan_item_msg(item.key, item.value, item.flags);
+            if (!msg)
+                continue;
+            int rc = send_msg(connfd, msg, item.value.data());
+            free(msg);
+            if (rc < 0)
+                return -1;
+            sent++;
+        }
+    }
+    return sent;
+}
+
+/**
+ * @brief the core owning a key, picked from other bits of its hash
+ * than the shard and the bucket of the key in the store of the core
+ */
+static inline unsigned int core_for(const char *key, size_t ncores)
+{
+    return (hash_bytes(key, strnlen(key, MAX_KSIZE)) >> 32) % ncores;
+}
+
+/**
+ * @brief wake up a core if it sleeps or is about to, after
+ * something was queued to it
+ */
+static void wake_core(core_t *core)
+{
+    // pairs with the fence of a core going to sleep: either it sees
+    // what was queued, or this sees it sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t one = 1;
+    if (core->sleeping.load(std::memory_order_relaxed) &&
+        write(core->wakefd, &one, sizeof(one)) < 0)
+        perror("[Server] Couldn't wake up a core");
+}
+
+/**
+ * @brief read what a core connection received, without waiting
+ * for more. The connection is marked closed once the client went
+ * away.
+ */
+static void read_core_conn(core_conn_t *conn)
+{
+    for (int round = 0; round < CORE_READ_ROUNDS; round++)
+    {
+        size_t len = conn->in.size();
+        conn->in.resize(len + CORE_READ_CHUNK);
+        ssize_t n = read(conn->fd, &conn->in[len], CORE_READ_CHUNK);
+        conn->in.resize(len + (n > 0 ? n : 0));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            conn->closed = true;
+        if (n < CORE_READ_CHUNK)
+            return;
+    }
+}
+
+/**
+ * @brief send what the socket of a core connection takes of its
+ * responses, without waiting
+ *
+ * @return false if the client went away, else true
+ */
+static bool flush_core_conn(core_conn_t *conn)
+{
+    while (conn->out_off < conn->out.size())
+    {
+        // a peer that went away must not raise SIGPIPE
+        ssize_t n = send(conn->fd, conn->out.data() + conn->out_off,
+                         conn->out.size() - conn->out_off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        if (n < 0)
+            break;
+        conn->out_off += n;
+    }
+    if (conn->out_off == conn->out.size())
+    {
+        conn->out.clear();
+        conn->out_off = 0;
+    }
+    else if (conn->out_off >= CORE_READ_CHUNK)
+    {
+        conn->out.erase(0, conn->out_off);
+        conn->out_off = 0;
+    }
+    return true;
+}
+
+/**
+ * @brief watch a core connection for what it waits for: more
+ * requests unless one is with another core or the client is
+ * behind on its responses, and room for the responses not sent
+ */
+static void watch_core_conn(core_t *core, core_conn_t *conn)
+{
+    size_t unsent = conn->out.size() - conn->out_off;
+    uint32_t events = (!conn->busy && unsent < CORE_OUT_MAX ? EPOLLIN : 0) |
+                      (unsent > 0 ? EPOLLOUT : 0);
+    if (events == conn->events)
+        return;
+
+    // a connection watched for nothing is left out of the set, so
+    // a hang up is not reported until it is watched again
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = conn->fd;
+    int op = !events ? EPOLL_CTL_DEL : conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    epoll_ctl(core->epfd, op, conn->fd, &ev);
+    conn->events = events;
+}
+
+/**
+ * @brief create a store, a listener socket and a thread for
+ * each core
+ *
+ * @param[in] port The port to listen on
+ */
+void Server::start_cores(int port)
+{
+    unsigned int n = opts.cores;
+    bool tcp = opts.unix_path.empty();
+    std::vector<int> cpus = usable_cpus(opts.pin_cpus);
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        // only the core thread uses its store, so it takes no locks
+        store_opts_t store_opts = opts.store;
+        store_opts.memory_bytes /= n;
+        store_opts.ext_path = "";
+        store_opts.single_owner = true;
+        if (!store_opts.segment_path.empty())
+            store_opts.segment_path += "." + std::to_string(i);
+
+        core_t *core = new core_t();
+        core->store = new Store(store_opts);
+        core->leases = new LeaseTable(opts.lease_ms, true);
+        core->sampler = new KeySampler();
+        LeaseTable *lease_table = core->leases;
+        core->store->set_evict_listener([lease_table](const std::string &key, const std::string &value, uint32_t flags)
+                                        { lease_table->keep_stale(key, value, flags); });
+        if (core->store->attached())
+        {
+            printf("[Server] Core %u attached to %zu items in %s\n", i, core->store->size(),
+                   store_opts.segment_path.c_str());
+        }
+        for (unsigned int j = 0; j < n; j++)
+            core->inbox.push_back(new SpscQueue<core_req_t *>(CORE_QUEUE_LEN));
+        core->backlog.resize(n);
+        core->sleeping = false;
+        core->epfd = epoll_create1(EPOLL_CLOEXEC);
+        core->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = core->wakefd;
+        epoll_ctl(core->epfd, EPOLL_CTL_ADD, core->wakefd, &ev);
+
+        // over TCP each core has its own socket, a Unix domain
+        // socket is shared and wakes up one core per connection
+        if (!tcp)
+            core->listenfd = i == 0 ? start_listener(unix_endpoint(opts.unix_path, port)) : cores[0]->listenfd;
+        else
+            core->listenfd = start_listener(tcp_endpoint(port, opts.bind_addr), n > 1);
+        if (core->listenfd < 0)
+        {
+            perror("[Server] Couldn't listen");
+        }
+        else
+        {
+            if (tcp || i == 0)
+                listenfds.push_back(core->listenfd);
+            fcntl(core->listenfd, F_SETFL, fcntl(core->listenfd, F_GETFL) | O_NONBLOCK);
+            ev.events = tcp ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.fd = core->listenfd;
+            epoll_ctl(core->epfd, EPOLL_CTL_ADD, core->listenfd, &ev);
+            listening_cores++;
+        }
+        cores.push_back(core);
+    }
+
+    // the cores hand requests to each other from the start
+    for (unsigned int i = 0; i < n; i++)
+    {
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        cores[i]->thread = std::thread(&Server::serve_core, this, i, cpu);
+    }
+}
+
+/**
+ * @brief accept and serve the connections of a core, and the
+ * requests other cores hand to it, until the cores are stopped
+ *
+ * @param[in] id The core
+ * @param[in] cpu The CPU to run on, -1 for any
+ */
+void Server::serve_core(int id, int cpu)
+{
+    pin_to_cpu(cpu);
+    core_t *core = cores[id];
+    struct epoll_event events[CORE_EVENTS];
+    int poll_rounds = std::thread::hardware_concurrency() > 1 ? CORE_POLL_ROUNDS : 0;
+    int idle = 0;
+
+    while (!stopping_cores)
+    {
+        // the listener is dropped once the server is closed
+        if (closing && core->listenfd >= 0)
+        {
+            epoll_ctl(core->epfd, EPOLL_CTL_DEL, core->listenfd, NULL);
+            core->listenfd = -1;
+            std::lock_guard<std::mutex> lock(conns_mutex);
+            listening_cores--;
+            conns_cv.notify_all();
+        }
+
+        idle = drain_core_inbox(id) > 0 ? 0 : idle + 1;
+
+        // sleep only once nothing came in for a while, other cores
+        // write the wake up descriptor of a sleeping core only
+        int timeout = 0;
+        if (idle > poll_rounds)
+        {
+            core->sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            timeout = -1;
+            for (unsigned int i = 0; i < cores.size() && timeout < 0; i++)
+                if (!core->inbox[i]->empty() || !core->backlog[i].empty())
+                    timeout = 0;
+        }
+        int nevents = epoll_wait(core->epfd, events, CORE_EVENTS, timeout);
+        core->sleeping.store(false, std::memory_order_relaxed);
+
+        for (int i = 0; i < nevents; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == core->wakefd)
+            {
+                uint64_t count;
+                if (read(core->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("[Server] Couldn't read the wake up count");
+            }
+            else if (fd == core->listenfd)
+            {
+                int connfd;
+                while ((connfd = accept_client(core->listenfd)) >= 0)
+                    add_core_conn(id, connfd);
+            }
+            else
+            {
+                auto it = core->conns.find(fd);
+                if (it == core->conns.end())
+                    continue;
+                core_conn_t *conn = it->second;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    read_core_conn(conn);
+                serve_core_conn(id, conn);
+            }
+        }
+        if (nevents > 0)
+            idle = 0;
+    }
+}
+
+/**
+ * @brief start serving a connection accepted by a core
+ *
+ * @param[in] id The core
+ * @param[in] connfd The connection
+ */
+void Server::add_core_conn(int id, int connfd)
+{
+    *logger << GREEN << "\n[Server] Client connected\n"
+            << RESET;
+    conns_mutex.lock();
+    conns.insert(connfd);
+    conns_mutex.unlock();
+
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+    core_conn_t *conn = new core_conn_t();
+    conn->fd = connfd;
+    cores[id]->conns[connfd] = conn;
+    serve_core_conn(id, conn);
+}
+
+/**
+ * @brief take the requests a core connection received whole,
+ * one at a time while none is with another core, and execute
+ * each there or hand it to the core owning its key. Then send
+ * what the socket takes of the responses, and watch the socket
+ * for what the connection waits for.
+ *
+ * @param[in] id The core
+ * @param[in] conn The connection
+ */
+void Server::serve_core_conn(int id, core_conn_t *conn)
+{
+    core_t *core = cores[id];
+
+    // the next request is only taken once the response to the last
+    // one is queued, so responses keep the order of the requests
+    while (!conn->busy && conn->out.size() - conn->out_off < CORE_OUT_MAX)
+    {
+        size_t drop = std::min(conn->skip, conn->in.size() - conn->in_off);
+        conn->in_off += drop;
+        conn->skip -= drop;
+        if (conn->skip > 0)
+            break;
+
+        core_req_t *creq;
+        if (core->spare.empty())
+        {
+            creq = new core_req_t();
+            creq->req = make_msg_ref();
+            creq->resp = NULL;
+        }
+        else
+        {
+            creq = core->spare.back();
+            core->spare.pop_back();
+        }
+        int taken = take_core_request(conn, creq);
+        if (taken <= 0)
+        {
+            core->spare.push_back(creq);
+            if (taken < 0)
+                conn->closed = true;
+            break;
+        }
+        creq->conn = conn;
+        dispatch_core_request(id, creq);
+    }
+
+    if (conn->in_off == conn->in.size())
+    {
+        conn->in.clear();
+        conn->in_off = 0;
+    }
+    else if (conn->in_off >= CORE_READ_CHUNK)
+    {
+        conn->in.erase(0, conn->in_off);
+        conn->in_off = 0;
+    }
+
+    if (!flush_core_conn(conn))
+        conn->closed = true;
+    if (!conn->closed)
+    {
+        watch_core_conn(core, conn);
+        return;
+    }
+    // the request with another core still comes back to it, the
+    // responses the client did not take are dropped
+    if (conn->busy)
+    {
+        conn->out.clear();
+        conn->out_off = 0;
+        watch_core_conn(core, conn);
+        return;
+    }
+    close_core_conn(id, conn);
+}
+
+/**
+ * @brief take the next request of a core connection from the
+ * bytes read so far, with its value
+ *
+ * @param[in] conn The connection
+ * @param[out] creq Location where the request is stored
+ *
+ * @return 1 if a request was taken, 0 if it was not received
+ * whole yet, -1 if it is malformed
+ */
+int Server::take_core_request(core_conn_t *conn, core_req_t *creq)
+{
+    const char *buf = conn->in.data() + conn->in_off;
+    size_t len = conn->in.size() - conn->in_off;
+    msg_t *req_msg = creq->req;
+    long n = parse_msg(buf, len, req_msg);
+    if (n <= 0)
+        return n;
+
+    // a streamed value is taken once whole, one over the limit is
+    // dropped as it arrives to stay in step
+    creq->too_large = req_msg->vlen > opts.max_value_bytes;
+    if (!msg_value_streamed(req_msg))
+    {
+        creq->req_value.assign(req_msg->value, req_msg->vlen);
+    }
+    else if (creq->too_large)
+    {
+        creq->req_value.clear();
+        conn->skip = req_msg->vlen;
+    }
+    else if (len - n < req_msg->vlen)
+    {
+        return 0;
+    }
+    else
+    {
+        creq->req_value.assign(buf + n, req_msg->vlen);
+        n += req_msg->vlen;
+    }
+    conn->in_off += n;
+    return 1;
+}
+
+/**
+ * @brief execute a request a core read, or hand it to the core
+ * owning its key
+ *
+ * @param[in] id The core
+ * @param[in] creq The request
+ */
+void Server::dispatch_core_request(int id, core_req_t *creq)
+{
+    core_t *core = cores[id];
+    msg_t *req_msg = creq->req;
+    logger->display_msg("[Server] Received Request", req_msg);
+    creq->from = id;
+    creq->hops = 1;
+    creq->done = false;
+
+    // requests without a key are served by the core that read them
+    unsigned int owner = id;
+    if (req_msg->type != req_flush_all_t && req_msg->type != req_stats_t &&
+        req_msg->type != req_ping_t && req_msg->type != req_shm_attach_t &&
+        req_msg->type != req_scan_t)
+        owner = core_for(req_msg->key, cores.size());
+
+    // the rings are not polled by the cores, and a scan would have
+    // to visit the store of every core
+    if (req_msg->type == req_shm_attach_t || req_msg->type == req_scan_t)
+        creq->resp = create_error_msg();
+    else if (owner == (unsigned int)id)
+        creq->resp = execute(req_msg, creq->req_value, creq->too_large, *core->store,
+                             *core->leases, *core->sampler, creq->value);
+
+    // a flush goes on to the next core until every core did it
+    if (req_msg->type == req_flush_all_t && cores.size() > 1)
+        owner = (id + 1) % cores.size();
+    if (owner == (unsigned int)id)
+    {
+        respond_from_core(id, creq);
+        return;
+    }
+
+    // the connection takes no other request until the response
+    // is back, so responses keep the order of the requests
+    creq->conn->busy = true;
+    send_to_core(id, owner, creq);
+}
+
+/**
+ * @brief stop serving a core connection and close it
+ *
+ * @param[in] id The core
+ * @param[in] conn The connection
+ */
+void Server::close_core_conn(int id, core_conn_t *conn)
+{
+    *logger << "\n[Server] EOF recieved from connfd\n";
+    if (conn->events)
+        epoll_ctl(cores[id]->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    cores[id]->conns.erase(conn->fd);
+
+    std::lock_guard<std::mutex> lock(conns_mutex);
+    close(conn->fd);
+    conns.erase(conn->fd);
+    conns_cv.notify_all();
+    delete conn;
+}
+
+/**
+ * @brief execute the requests and send the responses other
+ * cores handed to a core
+ *
+ * @param[in] id The core
+ *
+ * @return the number of requests and responses handled
+ */
+int Server::drain_core_inbox(int id)
+{
+    core_t *core = cores[id];
+    core_req_t *creq;
+    int handled = 0;
+
+    for (unsigned int i = 0; i < cores.size(); i++)
+    {
+        while (core->inbox[i]->pop(creq))
+        {
+            handled++;
+            if (creq->done)
+            {
+                // the response to a request this core read, its
+                // connection takes the next request
+                core_conn_t *conn = creq->conn;
+                respond_from_core(id, creq);
+                conn->busy = false;
+                serve_core_conn(id, conn);
+                continue;
+            }
+
+            free(creq->resp);
+            creq->resp = execute(creq->req, creq->req_value, creq->too_large, *core->store,
+                                 *core->leases, *core->sampler, creq->value);
+            if (creq->req->type == req_flush_all_t && ++creq->hops < cores.size())
+            {
+                send_to_core(id, (id + 1) % cores.size(), creq);
+                continue;
+            }
+            creq->done = true;
+            send_to_core(id, creq->from, creq);
+        }
+
+        // what did not fit the queue of the core before
+        std::deque<core_req_t *> &waiting = core->backlog[i];
+        if (!waiting.empty())
+        {
+            while (!waiting.empty() && cores[i]->inbox[id]->push(waiting.front()))
+                waiting.pop_front();
+            wake_core(cores[i]);
+            handled++;
+        }
+    }
+    return handled;
+}
+
+/**
+ * @brief hand a request or a response to a core
+ *
+ * @param[in] from The sending core
+ * @param[in] to The receiving core
+ * @param[in] creq The request
+ */
+void Server::send_to_core(int from, int to, core_req_t *creq)
+{
+    std::deque<core_req_t *> &waiting = cores[from]->backlog[to];
+    if (!waiting.empty() || !cores[to]->inbox[from]->push(creq))
+        waiting.push_back(creq);
+    wake_core(cores[to]);
+}
+
+/**
+ * @brief queue the response of a request read by a core on its
+ * connection, and keep the request for reuse
+ *
+ * @param[in] id The core
+ * @param[in] creq The request
+ */
+void Server::respond_from_core(int id, core_req_t *creq)
+{
+    append_msg(creq->conn->out, creq->resp, creq->value.data());
+    logger->display_msg("[Server] Sending Response", creq->resp);
+    free(creq->resp);
+    creq->resp = NULL;
+    cores[id]->spare.push_back(creq);
+}
+
+/**
+ * @brief stop the core threads once no connection is left,
+ * and free their stores
+ */
+void Server::stop_cores()
+{
+    stopping_cores = true;
+    uint64_t one = 1;
+    for (core_t *core : cores)
+        if (write(core->wakefd, &one, sizeof(one)) < 0)
+            perror("[Server] Couldn't wake up a core");
+
+    for (core_t *core : cores)
+    {
+        core->thread.join();
+        for (core_req_t *creq : core->spare)
+        {
+            free(creq->req);
+            free(creq->resp);
+            delete creq;
+        }
+        for (SpscQueue<core_req_t *> *queue : core->inbox)
+            delete queue;
+        close(core->epfd);
+        close(core->wakefd);
+        delete core->store;
+        delete core->leases;
+        delete core->sampler;
+        delete core;
+    }
+    cores.clear();
 }
 
 /**
  * @brief display the current kv store state
+ *
+ * @param[in] store The store to display
  */
-void Server::print_kv_state()
+void Server::print_kv_state(Store &store)
 {
-    kv_store_mutex.lock_shared(); // read
+    // walks the whole store, so only when someone reads it
+    if (!logger->enabled())
+        return;
     *logger << GREEN << "\n[Server] KV Store state so far:\n"
             << RESET;
-    for (std::pair<std::string, std::string> p : kv_store)
+    store.for_each([this](const std::string &key, const std::string &value)
+                   { *logger << "\t" << YELLOW << key << RESET
+                             << " -> " << YELLOW << value << RESET << "\n"; });
+}
+
+/**
+ * @brief display hit, miss and latency figures of the memory
+ * tier and the ext file tier of a store
+ */
+static void print_store_stats(const std::string &prompt, Store &store)
+{
+    store_stats_t st = store.stats();
+    const char *p = prompt.c_str();
+    printf("%s items %lu, evictions %lu, reclaimed after flush %lu, moved to ext file %lu, "
+           "rejected by admission %lu\n",
+           p, st.items, st.evictions, st.reclaimed, st.ext_flushes, st.admission_rejects);
+    printf("%s ram hits %lu (avg %lu ns, p99 <= %lu ns), "
+           "ext hits %lu (avg %lu ns, p99 <= %lu ns), misses %lu\n",
+           p, st.ram_hits, st.ram_avg_ns, st.ram_p99_ns,
+           st.ext_hits, st.ext_avg_ns, st.ext_p99_ns, st.misses);
+    if (st.ext_enabled)
+        printf("%s ext file: %lu of %lu pages free, %lu MB live, "
+               "%lu MB written, %lu pages compacted\n",
+               p, st.ext.free_pages, st.ext.pages, st.ext.live_bytes >> 20,
+               st.ext.bytes_written >> 20, st.ext.pages_compacted);
+}
+
+/**
+ * @brief display hit, miss and latency figures of the
+ * memory tier and the ext file tier of the store, the
+ * leases handed out, and the sampled top keys and key/value
+ * sizes
+ */
+void Server::print_stats()
+{
+    lease_stats_t ls = leases->stats();
+    if (cores.empty())
+        print_store_stats("[Server]", kv_store);
+
+    // the cores keep serving while their figures are read, so
+    // these may lag behind a little
+    for (size_t i = 0; i < cores.size(); i++)
     {
-        *logger << "\t" << YELLOW << p.first << RESET
-                << " -> " << YELLOW << p.second << RESET << "\n";
+        print_store_stats("[Server] core " + std::to_string(i) + ":", *cores[i]->store);
+        lease_stats_t core_ls = cores[i]->leases->stats();
+        ls.granted += core_ls.granted;
+        ls.waits += core_ls.waits;
+        ls.stale_hits += core_ls.stale_hits;
+        ls.rejected_puts += core_ls.rejected_puts;
     }
-    kv_store_mutex.unlock_shared();
+    printf("[Server] leases granted %lu, waits %lu, stale hits %lu, rejected puts %lu\n",
+           ls.granted, ls.waits, ls.stale_hits, ls.rejected_puts);
+    printf("%s", key_report().c_str());
 }
 
 /**
@@ -122,5 +1217,92 @@ void Server::print_kv_state()
  */
 void Server::close_server()
 {
-    close(listenfd);
+    if (closing.exchange(true))
+        return;
+
+    // wakes up the threads blocked in accept(), and only closes
+    // the descriptors once those threads can no longer use them
+    for (int listenfd : listenfds)
+        shutdown(listenfd, SHUT_RDWR);
+    for (std::thread &th : serve_threads)
+        th.join();
+    if (!cores.empty())
+    {
+        uint64_t one = 1;
+        for (core_t *core : cores)
+            if (write(core->wakefd, &one, sizeof(one)) < 0)
+                perror("[Server] Couldn't wake up a core");
+        std::unique_lock<std::mutex> lock(conns_mutex);
+        conns_cv.wait(lock, [this]()
+                      { return listening_cores == 0; });
+    }
+    for (int listenfd : listenfds)
+        close(listenfd);
+    if (!opts.unix_path.empty())
+        unlink(opts.unix_path.c_str());
+
+    save_snapshot();
+    snapshot_mutex.lock();
+    closed = true;
+    snapshot_mutex.unlock();
+    snapshot_cv.notify_all();
+    if (snapshot_thread.joinable())
+        snapshot_thread.join();
+    kv_store.detach();
+}
+
+/**
+ * @brief Write a snapshot of the store to the configured
+ * snapshot file without pausing request processing
+ *
+ * @return number of items written, -1 if snapshots are
+ * disabled or the snapshot failed
+ */
+long Server::save_snapshot()
+{
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    if (opts.snapshot_path.empty() || closed)
+        return -1;
+
+    long items = kv_store.save_snapshot(opts.snapshot_path);
+    if (items >= 0)
+    {
+        *logger << GREEN << "\n[Server] Wrote " << std::to_string(items)
+                << " items to snapshot " << opts.snapshot_path << "\n"
+                << RESET;
+    }
+    return items;
+}
+
+/**
+ * @brief warm-start the store from the snapshot file, if any
+ */
+void Server::load_snapshot()
+{
+    snapshot_stats_t stats;
+    if (opts.snapshot_path.empty() ||
+        !kv_store.load_snapshot(opts.snapshot_path, opts.load_threads, &stats))
+        return;
+
+    double gb = stats.bytes / 1e9;
+    printf("[Server] Loaded %zu items (%.1f MB) from snapshot in %.3f s (%.2f s/GB)\n",
+           stats.items, stats.bytes / 1e6, stats.seconds,
+           gb > 0 ? stats.seconds / gb : 0);
+}
+
+/**
+ * @brief write a snapshot every `opts.snapshot_interval`
+ * seconds until the server is closed
+ */
+void Server::snapshot_periodically()
+{
+    std::unique_lock<std::mutex> lock(snapshot_mutex);
+    while (!snapshot_cv.wait_for(lock, std::chrono::seconds(opts.snapshot_interval),
+                                 [this]()
+                                 { return closed; }))
+    {
+        lock.unlock();
+        save_snapshot();
+        lock.lock();
+    }
 }
\ No newline at end of file
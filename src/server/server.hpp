@@ -12,8 +12,156 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <shared_mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "../utils/logger.hpp"
+#include "../store/store.hpp"
+#include "../utils/conn.hpp"
+#include "../utils/spscqueue.hpp"
+#include "keysampler.hpp"
+#include "leases.hpp"
+
+/* Requests and responses a core can have queued to each other core,
+ * more wait on the sending core until there is room */
+#define CORE_QUEUE_LEN 1024
+
+/* Idle rounds a core polls its queues and connections before it
+ * sleeps. Cores on a single CPU do not poll. */
+#define CORE_POLL_ROUNDS 64
+
+/* Bytes a core reads from a connection at a time, and most reads
+ * of one connection per wake up */
+#define CORE_READ_CHUNK (64 * 1024)
+#define CORE_READ_ROUNDS 16
+
+/* Bytes of responses a client has not taken yet past which its
+ * core stops reading its requests until it catches up */
+#define CORE_OUT_MAX (4 << 20)
+
+/* Gets a connection sent back to back that are looked up in the
+ * store together */
+#define SERVER_GET_BATCH 64
+
+/**
+ * @brief Optional server settings
+ */
+struct server_opts_t
+{
+    /* Memory limit of the store, the segment file that lets
+     * a restarted server attach to the items of its predecessor,
+     * and the ext file that evicted values are moved to */
+    store_opts_t store;
+
+    /* File the store is snapshotted to and warm-started from,
+     * snapshots are disabled if empty */
+    std::string snapshot_path = "";
+
+    /* Seconds between periodic snapshots, 0 for on-demand only */
+    unsigned int snapshot_interval = 0;
+
+    /* Threads used to bulk load the snapshot at startup */
+    unsigned int load_threads = 4;
+
+    /* Longest value accepted in a put request */
+    size_t max_value_bytes = MAX_STREAM_VSIZE;
+
+    /* Milliseconds a lease handed out on a miss stays valid
+     * if the client holding it does not fill the key */
+    unsigned int lease_ms = 1000;
+
+    /* Numeric IPv4 or IPv6 address the server listens on, e.g.
+     * "0.0.0.0" or "::" for every interface */
+    std::string bind_addr = LOCALHOST;
+
+    /* File of a Unix domain socket the server listens on instead
+     * of TCP, for clients on the same host */
+    std::string unix_path = "";
+
+    /* Threads accepting connections. Over TCP each one has its own
+     * socket bound with SO_REUSEPORT, and the kernel spreads new
+     * connections over them. A Unix domain socket is shared. */
+    unsigned int listeners = 1;
+
+    /* Pin the n-th accepting thread, and the threads serving the
+     * connections it accepts, to the n-th CPU the server may use */
+    bool pin_cpus = false;
+
+    /* Threads that each own a store holding a share of the keys, 0
+     * for one locked store shared by a thread per connection. Each
+     * core thread accepts and serves its own connections, and hands
+     * requests for keys of other cores to them through queues. The
+     * memory limit is split between the cores and `listeners` is
+     * ignored. Snapshots and the ext file are not used. */
+    unsigned int cores = 0;
+};
+
+/**
+ * @brief A connection served by a core. Its socket never blocks:
+ * bytes are read into `in` as they arrive and requests are taken
+ * from there once whole, responses wait in `out` until the socket
+ * takes them.
+ */
+struct core_conn_t
+{
+    int fd;
+    std::string in;
+    size_t in_off = 0;  // start of the bytes not taken yet
+    size_t skip = 0;    // bytes of a value over the limit still to drop
+    std::string out;
+    size_t out_off = 0; // start of the bytes not sent yet
+    uint32_t events = 0; // watched for, 0 if not in the epoll set
+    bool busy = false;   // a request is with another core
+    bool closed = false; // dropped once no request is with another core
+};
+
+/**
+ * @brief A request read by one core, handed to the core owning its
+ * key and back with the response
+ */
+struct core_req_t
+{
+    msg_t *req;
+    std::string req_value;
+    bool too_large;
+    msg_t *resp;
+    std::string value; // of the response
+    core_conn_t *conn;
+    int from;          // core serving the connection
+    unsigned int hops; // cores a flush went through
+    bool done;         // the response is set
+};
+
+/**
+ * @brief State of a core thread. Only the queues and `sleeping`
+ * are touched by other cores.
+ */
+struct core_t
+{
+    Store *store;
+    LeaseTable *leases;
+    KeySampler *sampler;
+    int epfd;
+    int wakefd; // written to wake up the core
+    int listenfd;
+    std::atomic<bool> sleeping;
+
+    // requests and responses from each core, and those for each
+    // core that did not fit its queue yet
+    std::vector<SpscQueue<core_req_t *> *> inbox;
+    std::vector<std::deque<core_req_t *>> backlog;
+
+    // requests this core read, reused once they came back
+    std::vector<core_req_t *> spare;
+
+    // the connections of the core by descriptor
+    std::unordered_map<int, core_conn_t *> conns;
+    std::thread thread;
+};
 
 /**
  * @brief Represents a single server
@@ -23,29 +171,91 @@ class Server
 public:
     /**
      * The constructor should start a new server
-     * @param[in] port the localhost port where server should be started
+     * @param[in] port the port where server should be started, on
+     * `opts.bind_addr` unless `opts.unix_path` is set
      * @param[in] print_logs Indicates if logs should be printed
      * to console
+     * @param[in] opts Optional server settings. If the store could
+     * not attach to an existing segment file and a snapshot file
+     * exists at `opts.snapshot_path`, the snapshot is loaded before
+     * clients are accepted.
+     */
+    Server(int port, bool print_logs, server_opts_t opts = server_opts_t());
+
+    /**
+     * @brief closes the server if that was not done yet, and
+     * waits for the connections still served to be shut down
      */
-    Server(int port, bool print_logs);
+    ~Server();
 
     /**
      * @brief Server cannot accept new clients after this call
      * Connected clients will be served until they disconnect.
+     * A final snapshot is written if snapshots are enabled, and
+     * the store is detached from its segment file, if any.
      */
     void close_server();
 
+    /**
+     * @brief Write a snapshot of the store to the configured
+     * snapshot file without pausing request processing
+     *
+     * @return number of items written, -1 if snapshots are
+     * disabled or the snapshot failed
+     */
+    long save_snapshot();
+
+    /**
+     * @brief display hit, miss and latency figures of the
+     * memory tier and the ext file tier of the store, the
+     * leases handed out, and the sampled top keys and key/value
+     * sizes
+     */
+    void print_stats();
+
 private:
-    int listenfd;
-    std::shared_mutex kv_store_mutex;
-    std::unordered_map<std::string, std::string> kv_store;
+    std::vector<int> listenfds;
+    Store kv_store;
     Logger *logger;
+    KeySampler *key_sampler;
+    LeaseTable *leases;
+    server_opts_t opts;
+
+    std::vector<std::thread> serve_threads;
+    std::thread snapshot_thread;
+    std::atomic<bool> closing;
+
+    // serializes snapshot writers
+    std::mutex snapshot_mutex;
+    std::condition_variable snapshot_cv;
+    bool closed;
+
+    // connections being served, so none outlives the server
+    std::mutex conns_mutex;
+    std::condition_variable conns_cv;
+    std::unordered_set<int> conns;
+
+    // a store per core, empty if the shared one is used
+    std::vector<core_t *> cores;
+    unsigned int listening_cores; // guarded by `conns_mutex`
+    std::atomic<bool> stopping_cores;
+
+    /**
+     * @brief open the listener sockets and start a thread accepting
+     * connections from each
+     *
+     * @param[in] port The port to listen on
+     */
+    void start_listeners(int port);
 
     /**
      * @brief continuously and sequentially keep accepting connections
      * serving requests
+     *
+     * @param[in] listenfd The socket to accept connections from
+     * @param[in] cpu The CPU to run on, -1 for any
      */
-    void accept_and_serve_forever();
+    void accept_and_serve_forever(int listenfd, int cpu);
 
     /**
      * @brief process requests received from the client
@@ -54,9 +264,177 @@ private:
      */
     void process_requests(int connfd);
 
+    /**
+     * @brief apply a request to a store and build the response
+     *
+     * @param[in] req_msg The request
+     * @param[in] req_value The value of the request
+     * @param[in] too_large Indicates if the value was over the
+     * limit and dropped
+     * @param[in] store The store holding the key
+     * @param[in] lease_table The leases of the keys of `store`
+     * @param[in] sampler The sampler of the requests to `store`
+     * @param[out] value Location of the value of the response
+     *
+     * @return the response
+     */
+    msg_t *execute(msg_t *req_msg, const std::string &req_value, bool too_large,
+                   Store &store, LeaseTable &lease_table, KeySampler &sampler,
+                   std::string &value);
+
+    /**
+     * @brief the report of the sampled keys and sizes, over the
+     * samplers of all cores if each core has its own
+     *
+     * @return the report
+     */
+    std::string key_report();
+
+    /**
+     * @brief answer a get together with the gets the client sent
+     * right behind it, looking them up with `Store::get_batch()`.
+     * Reading stops at the first other request, which is left in
+     * `req_msg` with its value not read yet.
+     *
+     * @param[in] connfd the fd to communicate with client
+     * @param[in,out] req_msg The get, then the request reading
+     * stopped at
+     *
+     * @return 1 if a request was left in `req_msg`, 0 if not, -1 if
+     * the client went away
+     */
+    int serve_gets(int connfd, msg_t *req_msg);
+
+    /**
+     * @brief send a `resp_scan_item_t` message for every key of the
+     * store on an arc of the ring, see `create_scan_msg()`. The keys
+     * of a shard are gathered under its lock and sent after it was
+     * released.
+     *
+     * @param[in] connfd the fd to communicate with client
+     * @param[in] lo The start of the arc, not included
+     * @param[in] hi The end of the arc
+     *
+     * @return the number of keys sent, -1 if the client went away
+     */
+    long send_range(int connfd, uint32_t lo, uint32_t hi);
+
+    /**
+     * @brief create a store, a listener socket and a thread for
+     * each core
+     *
+     * @param[in] port The port to listen on
+     */
+    void start_cores(int port);
+
+    /**
+     * @brief accept and serve the connections of a core, and the
+     * requests other cores hand to it, until the cores are stopped
+     *
+     * @param[in] id The core
+     * @param[in] cpu The CPU to run on, -1 for any
+     */
+    void serve_core(int id, int cpu);
+
+    /**
+     * @brief start serving a connection accepted by a core
+     *
+     * @param[in] id The core
+     * @param[in] connfd The connection
+     */
+    void add_core_conn(int id, int connfd);
+
+    /**
+     * @brief take the requests a core connection received whole,
+     * one at a time while none is with another core, and execute
+     * each there or hand it to the core owning its key. Then send
+     * what the socket takes of the responses, and watch the socket
+     * for what the connection waits for.
+     *
+     * @param[in] id The core
+     * @param[in] conn The connection
+     */
+    void serve_core_conn(int id, core_conn_t *conn);
+
+    /**
+     * @brief take the next request of a core connection from the
+     * bytes read so far, with its value
+     *
+     * @param[in] conn The connection
+     * @param[out] creq Location where the request is stored
+     *
+     * @return 1 if a request was taken, 0 if it was not received
+     * whole yet, -1 if it is malformed
+     */
+    int take_core_request(core_conn_t *conn, core_req_t *creq);
+
+    /**
+     * @brief execute a request a core read, or hand it to the core
+     * owning its key
+     *
+     * @param[in] id The core
+     * @param[in] creq The request
+     */
+    void dispatch_core_request(int id, core_req_t *creq);
+
+    /**
+     * @brief stop serving a core connection and close it
+     *
+     * @param[in] id The core
+     * @param[in] conn The connection
+     */
+    void close_core_conn(int id, core_conn_t *conn);
+
+    /**
+     * @brief execute the requests and send the responses other
+     * cores handed to a core
+     *
+     * @param[in] id The core
+     *
+     * @return the number of requests and responses handled
+     */
+    int drain_core_inbox(int id);
+
+    /**
+     * @brief hand a request or a response to a core
+     *
+     * @param[in] from The sending core
+     * @param[in] to The receiving core
+     * @param[in] creq The request
+     */
+    void send_to_core(int from, int to, core_req_t *creq);
+
+    /**
+     * @brief queue the response of a request read by a core on its
+     * connection, and keep the request for reuse
+     *
+     * @param[in] id The core
+     * @param[in] creq The request
+     */
+    void respond_from_core(int id, core_req_t *creq);
+
+    /**
+     * @brief stop the core threads once no connection is left,
+     * and free their stores
+     */
+    void stop_cores();
+
     /**
      * @brief display the current kv store state
+     *
+     * @param[in] store The store to display
+     */
+    void print_kv_state(Store &store);
+
+    /**
+     * @brief warm-start the store from the snapshot file, if any
+     */
+    void load_snapshot();
+
+    /**
+     * @brief write a snapshot every `opts.snapshot_interval`
+     * seconds until the server is closed
      */
-    void print_kv_state();
+    void snapshot_periodically();
 };
 #endif
\ No newline at end of file
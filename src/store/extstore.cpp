@@ -0,0 +1,342 @@
+/**
+ * @file /src/store/extstore.cpp
+ *
+ * @brief This file contains the implementation of the `ExtStore`
+ * class declared in /src/store/extstore.hpp
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include "extstore.hpp"
+
+/* Pages are compacted once fewer than this share of them is free */
+#define EXT_COMPACT_FREE_RATIO 0.1
+
+/* Pages with a smaller share of live bytes are compacted */
+#define EXT_COMPACT_LIVE_RATIO 0.5
+
+/**
+ * @brief record one sample
+ */
+void latency_hist_t::record(uint64_t ns)
+{
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    buckets[b < 32 ? b : 31].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+/**
+ * @brief upper bound of the bucket holding the given percentile
+ */
+uint64_t latency_hist_t::percentile(double p)
+{
+    uint64_t n = count.load(), seen = 0;
+    for (int b = 0; b < 32 && n; b++)
+    {
+        seen += buckets[b].load();
+        if (seen >= p * n)
+            return 1ULL << b;
+    }
+    return 0;
+}
+
+/**
+ * @brief Open (and truncate) the ext file and start the
+ * thread that writes out full page buffers
+ *
+ * @param[in] path The ext file
+ * @param[in] bytes Size of the ext file
+ */
+ExtStore::ExtStore(const std::string &path, size_t bytes)
+{
+    open_page = -1;
+    stopping = false;
+    bytes_written = objects_written = pages_compacted = 0;
+
+    // nothing in memory refers to previous contents
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        perror("[ExtStore] Couldn't open ext file");
+        return;
+    }
+
+    pages.resize(bytes / EXT_PAGE_BYTES);
+    for (uint32_t i = pages.size(); i > 0; i--)
+    {
+        pages[i - 1] = {page_free, 0, 0, 0, NULL};
+        free_pages.push_back(i - 1);
+    }
+    writer = std::thread(&ExtStore::write_pages, this);
+}
+
+/**
+ * @brief Stop the writer thread and close the file
+ */
+ExtStore::~ExtStore()
+{
+    if (fd < 0)
+        return;
+
+    mutex.lock();
+    stopping = true;
+    mutex.unlock();
+    flush_cv.notify_all();
+    writer.join();
+
+    for (page_t &p : pages)
+        free(p.buf);
+    close(fd);
+}
+
+/**
+ * @brief Indicates if the file could be opened
+ */
+bool ExtStore::ok()
+{
+    return fd >= 0;
+}
+
+/**
+ * @brief queue the open page for writing, the mutex
+ * must be held
+ */
+void ExtStore::seal_open_page()
+{
+    if (open_page < 0)
+        return;
+    pages[open_page].state = page_flushing;
+    flush_queue.push_back(open_page);
+    open_page = -1;
+    flush_cv.notify_one();
+}
+
+/**
+ * @brief Append an object to the open page. The call only
+ * copies into memory, the page is written out later.
+ *
+ * @param[in] key The key of the item
+ * @param[in] klen Length of the key
+ * @param[in] value The value to write
+ * @param[in] vlen Length of the value
+ * @param[out] ptr Location of the object
+ *
+ * @return true if appended, false if no page is free
+ */
+bool ExtStore::append(const char *key, uint16_t klen, const char *value,
+                      uint32_t vlen, ext_ptr_t *ptr)
+{
+    uint64_t len = ext_obj_size(klen, vlen);
+    if (fd < 0 || len > EXT_PAGE_BYTES)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (open_page >= 0 && pages[open_page].used + len > EXT_PAGE_BYTES)
+        seal_open_page();
+
+    if (open_page < 0)
+    {
+        if (free_pages.empty())
+            return false;
+        open_page = free_pages.back();
+        free_pages.pop_back();
+        page_t &p = pages[open_page];
+        p.state = page_open;
+        p.used = p.live = 0;
+        p.buf = (char *)malloc(EXT_PAGE_BYTES);
+    }
+
+    page_t &p = pages[open_page];
+    ext_obj_t obj = {klen, 0, vlen};
+    memcpy(p.buf + p.used, &obj, sizeof(obj));
+    memcpy(p.buf + p.used + sizeof(obj), key, klen);
+    memcpy(p.buf + p.used + sizeof(obj) + klen, value, vlen);
+
+    *ptr = {(uint32_t)open_page, p.version, p.used, (uint32_t)len};
+    p.used += len;
+    p.live += len;
+    objects_written++;
+    return true;
+}
+
+/**
+ * @brief Read the value of an object, either from a page
+ * buffer that is not written out yet or with pread()
+ *
+ * @param[in] ptr Location of the object
+ * @param[out] value Location where the value is copied
+ *
+ * @return true if read, false if the page was reused since
+ */
+bool ExtStore::read(const ext_ptr_t &ptr, std::string &value)
+{
+    std::string buf;
+    const char *obj_p;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        page_t &p = pages[ptr.page];
+        if (p.version != ptr.version || p.state == page_free)
+            return false;
+        if (p.buf)
+        {
+            ext_obj_t *obj = (ext_obj_t *)(p.buf + ptr.offset);
+            value.assign(p.buf + ptr.offset + sizeof(*obj) + obj->klen, obj->vlen);
+            return true;
+        }
+    }
+
+    buf.resize(ptr.len);
+    off_t off = (off_t)ptr.page * EXT_PAGE_BYTES + ptr.offset;
+    if (pread(fd, &buf[0], ptr.len, off) != (ssize_t)ptr.len)
+        return false;
+
+    // the page may have been compacted and reused while reading
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pages[ptr.page].version != ptr.version)
+        return false;
+
+    obj_p = buf.data();
+    ext_obj_t *obj = (ext_obj_t *)obj_p;
+    if (sizeof(*obj) + obj->klen + obj->vlen > ptr.len)
+        return false;
+    value.assign(obj_p + sizeof(*obj) + obj->klen, obj->vlen);
+    return true;
+}
+
+/**
+ * @brief Mark an object dead, once no item refers to it
+ *
+ * @param[in] ptr Location of the object
+ */
+void ExtStore::release(const ext_ptr_t &ptr)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    page_t &p = pages[ptr.page];
+    if (p.version == ptr.version && p.live >= ptr.len)
+        p.live -= ptr.len;
+}
+
+/**
+ * @brief Pick the written page with the smallest share of
+ * live bytes, if free pages are scarce and that share is low
+ *
+ * @return the page number, -1 if no page needs compaction
+ */
+int ExtStore::compaction_candidate()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_pages.size() >= pages.size() * EXT_COMPACT_FREE_RATIO + 1)
+        return -1;
+
+    int best = -1;
+    double best_ratio = EXT_COMPACT_LIVE_RATIO;
+    for (uint32_t i = 0; i < pages.size(); i++)
+    {
+        if (pages[i].state != page_on_disk)
+            continue;
+        double ratio = (double)pages[i].live / pages[i].used;
+        if (ratio < best_ratio)
+        {
+            best = i;
+            best_ratio = ratio;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Read a whole written page
+ *
+ * @param[in] page The page number
+ * @param[out] buf Location where the page is copied
+ * @param[out] version Version of the page that was read
+ * @param[out] used Bytes of the page holding objects
+ *
+ * @return true if read, else false
+ */
+bool ExtStore::read_page(uint32_t page, std::string &buf, uint32_t *version,
+                         uint32_t *used)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pages[page].state != page_on_disk)
+            return false;
+        *version = pages[page].version;
+        *used = pages[page].used;
+    }
+    buf.resize(*used);
+    return pread(fd, &buf[0], *used, (off_t)page * EXT_PAGE_BYTES) == (ssize_t)*used;
+}
+
+/**
+ * @brief Return a page to the free pages once it has no
+ * live bytes left
+ *
+ * @param[in] page The page number
+ */
+void ExtStore::reclaim(uint32_t page)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    page_t &p = pages[page];
+    if (p.state != page_on_disk || p.live > 0)
+        return;
+    p.state = page_free;
+    p.version++;
+    p.used = 0;
+    free_pages.push_back(page);
+    pages_compacted++;
+}
+
+/**
+ * @brief Current figures of the ext file
+ */
+ext_stats_t ExtStore::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ext_stats_t st = {pages.size(), free_pages.size(), 0,
+                      bytes_written, objects_written, pages_compacted};
+    for (page_t &p : pages)
+        st.live_bytes += p.live;
+    return st;
+}
+
+/**
+ * @brief write out full page buffers until stopped
+ */
+void ExtStore::write_pages()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        flush_cv.wait(lock, [this]()
+                      { return stopping || !flush_queue.empty(); });
+        if (stopping)
+            return;
+
+        uint32_t page = flush_queue.front();
+        flush_queue.pop_front();
+        char *buf = pages[page].buf;
+        uint32_t used = pages[page].used;
+
+        // readers keep using the buffer until it is on disk
+        lock.unlock();
+        ssize_t n = pwrite(fd, buf, used, (off_t)page * EXT_PAGE_BYTES);
+        lock.lock();
+
+        if (n != (ssize_t)used)
+        {
+            // the page stays readable from memory, try again later
+            perror("[ExtStore] Couldn't write page");
+            flush_queue.push_back(page);
+            flush_cv.wait_for(lock, std::chrono::seconds(1), [this]()
+                              { return stopping; });
+            continue;
+        }
+        pages[page].state = page_on_disk;
+        pages[page].buf = NULL;
+        bytes_written += used;
+        free(buf);
+    }
+}
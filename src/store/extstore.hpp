@@ -0,0 +1,233 @@
+/**
+ * @file /src/store/extstore.hpp
+ *
+ * @brief This file contains the declaration of the `ExtStore` class,
+ * the second tier of the store. Values evicted from memory are
+ * appended to a large local file, so only their key and an
+ * `ext_ptr_t` have to stay in memory.
+ *
+ * The file is split into pages of `EXT_PAGE_BYTES`. Objects are
+ * appended to an in-memory buffer of the open page, and full buffers
+ * are written out by a background thread. Every page counts the
+ * bytes still referenced by items, so mostly dead pages can be
+ * compacted and reused. A page gets a new version when it is reused,
+ * which invalidates pointers into its previous contents.
+ *
+ * The implementation is present in /src/store/extstore.cpp
+ */
+
+#ifndef EXTSTORE_H
+#define EXTSTORE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define EXT_PAGE_BYTES (1 << 20)
+
+/**
+ * @brief Location of a value in the ext file
+ */
+struct ext_ptr_t
+{
+    uint32_t page;
+    uint32_t version; // version of the page when the value was written
+    uint32_t offset;  // of the object within the page
+    uint32_t len;     // bytes the object takes in the page
+};
+
+/**
+ * @brief Header of an object in the ext file, followed by `klen`
+ * bytes of key and `vlen` bytes of value, padded to 8 bytes. The key
+ * lets the compactor find the item that refers to the object.
+ */
+struct ext_obj_t
+{
+    uint16_t klen;
+    uint16_t pad;
+    uint32_t vlen;
+};
+
+/**
+ * @brief Size an object takes in a page
+ */
+static inline uint32_t ext_obj_size(uint32_t klen, uint32_t vlen)
+{
+    return (sizeof(ext_obj_t) + klen + vlen + 7) & ~(uint32_t)7;
+}
+
+/**
+ * @brief A read latency histogram with power of two buckets
+ */
+struct latency_hist_t
+{
+    std::atomic<uint64_t> buckets[32] = {};
+    std::atomic<uint64_t> count = {0};
+    std::atomic<uint64_t> total_ns = {0};
+
+    /**
+     * @brief record one sample
+     */
+    void record(uint64_t ns);
+
+    /**
+     * @brief upper bound of the bucket holding the given percentile
+     */
+    uint64_t percentile(double p);
+};
+
+/**
+ * @brief Figures describing the ext file
+ */
+struct ext_stats_t
+{
+    uint64_t pages;
+    uint64_t free_pages;
+    uint64_t live_bytes;
+    uint64_t bytes_written;
+    uint64_t objects_written;
+    uint64_t pages_compacted;
+};
+
+/**
+ * @brief The flash tier, an append-only file of pages
+ */
+class ExtStore
+{
+public:
+    /**
+     * @brief Open (and truncate) the ext file and start the
+     * thread that writes out full page buffers
+     *
+     * @param[in] path The ext file
+     * @param[in] bytes Size of the ext file
+     */
+    ExtStore(const std::string &path, size_t bytes);
+
+    /**
+     * @brief Stop the writer thread and close the file
+     */
+    ~ExtStore();
+
+    /**
+     * @brief Indicates if the file could be opened
+     */
+    bool ok();
+
+    /**
+     * @brief Append an object to the open page. The call only
+     * copies into memory, the page is written out later.
+     *
+     * @param[in] key The key of the item
+     * @param[in] klen Length of the key
+     * @param[in] value The value to write
+     * @param[in] vlen Length of the value
+     * @param[out] ptr Location of the object
+     *
+     * @return true if appended, false if no page is free
+     */
+    bool append(const char *key, uint16_t klen, const char *value,
+                uint32_t vlen, ext_ptr_t *ptr);
+
+    /**
+     * @brief Read the value of an object, either from a page
+     * buffer that is not written out yet or with pread()
+     *
+     * @param[in] ptr Location of the object
+     * @param[out] value Location where the value is copied
+     *
+     * @return true if read, false if the page was reused since
+     */
+    bool read(const ext_ptr_t &ptr, std::string &value);
+
+    /**
+     * @brief Mark an object dead, once no item refers to it
+     *
+     * @param[in] ptr Location of the object
+     */
+    void release(const ext_ptr_t &ptr);
+
+    /**
+     * @brief Pick the written page with the smallest share of
+     * live bytes, if free pages are scarce and that share is low
+     *
+     * @return the page number, -1 if no page needs compaction
+     */
+    int compaction_candidate();
+
+    /**
+     * @brief Read a whole written page
+     *
+     * @param[in] page The page number
+     * @param[out] buf Location where the page is copied
+     * @param[out] version Version of the page that was read
+     * @param[out] used Bytes of the page holding objects
+     *
+     * @return true if read, else false
+     */
+    bool read_page(uint32_t page, std::string &buf, uint32_t *version,
+                   uint32_t *used);
+
+    /**
+     * @brief Return a page to the free pages once it has no
+     * live bytes left
+     *
+     * @param[in] page The page number
+     */
+    void reclaim(uint32_t page);
+
+    /**
+     * @brief Current figures of the ext file
+     */
+    ext_stats_t stats();
+
+private:
+    enum page_state_t
+    {
+        page_free,
+        page_open,    // being appended to in memory
+        page_flushing, // full, waiting for the writer thread
+        page_on_disk,
+    };
+
+    struct page_t
+    {
+        page_state_t state;
+        uint32_t version;
+        uint32_t used;
+        uint32_t live;
+        char *buf; // contents while not on disk
+    };
+
+    int fd;
+    std::mutex mutex;
+    std::condition_variable flush_cv;
+    std::vector<page_t> pages;
+    std::vector<uint32_t> free_pages;
+    std::deque<uint32_t> flush_queue;
+    int open_page;
+    bool stopping;
+    std::thread writer;
+
+    uint64_t bytes_written;
+    uint64_t objects_written;
+    uint64_t pages_compacted;
+
+    /**
+     * @brief write out full page buffers until stopped
+     */
+    void write_pages();
+
+    /**
+     * @brief queue the open page for writing, the mutex
+     * must be held
+     */
+    void seal_open_page();
+};
+
+#endif
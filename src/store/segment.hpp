@@ -0,0 +1,186 @@
+/**
+ * @file /src/store/segment.hpp
+ *
+ * @brief Memory layout of the segment that holds all items of a
+ * `Store`. The segment is either anonymous memory or a shared file
+ * mapping that a restarted server can attach to again. All links
+ * inside the segment are byte offsets from its start, never
+ * pointers, so the segment may be mapped at any address.
+ *
+ *  +----------------+---------+---------+-----
+ *  | segment header | shard 0 | shard 1 | ...
+ *  +----------------+---------+---------+-----
+ *
+ * Every shard region starts with a shard header, followed by the
+ * hash bucket array reserved for its largest size, followed by the
+ * item memory. The table grows a few buckets at a time as in linear
+ * hashing: the next buckets in line hand the items that belong to new
+ * buckets at the end over to them, so no insertion ever rehashes the
+ * whole table. Buckets and the links between items are 32 bit
+ * references, offsets divided by `SLAB_ALIGN`, so every item
+ * header and bucket stays small; a segment is then limited to
+ * `SEGMENT_BYTES_MAX`. Item memory is handed out in chunks of fixed size
+ * classes, each class keeps its own free list and LRU list.
+ * Values too large for the largest class are split over a chain of
+ * chunks of that class. With admission enabled, new items first
+ * wait on a small window list of their class before they compete
+ * for a place on its LRU list. Chunks follow each other without
+ * gaps up to `top`, and each one starts with a header giving its
+ * class, so the chunks after any item can be walked to hand their
+ * memory to another class.
+ *
+ * Offset 0 is the segment header, so it doubles as the null offset.
+ */
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <stdint.h>
+
+#define SEGMENT_MAGIC "MCMSEG"
+
+/* Bump whenever any struct in this file changes */
+#define SEGMENT_VERSION 10
+
+#define SEGMENT_HEADER_SIZE 4096
+
+/* Chunk sizes start at `SLAB_CHUNK_MIN` and grow by `SLAB_FACTOR`
+ * until `SLAB_CHUNK_MAX` is reached. The small factor wastes less
+ * of each chunk on items of a few dozen bytes. */
+#define SLAB_CHUNK_MIN 64
+#define SLAB_CHUNK_MAX 16384
+#define SLAB_FACTOR 1.15
+#define SLAB_CLASSES_MAX 48
+#define SLAB_ALIGN 8
+
+/* Largest segment the 32 bit references can address */
+#define SEGMENT_BYTES_MAX ((uint64_t)UINT32_MAX * SLAB_ALIGN)
+
+/* Longest key an item can hold */
+#define ITEM_KEY_MAX 255
+
+/* Expected average chunk size, used to size the bucket array */
+#define SLAB_CHUNK_AVG 128
+
+/* Number of buckets a shard starts out with */
+#define BUCKETS_INITIAL 1024
+
+/* Items with this flag were read since they were last
+ * considered for eviction */
+#define ITEM_ACTIVE 1
+
+/* The value of items with this flag was moved to the ext file,
+ * the key is followed by an `ext_ptr_t` instead */
+#define ITEM_EXT 2
+
+/* The value of items with this flag does not fit one chunk. The key
+ * is followed by the offset of the next chunk and the start of the
+ * value. Every further chunk is an `item_t` holding `vlen` bytes of
+ * the value in `data`, linked to the next one through `h_next`. */
+#define ITEM_CHAINED 4
+
+/* Items with this flag are new and still on the window list of their
+ * class, they have not been admitted to its LRU list yet */
+#define ITEM_WINDOW 8
+
+/* Chunks with this flag are on the free list of their class */
+#define ITEM_FREE 16
+
+/* Chunks with this flag hold part of a chained value, `prev` refers
+ * to the item the value belongs to */
+#define ITEM_CHUNK 32
+
+/* Items with this flag are being written and not linked yet */
+#define ITEM_NEW 64
+
+/**
+ * @brief Reference to an item, 0 for none
+ */
+typedef uint32_t item_ref_t;
+
+/**
+ * @brief the reference to the item at an offset
+ */
+static inline item_ref_t ref_of(uint64_t off)
+{
+    return (item_ref_t)(off / SLAB_ALIGN);
+}
+
+/**
+ * @brief the offset of the item a reference points to
+ */
+static inline uint64_t off_of(item_ref_t ref)
+{
+    return (uint64_t)ref * SLAB_ALIGN;
+}
+
+/**
+ * @brief Header at the start of the segment
+ */
+struct seg_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nshards;
+    uint64_t seg_bytes;
+    uint64_t shard_bytes;
+    uint32_t nclasses;
+    uint32_t class_size[SLAB_CLASSES_MAX];
+
+    /* set when the owning process detached cleanly, cleared
+     * while a process is attached */
+    uint32_t clean;
+
+    /* bumped by every flush, items written in an earlier
+     * epoch are dead and read as misses until reclaimed */
+    uint32_t epoch;
+};
+
+/**
+ * @brief Header at the start of every shard region
+ */
+struct shard_header_t
+{
+    uint64_t buckets;     // offset of the `item_ref_t` bucket array
+    uint64_t nbuckets;    // buckets in use
+    uint64_t bucket_mask; // twice the largest power of two <= nbuckets, minus 1
+    uint64_t nbuckets_max;
+    uint64_t items;
+    uint64_t top;         // start of memory never handed out
+    uint64_t end;         // end of the shard region
+    uint64_t evictions;
+    uint64_t ext_flushes; // items whose value was moved to the ext file
+    uint64_t ext_split_bytes; // chunks split into ext item headers
+    uint64_t next_cas;    // versions handed out by this shard
+    uint64_t free_list[SLAB_CLASSES_MAX];
+    uint64_t lru_head[SLAB_CLASSES_MAX]; // most recently used
+    uint64_t lru_tail[SLAB_CLASSES_MAX]; // eviction candidate
+    uint64_t window_head[SLAB_CLASSES_MAX]; // newest item not admitted yet
+    uint64_t window_tail[SLAB_CLASSES_MAX]; // next admission candidate
+    uint64_t window_items[SLAB_CLASSES_MAX];
+    uint64_t class_items[SLAB_CLASSES_MAX]; // on either list
+    uint64_t admission_rejects; // candidates evicted instead of a victim
+};
+
+/**
+ * @brief Header of an item, followed by `klen` bytes of key
+ * and `vlen` bytes of value in the same chunk. It takes 40 bytes.
+ */
+struct item_t
+{
+    item_ref_t h_next; // next item in the same bucket
+    item_ref_t prev;   // LRU neighbour towards the head
+    item_ref_t next;   // LRU neighbour towards the tail
+    uint32_t hash;     // low bits of the hash of the key
+    uint32_t vlen;
+    uint8_t klen;
+    uint8_t cls;
+    uint8_t flags;
+    uint8_t pad;       // bytes past the class size / SLAB_ALIGN
+    uint32_t client_flags; // stored for clients, never interpreted
+    uint32_t epoch;        // of the segment when the item was written
+    uint64_t cas;          // version, changes on every update
+    char data[];
+};
+
+#endif
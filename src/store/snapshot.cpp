@@ -0,0 +1,218 @@
+/**
+ * @file /src/store/snapshot.cpp
+ *
+ * @brief This file contains the implementation of the snapshot
+ * methods of the `Store` class declared in /src/store/store.hpp.
+ * The file layout is described in /src/store/snapshot.hpp
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "store.hpp"
+#include "snapshot.hpp"
+
+/**
+ * @brief write the whole buffer to fd at the given offset
+ *
+ * @return true if successful, else false
+ */
+static bool pwrite_full(int fd, const char *buf, size_t len, off_t off)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0)
+            return false;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+/**
+ * @brief Write the store to a snapshot file while it keeps
+ * serving requests. Each shard is copied under its own shared
+ * lock, so only writers to the shard being copied ever wait.
+ * The file is written next to `path` and renamed over it once
+ * complete.
+ *
+ * @param[in] path The snapshot file
+ *
+ * @return number of items written, -1 in case of an error
+ */
+long Store::save_snapshot(const std::string &path)
+{
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("[Store] Couldn't create snapshot file");
+        return -1;
+    }
+
+    snapshot_header_t header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.nsections = STORE_SHARDS;
+    header.created = time(NULL);
+
+    snapshot_section_t table[STORE_SHARDS] = {};
+    off_t off = sizeof(header) + sizeof(table);
+    std::string buf;
+    bool ok = true;
+
+    for (int i = 0; i < STORE_SHARDS && ok; i++)
+    {
+        buf.clear();
+        table[i].offset = off;
+        {
+            // only this shard is held while its records are copied out
+            std::shared_lock<shard_mutex_t> lock(shard_mutex[i]);
+            if (detached)
+                break;
+            std::string value;
+            walk_shard(i, [&](item_t *it)
+                       {
+                           if (!item_live(it) || !item_value(it, value))
+                               return;
+                           snapshot_record_t rec = {it->klen, it->vlen, it->client_flags, 0};
+                           size_t start = buf.size();
+                           buf.append((const char *)&rec, sizeof(rec));
+                           buf.append(it->data, it->klen);
+                           buf.append(value);
+                           buf.resize(start + snapshot_record_size(rec.klen, rec.vlen), '\0');
+                           table[i].items++; });
+        }
+        table[i].bytes = buf.size();
+        header.items += table[i].items;
+        ok = pwrite_full(fd, buf.data(), buf.size(), off);
+        off += buf.size();
+    }
+
+    ok = ok && pwrite_full(fd, (const char *)&header, sizeof(header), 0) &&
+         pwrite_full(fd, (const char *)table, sizeof(table), sizeof(header)) &&
+         fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0)
+    {
+        perror("[Store] Couldn't write snapshot file");
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    return header.items;
+}
+
+/**
+ * @brief Bulk load a snapshot file written by `save_snapshot`.
+ * The file is mapped into memory and its sections are inserted
+ * by `nthreads` threads in parallel.
+ *
+ * @param[in] path The snapshot file
+ * @param[in] nthreads Number of loader threads
+ * @param[out] stats Location where the load figures are saved
+ *
+ * @return true if the snapshot was loaded, else false
+ */
+bool Store::load_snapshot(const std::string &path, unsigned int nthreads,
+                          snapshot_stats_t *stats)
+{
+    auto start = std::chrono::steady_clock::now();
+    struct stat st;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_header_t))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t file_size = st.st_size;
+    char *base = (char *)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("[Store] Couldn't map snapshot file");
+        return false;
+    }
+    madvise(base, file_size, MADV_WILLNEED);
+
+    snapshot_header_t *header = (snapshot_header_t *)base;
+    snapshot_section_t *table = (snapshot_section_t *)(base + sizeof(*header));
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header->version != SNAPSHOT_VERSION ||
+        sizeof(*header) + header->nsections * sizeof(*table) > file_size)
+    {
+        printf("[Store] %s is not a valid snapshot\n", path.c_str());
+        munmap(base, file_size);
+        return false;
+    }
+
+    std::atomic<uint32_t> next_section(0);
+    std::atomic<bool> corrupt(false);
+    auto loader = [&]()
+    {
+        uint32_t i;
+        while ((i = next_section++) < header->nsections)
+        {
+            snapshot_section_t &sec = table[i];
+            if (sec.offset > file_size || sec.bytes > file_size - sec.offset)
+            {
+                corrupt = true;
+                return;
+            }
+            const char *p = base + sec.offset, *end = p + sec.bytes;
+            for (uint64_t n = 0; n < sec.items; n++)
+            {
+                snapshot_record_t *rec = (snapshot_record_t *)p;
+                if ((size_t)(end - p) < sizeof(*rec) ||
+                    (size_t)(end - p) < snapshot_record_size(rec->klen, rec->vlen))
+                {
+                    corrupt = true;
+                    return;
+                }
+                const char *key = p + sizeof(*rec);
+                put(std::string(key, rec->klen),
+                    std::string(key + rec->klen, rec->vlen), rec->flags);
+                p += snapshot_record_size(rec->klen, rec->vlen);
+            }
+        }
+    };
+
+    // only the owner may insert into a store with a single owner
+    std::vector<std::thread> threads;
+    if (single_owner)
+        loader();
+    for (unsigned int t = 0; t < std::max(1u, nthreads) && !single_owner; t++)
+        threads.emplace_back(loader);
+    for (std::thread &t : threads)
+        t.join();
+
+    if (stats)
+    {
+        stats->items = header->items;
+        stats->bytes = file_size;
+        stats->seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    }
+    munmap(base, file_size);
+
+    if (corrupt)
+    {
+        printf("[Store] %s is truncated, loaded it partially\n", path.c_str());
+        return false;
+    }
+    return true;
+}
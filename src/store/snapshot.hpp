@@ -0,0 +1,69 @@
+/**
+ * @file /src/store/snapshot.hpp
+ *
+ * @brief On-disk layout of store snapshots. A snapshot starts with a
+ * fixed header followed by a table with one entry per section. Every
+ * section holds the records of one store shard, so sections can be
+ * loaded in parallel. Records are 8 byte aligned and length prefixed,
+ * which lets a loader walk a memory mapped file in place.
+ *
+ *  +--------+---------------+-----------+-----------+-----
+ *  | header | section table | section 0 | section 1 | ...
+ *  +--------+---------------+-----------+-----------+-----
+ *
+ * All integers are stored in host byte order.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "MCMSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN 8
+
+/**
+ * @brief Header at the start of a snapshot file
+ */
+struct snapshot_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nsections;
+    uint64_t items;
+    uint64_t created; // unix time the snapshot was started at
+};
+
+/**
+ * @brief Entry of the section table, locates a section in the file
+ */
+struct snapshot_section_t
+{
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t items;
+};
+
+/**
+ * @brief Record header, followed by `klen` bytes of key and `vlen`
+ * bytes of value, padded up to `SNAPSHOT_ALIGN`
+ */
+struct snapshot_record_t
+{
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t flags;
+    uint32_t pad;
+};
+
+/**
+ * @brief Size a record occupies in a section
+ */
+static inline uint64_t snapshot_record_size(uint32_t klen, uint32_t vlen)
+{
+    uint64_t n = sizeof(snapshot_record_t) + klen + vlen;
+    return (n + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+#endif
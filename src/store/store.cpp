@@ -0,0 +1,1761 @@
+/**
+ * @file /src/store/store.cpp
+ *
+ * @brief This file contains the implementation of the `Store` class
+ * declared in /src/store/store.hpp. The layout of the memory it
+ * manages is described in /src/store/segment.hpp
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "store.hpp"
+#include "../hash/hash.hpp"
+
+/* Eviction looks at this many active items before it evicts
+ * one regardless */
+#define EVICT_SEARCH_MAX 50
+
+/* Every this many memory hits per thread, one is timed */
+#define RAM_LATENCY_SAMPLE 64
+
+/* Share of a shard that may be split into ext item headers */
+#define EXT_HEADER_SHARE 0.5
+
+/* Milliseconds between compactor rounds, and the most ext
+ * file pages compacted per round */
+#define EXT_COMPACT_INTERVAL_MS 100
+#define EXT_COMPACT_PAGES_MAX 4
+
+/* Buckets split by an insertion that finds its shard more than half
+ * as full of items as of buckets, so the table grows without a long
+ * pause and without long chains in the buckets not split yet */
+#define SPLIT_BUCKETS 64
+
+/* Buckets the crawler visits per hold of a shard, so a flush
+ * of a large store never keeps a shard from requests for long */
+#define CRAWL_BUCKETS 256
+
+#define PAGE_ALIGN(n) (((n) + 4095) & ~(uint64_t)4095)
+
+/**
+ * @brief the shard owning a key, picked from the high bits of its
+ * hash since the low bits select the bucket
+ */
+static inline int shard_for(uint64_t hash)
+{
+    return (hash >> 56) % STORE_SHARDS;
+}
+
+/**
+ * @brief size of the size class following a class of `size` bytes
+ */
+static inline int next_class_size(int size)
+{
+    size = ((int)(size * SLAB_FACTOR) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+    return std::min(size, SLAB_CHUNK_MAX);
+}
+
+/**
+ * @brief word and shift of the counter of a key in one row of a
+ * frequency sketch, from a multiplicative hash of the key hash and
+ * the row
+ */
+static inline void sketch_slot(uint32_t hash, int row, uint64_t mask, uint64_t *word, int *shift)
+{
+    uint64_t h = ((uint64_t)hash << 2 | row) * 0x9e3779b97f4a7c15ULL;
+    *word = (h >> 32) & mask;
+    *shift = ((h >> 28) & 15) * 4;
+}
+
+/**
+ * @brief size the sketch for `capacity` items
+ */
+void freq_sketch_t::init(uint64_t capacity)
+{
+    uint64_t n = 1;
+    while (n * 16 < capacity * ADMISSION_COUNTERS_PER_ITEM)
+        n <<= 1;
+    words.assign(n, 0);
+    mask = n - 1;
+    additions = 0;
+    sample_size = std::max<uint64_t>(capacity, 1) * ADMISSION_SAMPLE_FACTOR;
+}
+
+/**
+ * @brief count one request of the key with this hash
+ */
+void freq_sketch_t::add(uint32_t hash)
+{
+    for (int row = 0; row < 4; row++)
+    {
+        uint64_t i;
+        int shift;
+        sketch_slot(hash, row, mask, &i, &shift);
+        uint64_t w = __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+        if (((w >> shift) & 15) != 15)
+            __atomic_store_n(&words[i], w + ((uint64_t)1 << shift), __ATOMIC_RELAXED);
+    }
+
+    // a lost addition only delays the next halving
+    uint64_t n = __atomic_load_n(&additions, __ATOMIC_RELAXED) + 1;
+    if (n >= sample_size)
+    {
+        age();
+        n = 0;
+    }
+    __atomic_store_n(&additions, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief estimated requests of the key with this hash, at most 15
+ */
+unsigned int freq_sketch_t::estimate(uint32_t hash)
+{
+    unsigned int est = 15;
+    for (int row = 0; row < 4; row++)
+    {
+        uint64_t i;
+        int shift;
+        sketch_slot(hash, row, mask, &i, &shift);
+        est = std::min(est, (unsigned int)(__atomic_load_n(&words[i], __ATOMIC_RELAXED) >> shift) & 15);
+    }
+    return est;
+}
+
+/**
+ * @brief halve every counter
+ */
+void freq_sketch_t::age()
+{
+    for (uint64_t &w : words)
+        __atomic_store_n(&w, (__atomic_load_n(&w, __ATOMIC_RELAXED) >> 1) & 0x7777777777777777ULL,
+                         __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Create a store in anonymous memory with the
+ * default settings
+ */
+Store::Store()
+    : Store(store_opts_t())
+{
+}
+
+/**
+ * @brief Create a store, or attach to the segment file
+ * named in `opts` if it holds a compatible, cleanly
+ * detached store
+ *
+ * @param[in] opts Settings of the store
+ */
+Store::Store(const store_opts_t &opts)
+{
+    single_owner = opts.single_owner;
+    for (int i = 0; i < STORE_SHARDS; i++)
+        shard_mutex[i].enabled = !single_owner;
+    open_segment(opts);
+    open_ext(opts);
+
+    // the sketches start empty, also over an attached segment
+    admission = opts.admission;
+    if (admission)
+        for (int i = 0; i < STORE_SHARDS; i++)
+            sketch[i].init(seg_header()->shard_bytes / SLAB_CHUNK_AVG);
+
+    // items of an attached segment may predate its last flush
+    crawl_pending = false;
+    if (was_attached && current_epoch() != 0 && !single_owner)
+        request_crawl();
+}
+
+/**
+ * @brief Stop the ext file compactor and unmap the store,
+ * detaching it first if it is backed by a segment file
+ */
+Store::~Store()
+{
+    compactor_mutex.lock();
+    crawler_mutex.lock();
+    stopping = true;
+    crawler_mutex.unlock();
+    compactor_mutex.unlock();
+    compactor_cv.notify_all();
+    crawler_cv.notify_all();
+    if (compactor.joinable())
+        compactor.join();
+    if (crawler.joinable())
+        crawler.join();
+
+    detach();
+    delete ext;
+    munmap(base, seg_bytes);
+    if (seg_fd >= 0)
+        close(seg_fd);
+}
+
+/**
+ * @brief map the segment and attach to it or format it
+ */
+void Store::open_segment(const store_opts_t &opts)
+{
+    // items are linked by 32 bit references
+    uint64_t memory_bytes = opts.memory_bytes;
+    if (memory_bytes > SEGMENT_BYTES_MAX - SEGMENT_HEADER_SIZE - STORE_SHARDS * 4096)
+    {
+        memory_bytes = SEGMENT_BYTES_MAX - SEGMENT_HEADER_SIZE - STORE_SHARDS * 4096;
+        printf("[Store] Memory limited to %lu MB\n", memory_bytes >> 20);
+    }
+    uint64_t shard_bytes = PAGE_ALIGN(memory_bytes / STORE_SHARDS);
+    seg_bytes = SEGMENT_HEADER_SIZE + shard_bytes * STORE_SHARDS;
+    seg_fd = -1;
+    was_attached = false;
+    detached = false;
+
+    if (!opts.segment_path.empty())
+    {
+        seg_fd = open(opts.segment_path.c_str(), O_RDWR | O_CREAT, 0600);
+        if (seg_fd >= 0 && flock(seg_fd, LOCK_EX | LOCK_NB) < 0)
+        {
+            printf("[Store] %s is in use by another process\n",
+                   opts.segment_path.c_str());
+            close(seg_fd);
+            seg_fd = -1;
+        }
+        else if (seg_fd < 0)
+        {
+            perror("[Store] Couldn't open segment file");
+        }
+    }
+
+    if (seg_fd >= 0)
+    {
+        struct stat st;
+        fstat(seg_fd, &st);
+        bool existing = (size_t)st.st_size == seg_bytes;
+
+        // sparse, pages are only backed once touched
+        if (!existing && ftruncate(seg_fd, seg_bytes) < 0)
+            perror("[Store] Couldn't size segment file");
+
+        base = (char *)mmap(NULL, seg_bytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, seg_fd, 0);
+        if (base == MAP_FAILED)
+        {
+            perror("[Store] Couldn't map segment file");
+            close(seg_fd);
+            seg_fd = -1;
+        }
+        else if (existing)
+        {
+            std::string reason = check_segment(shard_bytes);
+            if (reason.empty())
+            {
+                was_attached = true;
+                seg_header()->clean = 0;
+                return;
+            }
+            printf("[Store] Not attaching to %s: %s\n",
+                   opts.segment_path.c_str(), reason.c_str());
+        }
+    }
+
+    if (seg_fd < 0)
+    {
+        base = (char *)mmap(NULL, seg_bytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            perror("[Store] Couldn't map store memory");
+            exit(1);
+        }
+    }
+    format_segment(shard_bytes);
+}
+
+/**
+ * @brief open the ext file if configured, after dropping items
+ * of an attached segment that refer to an earlier ext file
+ */
+void Store::open_ext(const store_opts_t &opts)
+{
+    ext = NULL;
+    ext_min_value = opts.ext_min_value;
+    stopping = false;
+
+    if (was_attached)
+    {
+        // the ext file is not kept across restarts
+        size_t dropped = 0;
+        for (int i = 0; i < STORE_SHARDS; i++)
+        {
+            std::vector<uint64_t> ext_items;
+            walk_shard(i, [&](item_t *it)
+                       {
+                           if (it->flags & ITEM_EXT)
+                               ext_items.push_back((char *)it - base); });
+            for (uint64_t off : ext_items)
+                unlink_item(shard_header(i), off);
+            dropped += ext_items.size();
+        }
+        if (dropped > 0)
+            printf("[Store] Dropped %zu items whose value was in the ext file\n", dropped);
+    }
+
+    if (opts.ext_path.empty())
+        return;
+    if (single_owner)
+    {
+        printf("[Store] A store with a single owner does not use an ext file\n");
+        return;
+    }
+
+    ext = new ExtStore(opts.ext_path, opts.ext_bytes);
+    if (!ext->ok())
+    {
+        delete ext;
+        ext = NULL;
+        return;
+    }
+    compactor = std::thread(&Store::compact_ext, this);
+}
+
+/**
+ * @brief check that the mapped segment was written by a
+ * compatible build with the same settings
+ *
+ * @return empty string if compatible, else the reason why not
+ */
+std::string Store::check_segment(uint64_t shard_bytes)
+{
+    seg_header_t *hdr = seg_header();
+    if (memcmp(hdr->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0)
+        return "not a segment file";
+    if (hdr->version != SEGMENT_VERSION)
+        return "layout version " + std::to_string(hdr->version) +
+               " does not match " + std::to_string(SEGMENT_VERSION);
+    if (hdr->nshards != STORE_SHARDS || hdr->shard_bytes != shard_bytes ||
+        hdr->seg_bytes != seg_bytes)
+        return "memory size or shard count changed";
+    if (!hdr->clean)
+        return "previous owner did not detach cleanly";
+
+    for (int cls = 0, size = SLAB_CHUNK_MIN; cls < (int)hdr->nclasses; cls++)
+    {
+        if (hdr->class_size[cls] != (uint32_t)size)
+            return "size classes changed";
+        size = next_class_size(size);
+    }
+    return "";
+}
+
+/**
+ * @brief lay out an empty store in the mapped segment
+ */
+void Store::format_segment(uint64_t shard_bytes)
+{
+    seg_header_t *hdr = seg_header();
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    hdr->version = SEGMENT_VERSION;
+    hdr->nshards = STORE_SHARDS;
+    hdr->seg_bytes = seg_bytes;
+    hdr->shard_bytes = shard_bytes;
+
+    int size = SLAB_CHUNK_MIN;
+    while (hdr->nclasses < SLAB_CLASSES_MAX)
+    {
+        hdr->class_size[hdr->nclasses++] = size;
+        if (size >= SLAB_CHUNK_MAX)
+            break;
+        size = next_class_size(size);
+    }
+
+    uint64_t nbuckets_max = BUCKETS_INITIAL;
+    while (nbuckets_max * SLAB_CHUNK_AVG < shard_bytes)
+        nbuckets_max *= 2;
+
+    for (int i = 0; i < STORE_SHARDS; i++)
+    {
+        uint64_t start = SEGMENT_HEADER_SIZE + i * shard_bytes;
+        shard_header_t *sh = (shard_header_t *)(base + start);
+        memset(sh, 0, sizeof(*sh));
+        sh->buckets = start + sizeof(*sh);
+        sh->nbuckets = BUCKETS_INITIAL;
+        sh->bucket_mask = 2 * BUCKETS_INITIAL - 1;
+        sh->nbuckets_max = nbuckets_max;
+        sh->top = sh->buckets + nbuckets_max * sizeof(item_ref_t);
+        sh->end = start + shard_bytes;
+        memset(base + sh->buckets, 0, sh->nbuckets * sizeof(item_ref_t));
+    }
+}
+
+shard_header_t *Store::shard_header(int shard)
+{
+    return (shard_header_t *)(base + SEGMENT_HEADER_SIZE +
+                              shard * seg_header()->shard_bytes);
+}
+
+item_ref_t *Store::bucket_of(shard_header_t *sh, uint64_t hash)
+{
+    // buckets past the last one in use are not split off yet
+    uint64_t b = hash & sh->bucket_mask;
+    if (b >= sh->nbuckets)
+        b &= sh->bucket_mask >> 1;
+    return (item_ref_t *)(base + sh->buckets) + b;
+}
+
+/**
+ * @brief smallest size class that fits `bytes`, -1 if none
+ */
+int Store::class_for(size_t bytes)
+{
+    seg_header_t *hdr = seg_header();
+    for (int cls = 0; cls < (int)hdr->nclasses; cls++)
+    {
+        if (hdr->class_size[cls] >= bytes)
+            return cls;
+    }
+    return -1;
+}
+
+/**
+ * @brief find a live item in a shard, the shard must be locked
+ *
+ * @return offset of the item, 0 if not found
+ */
+uint64_t Store::find(shard_header_t *sh, uint64_t hash, const std::string &key)
+{
+    for (uint64_t off = off_of(*bucket_of(sh, hash)); off; off = off_of(item_at(off)->h_next))
+    {
+        item_t *it = item_at(off);
+        if (it->hash == (uint32_t)hash && it->klen == key.size() &&
+            memcmp(it->data, key.data(), key.size()) == 0 && item_live(it))
+            return off;
+    }
+    return 0;
+}
+
+// items with `ITEM_WINDOW` set are on the window list of their class
+void Store::lru_push_head(shard_header_t *sh, uint64_t off)
+{
+    item_t *it = item_at(off);
+    bool window = it->flags & ITEM_WINDOW;
+    uint64_t *head = window ? sh->window_head : sh->lru_head;
+    uint64_t *tail = window ? sh->window_tail : sh->lru_tail;
+    it->prev = 0;
+    it->next = ref_of(head[it->cls]);
+    if (it->next)
+        item_at(off_of(it->next))->prev = ref_of(off);
+    else
+        tail[it->cls] = off;
+    head[it->cls] = off;
+    sh->class_items[it->cls]++;
+    if (window)
+        sh->window_items[it->cls]++;
+}
+
+void Store::lru_remove(shard_header_t *sh, uint64_t off)
+{
+    item_t *it = item_at(off);
+    bool window = it->flags & ITEM_WINDOW;
+    uint64_t *head = window ? sh->window_head : sh->lru_head;
+    uint64_t *tail = window ? sh->window_tail : sh->lru_tail;
+    if (it->prev)
+        item_at(off_of(it->prev))->next = it->next;
+    else
+        head[it->cls] = off_of(it->next);
+    if (it->next)
+        item_at(off_of(it->next))->prev = it->prev;
+    else
+        tail[it->cls] = off_of(it->prev);
+    sh->class_items[it->cls]--;
+    if (window)
+        sh->window_items[it->cls]--;
+}
+
+/**
+ * @brief remove an item from its bucket and LRU, and return
+ * its chunk to the free list. The shard must be write locked.
+ */
+void Store::unlink_item(shard_header_t *sh, uint64_t off)
+{
+    item_t *it = item_at(off);
+    item_ref_t *link = bucket_of(sh, it->hash);
+    while (*link != ref_of(off))
+        link = &item_at(off_of(*link))->h_next;
+    *link = it->h_next;
+
+    lru_remove(sh, off);
+    sh->items--;
+    if ((it->flags & ITEM_EXT) && ext)
+        ext->release(item_ext_ptr(it));
+    if (it->flags & ITEM_CHAINED)
+    {
+        uint64_t chain;
+        memcpy(&chain, it->data + it->klen, sizeof(chain));
+        free_chain(sh, chain, it->cls);
+    }
+    free_chunk(sh, off, it->cls);
+}
+
+/**
+ * @brief put a chunk on the free list of a class, the shard
+ * must be write locked
+ */
+void Store::free_chunk(shard_header_t *sh, uint64_t off, int cls)
+{
+    item_t *it = item_at(off);
+    it->cls = cls;
+    it->flags = ITEM_FREE;
+    it->h_next = ref_of(sh->free_list[cls]);
+    sh->free_list[cls] = off;
+}
+
+/**
+ * @brief unlink an item to free its memory, reporting it to the
+ * evict listener unless it was dead. The shard must be write
+ * locked.
+ */
+void Store::evict_item(shard_header_t *sh, uint64_t off)
+{
+    // dead items are reclaimed without a trace
+    item_t *it = item_at(off);
+    if (!item_live(it))
+    {
+        unlink_item(sh, off);
+        reclaimed++;
+        return;
+    }
+    if (evict_listener && !(it->flags & ITEM_EXT))
+    {
+        std::string value;
+        copy_value(it, value);
+        evict_listener(std::string(it->data, it->klen), value, it->client_flags);
+    }
+    unlink_item(sh, off);
+    sh->evictions++;
+}
+
+/**
+ * @brief the least recently used item of a class, giving items read
+ * since they were last seen here a second chance at the head. The
+ * shard must be write locked.
+ *
+ * @return offset of the item, 0 if the class has none
+ */
+uint64_t Store::lru_victim(shard_header_t *sh, int cls)
+{
+    uint64_t off;
+    for (int n = 0; (off = sh->lru_tail[cls]); n++)
+    {
+        item_t *it = item_at(off);
+        if (!(it->flags & ITEM_ACTIVE) || !item_live(it) || n >= EVICT_SEARCH_MAX)
+            break;
+        it->flags &= ~ITEM_ACTIVE;
+        lru_remove(sh, off);
+        lru_push_head(sh, off);
+    }
+    return off;
+}
+
+/**
+ * @brief take a chunk of a class, evicting from the class
+ * LRU if needed, or from another class if this one holds no
+ * items. The shard must be write locked.
+ *
+ * @param[in] may_flush false while an item is being moved, so
+ * neither values are flushed nor memory is reassigned
+ *
+ * @return offset of the chunk, 0 if none could be freed
+ */
+uint64_t Store::alloc_chunk(shard_header_t *sh, int cls, bool may_flush)
+{
+    uint64_t off = sh->free_list[cls];
+    if (off)
+    {
+        sh->free_list[cls] = off_of(item_at(off)->h_next);
+        return off;
+    }
+
+    uint64_t size = seg_header()->class_size[cls];
+    if (sh->top + size <= sh->end)
+    {
+        off = sh->top;
+        sh->top += size;
+        item_at(off)->cls = cls;
+        item_at(off)->pad = 0;
+        return off;
+    }
+
+    while (true)
+    {
+        off = admission ? admission_victim(sh, cls) : lru_victim(sh, cls);
+        if (!off)
+            return may_flush ? reassign_chunk(sh, cls) : 0;
+
+        if (!item_live(item_at(off)) || !may_flush || !flush_item(sh, off))
+            evict_item(sh, off);
+        else if (sh->free_list[cls] != off)
+        {
+            // the chunk became item headers, evict the next item
+            continue;
+        }
+        sh->free_list[cls] = off_of(item_at(off)->h_next);
+        return off;
+    }
+}
+
+/**
+ * @brief take memory for a chunk of a class that holds no items
+ * from the class holding the most. The chunks from the oldest
+ * item of that class on are freed, whatever class they are of,
+ * until they cover a chunk of the class; the memory left over is
+ * cut into free chunks. The shard must be write locked.
+ *
+ * @return offset of the chunk, 0 if none could be freed
+ */
+uint64_t Store::reassign_chunk(shard_header_t *sh, int cls)
+{
+    seg_header_t *hdr = seg_header();
+    int donor = -1;
+    for (int c = 0; c < (int)hdr->nclasses; c++)
+        if (c != cls && sh->class_items[c] &&
+            (donor < 0 || sh->class_items[c] > sh->class_items[donor]))
+            donor = c;
+    if (donor < 0)
+        return 0;
+
+    uint64_t size = hdr->class_size[cls];
+    uint64_t start = sh->lru_tail[donor] ? sh->lru_tail[donor] : sh->window_tail[donor];
+    if (start + size > sh->end)
+        start = sh->buckets + sh->nbuckets_max * sizeof(item_ref_t);
+
+    // chunks follow each other up to `top`, past it the memory
+    // was never handed out
+    uint64_t end = start;
+    while (end < start + size)
+    {
+        if (end >= sh->top)
+        {
+            if (start + size > sh->end)
+                return 0;
+            end = sh->top = start + size;
+            break;
+        }
+        item_t *it = item_at(end);
+        uint64_t bytes = chunk_bytes(it);
+        if (!(it->flags & ITEM_FREE))
+        {
+            // a chunk of a chained value goes with its item, and the
+            // range starts over past the chunks of an item being written
+            uint64_t owner = it->flags & ITEM_CHUNK ? off_of(it->prev) : end;
+            if (item_at(owner)->flags & ITEM_NEW)
+            {
+                start = end = end + bytes;
+                continue;
+            }
+            evict_item(sh, owner);
+        }
+        end += bytes;
+    }
+
+    // the freed chunks leave the free lists of their classes
+    for (int c = 0; c < (int)hdr->nclasses; c++)
+    {
+        uint64_t first = 0;
+        item_t *last = NULL;
+        for (uint64_t off = sh->free_list[c], next; off; off = next)
+        {
+            next = off_of(item_at(off)->h_next);
+            if (off >= start && off < end)
+                continue;
+            if (last)
+                last->h_next = ref_of(off);
+            else
+                first = off;
+            last = item_at(off);
+        }
+        if (last)
+            last->h_next = 0;
+        sh->free_list[c] = first;
+    }
+
+    // the rest is cut into the largest chunks that fit, what is too
+    // small for any chunk pads the last one
+    uint64_t last = start;
+    item_at(start)->cls = cls;
+    item_at(start)->pad = 0;
+    for (uint64_t off = start + size; end - off >= SLAB_CHUNK_MIN;)
+    {
+        int c = hdr->nclasses - 1;
+        while (hdr->class_size[c] > end - off)
+            c--;
+        item_at(off)->pad = 0;
+        free_chunk(sh, off, c);
+        last = off;
+        off += hdr->class_size[c];
+    }
+    item_t *it = item_at(last);
+    it->pad = (end - last - hdr->class_size[it->cls]) / SLAB_ALIGN;
+    return start;
+}
+
+/**
+ * @brief pick the item to evict from a class when admission is
+ * enabled. Once the window list of the class outgrows its share,
+ * its oldest item moves to the LRU list and is evicted itself
+ * unless it was requested more often than the LRU victim. The
+ * shard must be write locked.
+ *
+ * @return offset of the item to evict, 0 if the class has none
+ */
+uint64_t Store::admission_victim(shard_header_t *sh, int cls)
+{
+    uint64_t cand = sh->window_tail[cls];
+    if (!cand || (sh->lru_tail[cls] &&
+                  sh->window_items[cls] * 100 <= sh->class_items[cls] * ADMISSION_WINDOW_PERCENT))
+        return lru_victim(sh, cls);
+
+    // the candidate leaves the window either way
+    uint64_t victim = lru_victim(sh, cls);
+    item_t *it = item_at(cand);
+    lru_remove(sh, cand);
+    it->flags &= ~ITEM_WINDOW;
+    lru_push_head(sh, cand);
+    if (!victim || !item_live(it))
+        return cand;
+
+    freq_sketch_t &fs = sketch[((char *)sh - base - SEGMENT_HEADER_SIZE) / seg_header()->shard_bytes];
+    item_t *v = item_at(victim);
+    if (!item_live(v) || fs.estimate(it->hash) > fs.estimate(v->hash))
+        return victim;
+    sh->admission_rejects++;
+    return cand;
+}
+
+/**
+ * @brief move the value of an item chosen for eviction to the
+ * ext file and keep only a header with its key and the location
+ * of the value in memory. On success the chunk of the item is
+ * either on the free list or was split into header chunks. The
+ * shard must be write locked.
+ *
+ * @return true if the item was moved, else false
+ */
+bool Store::flush_item(shard_header_t *sh, uint64_t off)
+{
+    item_t *it = item_at(off);
+    if (!ext || (it->flags & (ITEM_EXT | ITEM_CHAINED)) || it->vlen < ext_min_value)
+        return false;
+
+    // the header must come from a smaller class, or nothing is gained
+    int cls = class_for(sizeof(item_t) + it->klen + sizeof(ext_ptr_t));
+    if (cls < 0 || cls >= it->cls)
+        return false;
+
+    // headers need memory of their own once the values are gone,
+    // so up to a share of the shard is taken over from the larger
+    // classes, instead of evicting the oldest headers
+    uint64_t size = seg_header()->class_size[cls];
+    uint64_t item_size = seg_header()->class_size[it->cls];
+    bool split = !sh->free_list[cls] && sh->top + size > sh->end &&
+                 sh->lru_head[it->cls] != off &&
+                 sh->ext_split_bytes + item_size <= seg_header()->shard_bytes * EXT_HEADER_SHARE;
+
+    uint64_t hdr_off = split ? off : alloc_chunk(sh, cls, false);
+    if (!hdr_off)
+        return false;
+
+    ext_ptr_t ptr;
+    if (!ext->append(it->data, it->klen, it->data + it->klen, it->vlen, &ptr))
+    {
+        if (!split)
+            free_chunk(sh, hdr_off, cls);
+        return false;
+    }
+
+    if (split)
+    {
+        // the item becomes its own header, the rest of the
+        // chunk is cut into free header chunks
+        uint64_t bytes = chunk_bytes(it);
+        lru_remove(sh, off);
+        it->cls = cls;
+        it->flags = ITEM_EXT;
+        it->pad = 0;
+        memcpy(it->data + it->klen, &ptr, sizeof(ptr));
+        lru_push_head(sh, off);
+        uint64_t c = off + size;
+        for (; c + size <= off + bytes; c += size)
+        {
+            item_at(c)->pad = 0;
+            free_chunk(sh, c, cls);
+        }
+        // the rest is too small for another header
+        item_at(c - size)->pad = (off + bytes - c) / SLAB_ALIGN;
+        sh->ext_split_bytes += item_size;
+        sh->ext_flushes++;
+        return true;
+    }
+
+    item_t *hdr = item_at(hdr_off);
+    hdr->hash = it->hash;
+    hdr->vlen = it->vlen;
+    hdr->klen = it->klen;
+    hdr->cls = cls;
+    hdr->flags = ITEM_EXT;
+    hdr->client_flags = it->client_flags;
+    hdr->epoch = it->epoch;
+    hdr->cas = it->cas;
+    memcpy(hdr->data, it->data, it->klen);
+    memcpy(hdr->data + it->klen, &ptr, sizeof(ptr));
+
+    // the header takes the place of the item in its bucket
+    item_ref_t *link = bucket_of(sh, it->hash);
+    while (*link != ref_of(off))
+        link = &item_at(off_of(*link))->h_next;
+    *link = ref_of(hdr_off);
+    hdr->h_next = it->h_next;
+    lru_push_head(sh, hdr_off);
+
+    lru_remove(sh, off);
+    free_chunk(sh, off, it->cls);
+    sh->ext_flushes++;
+    return true;
+}
+
+/**
+ * @brief copy the value of an item from whichever tier holds
+ * it, the shard must be locked
+ *
+ * @return true if copied, false if it was lost from the ext file
+ */
+bool Store::item_value(item_t *it, std::string &value)
+{
+    if (!(it->flags & ITEM_EXT))
+    {
+        copy_value(it, value);
+        return true;
+    }
+    return ext && ext->read(item_ext_ptr(it), value);
+}
+
+/**
+ * @brief copy the value of an item held in memory, following
+ * its chunk chain if any. The shard must be locked.
+ */
+void Store::copy_value(item_t *it, std::string &value)
+{
+    if (!(it->flags & ITEM_CHAINED))
+    {
+        value.assign(it->data + it->klen, it->vlen);
+        return;
+    }
+
+    uint64_t chain;
+    size_t pos = chain_head_bytes(it);
+    memcpy(&chain, it->data + it->klen, sizeof(chain));
+    value.resize(it->vlen);
+    memcpy(&value[0], it->data + it->klen + sizeof(chain), pos);
+    for (; chain; chain = off_of(item_at(chain)->h_next))
+    {
+        item_t *chunk = item_at(chain);
+        memcpy(&value[pos], chunk->data, chunk->vlen);
+        pos += chunk->vlen;
+    }
+}
+
+/**
+ * @brief copy the rest of a value past the first chunk into a
+ * chain of chunks of the same class, and link the chain to the
+ * first chunk. The shard must be write locked.
+ *
+ * @return true if stored, false if no memory could be freed
+ */
+bool Store::store_chain(shard_header_t *sh, item_t *it, const std::string &value)
+{
+    size_t pos = chain_head_bytes(it);
+    size_t chunk_bytes = seg_header()->class_size[it->cls] - sizeof(item_t);
+    uint64_t chain = 0;
+    item_t *last = NULL;
+    memcpy(it->data + it->klen + sizeof(chain), value.data(), pos);
+
+    // the first chunk is not linked anywhere yet and marked
+    // `ITEM_NEW`, so evictions made room for the chain cannot pick it
+    while (pos < value.size())
+    {
+        uint64_t off = alloc_chunk(sh, it->cls);
+        if (!off)
+        {
+            free_chain(sh, chain, it->cls);
+            return false;
+        }
+        item_t *chunk = item_at(off);
+        chunk->h_next = 0;
+        chunk->prev = ref_of((char *)it - base);
+        chunk->cls = it->cls;
+        chunk->flags = ITEM_CHUNK;
+        chunk->klen = 0;
+        chunk->vlen = std::min(chunk_bytes, value.size() - pos);
+        memcpy(chunk->data, value.data() + pos, chunk->vlen);
+        pos += chunk->vlen;
+        if (last)
+            last->h_next = ref_of(off);
+        else
+            chain = off;
+        last = chunk;
+    }
+    memcpy(it->data + it->klen, &chain, sizeof(chain));
+    return true;
+}
+
+/**
+ * @brief return every chunk of a chain to the free list, the
+ * shard must be write locked
+ */
+void Store::free_chain(shard_header_t *sh, uint64_t chain, int cls)
+{
+    while (chain)
+    {
+        uint64_t next = off_of(item_at(chain)->h_next);
+        free_chunk(sh, chain, cls);
+        chain = next;
+    }
+}
+
+/**
+ * @brief split the next `SPLIT_BUCKETS` buckets once the shard
+ * holds more than one item per two buckets. The shard must be
+ * write locked.
+ */
+void Store::maybe_grow(shard_header_t *sh)
+{
+    if (sh->items * 2 <= sh->nbuckets || sh->nbuckets >= sh->nbuckets_max)
+        return;
+
+    // bucket b splits into buckets b and b + half, the new last
+    // one. A batch stops at the end of the round, where half doubles.
+    uint64_t half = (sh->bucket_mask + 1) / 2;
+    uint64_t first = sh->nbuckets - half;
+    uint64_t end = std::min(first + SPLIT_BUCKETS, half);
+    item_ref_t *buckets = (item_ref_t *)(base + sh->buckets);
+
+    // the first items of the batch are fetched together, instead
+    // of one cache miss after another
+    for (uint64_t b = first; b < end; b++)
+        if (buckets[b])
+            __builtin_prefetch(item_at(off_of(buckets[b])));
+
+    for (uint64_t b = first; b < end; b++)
+    {
+        item_ref_t *lo = &buckets[b], *hi = &buckets[b + half];
+        *hi = 0;
+        item_ref_t ref = *lo;
+        *lo = 0;
+        while (ref)
+        {
+            item_t *it = item_at(off_of(ref));
+            item_ref_t next = it->h_next;
+            item_ref_t *dst = (it->hash & half) ? hi : lo;
+            it->h_next = *dst;
+            *dst = ref;
+            ref = next;
+        }
+    }
+
+    sh->nbuckets = end + half;
+    if (sh->nbuckets > sh->bucket_mask)
+        sh->bucket_mask = 2 * sh->bucket_mask + 1;
+}
+
+/**
+ * @brief Look up the value mapped to a key
+ *
+ * @param[in] key The key to look up
+ * @param[out] value Location where the value is copied on a hit
+ * @param[out] flags Optional location where the flags stored
+ * with the value are copied on a hit
+ * @param[out] cas Optional location where the version of the
+ * value is copied on a hit
+ *
+ * @return true on a hit, else false
+ */
+bool Store::get(const std::string &key, std::string &value, uint32_t *flags,
+                uint64_t *cas)
+{
+    static thread_local unsigned int nth_hit = 0;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t hash = hash_bytes(key.data(), key.size());
+    int shard = shard_for(hash);
+    if (admission)
+        sketch[shard].add(hash);
+    ext_ptr_t ptr;
+    {
+        std::shared_lock<shard_mutex_t> lock(shard_mutex[shard]); // read
+        uint64_t off = detached ? 0 : find(shard_header(shard), hash, key);
+        if (!off)
+        {
+            count(counters[shard].misses);
+            return false;
+        }
+
+        item_t *it = item_at(off);
+
+        // readers share the lock, so the flag is set atomically and
+        // only written if not already set
+        if (!(__atomic_load_n(&it->flags, __ATOMIC_RELAXED) & ITEM_ACTIVE))
+            __atomic_fetch_or(&it->flags, ITEM_ACTIVE, __ATOMIC_RELAXED);
+        if (flags)
+            *flags = it->client_flags;
+        if (cas)
+            *cas = it->cas;
+
+        if (!(it->flags & ITEM_EXT))
+        {
+            copy_value(it, value);
+            count(counters[shard].ram_hits);
+            if (++nth_hit % RAM_LATENCY_SAMPLE == 0)
+                ram_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                       std::chrono::steady_clock::now() - start)
+                                       .count());
+            return true;
+        }
+        ptr = item_ext_ptr(it);
+    }
+
+    // the shard is not held while reading from the ext file
+    bool hit = ext && ext->read(ptr, value);
+    ext_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count());
+    count(hit ? counters[shard].ext_hits : counters[shard].misses);
+    return hit;
+}
+
+/**
+ * @brief Look up several keys like `get()`. The keys are taken
+ * `STORE_BATCH_GROUP` at a time: all of them are hashed and
+ * their buckets prefetched, then the first item of every
+ * bucket, and only then are they probed, so the cache misses of
+ * the keys of a group overlap instead of following each other.
+ *
+ * @param[in,out] lookups The keys, their outcome is filled in
+ */
+void Store::get_batch(std::vector<store_lookup_t> &lookups)
+{
+    for (size_t first = 0; first < lookups.size(); first += STORE_BATCH_GROUP)
+        get_group(&lookups[first], std::min(lookups.size() - first, (size_t)STORE_BATCH_GROUP));
+}
+
+/**
+ * @brief look up at most `STORE_BATCH_GROUP` keys, locking each
+ * of their shards once, see `get_batch()`
+ */
+void Store::get_group(store_lookup_t *group, size_t n)
+{
+    static thread_local unsigned int nth_hit = 0;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t hash[STORE_BATCH_GROUP];
+    int shard[STORE_BATCH_GROUP];
+    item_ref_t *bucket[STORE_BATCH_GROUP];
+    ext_ptr_t ptr[STORE_BATCH_GROUP];
+    bool in_ext[STORE_BATCH_GROUP] = {false};
+    bool used[STORE_SHARDS] = {false};
+    bool sample = false;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        hash[i] = hash_bytes(group[i].key.data(), group[i].key.size());
+        shard[i] = shard_for(hash[i]);
+        used[shard[i]] = true;
+        group[i].hit = false;
+        if (admission)
+            sketch[shard[i]].add(hash[i]);
+    }
+
+    // shards are always locked in ascending order, as by `flush_all()`
+    for (int s = 0; s < STORE_SHARDS; s++)
+        if (used[s])
+            shard_mutex[s].lock_shared();
+
+    if (!detached)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            bucket[i] = bucket_of(shard_header(shard[i]), hash[i]);
+            __builtin_prefetch(bucket[i]);
+        }
+        // the header and the start of the key of the first item
+        for (size_t i = 0; i < n; i++)
+            if (*bucket[i])
+                __builtin_prefetch(item_at(off_of(*bucket[i])));
+
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t off = find(shard_header(shard[i]), hash[i], group[i].key);
+            if (!off)
+                continue;
+
+            item_t *it = item_at(off);
+            if (!(__atomic_load_n(&it->flags, __ATOMIC_RELAXED) & ITEM_ACTIVE))
+                __atomic_fetch_or(&it->flags, ITEM_ACTIVE, __ATOMIC_RELAXED);
+            group[i].flags = it->client_flags;
+            group[i].cas = it->cas;
+            if (it->flags & ITEM_EXT)
+            {
+                ptr[i] = item_ext_ptr(it);
+                in_ext[i] = true;
+                continue;
+            }
+            copy_value(it, group[i].value);
+            group[i].hit = true;
+            count(counters[shard[i]].ram_hits);
+            sample = sample || ++nth_hit % RAM_LATENCY_SAMPLE == 0;
+        }
+    }
+
+    for (int s = 0; s < STORE_SHARDS; s++)
+        if (used[s])
+            shard_mutex[s].unlock_shared();
+
+    // the latency of a key is its share of the group
+    if (sample)
+        ram_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start)
+                               .count() /
+                           n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (in_ext[i])
+        {
+            // the shards are not held while reading from the ext file
+            group[i].hit = ext && ext->read(ptr[i], group[i].value);
+            ext_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count());
+        }
+        if (!group[i].hit)
+            count(counters[shard[i]].misses);
+        else if (in_ext[i])
+            count(counters[shard[i]].ext_hits);
+    }
+}
+
+/**
+ * @brief Map a key to a value, replacing any previous value
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags Opaque flags stored with the value
+ * @param[out] cas Optional location where the version of the
+ * new value is copied
+ *
+ * @return true if stored, false if no memory could be freed
+ * for it or the key is longer than `ITEM_KEY_MAX` bytes
+ */
+bool Store::put(const std::string &key, const std::string &value, uint32_t flags,
+                uint64_t *cas)
+{
+    uint64_t hash = hash_bytes(key.data(), key.size());
+    int shard = shard_for(hash);
+    std::unique_lock<shard_mutex_t> lock(shard_mutex[shard]); // write
+    if (detached)
+        return false;
+    return store_item(shard, hash, find(shard_header(shard), hash, key), key, value, flags, cas);
+}
+
+/**
+ * @brief Map a key to a value only if the key is not stored yet
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags Opaque flags stored with the value
+ * @param[out] cas Optional location where the version of the
+ * new value is copied
+ *
+ * @return `STORE_OK` if stored, `STORE_EXISTS` if the key
+ * holds a value already, or `STORE_NO_MEMORY`
+ */
+store_status_t Store::add(const std::string &key, const std::string &value, uint32_t flags,
+                          uint64_t *cas)
+{
+    uint64_t hash = hash_bytes(key.data(), key.size());
+    int shard = shard_for(hash);
+    std::unique_lock<shard_mutex_t> lock(shard_mutex[shard]); // write
+    if (detached)
+        return STORE_NO_MEMORY;
+    if (find(shard_header(shard), hash, key))
+        return STORE_EXISTS;
+    return store_item(shard, hash, 0, key, value, flags, cas) ? STORE_OK : STORE_NO_MEMORY;
+}
+
+/**
+ * @brief Replace the value of a key only if it is still at
+ * the version the caller read
+ *
+ * @param[in] key The key
+ * @param[in] value The new value
+ * @param[in] flags Opaque flags stored with the value
+ * @param[in] expected The version returned by `get()`
+ * @param[out] cas Optional location where the version of the
+ * new value is copied
+ *
+ * @return `STORE_OK` if replaced, `STORE_EXISTS` if the value
+ * changed since, `STORE_NOT_FOUND` or `STORE_NO_MEMORY`
+ */
+store_status_t Store::compare_and_swap(const std::string &key, const std::string &value,
+                                       uint32_t flags, uint64_t expected, uint64_t *cas)
+{
+    uint64_t hash = hash_bytes(key.data(), key.size());
+    int shard = shard_for(hash);
+    std::unique_lock<shard_mutex_t> lock(shard_mutex[shard]); // write
+    uint64_t old = detached ? 0 : find(shard_header(shard), hash, key);
+    if (!old)
+        return STORE_NOT_FOUND;
+    if (item_at(old)->cas != expected)
+        return STORE_EXISTS;
+    return store_item(shard, hash, old, key, value, flags, cas) ? STORE_OK : STORE_NO_MEMORY;
+}
+
+/**
+ * @brief Add to or subtract from a value holding a decimal
+ * number. Additions wrap around at 2^64, subtractions stop at 0.
+ *
+ * @param[in] key The key
+ * @param[in] delta The amount to add or subtract
+ * @param[in] decr Subtract instead of add
+ * @param[out] result Location where the new number is copied
+ * @param[out] cas Optional location where the version of the
+ * new value is copied
+ *
+ * @return `STORE_OK`, `STORE_NOT_FOUND`, `STORE_NOT_NUMBER` or
+ * `STORE_NO_MEMORY`
+ */
+store_status_t Store::incr(const std::string &key, uint64_t delta, bool decr,
+                           uint64_t *result, uint64_t *cas)
+{
+    uint64_t hash = hash_bytes(key.data(), key.size());
+    int shard = shard_for(hash);
+    std::string value;
+    std::unique_lock<shard_mutex_t> lock(shard_mutex[shard]); // write
+    uint64_t old = find_for_update(shard, hash, key, value);
+    if (!old)
+        return STORE_NOT_FOUND;
+
+    // at most 20 digits, the range of a 64 bit number
+    uint64_t n = 0;
+    if (value.empty() || value.size() > 20)
+        return STORE_NOT_NUMBER;
+    for (char c : value)
+    {
+        if (c < '0' || c > '9' || n > (UINT64_MAX - (c - '0')) / 10)
+            return STORE_NOT_NUMBER;
+        n = n * 10 + (c - '0');
+    }
+
+    n = decr ? (n > delta ? n - delta : 0) : n + delta;
+    if (!store_item(shard, hash, old, key, std::to_string(n), item_at(old)->client_flags, cas))
+        return STORE_NO_MEMORY;
+    *result = n;
+    return STORE_OK;
+}
+
+/**
+ * @brief Add bytes at the end or the start of a value,
+ * keeping its flags
+ *
+ * @param[in] key The key
+ * @param[in] data The bytes to add
+ * @param[in] prepend Add at the start instead of the end
+ * @param[out] cas Optional location where the version of the
+ * new value is copied
+ *
+ * @return `STORE_OK`, `STORE_NOT_FOUND` or `STORE_NO_MEMORY`
+ */
+store_status_t Store::append(const std::string &key, const std::string &data, bool prepend,
+                             uint64_t *cas)
+{
+    uint64_t hash = hash_bytes(key.data(), key.size());
+    int shard = shard_for(hash);
+    std::string value;
+    std::unique_lock<shard_mutex_t> lock(shard_mutex[shard]); // write
+    uint64_t old = find_for_update(shard, hash, key, value);
+    if (!old)
+        return STORE_NOT_FOUND;
+
+    value = prepend ? data + value : value + data;
+    return store_item(shard, hash, old, key, value, item_at(old)->client_flags, cas)
+               ? STORE_OK
+               : STORE_NO_MEMORY;
+}
+
+/**
+ * @brief find a key and read its value for an update, the
+ * shard must be write locked
+ *
+ * @return offset of the item, 0 if not found or its value
+ * was lost from the ext file
+ */
+uint64_t Store::find_for_update(int shard, uint64_t hash, const std::string &key,
+                                std::string &value)
+{
+    uint64_t off = detached ? 0 : find(shard_header(shard), hash, key);
+    // a value in the ext file is read with the shard held, updates
+    // of flushed values are rare enough
+    if (!off || !item_value(item_at(off), value))
+        return 0;
+    return off;
+}
+
+/**
+ * @brief map a key to a value in a shard, replacing the item
+ * at `old` if not 0. The shard must be write locked.
+ *
+ * @return true if stored, false if no memory could be freed
+ */
+bool Store::store_item(int shard, uint64_t hash, uint64_t old, const std::string &key,
+                       const std::string &value, uint32_t flags, uint64_t *cas)
+{
+    if (key.size() > ITEM_KEY_MAX)
+        return false;
+
+    // values too large for one chunk are chained
+    int cls = class_for(sizeof(item_t) + key.size() + value.size());
+    bool chained = cls < 0;
+    if (chained)
+    {
+        cls = seg_header()->nclasses - 1;
+        if (sizeof(item_t) + key.size() + sizeof(uint64_t) >= seg_header()->class_size[cls])
+            return false;
+    }
+
+    // the old item stays until the new one is written, so a put
+    // that finds no memory leaves the old value in place. Meanwhile
+    // it is off its LRU list and marked, so making room skips it.
+    shard_header_t *sh = shard_header(shard);
+    auto restore_old = [&]()
+    {
+        if (!old)
+            return;
+        item_at(old)->flags &= ~ITEM_NEW;
+        lru_push_head(sh, old);
+    };
+    if (old)
+    {
+        lru_remove(sh, old);
+        item_at(old)->flags |= ITEM_NEW;
+    }
+    uint64_t off = alloc_chunk(sh, cls);
+    if (!off)
+    {
+        restore_old();
+        return false;
+    }
+
+    item_t *it = item_at(off);
+    it->hash = (uint32_t)hash;
+    it->vlen = value.size();
+    it->klen = key.size();
+    it->cls = cls;
+    it->flags = ITEM_NEW | (chained ? ITEM_CHAINED : 0);
+    if (admission)
+    {
+        // new keys only wait on the window once the shard handed out
+        // all its memory, until then there is room for every key
+        if (!old && sh->top + seg_header()->class_size[cls] > sh->end)
+            it->flags |= ITEM_WINDOW;
+        sketch[shard].add(hash);
+    }
+    it->client_flags = flags;
+    it->epoch = current_epoch();
+    memcpy(it->data, key.data(), key.size());
+    if (!chained)
+    {
+        memcpy(it->data + key.size(), value.data(), value.size());
+    }
+    else if (!store_chain(sh, it, value))
+    {
+        free_chunk(sh, off, cls);
+        restore_old();
+        return false;
+    }
+
+    restore_old();
+    if (old)
+        unlink_item(sh, old);
+    it->flags &= ~ITEM_NEW;
+
+    // versions are unique across shards and never 0
+    it->cas = ++sh->next_cas * STORE_SHARDS + shard;
+    if (cas)
+        *cas = it->cas;
+
+    item_ref_t *bucket = bucket_of(sh, hash);
+    it->h_next = *bucket;
+    *bucket = ref_of(off);
+    lru_push_head(sh, off);
+    sh->items++;
+    maybe_grow(sh);
+    return true;
+}
+
+/**
+ * @brief Remove a key and its value
+ *
+ * @param[in] key The key
+ * @param[out] value Optional location where the removed value
+ * is copied
+ * @param[out] flags Optional location where the flags of the
+ * removed value are copied
+ *
+ * @return true if the key was present, else false
+ */
+bool Store::remove(const std::string &key, std::string *value, uint32_t *flags)
+{
+    uint64_t hash = hash_bytes(key.data(), key.size());
+    int shard = shard_for(hash);
+    std::unique_lock<shard_mutex_t> lock(shard_mutex[shard]); // write
+    shard_header_t *sh = shard_header(shard);
+    uint64_t off = detached ? 0 : find(sh, hash, key);
+    if (!off)
+        return false;
+
+    item_t *it = item_at(off);
+    if (value && !item_value(it, *value))
+        value->clear();
+    if (flags)
+        *flags = it->client_flags;
+    unlink_item(sh, off);
+    return true;
+}
+
+/**
+ * @brief Remove every key in constant time. The epoch of the
+ * store is bumped, so items written before read as misses; their
+ * memory is reclaimed by eviction, or by a background crawler
+ * that holds one shard for a few buckets at a time.
+ */
+void Store::flush_all()
+{
+    if (detached)
+        return;
+    __atomic_fetch_add(&seg_header()->epoch, 1, __ATOMIC_RELEASE);
+    if (!single_owner)
+        request_crawl();
+}
+
+/**
+ * @brief Call `fn` with the key, value and flags of every item
+ * dropped from memory to make room from now on. Items whose
+ * value is moved to the ext file are not dropped. `fn` runs
+ * while the shard of the item is locked, so it must not call
+ * back into the store. Set it before the store is shared
+ * between threads.
+ *
+ * @param[in] fn Callback receiving the key, the value and
+ * the flags
+ */
+void Store::set_evict_listener(std::function<void(const std::string &, const std::string &, uint32_t)> fn)
+{
+    evict_listener = fn;
+}
+
+/**
+ * @brief Number of keys currently stored
+ *
+ * @return the number of keys
+ */
+size_t Store::size()
+{
+    size_t n = 0;
+    for (int i = 0; i < STORE_SHARDS; i++)
+    {
+        std::shared_lock<shard_mutex_t> lock(shard_mutex[i]);
+        n += shard_header(i)->items;
+    }
+    return n;
+}
+
+/**
+ * @brief Number of items evicted to make room for new ones
+ *
+ * @return the number of evictions
+ */
+size_t Store::evictions()
+{
+    size_t n = 0;
+    for (int i = 0; i < STORE_SHARDS; i++)
+    {
+        std::shared_lock<shard_mutex_t> lock(shard_mutex[i]);
+        n += shard_header(i)->evictions;
+    }
+    return n;
+}
+
+/**
+ * @brief Hit, miss and latency figures per tier
+ *
+ * @return the figures
+ */
+store_stats_t Store::stats()
+{
+    store_stats_t st = {};
+    for (int i = 0; i < STORE_SHARDS; i++)
+    {
+        std::shared_lock<shard_mutex_t> lock(shard_mutex[i]);
+        shard_header_t *sh = shard_header(i);
+        st.items += sh->items;
+        st.evictions += sh->evictions;
+        st.ext_flushes += sh->ext_flushes;
+        st.admission_rejects += sh->admission_rejects;
+        st.ram_hits += counters[i].ram_hits;
+        st.ext_hits += counters[i].ext_hits;
+        st.misses += counters[i].misses;
+    }
+
+    st.reclaimed = reclaimed;
+
+    uint64_t n = ram_latency.count;
+    st.ram_avg_ns = n ? ram_latency.total_ns / n : 0;
+    st.ram_p99_ns = ram_latency.percentile(0.99);
+    n = ext_latency.count;
+    st.ext_avg_ns = n ? ext_latency.total_ns / n : 0;
+    st.ext_p99_ns = ext_latency.percentile(0.99);
+
+    st.ext_enabled = ext != NULL;
+    if (ext)
+        st.ext = ext->stats();
+    return st;
+}
+
+/**
+ * @brief Indicates if the items were found in the segment file
+ * when this store was created
+ *
+ * @return true if attached to existing items, else false
+ */
+bool Store::attached()
+{
+    return was_attached;
+}
+
+/**
+ * @brief Make the segment file consistent and mark it cleanly
+ * detached so a new process can attach to it. The store serves
+ * every later request as a miss. Does nothing for a store in
+ * anonymous memory.
+ */
+void Store::detach()
+{
+    if (seg_fd < 0)
+        return;
+
+    for (int i = 0; i < STORE_SHARDS; i++)
+        shard_mutex[i].lock();
+    if (!detached)
+    {
+        detached = true;
+        seg_header()->clean = 1;
+        msync(base, seg_bytes, MS_SYNC);
+        flock(seg_fd, LOCK_UN);
+    }
+    for (int i = 0; i < STORE_SHARDS; i++)
+        shard_mutex[i].unlock();
+}
+
+/**
+ * @brief Call `fn` on every key-value pair. Shards are visited
+ * one at a time while holding a shared lock on that shard only.
+ *
+ * @param[in] fn Callback receiving the key and the value
+ */
+void Store::for_each(std::function<void(const std::string &, const std::string &)> fn)
+{
+    for (int i = 0; i < STORE_SHARDS; i++)
+        for_each_in_shard(i, [&fn](const std::string &key, const std::string &value, uint32_t)
+                          { fn(key, value); });
+}
+
+/**
+ * @brief Call `fn` on every key-value pair of one shard, with
+ * the flags stored with the value, while holding a shared lock
+ * on that shard
+ *
+ * @param[in] shard The shard, below `STORE_SHARDS`
+ * @param[in] fn Callback receiving the key, the value and
+ * the flags
+ */
+void Store::for_each_in_shard(int shard,
+                              std::function<void(const std::string &, const std::string &, uint32_t)> fn)
+{
+    std::shared_lock<shard_mutex_t> lock(shard_mutex[shard]);
+    if (detached)
+        return;
+
+    std::string value;
+    walk_shard(shard, [&](item_t *it)
+               {
+                   if (item_live(it) && item_value(it, value))
+                       fn(std::string(it->data, it->klen), value, it->client_flags); });
+}
+
+/**
+ * @brief call `fn` on every item of a shard, the shard
+ * must be locked
+ */
+void Store::walk_shard(int shard, std::function<void(item_t *)> fn)
+{
+    shard_header_t *sh = shard_header(shard);
+    item_ref_t *buckets = (item_ref_t *)(base + sh->buckets);
+    for (uint64_t b = 0; b < sh->nbuckets; b++)
+    {
+        for (uint64_t off = off_of(buckets[b]); off; off = off_of(item_at(off)->h_next))
+        {
+            fn(item_at(off));
+        }
+    }
+}
+
+
+/**
+ * @brief have the crawler reclaim the dead items, starting it
+ * if needed
+ */
+void Store::request_crawl()
+{
+    std::lock_guard<std::mutex> lock(crawler_mutex);
+    crawl_pending = true;
+    if (!crawler.joinable())
+        crawler = std::thread(&Store::crawl, this);
+    crawler_cv.notify_all();
+}
+
+/**
+ * @brief reclaim dead items whenever a flush asks for it,
+ * until the store is destroyed
+ */
+void Store::crawl()
+{
+    std::unique_lock<std::mutex> lock(crawler_mutex);
+    while (true)
+    {
+        crawler_cv.wait(lock, [this]()
+                        { return stopping || crawl_pending; });
+        if (stopping)
+            return;
+
+        // a flush while crawling asks for another pass
+        crawl_pending = false;
+        lock.unlock();
+        for (int i = 0; i < STORE_SHARDS; i++)
+            crawl_shard(i);
+        lock.lock();
+    }
+}
+
+/**
+ * @brief unlink the dead items of a shard, holding the shard
+ * for `CRAWL_BUCKETS` buckets at a time
+ */
+void Store::crawl_shard(int shard)
+{
+    // buckets split by a growing table between two holds only
+    // move items to buckets not visited yet
+    for (uint64_t b = 0;;)
+    {
+        std::unique_lock<shard_mutex_t> lock(shard_mutex[shard]); // write
+        shard_header_t *sh = shard_header(shard);
+        if (detached || b >= sh->nbuckets)
+            return;
+
+        item_ref_t *buckets = (item_ref_t *)(base + sh->buckets);
+        for (uint64_t end = std::min<uint64_t>(b + CRAWL_BUCKETS, sh->nbuckets); b < end; b++)
+        {
+            item_ref_t *link = &buckets[b];
+            while (*link)
+            {
+                item_t *it = item_at(off_of(*link));
+                if (item_live(it))
+                {
+                    link = &it->h_next;
+                    continue;
+                }
+                // unlinking makes `link` point to the next item
+                unlink_item(sh, off_of(*link));
+                reclaimed++;
+            }
+        }
+    }
+}
+
+/**
+ * @brief compact mostly dead pages of the ext file until
+ * the store is destroyed
+ */
+void Store::compact_ext()
+{
+    std::unique_lock<std::mutex> lock(compactor_mutex);
+    while (!compactor_cv.wait_for(lock, std::chrono::milliseconds(EXT_COMPACT_INTERVAL_MS), [this]()
+                                  { return stopping; }))
+    {
+        lock.unlock();
+        int page;
+        for (int n = 0; n < EXT_COMPACT_PAGES_MAX &&
+                        (page = ext->compaction_candidate()) >= 0;
+             n++)
+        {
+            compact_page(page);
+        }
+        lock.lock();
+    }
+}
+
+/**
+ * @brief move the live objects of an ext file page to the
+ * open page and reclaim it
+ */
+void Store::compact_page(uint32_t page)
+{
+    std::string buf;
+    uint32_t version, used;
+    if (!ext->read_page(page, buf, &version, &used))
+        return;
+
+    uint32_t pos = 0;
+    while (pos + sizeof(ext_obj_t) <= used)
+    {
+        ext_obj_t *obj = (ext_obj_t *)(buf.data() + pos);
+        uint32_t len = ext_obj_size(obj->klen, obj->vlen);
+        if (pos + len > used)
+            break;
+
+        const char *key = buf.data() + pos + sizeof(*obj);
+        uint64_t hash = hash_bytes(key, obj->klen);
+        int shard = shard_for(hash);
+        std::unique_lock<shard_mutex_t> lock(shard_mutex[shard]);
+
+        // only objects an item still points to are moved
+        uint64_t off = detached ? 0 : find(shard_header(shard), hash, std::string(key, obj->klen));
+        item_t *it = item_at(off);
+        if (it && (it->flags & ITEM_EXT))
+        {
+            ext_ptr_t ptr = item_ext_ptr(it), moved;
+            if (ptr.page == page && ptr.version == version && ptr.offset == pos &&
+                ext->append(key, obj->klen, key + obj->klen, obj->vlen, &moved))
+            {
+                ext->release(ptr);
+                memcpy(it->data + it->klen, &moved, sizeof(moved));
+            }
+        }
+        pos += len;
+    }
+    ext->reclaim(page);
+}
@@ -0,0 +1,785 @@
+/**
+ * @file /src/store/store.hpp
+ *
+ * @brief This file contains the declaration of the `Store` class.
+ * An instance of this class holds the key-value state of a single
+ * server and guards it against concurrent access. It is kept apart
+ * from `Server` so it can be exercised without any sockets.
+ * The implementation is present in /src/store/store.cpp
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <string>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "segment.hpp"
+#include "extstore.hpp"
+
+/* Number of independently locked partitions of the store */
+#define STORE_SHARDS 16
+
+/* Default memory limit of a store */
+#define STORE_DEFAULT_MB 64
+
+/* 4 bit counters of the admission sketch per item a shard can hold */
+#define ADMISSION_COUNTERS_PER_ITEM 8
+
+/* Sketch counters are halved after this many additions per item
+ * a shard can hold, so old popularity fades */
+#define ADMISSION_SAMPLE_FACTOR 10
+
+/* Share of the items of a class kept on its window list, in percent */
+#define ADMISSION_WINDOW_PERCENT 1
+
+/* Keys of a batched lookup whose buckets are prefetched before any
+ * of them is probed */
+#define STORE_BATCH_GROUP 16
+
+/**
+ * @brief Settings of a store
+ */
+struct store_opts_t
+{
+    /* Memory available for buckets and items, in bytes */
+    size_t memory_bytes = (size_t)STORE_DEFAULT_MB << 20;
+
+    /* If set, items live in a shared mapping of this file (for
+     * example under /dev/shm) and survive the process. A later
+     * store opened on the same file with the same settings
+     * attaches to the items instead of starting empty. */
+    std::string segment_path = "";
+
+    /* If set, values of evicted items are moved to this file
+     * (the second tier) instead of being dropped */
+    std::string ext_path = "";
+
+    /* Size of the ext file, in bytes */
+    size_t ext_bytes = (size_t)1 << 30;
+
+    /* Only values at least this long are moved to the ext file */
+    size_t ext_min_value = 256;
+
+    /* Only the thread that created the store ever uses it, so its
+     * shards are not locked and its counters are not updated
+     * atomically. There is no ext file, and items dead after a flush
+     * are reclaimed by eviction only, as both need a background
+     * thread. */
+    bool single_owner = false;
+
+    /* New keys wait on a small window list, and once they leave it
+     * they only displace the eviction candidate if they were
+     * requested more often, as estimated by a frequency sketch.
+     * Keys seen once, as in a scan, then no longer push out the
+     * working set. */
+    bool admission = false;
+};
+
+/**
+ * @brief Count-Min sketch of 4 bit counters estimating how often
+ * keys were requested recently. Counters are read and written
+ * without a locked instruction: a concurrent update may be lost,
+ * which only makes an estimate a little low.
+ */
+struct freq_sketch_t
+{
+    std::vector<uint64_t> words; // 16 counters each
+    uint64_t mask;
+    uint64_t additions;
+    uint64_t sample_size;
+
+    /**
+     * @brief size the sketch for `capacity` items
+     */
+    void init(uint64_t capacity);
+
+    /**
+     * @brief count one request of the key with this hash
+     */
+    void add(uint32_t hash);
+
+    /**
+     * @brief estimated requests of the key with this hash, at most 15
+     */
+    unsigned int estimate(uint32_t hash);
+
+    /**
+     * @brief halve every counter
+     */
+    void age();
+};
+
+/**
+ * @brief Figures describing a store and its tiers
+ */
+struct store_stats_t
+{
+    uint64_t items;
+    uint64_t evictions;
+    uint64_t reclaimed; // dead items freed after a flush
+    uint64_t ext_flushes;
+    uint64_t admission_rejects; // new items evicted by the admission filter
+    uint64_t ram_hits;
+    uint64_t ext_hits;
+    uint64_t misses;
+
+    // read latency per tier, memory reads are sampled
+    uint64_t ram_avg_ns, ram_p99_ns;
+    uint64_t ext_avg_ns, ext_p99_ns;
+
+    bool ext_enabled;
+    ext_stats_t ext;
+};
+
+/**
+ * @brief One key of a batched lookup and what was found for it
+ */
+struct store_lookup_t
+{
+    std::string key;
+    bool hit;
+    std::string value;
+    uint32_t flags;
+    uint64_t cas;
+};
+
+/**
+ * @brief Outcome of an update of a stored value
+ */
+enum store_status_t
+{
+    STORE_OK,
+    STORE_NOT_FOUND,
+    STORE_EXISTS,     // the value changed since the given version
+    STORE_NOT_NUMBER, // the value is not a decimal number
+    STORE_NO_MEMORY,
+};
+
+/**
+ * @brief Figures reported after loading a snapshot
+ */
+struct snapshot_stats_t
+{
+    size_t items;
+    size_t bytes;
+    double seconds;
+};
+
+/**
+ * @brief A thread-safe key-value store with a fixed memory limit.
+ * Keys are spread over `STORE_SHARDS` shards that are locked
+ * independently. When a shard runs out of memory the least
+ * recently used items of the needed size class are evicted, or the
+ * rarely requested new ones if admission is enabled. If an
+ * ext file is configured, the values of evicted items are moved
+ * there and only their keys stay in memory.
+ */
+class Store
+{
+public:
+    /**
+     * @brief Create a store in anonymous memory with the
+     * default settings
+     */
+    Store();
+
+    /**
+     * @brief Create a store, or attach to the segment file
+     * named in `opts` if it holds a compatible, cleanly
+     * detached store
+     *
+     * @param[in] opts Settings of the store
+     */
+    Store(const store_opts_t &opts);
+
+    /**
+     * @brief Stop the ext file compactor and unmap the store,
+     * detaching it first if it is backed by a segment file
+     */
+    ~Store();
+
+    /**
+     * @brief Look up the value mapped to a key
+     *
+     * @param[in] key The key to look up
+     * @param[out] value Location where the value is copied on a hit
+     * @param[out] flags Optional location where the flags stored
+     * with the value are copied on a hit
+     * @param[out] cas Optional location where the version of the
+     * value is copied on a hit
+     *
+     * @return true on a hit, else false
+     */
+    bool get(const std::string &key, std::string &value, uint32_t *flags = NULL,
+             uint64_t *cas = NULL);
+
+    /**
+     * @brief Look up several keys like `get()`. The keys are taken
+     * `STORE_BATCH_GROUP` at a time: all of them are hashed and
+     * their buckets prefetched, then the first item of every
+     * bucket, and only then are they probed, so the cache misses of
+     * the keys of a group overlap instead of following each other.
+     *
+     * @param[in,out] lookups The keys, their outcome is filled in
+     */
+    void get_batch(std::vector<store_lookup_t> &lookups);
+
+    /**
+     * @brief Map a key to a value, replacing any previous value
+     *
+     * @param[in] key The key
+     * @param[in] value The value
+     * @param[in] flags Opaque flags stored with the value
+     * @param[out] cas Optional location where the version of the
+     * new value is copied
+     *
+     * @return true if stored, false if no memory could be freed
+     * for it or the key is longer than `ITEM_KEY_MAX` bytes
+     */
+    bool put(const std::string &key, const std::string &value, uint32_t flags = 0,
+             uint64_t *cas = NULL);
+
+    /**
+     * @brief Map a key to a value only if the key is not stored yet
+     *
+     * @param[in] key The key
+     * @param[in] value The value
+     * @param[in] flags Opaque flags stored with the value
+     * @param[out] cas Optional location where the version of the
+     * new value is copied
+     *
+     * @return `STORE_OK` if stored, `STORE_EXISTS` if the key
+     * holds a value already, or `STORE_NO_MEMORY`
+     */
+    store_status_t add(const std::string &key, const std::string &value, uint32_t flags = 0,
+                       uint64_t *cas = NULL);
+
+    /**
+     * @brief Replace the value of a key only if it is still at
+     * the version the caller read
+     *
+     * @param[in] key The key
+     * @param[in] value The new value
+     * @param[in] flags Opaque flags stored with the value
+     * @param[in] expected The version returned by `get()`
+     * @param[out] cas Optional location where the version of the
+     * new value is copied
+     *
+     * @return `STORE_OK` if replaced, `STORE_EXISTS` if the value
+     * changed since, `STORE_NOT_FOUND` or `STORE_NO_MEMORY`
+     */
+    store_status_t compare_and_swap(const std::string &key, const std::string &value,
+                                    uint32_t flags, uint64_t expected, uint64_t *cas = NULL);
+
+    /**
+     * @brief Add to or subtract from a value holding a decimal
+     * number. Additions wrap around at 2^64, subtractions stop at 0.
+     *
+     * @param[in] key The key
+     * @param[in] delta The amount to add or subtract
+     * @param[in] decr Subtract instead of add
+     * @param[out] result Location where the new number is copied
+     * @param[out] cas Optional location where the version of the
+     * new value is copied
+     *
+     * @return `STORE_OK`, `STORE_NOT_FOUND`, `STORE_NOT_NUMBER` or
+     * `STORE_NO_MEMORY`
+     */
+    store_status_t incr(const std::string &key, uint64_t delta, bool decr,
+                        uint64_t *result, uint64_t *cas = NULL);
+
+    /**
+     * @brief Add bytes at the end or the start of a value,
+     * keeping its flags
+     *
+     * @param[in] key The key
+     * @param[in] data The bytes to add
+     * @param[in] prepend Add at the start instead of the end
+     * @param[out] cas Optional location where the version of the
+     * new value is copied
+     *
+     * @return `STORE_OK`, `STORE_NOT_FOUND` or `STORE_NO_MEMORY`
+     */
+    store_status_t append(const std::string &key, const std::string &data, bool prepend,
+                          uint64_t *cas = NULL);
+
+    /**
+     * @brief Remove a key and its value
+     *
+     * @param[in] key The key
+     * @param[out] value Optional location where the removed value
+     * is copied
+     * @param[out] flags Optional location where the flags of the
+     * removed value are copied
+     *
+     * @return true if the key was present, else false
+     */
+    bool remove(const std::string &key, std::string *value = NULL, uint32_t *flags = NULL);
+
+    /**
+     * @brief Remove every key in constant time. The epoch of the
+     * store is bumped, so items written before read as misses; their
+     * memory is reclaimed by eviction, or by a background crawler
+     * that holds one shard for a few buckets at a time.
+     */
+    void flush_all();
+
+    /**
+     * @brief Call `fn` with the key, value and flags of every item
+     * dropped from memory to make room from now on. Items whose
+     * value is moved to the ext file are not dropped. `fn` runs
+     * while the shard of the item is locked, so it must not call
+     * back into the store. Set it before the store is shared
+     * between threads.
+     *
+     * @param[in] fn Callback receiving the key, the value and
+     * the flags
+     */
+    void set_evict_listener(std::function<void(const std::string &, const std::string &, uint32_t)> fn);
+
+    /**
+     * @brief Number of keys currently stored
+     *
+     * @return the number of keys
+     */
+    size_t size();
+
+    /**
+     * @brief Number of items evicted to make room for new ones
+     *
+     * @return the number of evictions
+     */
+    size_t evictions();
+
+    /**
+     * @brief Hit, miss and latency figures per tier
+     *
+     * @return the figures
+     */
+    store_stats_t stats();
+
+    /**
+     * @brief Indicates if the items were found in the segment file
+     * when this store was created
+     *
+     * @return true if attached to existing items, else false
+     */
+    bool attached();
+
+    /**
+     * @brief Make the segment file consistent and mark it cleanly
+     * detached so a new process can attach to it. The store serves
+     * every later request as a miss. Does nothing for a store in
+     * anonymous memory.
+     */
+    void detach();
+
+    /**
+     * @brief Call `fn` on every key-value pair. Shards are visited
+     * one at a time while holding a shared lock on that shard only.
+     *
+     * @param[in] fn Callback receiving the key and the value
+     */
+    void for_each(std::function<void(const std::string &, const std::string &)> fn);
+
+    /**
+     * @brief Call `fn` on every key-value pair of one shard, with
+     * the flags stored with the value, while holding a shared lock
+     * on that shard. Callers that walk the shards one by one hold
+     * up the writers of a single shard at a time.
+     *
+     * @param[in] shard The shard, below `STORE_SHARDS`
+     * @param[in] fn Callback receiving the key, the value and
+     * the flags
+     */
+    void for_each_in_shard(int shard,
+                           std::function<void(const std::string &, const std::string &, uint32_t)> fn);
+
+    /**
+     * @brief Write the store to a snapshot file while it keeps
+     * serving requests. Each shard is copied under its own shared
+     * lock, so only writers to the shard being copied ever wait.
+     * The file is written next to `path` and renamed over it once
+     * complete.
+     *
+     * @param[in] path The snapshot file
+     *
+     * @return number of items written, -1 in case of an error
+     */
+    long save_snapshot(const std::string &path);
+
+    /**
+     * @brief Bulk load a snapshot file written by `save_snapshot`.
+     * The file is mapped into memory and its sections are inserted
+     * by `nthreads` threads in parallel.
+     *
+     * @param[in] path The snapshot file
+     * @param[in] nthreads Number of loader threads
+     * @param[out] stats Location where the load figures are saved
+     *
+     * @return true if the snapshot was loaded, else false
+     */
+    bool load_snapshot(const std::string &path, unsigned int nthreads,
+                       snapshot_stats_t *stats);
+
+private:
+    char *base;         // start of the segment
+    size_t seg_bytes;   // length of the mapping
+    int seg_fd;         // -1 for anonymous memory
+    bool was_attached;
+    bool detached;
+
+    bool single_owner;
+
+    bool admission;
+    freq_sketch_t sketch[STORE_SHARDS];
+
+    /**
+     * @brief Lock of a shard, doing nothing in a store with a
+     * single owner
+     */
+    struct shard_mutex_t
+    {
+        std::shared_mutex mutex;
+        bool enabled = true;
+
+        inline void lock()
+        {
+            if (enabled)
+                mutex.lock();
+        }
+
+        inline void unlock()
+        {
+            if (enabled)
+                mutex.unlock();
+        }
+
+        inline void lock_shared()
+        {
+            if (enabled)
+                mutex.lock_shared();
+        }
+
+        inline void unlock_shared()
+        {
+            if (enabled)
+                mutex.unlock_shared();
+        }
+    };
+
+    // locks live in process memory, the segment only holds data
+    shard_mutex_t shard_mutex[STORE_SHARDS];
+
+    struct alignas(64) shard_counters_t
+    {
+        std::atomic<uint64_t> ram_hits = {0};
+        std::atomic<uint64_t> ext_hits = {0};
+        std::atomic<uint64_t> misses = {0};
+    };
+    shard_counters_t counters[STORE_SHARDS];
+    std::atomic<uint64_t> reclaimed = {0}; // dead items freed after a flush
+    latency_hist_t ram_latency, ext_latency;
+
+    std::function<void(const std::string &, const std::string &, uint32_t)> evict_listener;
+
+    ExtStore *ext;
+    size_t ext_min_value;
+    std::thread compactor;
+    std::mutex compactor_mutex;
+    std::condition_variable compactor_cv;
+    bool stopping; // set under both the compactor and crawler mutex
+
+    // started by the first flush
+    std::thread crawler;
+    std::mutex crawler_mutex;
+    std::condition_variable crawler_cv;
+    bool crawl_pending;
+
+    /**
+     * @brief map the segment and attach to it or format it
+     */
+    void open_segment(const store_opts_t &opts);
+
+    /**
+     * @brief open the ext file if configured, after dropping items
+     * of an attached segment that refer to an earlier ext file
+     */
+    void open_ext(const store_opts_t &opts);
+
+    /**
+     * @brief check that the mapped segment was written by a
+     * compatible build with the same settings
+     *
+     * @return empty string if compatible, else the reason why not
+     */
+    std::string check_segment(uint64_t shard_bytes);
+
+    /**
+     * @brief lay out an empty store in the mapped segment
+     */
+    void format_segment(uint64_t shard_bytes);
+
+    /**
+     * @brief translate an offset into the segment to a pointer
+     */
+    inline item_t *item_at(uint64_t off)
+    {
+        return off ? (item_t *)(base + off) : NULL;
+    }
+
+    /**
+     * @brief add one to a counter, without a locked instruction
+     * if the store has a single owner
+     */
+    inline void count(std::atomic<uint64_t> &counter)
+    {
+        if (single_owner)
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        else
+            counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline seg_header_t *seg_header()
+    {
+        return (seg_header_t *)base;
+    }
+
+    shard_header_t *shard_header(int shard);
+
+    inline uint32_t current_epoch()
+    {
+        return __atomic_load_n(&seg_header()->epoch, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * @brief Indicates if an item was written since the last flush
+     */
+    inline bool item_live(item_t *it)
+    {
+        return it->epoch == current_epoch();
+    }
+
+    item_ref_t *bucket_of(shard_header_t *sh, uint64_t hash);
+
+    /**
+     * @brief smallest size class that fits `bytes`, -1 if none
+     */
+    int class_for(size_t bytes);
+
+    /**
+     * @brief find a live item in a shard, the shard must be locked
+     *
+     * @return offset of the item, 0 if not found
+     */
+    uint64_t find(shard_header_t *sh, uint64_t hash, const std::string &key);
+
+    /**
+     * @brief look up at most `STORE_BATCH_GROUP` keys, locking each
+     * of their shards once, see `get_batch()`
+     */
+    void get_group(store_lookup_t *group, size_t n);
+
+    /**
+     * @brief map a key to a value in a shard, replacing the item
+     * at `old` if not 0. The shard must be write locked.
+     *
+     * @return true if stored, false if no memory could be freed
+     */
+    bool store_item(int shard, uint64_t hash, uint64_t old, const std::string &key,
+                    const std::string &value, uint32_t flags, uint64_t *cas);
+
+    /**
+     * @brief find a key and read its value for an update, the
+     * shard must be write locked
+     *
+     * @return offset of the item, 0 if not found or its value
+     * was lost from the ext file
+     */
+    uint64_t find_for_update(int shard, uint64_t hash, const std::string &key,
+                             std::string &value);
+
+    /**
+     * @brief the least recently used item of a class, giving items
+     * read since they were last seen here a second chance at the
+     * head. The shard must be write locked.
+     *
+     * @return offset of the item, 0 if the class has none
+     */
+    uint64_t lru_victim(shard_header_t *sh, int cls);
+
+    /**
+     * @brief take a chunk of a class, evicting from the class
+     * LRU if needed, or from another class if this one holds no
+     * items. The shard must be write locked.
+     *
+     * @param[in] may_flush false while an item is being moved, so
+     * neither values are flushed nor memory is reassigned
+     *
+     * @return offset of the chunk, 0 if none could be freed
+     */
+    uint64_t alloc_chunk(shard_header_t *sh, int cls, bool may_flush = true);
+
+    /**
+     * @brief take memory for a chunk of a class that holds no items
+     * from the class holding the most. The chunks from the oldest
+     * item of that class on are freed, whatever class they are of,
+     * until they cover a chunk of the class; the memory left over is
+     * cut into free chunks. The shard must be write locked.
+     *
+     * @return offset of the chunk, 0 if none could be freed
+     */
+    uint64_t reassign_chunk(shard_header_t *sh, int cls);
+
+    /**
+     * @brief unlink an item to free its memory, reporting it to the
+     * evict listener unless it was dead. The shard must be write
+     * locked.
+     */
+    void evict_item(shard_header_t *sh, uint64_t off);
+
+    /**
+     * @brief put a chunk on the free list of a class, the shard
+     * must be write locked
+     */
+    void free_chunk(shard_header_t *sh, uint64_t off, int cls);
+
+    /**
+     * @brief bytes a chunk takes in its shard, the size of its class
+     * and the padding it got when memory was reassigned
+     */
+    inline uint64_t chunk_bytes(item_t *it)
+    {
+        return seg_header()->class_size[it->cls] + (uint64_t)it->pad * SLAB_ALIGN;
+    }
+
+    /**
+     * @brief pick the item to evict from a class when admission is
+     * enabled. Once the window list of the class outgrows its share,
+     * its oldest item moves to the LRU list and is evicted itself
+     * unless it was requested more often than the LRU victim. The
+     * shard must be write locked.
+     *
+     * @return offset of the item to evict, 0 if the class has none
+     */
+    uint64_t admission_victim(shard_header_t *sh, int cls);
+
+    /**
+     * @brief move the value of an item chosen for eviction to the
+     * ext file and keep only a header with its key and the location
+     * of the value in memory. On success the chunk of the item is
+     * either on the free list or was split into header chunks. The
+     * shard must be write locked.
+     *
+     * @return true if the item was moved, else false
+     */
+    bool flush_item(shard_header_t *sh, uint64_t off);
+
+    /**
+     * @brief copy the value of an item from whichever tier holds
+     * it, the shard must be locked
+     *
+     * @return true if copied, false if it was lost from the ext file
+     */
+    bool item_value(item_t *it, std::string &value);
+
+    /**
+     * @brief copy the value of an item held in memory, following
+     * its chunk chain if any. The shard must be locked.
+     */
+    void copy_value(item_t *it, std::string &value);
+
+    /**
+     * @brief copy the rest of a value past the first chunk into a
+     * chain of chunks of the same class, and link the chain to the
+     * first chunk. The shard must be write locked.
+     *
+     * @return true if stored, false if no memory could be freed
+     */
+    bool store_chain(shard_header_t *sh, item_t *it, const std::string &value);
+
+    /**
+     * @brief return every chunk of a chain to the free list, the
+     * shard must be write locked
+     */
+    void free_chain(shard_header_t *sh, uint64_t chain, int cls);
+
+    /**
+     * @brief bytes of the value held by the first chunk of an item
+     * with `ITEM_CHAINED` set
+     */
+    inline size_t chain_head_bytes(item_t *it)
+    {
+        return seg_header()->class_size[it->cls] - sizeof(item_t) - it->klen - sizeof(uint64_t);
+    }
+
+    /**
+     * @brief location of the value of an item with `ITEM_EXT` set
+     */
+    inline ext_ptr_t item_ext_ptr(item_t *it)
+    {
+        ext_ptr_t ptr;
+        memcpy(&ptr, it->data + it->klen, sizeof(ptr));
+        return ptr;
+    }
+
+    /**
+     * @brief have the crawler reclaim the dead items, starting it
+     * if needed
+     */
+    void request_crawl();
+
+    /**
+     * @brief reclaim dead items whenever a flush asks for it,
+     * until the store is destroyed
+     */
+    void crawl();
+
+    /**
+     * @brief unlink the dead items of a shard, holding the shard
+     * for `CRAWL_BUCKETS` buckets at a time
+     */
+    void crawl_shard(int shard);
+
+    /**
+     * @brief compact mostly dead pages of the ext file until
+     * the store is destroyed
+     */
+    void compact_ext();
+
+    /**
+     * @brief move the live objects of an ext file page to the
+     * open page and reclaim it
+     */
+    void compact_page(uint32_t page);
+
+    /**
+     * @brief remove an item from its bucket and LRU, and return
+     * its chunk to the free list. The shard must be write locked.
+     */
+    void unlink_item(shard_header_t *sh, uint64_t off);
+
+    void lru_push_head(shard_header_t *sh, uint64_t off);
+    void lru_remove(shard_header_t *sh, uint64_t off);
+
+    /**
+     * @brief call `fn` on every item of a shard, the shard
+     * must be locked
+     */
+    void walk_shard(int shard, std::function<void(item_t *)> fn);
+
+    /**
+     * @brief split the next `SPLIT_BUCKETS` buckets once the shard
+     * holds more than one item per two buckets. The shard must be
+     * write locked.
+     */
+    void maybe_grow(shard_header_t *sh);
+};
+
+#endif
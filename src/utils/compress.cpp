@@ -0,0 +1,245 @@
+/**
+ * @file /src/utils/compress.cpp
+ *
+ * @brief This file contains the implementation of the LZ4 block
+ * codec declared in /src/utils/compress.hpp. The compressor is the
+ * greedy single-probe variant of LZ4, the block format follows the
+ * LZ4 block format description, so blocks can be read by other LZ4
+ * implementations.
+ */
+
+#include <stdint.h>
+#include <cstring>
+#include "compress.hpp"
+
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+
+/* The last 5 bytes are always literals, and no match starts
+ * within the last 12 bytes */
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+/* Bytes of the original length in front of the block */
+#define LZ4_PREFIX 4
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/**
+ * @brief write the part of a length that does not fit its token
+ */
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/**
+ * @brief read the part of a length that did not fit its token
+ *
+ * @return false if the input ends first
+ */
+static bool read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/**
+ * @brief write one sequence of literals, followed by a match
+ * unless `match_len` is 0
+ */
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len,
+                               size_t offset, size_t match_len)
+{
+    uint8_t *token = op++;
+    size_t ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+
+    *token = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15)
+        op = write_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (!match_len)
+        return op;
+    *token |= ml < 15 ? ml : 15;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (ml >= 15)
+        op = write_length(op, ml - 15);
+    return op;
+}
+
+/**
+ * @brief Compress a value
+ *
+ * @param[in] value The value to compress
+ * @param[out] out Location where the compressed value is saved
+ *
+ * @return true if the compressed value is smaller than `value`,
+ * else false and `out` must not be used
+ */
+bool compress_value(const std::string &value, std::string &out)
+{
+    size_t n = value.size();
+    if (n > UINT32_MAX)
+        return false;
+
+    // worst case of incompressible input
+    out.resize(LZ4_PREFIX + n + n / 255 + 16);
+    uint32_t raw_len = n;
+    memcpy(&out[0], &raw_len, LZ4_PREFIX);
+
+    const uint8_t *src = (const uint8_t *)value.data();
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = (uint8_t *)&out[LZ4_PREFIX];
+    uint32_t table[1 << LZ4_HASH_LOG] = {};
+
+    if (n >= LZ4_MF_LIMIT)
+    {
+        const uint8_t *mflimit = end - LZ4_MF_LIMIT;
+        const uint8_t *matchlimit = end - LZ4_LAST_LITERALS;
+        while (ip < mflimit)
+        {
+            uint32_t seq = read32(ip), h = lz4_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq)
+            {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *m = ip + LZ4_MIN_MATCH, *r = ref + LZ4_MIN_MATCH;
+            while (m < matchlimit && *m == *r)
+            {
+                m++;
+                r++;
+            }
+            op = write_sequence(op, anchor, ip - anchor, ip - ref, m - ip);
+            ip = anchor = m;
+        }
+    }
+    op = write_sequence(op, anchor, end - anchor, 0, 0);
+
+    out.resize(op - (uint8_t *)out.data());
+    return out.size() < n;
+}
+
+/**
+ * @brief Length a compressed value decompresses to
+ *
+ * @param[in] data The compressed value
+ * @param[in] len Length of the compressed value
+ *
+ * @return the length, -1 if `data` is too short
+ */
+long decompressed_size(const char *data, size_t len)
+{
+    uint32_t raw_len;
+    if (len < LZ4_PREFIX)
+        return -1;
+    memcpy(&raw_len, data, LZ4_PREFIX);
+    return raw_len;
+}
+
+/**
+ * @brief Decompress a value into a caller buffer
+ *
+ * @param[in] data The compressed value
+ * @param[in] len Length of the compressed value
+ * @param[out] buf Location where the value is saved
+ * @param[in] buf_len Size of `buf`
+ *
+ * @return length of the value, -1 if `data` is corrupt or the
+ * value does not fit `buf_len`
+ */
+long decompress_value(const char *data, size_t len, char *buf, size_t buf_len)
+{
+    long raw_len = decompressed_size(data, len);
+    if (raw_len < 0 || (size_t)raw_len > buf_len)
+        return -1;
+
+    const uint8_t *ip = (const uint8_t *)data + LZ4_PREFIX, *iend = (const uint8_t *)data + len;
+    uint8_t *dst = (uint8_t *)buf, *op = dst, *oend = dst + raw_len;
+
+    // every length and offset is checked, the input is untrusted
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_length(&ip, iend, &lit_len))
+            return -1;
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend) // the last sequence has no match
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_length(&ip, iend, &match_len))
+            return -1;
+        match_len += LZ4_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match_len > (size_t)(oend - op))
+            return -1;
+
+        // a match may overlap the bytes it produces
+        const uint8_t *m = op - offset;
+        if (offset >= match_len)
+        {
+            memcpy(op, m, match_len);
+            op += match_len;
+        }
+        else
+        {
+            for (size_t i = 0; i < match_len; i++)
+                *op++ = *m++;
+        }
+    }
+    return op == oend ? raw_len : -1;
+}
+
+/**
+ * @brief Decompress a value
+ *
+ * @param[in] data The compressed value
+ * @param[in] len Length of the compressed value
+ * @param[out] out Location where the value is saved
+ *
+ * @return true if decompressed, false if `data` is corrupt
+ */
+bool decompress_value(const char *data, size_t len, std::string &out)
+{
+    long raw_len = decompressed_size(data, len);
+    if (raw_len < 0)
+        return false;
+    out.resize(raw_len);
+    return decompress_value(data, len, &out[0], out.size()) == raw_len;
+}
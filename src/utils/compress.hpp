@@ -0,0 +1,62 @@
+/**
+ * @file /src/utils/compress.hpp
+ *
+ * @brief This file contains a small LZ4 block codec used by the
+ * client to compress values. A compressed value is the length of
+ * the original value (4 bytes, little endian) followed by one LZ4
+ * block, so it can be decompressed without any other state.
+ * The implementation is present in /src/utils/compress.cpp
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <string>
+
+/**
+ * @brief Compress a value
+ *
+ * @param[in] value The value to compress
+ * @param[out] out Location where the compressed value is saved
+ *
+ * @return true if the compressed value is smaller than `value`,
+ * else false and `out` must not be used
+ */
+bool compress_value(const std::string &value, std::string &out);
+
+/**
+ * @brief Length a compressed value decompresses to
+ *
+ * @param[in] data The compressed value
+ * @param[in] len Length of the compressed value
+ *
+ * @return the length, -1 if `data` is too short
+ */
+long decompressed_size(const char *data, size_t len);
+
+/**
+ * @brief Decompress a value into a caller buffer
+ *
+ * @param[in] data The compressed value
+ * @param[in] len Length of the compressed value
+ * @param[out] buf Location where the value is saved
+ * @param[in] buf_len Size of `buf`
+ *
+ * @return length of the value, -1 if `data` is corrupt or the
+ * value does not fit `buf_len`
+ */
+long decompress_value(const char *data, size_t len, char *buf, size_t buf_len);
+
+/**
+ * @brief Decompress a value
+ *
+ * @param[in] data The compressed value
+ * @param[in] len Length of the compressed value
+ * @param[out] out Location where the value is saved
+ *
+ * @return true if decompressed, false if `data` is corrupt
+ */
+bool decompress_value(const char *data, size_t len, std::string &out);
+
+#endif
@@ -2,8 +2,7 @@
  * @file conn.cpp
  *
  * @brief Implements functions to establish connections between servers and clients
- * over the network. Currently, server & client connections over the local network
- * are implemented.
+ * over TCP on IPv4 or IPv6 addresses, or over Unix domain sockets.
  *
  * @cite referred code examples available on student website of `Computer Systems: A Programmer's
  * Perspective, 3/E (CS:APP3e)` (https://csapp.cs.cmu.edu/3e/ics3/code/src/csapp.c)
@@ -11,9 +10,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "conn.hpp"
 
 // #define DEBUG
@@ -24,9 +27,148 @@
 #define dbg_perror(...) ((void)((0)))
 #endif
 
-#define LOCALHOST "127.0.0.1"
 #define CONN_BUFFER 2048
 
+/**
+ * @brief Endpoint of a TCP server
+ *
+ * @param[in] port The port
+ * @param[in] host Numeric IPv4 or IPv6 address of the server
+ *
+ * @return the endpoint
+ */
+endpoint_t tcp_endpoint(int port, const std::string &host)
+{
+    endpoint_t ep;
+    ep.host = host;
+    ep.port = port;
+    return ep;
+}
+
+/**
+ * @brief Endpoint of a server listening on a Unix domain socket
+ *
+ * @param[in] path The socket file
+ * @param[in] port Optional port naming the server, see `endpoint_t`
+ *
+ * @return the endpoint
+ */
+endpoint_t unix_endpoint(const std::string &path, int port)
+{
+    endpoint_t ep;
+    ep.transport = TRANSPORT_UNIX;
+    ep.host = "";
+    ep.path = path;
+    ep.port = port;
+    return ep;
+}
+
+/**
+ * @brief Parse an endpoint written as `port`, `address:port`,
+ * `[ipv6 address]:port`, `unix:path` or `shm:path`
+ *
+ * @param[in] spec The written endpoint
+ * @param[out] ep Location where the endpoint is stored
+ *
+ * @return 0 if `spec` was understood, else -1
+ */
+int parse_endpoint(const std::string &spec, endpoint_t *ep)
+{
+    if (spec.compare(0, 5, "unix:") == 0)
+    {
+        if (spec.size() == 5)
+            return -1;
+        *ep = unix_endpoint(spec.substr(5));
+        return 0;
+    }
+    if (spec.compare(0, 4, "shm:") == 0)
+    {
+        if (spec.size() == 4)
+            return -1;
+        *ep = unix_endpoint(spec.substr(4));
+        ep->transport = TRANSPORT_SHM;
+        return 0;
+    }
+
+    std::string host = LOCALHOST, port = spec;
+    size_t colon = spec.rfind(':');
+    if (colon != std::string::npos)
+    {
+        host = spec.substr(0, colon);
+        port = spec.substr(colon + 1);
+        if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+    }
+
+    char *end;
+    long p = strtol(port.c_str(), &end, 10);
+    if (port.empty() || *end || p <= 0 || p > 65535)
+        return -1;
+    *ep = tcp_endpoint(p, host);
+    return 0;
+}
+
+/**
+ * @brief The endpoint in the form read by `parse_endpoint()`
+ *
+ * @param[in] ep The endpoint
+ *
+ * @return the written endpoint
+ */
+std::string endpoint_str(const endpoint_t &ep)
+{
+    if (ep.transport == TRANSPORT_UNIX)
+        return "unix:" + ep.path;
+    if (ep.transport == TRANSPORT_SHM)
+        return "shm:" + ep.path;
+    if (ep.host.find(':') != std::string::npos)
+        return "[" + ep.host + "]:" + std::to_string(ep.port);
+    return ep.host + ":" + std::to_string(ep.port);
+}
+
+/**
+ * @brief Fill the socket address of an endpoint
+ *
+ * @param[in] ep The endpoint
+ * @param[out] addr Location where the address is stored
+ *
+ * @return length of the address, 0 if the endpoint is invalid
+ */
+static socklen_t make_addr(const endpoint_t &ep, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (ep.transport != TRANSPORT_TCP)
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)addr;
+        if (ep.path.empty() || ep.path.size() >= sizeof(un->sun_path))
+        {
+            errno = ENAMETOOLONG;
+            return 0;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, ep.path.c_str(), ep.path.size() + 1);
+        return sizeof(*un);
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    if (inet_pton(AF_INET, ep.host.c_str(), &in->sin_addr) == 1)
+    {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(ep.port);
+        return sizeof(*in);
+    }
+
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    if (inet_pton(AF_INET6, ep.host.c_str(), &in6->sin6_addr) == 1)
+    {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(ep.port);
+        return sizeof(*in6);
+    }
+    errno = EINVAL;
+    return 0;
+}
+
 /**
  * Open a socket where the server can listen for connections
  *
@@ -35,27 +177,58 @@
  * @return listener descriptor if no error was encountered, else, -1
  */
 int start_listener(int port)
+{
+    return start_listener(tcp_endpoint(port));
+}
+
+/**
+ * Open a socket where the server can listen for connections. The
+ * file of a Unix domain socket left behind by an earlier server is
+ * replaced.
+ *
+ * @param[in] ep The endpoint to listen on
+ * @param[in] reuse_port Bind with `SO_REUSEPORT`, so that several
+ * sockets listen on the same TCP port and the kernel spreads new
+ * connections over them
+ *
+ * @return listener descriptor if no error was encountered, else, -1
+ */
+int start_listener(const endpoint_t &ep, bool reuse_port)
 {
     int listenfd, opt = 1; // server listener descriptor, option for setsockopt
 
-    // address to bind to, AF_INET for IPv4
-    struct sockaddr_in addr = {.sin_family = AF_INET,
-                               .sin_addr.s_addr = inet_addr(LOCALHOST),
-                               .sin_port = htons(port)};
+    // address to bind to
+    struct sockaddr_storage addr;
+    socklen_t addr_len = make_addr(ep, &addr);
+    if (!addr_len)
+    {
+        dbg_perror("[server] invalid address to listen on");
+        return -1;
+    }
 
     // The socket where server should listen for new connection requests
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if ((listenfd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
     {
         dbg_perror("[server] couldn't create listenfd");
         return -1;
     }
 
     // Options to avoid errors during bind
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
+    if (ep.transport != TRANSPORT_TCP)
+        unlink(ep.path.c_str());
+    else
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int));
+    if (reuse_port && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int)) < 0)
+    {
+        close(listenfd);
+        dbg_perror("[server] couldn't set SO_REUSEPORT");
+        return -1;
+    }
 
     // Associate `addr` to the socket `listenfd`
-    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    if (bind(listenfd, (struct sockaddr *)&addr, addr_len) < 0)
     {
+        close(listenfd);
         dbg_perror("[server] couldn't bind socket to address");
         return -1;
     }
@@ -109,26 +282,118 @@ int accept_client(int listenfd)
  * case of an error
  */
 int connect_server(int port)
+{
+    return connect_server(tcp_endpoint(port));
+}
+
+/**
+ * @brief Establish a connection with the server at an endpoint
+ *
+ * @param[in] ep The endpoint to connect to
+ *
+ * @return FD to read and write messages to server OR -1 in
+ * case of an error
+ */
+int connect_server(const endpoint_t &ep)
 {
     int clientfd;
-    // AF_INET for IPv4
-    struct sockaddr_in addr = {.sin_family = AF_INET,
-                               .sin_addr.s_addr = inet_addr(LOCALHOST),
-                               .sin_port = htons(port)};
+    struct sockaddr_storage addr;
+    socklen_t addr_len = make_addr(ep, &addr);
+    if (!addr_len)
+    {
+        dbg_perror("[client] Invalid server address");
+        return -1;
+    }
 
     // Open a socket to communicate with server
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if ((clientfd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0)
     {
         dbg_perror("[client] Couldn't create socket");
         return -1;
     }
 
     // establish connection
-    if (connect(clientfd, (struct sockaddr *)&addr, sizeof(sockaddr)) < 0)
+    if (connect(clientfd, (struct sockaddr *)&addr, addr_len) < 0)
     {
         close(clientfd);
         dbg_perror("[client] Couldn't connect to the server");
         return -1;
     }
     return clientfd;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Start to establish a connection with server running on
+ * localhost without waiting for it. The returned FD becomes
+ * writable once the attempt is over, then `finish_connect()`
+ * tells how it went.
+ *
+ * @param[in] port The port to connect to
+ *
+ * @return FD of the connection in progress OR -1 in case of
+ * an error
+ */
+int start_connect(int port)
+{
+    return start_connect(tcp_endpoint(port));
+}
+
+/**
+ * @brief Start to establish a connection with the server at an
+ * endpoint without waiting for it, see `start_connect(int)`
+ *
+ * @param[in] ep The endpoint to connect to
+ *
+ * @return FD of the connection in progress OR -1 in case of
+ * an error
+ */
+int start_connect(const endpoint_t &ep)
+{
+    int clientfd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = make_addr(ep, &addr);
+    if (!addr_len)
+    {
+        dbg_perror("[client] Invalid server address");
+        return -1;
+    }
+
+    if ((clientfd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    {
+        dbg_perror("[client] Couldn't create socket");
+        return -1;
+    }
+
+    // a refused connection on localhost usually fails right here,
+    // one over a Unix domain socket either succeeds or fails here
+    if (connect(clientfd, (struct sockaddr *)&addr, addr_len) < 0 &&
+        errno != EINPROGRESS)
+    {
+        close(clientfd);
+        dbg_perror("[client] Couldn't connect to the server");
+        return -1;
+    }
+    return clientfd;
+}
+
+/**
+ * @brief Complete a connection attempt started with
+ * `start_connect()` and make the FD blocking again
+ *
+ * @param[in] fd The FD returned by `start_connect()`
+ *
+ * @return 0 if connected, -1 if the attempt failed
+ */
+int finish_connect(int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+    {
+        errno = err;
+        dbg_perror("[client] Couldn't connect to the server");
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0 ? -1 : 0;
+}
@@ -1,11 +1,102 @@
 /**
  * @file conn.hpp
  *
- * @brief Provides functions to establish server/client connections
- * over the network. Currently, both server/client assumed to be connected
- * over the local network.
+ * @brief Provides functions to establish server/client connections.
+ * A server listens, and a client connects, on an endpoint: TCP over
+ * an IPv4 or IPv6 address, or a Unix domain socket for a client on
+ * the same host. The functions taking a bare port use TCP on
+ * localhost.
  */
 
+#ifndef CONN_H
+#define CONN_H
+
+#include <string>
+
+#define LOCALHOST "127.0.0.1"
+
+/**
+ * @brief How a connection is carried
+ */
+enum transport_t
+{
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX,
+    TRANSPORT_SHM, // shared memory rings, set up over a Unix domain socket
+};
+
+/**
+ * @brief Where a server listens, or a client connects to
+ */
+struct endpoint_t
+{
+    transport_t transport = TRANSPORT_TCP;
+
+    /* numeric IPv4 or IPv6 address, TCP only */
+    std::string host = LOCALHOST;
+
+    /* the TCP port. A client also places the server on its ring
+     * by it, for a Unix domain socket by its path if it is 0 */
+    int port = 0;
+
+    /* file of the socket, Unix domain sockets and shared memory only */
+    std::string path = "";
+};
+
+/**
+ * @brief Endpoint of a TCP server
+ *
+ * @param[in] port The port
+ * @param[in] host Numeric IPv4 or IPv6 address of the server
+ *
+ * @return the endpoint
+ */
+endpoint_t tcp_endpoint(int port, const std::string &host = LOCALHOST);
+
+/**
+ * @brief Endpoint of a server listening on a Unix domain socket
+ *
+ * @param[in] path The socket file
+ * @param[in] port Optional port naming the server, see `endpoint_t`
+ *
+ * @return the endpoint
+ */
+endpoint_t unix_endpoint(const std::string &path, int port = 0);
+
+/**
+ * @brief Parse an endpoint written as `port`, `address:port`,
+ * `[ipv6 address]:port`, `unix:path` or `shm:path`
+ *
+ * @param[in] spec The written endpoint
+ * @param[out] ep Location where the endpoint is stored
+ *
+ * @return 0 if `spec` was understood, else -1
+ */
+int parse_endpoint(const std::string &spec, endpoint_t *ep);
+
+/**
+ * @brief The endpoint in the form read by `parse_endpoint()`
+ *
+ * @param[in] ep The endpoint
+ *
+ * @return the written endpoint
+ */
+std::string endpoint_str(const endpoint_t &ep);
+
+/**
+ * Open a socket where the server can listen for connections. The
+ * file of a Unix domain socket left behind by an earlier server is
+ * replaced.
+ *
+ * @param[in] ep The endpoint to listen on
+ * @param[in] reuse_port Bind with `SO_REUSEPORT`, so that several
+ * sockets listen on the same TCP port and the kernel spreads new
+ * connections over them
+ *
+ * @return listener descriptor if no error was encountered, else, -1
+ */
+int start_listener(const endpoint_t &ep, bool reuse_port = false);
+
 /**
  * Open a socket where the server can listen for connections
  *
@@ -36,4 +127,50 @@ int accept_client(int listenfd);
  * @return FD to read and write messages to server OR -1 in
  * case of an error
  */
-int connect_server(int port);
\ No newline at end of file
+int connect_server(int port);
+
+/**
+ * @brief Establish a connection with the server at an endpoint
+ *
+ * @param[in] ep The endpoint to connect to
+ *
+ * @return FD to read and write messages to server OR -1 in
+ * case of an error
+ */
+int connect_server(const endpoint_t &ep);
+
+/**
+ * @brief Start to establish a connection with server running on
+ * localhost without waiting for it. The returned FD becomes
+ * writable once the attempt is over, then `finish_connect()`
+ * tells how it went.
+ *
+ * @param[in] port The port to connect to
+ *
+ * @return FD of the connection in progress OR -1 in case of
+ * an error
+ */
+int start_connect(int port);
+
+/**
+ * @brief Start to establish a connection with the server at an
+ * endpoint without waiting for it, see `start_connect(int)`
+ *
+ * @param[in] ep The endpoint to connect to
+ *
+ * @return FD of the connection in progress OR -1 in case of
+ * an error
+ */
+int start_connect(const endpoint_t &ep);
+
+/**
+ * @brief Complete a connection attempt started with
+ * `start_connect()` and make the FD blocking again
+ *
+ * @param[in] fd The FD returned by `start_connect()`
+ *
+ * @return 0 if connected, -1 if the attempt failed
+ */
+int finish_connect(int fd);
+
+#endif
@@ -23,6 +23,50 @@ std::string mtype_to_str(msg_type_t type)
         return "Hit Response";
     case resp_miss_t:
         return "Miss Response";
+    case resp_error_t:
+        return "Error Response";
+    case req_ping_t:
+        return "Ping Request";
+    case resp_pong_t:
+        return "Pong Response";
+    case req_stats_t:
+        return "Stats Request";
+    case resp_stats_t:
+        return "Stats Response";
+    case req_incr_t:
+        return "Incr Request";
+    case req_decr_t:
+        return "Decr Request";
+    case req_append_t:
+        return "Append Request";
+    case req_prepend_t:
+        return "Prepend Request";
+    case req_cas_t:
+        return "Cas Request";
+    case resp_exists_t:
+        return "Exists Response";
+    case req_lease_get_t:
+        return "Lease Get Request";
+    case req_lease_put_t:
+        return "Lease Put Request";
+    case resp_lease_t:
+        return "Lease Response";
+    case resp_lease_wait_t:
+        return "Lease Wait Response";
+    case resp_stale_hit_t:
+        return "Stale Hit Response";
+    case req_delete_t:
+        return "Delete Request";
+    case req_flush_all_t:
+        return "Flush All Request";
+    case req_shm_attach_t:
+        return "Shm Attach Request";
+    case req_scan_t:
+        return "Scan Request";
+    case resp_scan_item_t:
+        return "Scan Item Response";
+    case req_add_t:
+        return "Add Request";
     default:
         return "Invalid Type";
     }
@@ -69,4 +113,15 @@ void Logger::display_msg(std::string prompt, msg_t *msg_p)
         printf("\tType: %s | Key: \"%s\" | Value: \"%s\"\n",
                mtype_to_str(msg_p->type).c_str(), msg_p->key, msg_p->value);
     }
-}
\ No newline at end of file
+}
+
+/**
+ * @brief indicates if logs are printed, so callers can
+ * skip building logs nobody sees
+ *
+ * @return true if so, else false
+ */
+bool Logger::enabled()
+{
+    return print_logs;
+}
@@ -31,6 +31,14 @@ public:
      */
     void display_msg(std::string prompt, msg_t *msg_p);
 
+    /**
+     * @brief indicates if logs are printed, so callers can
+     * skip building logs nobody sees
+     *
+     * @return true if so, else false
+     */
+    bool enabled();
+
 private:
     /* Flag to be set in constructor */
     bool print_logs;
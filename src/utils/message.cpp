@@ -1,7 +1,12 @@
 #include <iostream>
+#include <cstring>
+#include <errno.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "message.hpp"
+#include "shmring.hpp"
 
 /**
  * @brief validates that a given key and value are within
@@ -14,25 +19,65 @@
  */
 static bool validate_kv_size(std::string key, std::string value)
 {
-    if (key.length() > MAX_KSIZE)
+    // the key is sent with its terminator
+    if (key.length() >= MAX_KSIZE)
     {
-        printf("Cannot msg with key size greater than %d bytes",
+        printf("Cannot msg with key size of %d bytes or more",
                MAX_KSIZE);
         return false;
     }
 
-    if (value.length() > MAX_VSIZE)
+    if (value.length() > UINT32_MAX)
     {
-        printf("Cannot msg with value size greater than %d bytes",
-               MAX_VSIZE);
+        printf("Cannot msg with value size greater than %u bytes",
+               UINT32_MAX);
         return false;
     }
     return true;
 }
 
+/**
+ * @brief read exactly `len` bytes, waiting for each part
+ *
+ * @return 1 if successful, -1 in case of error/EOF/timeout
+ */
+static int read_full(int connfd, char *buf, size_t len, int timeout_ms)
+{
+    if (ShmChannel *ch = shm_channel(connfd))
+        return ch->read(buf, len, timeout_ms);
+
+    struct pollfd pfd = {.fd = connfd, .events = POLLIN, .revents = POLLIN};
+    while (len > 0)
+    {
+        if (timeout_ms > 0 && poll(&pfd, 1, timeout_ms) == 0)
+        {
+            printf("Timed out during read attempt\n");
+            return -1;
+        }
+
+        ssize_t n = read(connfd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            perror("Error during read\n");
+            return -1;
+        }
+        if (n == 0) // EOF Reached
+        {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
 /**
  * @brief Wait to read a message from as and when available
- * on connfd, and store in the location passed by reference
+ * on connfd, and store in the location passed by reference.
+ * A streamed value is left on the connection, it must be
+ * consumed with `read_value()`.
  *
  * @param[in] connfd File descriptor for client/server
  * communication on either side
@@ -41,50 +86,189 @@ static bool validate_kv_size(std::string key, std::string value)
  * @param[in] timeout_ms -1 if waiting forever is desired,
  * else pass timeout value in milliseconds.
  *
- * @return 1 if successful, -1 in case of error/EOF
+ * @return 1 if successful, -1 in case of error/EOF or a key
+ * that is not terminated
  */
 int read_msg(int connfd, msg_t *msg_p, int timeout_ms)
 {
-    struct pollfd pfd = {.fd = connfd, .events = POLL_IN, .revents = POLL_IN};
-    if (timeout_ms > 0 && poll(&pfd, 1, timeout_ms) == 0)
-    {
-        printf("Timed out during read attempt\n");
+    if (read_full(connfd, (char *)msg_p, MSG_HEADER_SIZE, timeout_ms) < 0)
+        return -1;
+    // a key cut short could be taken for another key
+    if (!memchr(msg_p->key, '\0', MAX_KSIZE))
         return -1;
+
+    if (msg_value_streamed(msg_p))
+    {
+        msg_p->value[0] = '\0';
+        return 1;
     }
+    if (read_full(connfd, msg_p->value, msg_p->vlen, timeout_ms) < 0)
+        return -1;
+    msg_p->value[msg_p->vlen] = '\0';
+    return 1;
+}
 
-    int len = read(connfd, msg_p, sizeof(*msg_p));
+/**
+ * @brief Read a streamed value that follows a message
+ *
+ * @param[in] connfd File descriptor for client/server
+ * communication on either side
+ * @param[out] buf Location where the value is read to, NULL
+ * to discard the value
+ * @param[in] len Length of the value
+ * @param[in] timeout_ms -1 if waiting forever is desired,
+ * else the longest wait for each part of the value
+ *
+ * @return 1 if successful, else -1
+ */
+int read_value(int connfd, char *buf, size_t len, int timeout_ms)
+{
+    if (buf)
+        return read_full(connfd, buf, len, timeout_ms);
 
-    if (len < 0)
+    char scratch[4096];
+    while (len > 0)
     {
-        perror("Error during read\n");
-        return -1;
+        size_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (read_full(connfd, scratch, n, timeout_ms) < 0)
+            return -1;
+        len -= n;
     }
-    if (len == 0) // EOF Reached
+    return 1;
+}
+
+/**
+ * @brief Send a message to client/server
+ *
+ * @param[in] connfd File descriptor for client/server
+ * communication on either side
+ * @param[in] msg_p Pointer to the location where the message
+ * contents are stored
+ * @param[in] value The `vlen` bytes of the value if it is
+ * streamed, written right after the message without a copy
+ *
+ * @return 1 if successful, else -1
+ */
+int send_msg(int connfd, msg_t *msg_p, const char *value)
+{
+    bool streamed = msg_value_streamed(msg_p);
+    if (streamed && !value)
     {
+        printf("Cannot send a message without its streamed value\n");
         return -1;
     }
 
+    if (ShmChannel *ch = shm_channel(connfd))
+    {
+        if (ch->write((char *)msg_p, MSG_HEADER_SIZE + (streamed ? 0 : msg_p->vlen)) < 0 ||
+            (streamed && ch->write(value, msg_p->vlen) < 0))
+            return -1;
+        return 1;
+    }
+
+    // header and value leave in a single call
+    struct iovec iov[2] = {
+        {msg_p, MSG_HEADER_SIZE + (streamed ? 0 : msg_p->vlen)},
+        {(void *)value, streamed ? msg_p->vlen : 0},
+    };
+    struct msghdr mh = {};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = streamed ? 2 : 1;
+    while (mh.msg_iovlen > 0)
+    {
+        // a peer that went away must not raise SIGPIPE
+        ssize_t n = sendmsg(connfd, &mh, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            perror("Error during writing message to conn");
+            return -1;
+        }
+        while (mh.msg_iovlen > 0 && (size_t)n >= mh.msg_iov->iov_len)
+        {
+            n -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0)
+        {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + n;
+            mh.msg_iov->iov_len -= n;
+        }
+    }
     return 1;
 }
 
 /**
- * @brief Send a message to client/server
+ * @brief Take a message from the bytes received so far on a
+ * connection that is read without blocking. A streamed value is
+ * left in `buf`, right after the message.
  *
- * @param[in] connfd File descriptor for client/server
- * communication on either side
+ * @param[in] buf The bytes received
+ * @param[in] len Number of bytes received
+ * @param[out] msg_p Location where the message is stored
+ *
+ * @return the number of bytes the message took, 0 if it was not
+ * received whole yet, -1 for a key that is not terminated
+ */
+long parse_msg(const char *buf, size_t len, msg_t *msg_p)
+{
+    if (len < MSG_HEADER_SIZE)
+        return 0;
+    memcpy(msg_p, buf, MSG_HEADER_SIZE);
+    if (!memchr(msg_p->key, '\0', MAX_KSIZE))
+        return -1;
+
+    if (msg_value_streamed(msg_p))
+    {
+        msg_p->value[0] = '\0';
+        return MSG_HEADER_SIZE;
+    }
+    if (len < MSG_HEADER_SIZE + msg_p->vlen)
+        return 0;
+    memcpy(msg_p->value, buf + MSG_HEADER_SIZE, msg_p->vlen);
+    msg_p->value[msg_p->vlen] = '\0';
+    return MSG_HEADER_SIZE + msg_p->vlen;
+}
+
+/**
+ * @brief Append a message to the bytes to send on a connection
+ * that is written without blocking
+ *
+ * @param[out] out The bytes to send
  * @param[in] msg_p Pointer to the location where the message
  * contents are stored
+ * @param[in] value The `vlen` bytes of the value if it is
+ * streamed, appended right after the message
  *
  * @return 1 if successful, else -1
  */
-int send_msg(int connfd, msg_t *msg_p)
+int append_msg(std::string &out, msg_t *msg_p, const char *value)
 {
-    if (write(connfd, msg_p, sizeof(*msg_p)) < 0)
+    bool streamed = msg_value_streamed(msg_p);
+    if (streamed && !value)
     {
-        perror("Error during writing message to conn");
+        printf("Cannot send a message without its streamed value\n");
         return -1;
     }
-    return 0;
+    out.append((const char *)msg_p, MSG_HEADER_SIZE + (streamed ? 0 : msg_p->vlen));
+    if (streamed)
+        out.append(value, msg_p->vlen);
+    return 1;
+}
+
+/**
+ * @brief copy a value into a message, or only note its length
+ * if it is too long and has to be streamed
+ */
+static void set_msg_value(msg_t *msg, const std::string &value)
+{
+    msg->vlen = value.length();
+    if (msg_value_streamed(msg))
+        return;
+    memcpy(msg->value, value.data(), value.length());
+    msg->value[value.length()] = '\0';
 }
 
 /**
@@ -96,6 +280,9 @@ int send_msg(int connfd, msg_t *msg_p)
 msg_t *make_msg_ref()
 {
     msg_t *msg = (msg_t *)malloc(sizeof(msg_t));
+    msg->vlen = 0;
+    msg->flags = 0;
+    msg->cas = 0;
     strcpy(msg->key, "");
     strcpy(msg->value, "");
     return msg;
@@ -103,15 +290,17 @@ msg_t *make_msg_ref()
 
 /**
  * @brief Create a `put` message with a KV pair. Caller should
- * free the returned reference.
+ * free the returned reference. A value longer than `MAX_VSIZE`
+ * is not copied, it must be passed to `send_msg()`.
  *
  * @param[in] key The key
  * @param[in] value The value
+ * @param[in] flags Flags stored with the value
  *
  * @return Reference to a `msg_t` instance, NULL in case of
  * greater than specified size strings passed
  */
-msg_t *create_put_msg(std::string key, std::string value)
+msg_t *create_put_msg(std::string key, std::string value, uint32_t flags)
 {
     // TODO: Validate value is non-empty
     if (!validate_kv_size(key, value))
@@ -121,8 +310,9 @@ msg_t *create_put_msg(std::string key, std::string value)
 
     msg_t *msg = make_msg_ref();
     msg->type = req_put_t;
+    msg->flags = flags;
     strcpy(msg->key, key.c_str());
-    strcpy(msg->value, value.c_str());
+    set_msg_value(msg, value);
     return msg;
 }
 
@@ -148,16 +338,210 @@ msg_t *create_get_msg(std::string key)
     return msg;
 }
 
+/**
+ * @brief Create a `cas` message, a put that only succeeds if
+ * the value is still at version `cas`. Caller should free the
+ * returned reference. A value longer than `MAX_VSIZE` is not
+ * copied, it must be passed to `send_msg()`.
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags Flags stored with the value
+ * @param[in] cas The version the value was read at
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_cas_msg(std::string key, std::string value, uint32_t flags, uint64_t cas)
+{
+    msg_t *msg = create_put_msg(key, value, flags);
+    if (msg)
+    {
+        msg->type = req_cas_t;
+        msg->cas = cas;
+    }
+    return msg;
+}
+
+/**
+ * @brief Create a `lease get` message, a get that is granted a
+ * lease if it misses. Caller should free the returned reference.
+ *
+ * @param[in] key The key
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_lease_get_msg(std::string key)
+{
+    msg_t *msg = create_get_msg(key);
+    if (msg)
+        msg->type = req_lease_get_t;
+    return msg;
+}
+
+/**
+ * @brief Create a `lease put` message, a put that only succeeds
+ * while the lease it carries is valid. Caller should free the
+ * returned reference. A value longer than `MAX_VSIZE` is not
+ * copied, it must be passed to `send_msg()`.
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags Flags stored with the value
+ * @param[in] lease The lease token granted on the miss
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_lease_put_msg(std::string key, std::string value, uint32_t flags, uint64_t lease)
+{
+    msg_t *msg = create_put_msg(key, value, flags);
+    if (msg)
+    {
+        msg->type = req_lease_put_t;
+        msg->cas = lease;
+    }
+    return msg;
+}
+
+/**
+ * @brief Create a `delete` message with just the key. Caller
+ * should free the returned reference.
+ *
+ * @param[in] key The key
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_delete_msg(std::string key)
+{
+    msg_t *msg = create_get_msg(key);
+    if (msg)
+        msg->type = req_delete_t;
+    return msg;
+}
+
+/**
+ * @brief Create a `flush_all` message, asking a server to remove
+ * every key. Caller should free the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_flush_all_msg()
+{
+    msg_t *msg = make_msg_ref();
+    msg->type = req_flush_all_t;
+    strcpy(msg->key, "");
+    strcpy(msg->value, "");
+    return msg;
+}
+
+/**
+ * @brief Create a `shm_attach` message, sent before the segment
+ * of the rings. Caller should free the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_shm_attach_msg()
+{
+    msg_t *msg = create_flush_all_msg();
+    msg->type = req_shm_attach_t;
+    return msg;
+}
+
+/**
+ * @brief Create a `scan` message, asking a server for every key
+ * whose `get_hash()` lies on the arc of the ring after `lo` up to
+ * and including `hi`, wrapping around. Caller should free the
+ * returned reference.
+ *
+ * @param[in] lo The start of the arc, not included
+ * @param[in] hi The end of the arc, the whole ring if equal to `lo`
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_scan_msg(uint32_t lo, uint32_t hi)
+{
+    msg_t *msg = create_flush_all_msg();
+    msg->type = req_scan_t;
+    msg->cas = (uint64_t)lo << 32 | hi;
+    return msg;
+}
+
+/**
+ * @brief Create a `scan item` message carrying one key of a scan
+ * with its value and flags. Caller should free the returned
+ * reference. A value longer than `MAX_VSIZE` is not copied, it
+ * must be passed to `send_msg()`.
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags The flags stored with the value
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_scan_item_msg(std::string key, std::string value, uint32_t flags)
+{
+    msg_t *msg = create_put_msg(key, value, flags);
+    if (msg)
+        msg->type = resp_scan_item_t;
+    return msg;
+}
+
+/**
+ * @brief Create an `incr` or `decr` message. Caller should
+ * free the returned reference.
+ *
+ * @param[in] key The key
+ * @param[in] delta The amount to add or subtract
+ * @param[in] decr Create a `decr` message
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_incr_msg(std::string key, uint64_t delta, bool decr)
+{
+    msg_t *msg = create_put_msg(key, std::to_string(delta));
+    if (msg)
+        msg->type = decr ? req_decr_t : req_incr_t;
+    return msg;
+}
+
+/**
+ * @brief Create an `append` or `prepend` message. Caller should
+ * free the returned reference. A value longer than `MAX_VSIZE`
+ * is not copied, it must be passed to `send_msg()`.
+ *
+ * @param[in] key The key
+ * @param[in] value The bytes to add to the value
+ * @param[in] prepend Create a `prepend` message
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_append_msg(std::string key, std::string value, bool prepend)
+{
+    msg_t *msg = create_put_msg(key, value);
+    if (msg)
+        msg->type = prepend ? req_prepend_t : req_append_t;
+    return msg;
+}
+
 /**
  * @brief Create an `ack` message. Caller should
  * free the returned reference.
  *
+ * @param[in] cas The version of the value stored
+ *
  * @return Reference to a `msg_t` instance, null in case of error
  */
-msg_t *create_ack_msg()
+msg_t *create_ack_msg(uint64_t cas)
 {
     msg_t *msg = make_msg_ref();
     msg->type = resp_ack_t;
+    msg->cas = cas;
     strcpy(msg->key, "");
     strcpy(msg->value, "");
     return msg;
@@ -165,18 +549,74 @@ msg_t *create_ack_msg()
 
 /**
  * @brief Create a `hit` message with the value.
- * Caller should free the returned reference.
+ * Caller should free the returned reference. A value longer
+ * than `MAX_VSIZE` is not copied, it must be passed to
+ * `send_msg()`.
  *
  * @param[in] value The value to be responded with
+ * @param[in] flags The flags stored with the value
+ * @param[in] cas The version of the value
  *
  * @return Reference to a `msg_t` instance, null in case of error
  */
-msg_t *create_hit_msg(std::string value)
+msg_t *create_hit_msg(std::string value, uint32_t flags, uint64_t cas)
 {
     msg_t *msg = make_msg_ref();
     msg->type = resp_hit_t;
+    msg->flags = flags;
+    msg->cas = cas;
     strcpy(msg->key, "");
-    strcpy(msg->value, value.c_str());
+    set_msg_value(msg, value);
+    return msg;
+}
+
+/**
+ * @brief Create a `stale hit` message with a value that was
+ * evicted recently, sent to clients waiting on the lease of
+ * another client. Caller should free the returned reference. A
+ * value longer than `MAX_VSIZE` is not copied, it must be passed
+ * to `send_msg()`.
+ *
+ * @param[in] value The value to be responded with
+ * @param[in] flags The flags stored with the value
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_stale_hit_msg(std::string value, uint32_t flags)
+{
+    msg_t *msg = create_hit_msg(value, flags);
+    msg->type = resp_stale_hit_t;
+    return msg;
+}
+
+/**
+ * @brief Create a `lease` message, a miss that grants the
+ * requester a lease to fill the key. Caller should free the
+ * returned reference.
+ *
+ * @param[in] lease The lease token
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_lease_msg(uint64_t lease)
+{
+    msg_t *msg = create_miss_msg();
+    msg->type = resp_lease_t;
+    msg->cas = lease;
+    return msg;
+}
+
+/**
+ * @brief Create a `lease wait` message, a miss telling the
+ * requester that another client holds the lease and to retry
+ * shortly. Caller should free the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_lease_wait_msg()
+{
+    msg_t *msg = create_miss_msg();
+    msg->type = resp_lease_wait_t;
     return msg;
 }
 
@@ -193,4 +633,102 @@ msg_t *create_miss_msg()
     strcpy(msg->key, "");
     strcpy(msg->value, "");
     return msg;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Create an `error` message, sent when a request
+ * could not be carried out. Caller should free the
+ * returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_error_msg()
+{
+    msg_t *msg = make_msg_ref();
+    msg->type = resp_error_t;
+    strcpy(msg->key, "");
+    strcpy(msg->value, "");
+    return msg;
+}
+
+/**
+ * @brief Create an `exists` message, sent when a `cas` request
+ * found the value at another version. Caller should free the
+ * returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_exists_msg()
+{
+    msg_t *msg = make_msg_ref();
+    msg->type = resp_exists_t;
+    strcpy(msg->key, "");
+    strcpy(msg->value, "");
+    return msg;
+}
+
+/**
+ * @brief Create a `ping` message, sent by clients to check
+ * that a server still responds. Caller should free the
+ * returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_ping_msg()
+{
+    msg_t *msg = make_msg_ref();
+    msg->type = req_ping_t;
+    strcpy(msg->key, "");
+    strcpy(msg->value, "");
+    return msg;
+}
+
+/**
+ * @brief Create a `pong` message, the response to a `ping`.
+ * Caller should free the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_pong_msg()
+{
+    msg_t *msg = make_msg_ref();
+    msg->type = resp_pong_t;
+    strcpy(msg->key, "");
+    strcpy(msg->value, "");
+    return msg;
+}
+
+/**
+ * @brief Create a `stats` request, asking a server for its
+ * report of top keys and key/value sizes. Caller should free
+ * the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_stats_req_msg()
+{
+    msg_t *msg = make_msg_ref();
+    msg->type = req_stats_t;
+    strcpy(msg->key, "");
+    strcpy(msg->value, "");
+    return msg;
+}
+
+/**
+ * @brief Create a `stats` response carrying a text report.
+ * Caller should free the returned reference. A report longer
+ * than `MAX_VSIZE` is not copied, it must be passed to
+ * `send_msg()`.
+ *
+ * @param[in] report The report
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_stats_resp_msg(std::string report)
+{
+    msg_t *msg = make_msg_ref();
+    msg->type = resp_stats_t;
+    strcpy(msg->key, "");
+    set_msg_value(msg, report);
+    return msg;
+}
@@ -1,9 +1,20 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/* Keys are sent with their terminator, so they are shorter */
 #define MAX_KSIZE 100
+
+/* Values up to this size are carried inside `msg_t`, longer
+ * values are streamed on the connection after the message */
 #define MAX_VSIZE 1000
 
+/* Default limit on the size of a streamed value */
+#define MAX_STREAM_VSIZE (1 << 20)
+
 /**
  * @brief Message types that can be sent to/from the
  * memcache server/client
@@ -15,22 +26,68 @@ enum msg_type_t
     resp_ack_t,
     resp_hit_t,
     resp_miss_t,
+    resp_error_t,
+    req_ping_t,  // heartbeat, answered right away
+    resp_pong_t,
+    req_stats_t, // admin, the response carries a text report
+    resp_stats_t,
+    req_incr_t,  // the delta is a decimal number in the value,
+    req_decr_t,  // the hit response carries the new number
+    req_append_t,
+    req_prepend_t,
+    req_cas_t,     // put only if the version still matches `cas`
+    resp_exists_t, // the version did not match
+    req_lease_get_t,   // a get that takes a lease on a miss
+    req_lease_put_t,   // a put carrying the lease token in `cas`
+    resp_lease_t,      // a miss, the lease token is in `cas`
+    resp_lease_wait_t, // a miss, another client holds the lease
+    resp_stale_hit_t,  // a recently evicted value, served to waiters
+    req_delete_t,
+    req_flush_all_t, // removes every key of the server
+    req_shm_attach_t, // moves the connection to shared memory rings, see shmring.hpp
+    req_scan_t,       // streams the keys of a range of the ring, see create_scan_msg()
+    resp_scan_item_t, // one key of a scan, the last one is followed by an ack
+    req_add_t,        // a put only stored if the key is absent, hands scanned keys over
 };
 
 /**
  * @brief `msg_t` type represents the format of a single
- * packet that can be sent to/from the server/client
+ * packet that can be sent to/from the server/client.
+ * The `flags` of a put are stored with the value and
+ * returned in the hit responses for it. Hit and ack responses
+ * carry the version of the value in `cas`, which a `cas`
+ * request passes back.
+ * Only the first `vlen` bytes of `value` are sent. If `vlen`
+ * is greater than `MAX_VSIZE`, `value` is left empty and the
+ * `vlen` bytes of the value follow the message instead.
  */
 struct msg_t
 {
     msg_type_t type;
+    uint32_t vlen;
+    uint32_t flags; // opaque to the server, stored with the value
+    uint64_t cas;
     char key[MAX_KSIZE];
-    char value[MAX_VSIZE];
+    char value[MAX_VSIZE + 1];
 };
 
+/* Bytes of a message sent before the value */
+#define MSG_HEADER_SIZE offsetof(msg_t, value)
+
+/**
+ * @brief Indicates if the value of a message is streamed
+ * after it instead of being carried inside
+ */
+static inline bool msg_value_streamed(const msg_t *msg_p)
+{
+    return msg_p->vlen > MAX_VSIZE;
+}
+
 /**
  * @brief Wait to read a message from as and when available
- * on connfd, and store in the location passed by reference
+ * on connfd, and store in the location passed by reference.
+ * A streamed value is left on the connection, it must be
+ * consumed with `read_value()`.
  *
  * @param[in] connfd File descriptor for client/server
  * communication on either side
@@ -39,10 +96,26 @@ struct msg_t
  * @param[in] timeout_ms -1 if waiting forever is desired,
  * else pass timeout value in milliseconds.
  *
- * @return 1 if successful, else -1
+ * @return 1 if successful, else -1, also for a key that is
+ * not terminated
  */
 int read_msg(int connfd, msg_t *msg_p, int timeout_ms);
 
+/**
+ * @brief Read a streamed value that follows a message
+ *
+ * @param[in] connfd File descriptor for client/server
+ * communication on either side
+ * @param[out] buf Location where the value is read to, NULL
+ * to discard the value
+ * @param[in] len Length of the value
+ * @param[in] timeout_ms -1 if waiting forever is desired,
+ * else the longest wait for each part of the value
+ *
+ * @return 1 if successful, else -1
+ */
+int read_value(int connfd, char *buf, size_t len, int timeout_ms);
+
 /**
  * @brief Send a message to client/server
  *
@@ -50,10 +123,40 @@ int read_msg(int connfd, msg_t *msg_p, int timeout_ms);
  * communication on either side
  * @param[in] msg_p Pointer to the location where the message
  * contents are stored
+ * @param[in] value The `vlen` bytes of the value if it is
+ * streamed, written right after the message without a copy
+ *
+ * @return 1 if successful, else -1
+ */
+int send_msg(int connfd, msg_t *msg_p, const char *value = NULL);
+
+/**
+ * @brief Take a message from the bytes received so far on a
+ * connection that is read without blocking. A streamed value is
+ * left in `buf`, right after the message.
+ *
+ * @param[in] buf The bytes received
+ * @param[in] len Number of bytes received
+ * @param[out] msg_p Location where the message is stored
+ *
+ * @return the number of bytes the message took, 0 if it was not
+ * received whole yet, -1 for a key that is not terminated
+ */
+long parse_msg(const char *buf, size_t len, msg_t *msg_p);
+
+/**
+ * @brief Append a message to the bytes to send on a connection
+ * that is written without blocking
+ *
+ * @param[out] out The bytes to send
+ * @param[in] msg_p Pointer to the location where the message
+ * contents are stored
+ * @param[in] value The `vlen` bytes of the value if it is
+ * streamed, appended right after the message
  *
  * @return 1 if successful, else -1
  */
-int send_msg(int connfd, msg_t *msg_p);
+int append_msg(std::string &out, msg_t *msg_p, const char *value = NULL);
 
 /**
  * @brief Create reference for a `msg_t` type struct.
@@ -65,15 +168,17 @@ msg_t *make_msg_ref();
 
 /**
  * @brief Create a `put` message with a KV pair. Caller should
- * free the returned reference.
+ * free the returned reference. A value longer than `MAX_VSIZE`
+ * is not copied, it must be passed to `send_msg()`.
  *
  * @param[in] key The key
  * @param[in] value The value
+ * @param[in] flags Flags stored with the value
  *
  * @return Reference to a `msg_t` instance, NULL in case of
  * greater than specified size
  */
-msg_t *create_put_msg(std::string key, std::string value);
+msg_t *create_put_msg(std::string key, std::string value, uint32_t flags = 0);
 
 /**
  * @brief Create a `get` message with just the key. Caller should
@@ -86,23 +191,199 @@ msg_t *create_put_msg(std::string key, std::string value);
  */
 msg_t *create_get_msg(std::string key);
 
+/**
+ * @brief Create a `cas` message, a put that only succeeds if
+ * the value is still at version `cas`. Caller should free the
+ * returned reference. A value longer than `MAX_VSIZE` is not
+ * copied, it must be passed to `send_msg()`.
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags Flags stored with the value
+ * @param[in] cas The version the value was read at
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_cas_msg(std::string key, std::string value, uint32_t flags, uint64_t cas);
+
+/**
+ * @brief Create a `lease get` message, a get that is granted a
+ * lease if it misses. Caller should free the returned reference.
+ *
+ * @param[in] key The key
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_lease_get_msg(std::string key);
+
+/**
+ * @brief Create a `lease put` message, a put that only succeeds
+ * while the lease it carries is valid. Caller should free the
+ * returned reference. A value longer than `MAX_VSIZE` is not
+ * copied, it must be passed to `send_msg()`.
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags Flags stored with the value
+ * @param[in] lease The lease token granted on the miss
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_lease_put_msg(std::string key, std::string value, uint32_t flags, uint64_t lease);
+
+/**
+ * @brief Create a `delete` message with just the key. Caller
+ * should free the returned reference.
+ *
+ * @param[in] key The key
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_delete_msg(std::string key);
+
+/**
+ * @brief Create a `flush_all` message, asking a server to remove
+ * every key. Caller should free the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_flush_all_msg();
+
+/**
+ * @brief Create a `shm_attach` message, sent before the segment
+ * of the rings. Caller should free the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_shm_attach_msg();
+
+/**
+ * @brief Create a `scan` message, asking a server for every key
+ * whose `get_hash()` lies on the arc of the ring after `lo` up to
+ * and including `hi`, wrapping around. The server answers with a
+ * `resp_scan_item_t` message for each key and then an ack carrying
+ * the number of keys in `cas`. Caller should free the returned
+ * reference.
+ *
+ * @param[in] lo The start of the arc, not included
+ * @param[in] hi The end of the arc, the whole ring if equal to `lo`
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_scan_msg(uint32_t lo, uint32_t hi);
+
+/**
+ * @brief Create a `scan item` message carrying one key of a scan
+ * with its value and flags. Caller should free the returned
+ * reference. A value longer than `MAX_VSIZE` is not copied, it
+ * must be passed to `send_msg()`.
+ *
+ * @param[in] key The key
+ * @param[in] value The value
+ * @param[in] flags The flags stored with the value
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_scan_item_msg(std::string key, std::string value, uint32_t flags);
+
+/**
+ * @brief Create an `incr` or `decr` message. Caller should
+ * free the returned reference.
+ *
+ * @param[in] key The key
+ * @param[in] delta The amount to add or subtract
+ * @param[in] decr Create a `decr` message
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_incr_msg(std::string key, uint64_t delta, bool decr);
+
+/**
+ * @brief Create an `append` or `prepend` message. Caller should
+ * free the returned reference. A value longer than `MAX_VSIZE`
+ * is not copied, it must be passed to `send_msg()`.
+ *
+ * @param[in] key The key
+ * @param[in] value The bytes to add to the value
+ * @param[in] prepend Create a `prepend` message
+ *
+ * @return Reference to a `msg_t` instance, NULL in case of
+ * greater than specified size
+ */
+msg_t *create_append_msg(std::string key, std::string value, bool prepend);
+
 /**
  * @brief Create an `ack` message. Caller should
  * free the returned reference.
  *
+ * @param[in] cas The version of the value stored
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_ack_msg(uint64_t cas = 0);
+
+/**
+ * @brief Create an `exists` message, sent when a `cas` request
+ * found the value at another version. Caller should free the
+ * returned reference.
+ *
  * @return Reference to a `msg_t` instance, null in case of error
  */
-msg_t *create_ack_msg();
+msg_t *create_exists_msg();
 
 /**
  * @brief Create a `hit` message with the value.
- * Caller should free the returned reference.
+ * Caller should free the returned reference. A value longer
+ * than `MAX_VSIZE` is not copied, it must be passed to
+ * `send_msg()`.
+ *
+ * @param[in] value The value to be responded with
+ * @param[in] flags The flags stored with the value
+ * @param[in] cas The version of the value
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_hit_msg(std::string value, uint32_t flags = 0, uint64_t cas = 0);
+
+/**
+ * @brief Create a `stale hit` message with a value that was
+ * evicted recently, sent to clients waiting on the lease of
+ * another client. Caller should free the returned reference. A
+ * value longer than `MAX_VSIZE` is not copied, it must be passed
+ * to `send_msg()`.
  *
  * @param[in] value The value to be responded with
+ * @param[in] flags The flags stored with the value
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_stale_hit_msg(std::string value, uint32_t flags);
+
+/**
+ * @brief Create a `lease` message, a miss that grants the
+ * requester a lease to fill the key. Caller should free the
+ * returned reference.
+ *
+ * @param[in] lease The lease token
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_lease_msg(uint64_t lease);
+
+/**
+ * @brief Create a `lease wait` message, a miss telling the
+ * requester that another client holds the lease and to retry
+ * shortly. Caller should free the returned reference.
  *
  * @return Reference to a `msg_t` instance, null in case of error
  */
-msg_t *create_hit_msg(std::string value);
+msg_t *create_lease_wait_msg();
 
 /**
  * @brief Create a `miss` message
@@ -112,4 +393,51 @@ msg_t *create_hit_msg(std::string value);
  */
 msg_t *create_miss_msg();
 
+/**
+ * @brief Create an `error` message, sent when a request
+ * could not be carried out. Caller should free the
+ * returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_error_msg();
+
+/**
+ * @brief Create a `ping` message, sent by clients to check
+ * that a server still responds. Caller should free the
+ * returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_ping_msg();
+
+/**
+ * @brief Create a `pong` message, the response to a `ping`.
+ * Caller should free the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_pong_msg();
+
+/**
+ * @brief Create a `stats` request, asking a server for its
+ * report of top keys and key/value sizes. Caller should free
+ * the returned reference.
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_stats_req_msg();
+
+/**
+ * @brief Create a `stats` response carrying a text report.
+ * Caller should free the returned reference. A report longer
+ * than `MAX_VSIZE` is not copied, it must be passed to
+ * `send_msg()`.
+ *
+ * @param[in] report The report
+ *
+ * @return Reference to a `msg_t` instance, null in case of error
+ */
+msg_t *create_stats_resp_msg(std::string report);
+
 #endif
\ No newline at end of file
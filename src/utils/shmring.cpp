@@ -0,0 +1,484 @@
+/**
+ * @file /src/utils/shmring.cpp
+ *
+ * @brief This file contains the implementation of the `ShmChannel`
+ * class and of the handshake declared in /src/utils/shmring.hpp
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "shmring.hpp"
+#include "message.hpp"
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "ring positions are used as futex words");
+
+/* channel bound to every descriptor, indexed by the descriptor */
+static std::atomic<ShmChannel *> channels[SHM_MAX_FD];
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/**
+ * @brief Sleep while `*word` is `val`, at most `timeout_ms`. The
+ * futex is not private, the two sides map the segment separately.
+ */
+static void futex_wait(std::atomic<uint32_t> *word, uint32_t val, long timeout_ms)
+{
+    struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+/**
+ * @brief Wake the side sleeping on `*word`, if it said it sleeps
+ */
+static void futex_wake(std::atomic<uint32_t> *word, std::atomic<uint32_t> *sleeping)
+{
+    // orders the store of `*word` before the load of `sleeping`,
+    // pairs with the fence in `ShmChannel::wait()`
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping->load(std::memory_order_relaxed))
+        syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * @brief Use a mapped segment
+ *
+ * @param[in] seg The segment
+ * @param[in] server Indicates if this is the server side
+ * @param[in] sockfd The socket the segment was passed over
+ */
+ShmChannel::ShmChannel(shm_seg_t *seg, bool server, int sockfd)
+    : seg(seg), sockfd(sockfd)
+{
+    // on a single CPU the peer cannot run while this side spins
+    spin = std::thread::hardware_concurrency() > 1 ? SHM_SPIN_MIN : 0;
+    in = server ? &seg->req : &seg->resp;
+    out = server ? &seg->resp : &seg->req;
+}
+
+/**
+ * @brief Unmap the segment
+ */
+ShmChannel::~ShmChannel()
+{
+    munmap(seg, sizeof(shm_seg_t));
+}
+
+/**
+ * @brief Indicates if the socket of the peer was closed
+ */
+bool ShmChannel::peer_gone()
+{
+    // nothing is sent on the socket after the handshake, so
+    // anything to read is its end
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+/**
+ * @brief Wait until `*word` is no longer `old`, spinning first
+ * and then sleeping on it
+ *
+ * @param[in] sleeping Flag telling the peer to wake this side
+ * @param[in] timeout_us The longest wait, -1 for no limit
+ *
+ * @return 0 once it changed, -1 on a timeout, -2 if the
+ * peer went away
+ */
+int ShmChannel::wait(std::atomic<uint32_t> *word, uint32_t old, std::atomic<uint32_t> *sleeping,
+                     long timeout_us)
+{
+    for (unsigned int i = 0; i < spin; i++)
+    {
+        if (word->load(std::memory_order_acquire) != old)
+        {
+            spin = std::min(spin * 2, (unsigned int)SHM_SPIN_MAX);
+            return 0;
+        }
+        cpu_relax();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    while (word->load(std::memory_order_acquire) == old)
+    {
+        if (peer_gone())
+            return -2;
+        long left_ms = SHM_CHECK_MS;
+        if (timeout_us >= 0)
+        {
+            long waited = std::chrono::duration_cast<std::chrono::microseconds>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+            if (waited >= timeout_us)
+                return -1;
+            left_ms = std::min(left_ms, (timeout_us - waited + 999) / 1000);
+        }
+
+        sleeping->store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (word->load(std::memory_order_relaxed) == old)
+            futex_wait(word, old, left_ms);
+        sleeping->store(0, std::memory_order_relaxed);
+    }
+
+    // spinning longer would have paid off if the bytes came right
+    // after this side went to sleep, unless the peer could only
+    // run once this side stopped spinning
+    auto slept = std::chrono::steady_clock::now() - start;
+    if (spin && slept < std::chrono::microseconds(50))
+        spin = std::min(spin * 2, (unsigned int)SHM_SPIN_MAX);
+    else if (spin)
+        spin = std::max(spin / 2, (unsigned int)SHM_SPIN_MIN);
+    return 0;
+}
+
+/**
+ * @brief Read exactly `len` bytes
+ *
+ * @param[out] buf Location where the bytes are read to
+ * @param[in] len The number of bytes
+ * @param[in] timeout_ms The longest wait for each part, -1 or
+ * 0 to wait until the peer goes away
+ *
+ * @return 1 if successful, -1 on a timeout or if the peer
+ * went away
+ */
+int ShmChannel::read(char *buf, size_t len, int timeout_ms)
+{
+    while (len > 0)
+    {
+        uint32_t head = in->head.load(std::memory_order_relaxed);
+        uint32_t avail = in->tail.load(std::memory_order_acquire) - head;
+        if (avail == 0)
+        {
+            int ret = wait(&in->tail, head, &in->reader_sleeping,
+                           timeout_ms > 0 ? timeout_ms * 1000L : -1);
+            if (ret == -1)
+                printf("Timed out during read attempt\n");
+            if (ret < 0)
+                return -1;
+            continue;
+        }
+
+        size_t off = head % SHM_RING_BYTES;
+        size_t n = std::min({len, (size_t)avail, SHM_RING_BYTES - off});
+        memcpy(buf, in->data + off, n);
+        in->head.store(head + n, std::memory_order_release);
+        futex_wake(&in->head, &in->writer_sleeping);
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * @brief Write `len` bytes, waiting while the ring is full
+ *
+ * @param[in] buf The bytes
+ * @param[in] len The number of bytes
+ *
+ * @return 1 if successful, -1 if the peer went away
+ */
+int ShmChannel::write(const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        uint32_t tail = out->tail.load(std::memory_order_relaxed);
+        uint32_t space = SHM_RING_BYTES - (tail - out->head.load(std::memory_order_acquire));
+        if (space == 0)
+        {
+            // the head of a full ring is a whole ring behind the tail
+            if (wait(&out->head, tail - SHM_RING_BYTES, &out->writer_sleeping, -1) < 0)
+                return -1;
+            continue;
+        }
+
+        size_t off = tail % SHM_RING_BYTES;
+        size_t n = std::min({len, (size_t)space, SHM_RING_BYTES - off});
+        memcpy(out->data + off, buf, n);
+        out->tail.store(tail + n, std::memory_order_release);
+        futex_wake(&out->tail, &out->reader_sleeping);
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * @brief Indicates if bytes can be read without waiting
+ *
+ * @return true if so, else false
+ */
+bool ShmChannel::readable()
+{
+    return in->tail.load(std::memory_order_acquire) != in->head.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Wait until bytes can be read, or the peer went away
+ *
+ * @param[in] timeout_us The longest wait, -1 for no limit
+ *
+ * @return true if a read would not wait, false on a timeout
+ */
+bool ShmChannel::wait_readable(long timeout_us)
+{
+    uint32_t head = in->head.load(std::memory_order_relaxed);
+    return wait(&in->tail, head, &in->reader_sleeping, timeout_us) != -1;
+}
+
+/**
+ * @brief pass a descriptor over a Unix domain socket, along
+ * with one byte
+ */
+static int send_fd(int sockfd, int fd)
+{
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char ctrl[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    return sendmsg(sockfd, &mh, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/**
+ * @brief receive a descriptor passed with `send_fd()`
+ *
+ * @return the descriptor, -1 if none was received
+ */
+static int recv_fd(int sockfd)
+{
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char ctrl[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+
+    if (recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+        return -1;
+    int fd;
+    memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+    return fd;
+}
+
+/**
+ * @brief Client side of the handshake: create a segment, pass it
+ * to the server over a connected Unix domain socket and bind it to
+ * the socket once the server accepted it
+ *
+ * @param[in] sockfd The socket
+ * @param[in] timeout_ms The longest wait for the server
+ *
+ * @return 0 if the connection now uses the rings, else -1
+ */
+int shm_connect(int sockfd, int timeout_ms)
+{
+    int memfd = memfd_create("memcached-mini-rings", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, sizeof(shm_seg_t)) < 0)
+    {
+        perror("[client] Couldn't create the ring segment");
+        if (memfd >= 0)
+            close(memfd);
+        return -1;
+    }
+    void *addr = mmap(NULL, sizeof(shm_seg_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror("[client] Couldn't map the ring segment");
+        close(memfd);
+        return -1;
+    }
+    shm_seg_t *seg = (shm_seg_t *)addr;
+    seg->magic = SHM_MAGIC;
+    seg->ring_bytes = SHM_RING_BYTES;
+
+    msg_t *attach = create_shm_attach_msg(), *ack = make_msg_ref();
+    bool ok = send_msg(sockfd, attach) > 0 && send_fd(sockfd, memfd) == 0 &&
+              read_msg(sockfd, ack, timeout_ms) > 0 && ack->type == resp_ack_t;
+    free(attach);
+    free(ack);
+    close(memfd);
+
+    ShmChannel *ch = new ShmChannel(seg, false, sockfd);
+    if (!ok || shm_bind(sockfd, ch) < 0)
+    {
+        delete ch;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Server side of the handshake, after a `req_shm_attach_t`
+ * message was read: receive and map the segment. The caller acks
+ * the message on the socket, and then binds the channel.
+ *
+ * @param[in] sockfd The socket
+ *
+ * @return the channel, NULL if the segment could not be used
+ */
+ShmChannel *shm_accept(int sockfd)
+{
+    int memfd = recv_fd(sockfd);
+    if (memfd < 0)
+        return NULL;
+
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(memfd, &st) == 0 && (size_t)st.st_size == sizeof(shm_seg_t))
+        addr = mmap(NULL, sizeof(shm_seg_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    shm_seg_t *seg = (shm_seg_t *)addr;
+    if (seg->magic != SHM_MAGIC || seg->ring_bytes != SHM_RING_BYTES)
+    {
+        munmap(addr, sizeof(shm_seg_t));
+        return NULL;
+    }
+    return new ShmChannel(seg, true, sockfd);
+}
+
+/**
+ * @brief Send the messages of a descriptor through a channel
+ *
+ * @param[in] fd The socket descriptor
+ * @param[in] ch The channel, owned by the binding from now on
+ *
+ * @return 0 if bound, -1 if the descriptor is too large
+ */
+int shm_bind(int fd, ShmChannel *ch)
+{
+    if (fd < 0 || fd >= SHM_MAX_FD)
+        return -1;
+    channels[fd].store(ch, std::memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief The channel bound to a descriptor
+ *
+ * @param[in] fd The descriptor
+ *
+ * @return the channel, NULL if there is none
+ */
+ShmChannel *shm_channel(int fd)
+{
+    if (fd < 0 || fd >= SHM_MAX_FD)
+        return NULL;
+    return channels[fd].load(std::memory_order_acquire);
+}
+
+/**
+ * @brief Unbind and delete the channel of a descriptor, before
+ * the descriptor is closed. Nothing is done if it has none.
+ *
+ * @param[in] fd The descriptor
+ */
+void shm_close(int fd)
+{
+    if (fd < 0 || fd >= SHM_MAX_FD)
+        return;
+    delete channels[fd].exchange(NULL);
+}
+
+/**
+ * @brief Like `poll()` for `POLLIN`, also for descriptors bound
+ * to a channel
+ *
+ * @param[in,out] fds The descriptors, negative ones are skipped
+ * @param[in] nfds Number of descriptors
+ * @param[in] timeout_us The longest wait, -1 for no limit
+ *
+ * @return the number of descriptors ready, 0 on a timeout, -1
+ * on an error
+ */
+int poll_msgs(struct pollfd *fds, nfds_t nfds, long timeout_us)
+{
+    std::vector<ShmChannel *> chs(nfds);
+    int rings = 0, waited = -1;
+    for (nfds_t i = 0; i < nfds; i++)
+    {
+        chs[i] = shm_channel(fds[i].fd);
+        if (chs[i])
+            rings++;
+        if (fds[i].fd >= 0)
+            waited = waited == -1 ? i : -2;
+    }
+
+    if (rings == 0)
+    {
+        struct timespec ts = {timeout_us / 1000000, (timeout_us % 1000000) * 1000};
+        return ppoll(fds, nfds, timeout_us >= 0 ? &ts : NULL, NULL);
+    }
+
+    // a single ring is waited for on its futex
+    if (waited >= 0)
+    {
+        fds[waited].revents = chs[waited]->wait_readable(timeout_us) ? POLLIN : 0;
+        return fds[waited].revents ? 1 : 0;
+    }
+
+    // otherwise the rings are checked between short polls of
+    // the sockets, which also tell when a peer went away
+    auto start = std::chrono::steady_clock::now();
+    while (true)
+    {
+        int ready = 0;
+        for (nfds_t i = 0; i < nfds; i++)
+        {
+            fds[i].revents = chs[i] && chs[i]->readable() ? POLLIN : 0;
+            ready += fds[i].revents != 0;
+        }
+        if (ready)
+            return ready;
+
+        long waited_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        if (timeout_us >= 0 && waited_us >= timeout_us)
+            return 0;
+        long slice_us = timeout_us >= 0 ? std::min(100L, timeout_us - waited_us) : 100L;
+        struct timespec ts = {0, slice_us * 1000};
+        ready = ppoll(fds, nfds, &ts, NULL);
+        if (ready != 0)
+            return ready;
+    }
+}
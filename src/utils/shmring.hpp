@@ -0,0 +1,219 @@
+/**
+ * @file /src/utils/shmring.hpp
+ *
+ * @brief This file contains the declaration of the `ShmChannel` class,
+ * a transport for a client and a server on the same host. Requests and
+ * responses are copied through two single-producer single-consumer
+ * byte rings in a shared memory segment instead of a socket, so a
+ * round trip needs no system call while both sides are busy.
+ *
+ * The client connects over the Unix domain socket of the server and
+ * sends a `req_shm_attach_t` message, followed by the descriptor of
+ * the segment. Once the server acknowledged it on the socket, every
+ * message of the connection goes through the rings. The socket stays
+ * open only to tell either side that the other one went away.
+ *
+ * The functions of /src/utils/message.hpp look up the channel bound
+ * to a descriptor, so callers keep using the socket descriptor. The
+ * implementation is present in /src/utils/shmring.cpp
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <atomic>
+
+/* Bytes of the ring of each direction, a power of two */
+#define SHM_RING_BYTES (256 << 10)
+
+/* A reader polls its ring this many times before it sleeps. The
+ * number grows while data keeps arriving during the polls or right
+ * after the reader went to sleep, and shrinks while it sleeps long.
+ * Readers on a single CPU do not poll. */
+#define SHM_SPIN_MIN 64
+#define SHM_SPIN_MAX 32768
+
+/* A sleeping reader wakes up this often to check if its peer went away */
+#define SHM_CHECK_MS 20
+
+/* Descriptors above this cannot be bound to a channel */
+#define SHM_MAX_FD 65536
+
+#define SHM_MAGIC 0x4d434d52 // "MCMR"
+
+/**
+ * @brief Ring of one direction. `head` and `tail` count the bytes
+ * read and written so far, and wrap around.
+ */
+struct shm_ring_t
+{
+    alignas(64) std::atomic<uint32_t> head;
+    std::atomic<uint32_t> writer_sleeping;
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> reader_sleeping;
+    alignas(64) char data[SHM_RING_BYTES];
+};
+
+/**
+ * @brief Layout of the shared segment
+ */
+struct shm_seg_t
+{
+    uint32_t magic;
+    uint32_t ring_bytes;
+    shm_ring_t req;  // client to server
+    shm_ring_t resp; // server to client
+};
+
+/**
+ * @brief The side of a connection that maps the segment
+ */
+class ShmChannel
+{
+public:
+    /**
+     * @brief Use a mapped segment
+     *
+     * @param[in] seg The segment
+     * @param[in] server Indicates if this is the server side
+     * @param[in] sockfd The socket the segment was passed over
+     */
+    ShmChannel(shm_seg_t *seg, bool server, int sockfd);
+
+    /**
+     * @brief Unmap the segment
+     */
+    ~ShmChannel();
+
+    /**
+     * @brief Read exactly `len` bytes
+     *
+     * @param[out] buf Location where the bytes are read to
+     * @param[in] len The number of bytes
+     * @param[in] timeout_ms The longest wait for each part, -1 or
+     * 0 to wait until the peer goes away
+     *
+     * @return 1 if successful, -1 on a timeout or if the peer
+     * went away
+     */
+    int read(char *buf, size_t len, int timeout_ms);
+
+    /**
+     * @brief Write `len` bytes, waiting while the ring is full
+     *
+     * @param[in] buf The bytes
+     * @param[in] len The number of bytes
+     *
+     * @return 1 if successful, -1 if the peer went away
+     */
+    int write(const char *buf, size_t len);
+
+    /**
+     * @brief Indicates if bytes can be read without waiting
+     *
+     * @return true if so, else false
+     */
+    bool readable();
+
+    /**
+     * @brief Wait until bytes can be read, or the peer went away
+     *
+     * @param[in] timeout_us The longest wait, -1 for no limit
+     *
+     * @return true if a read would not wait, false on a timeout
+     */
+    bool wait_readable(long timeout_us);
+
+private:
+    shm_seg_t *seg;
+    shm_ring_t *in;
+    shm_ring_t *out;
+    int sockfd;
+    unsigned int spin;
+
+    /**
+     * @brief Wait until `*word` is no longer `old`, spinning first
+     * and then sleeping on it
+     *
+     * @param[in] sleeping Flag telling the peer to wake this side
+     * @param[in] timeout_us The longest wait, -1 for no limit
+     *
+     * @return 0 once it changed, -1 on a timeout, -2 if the
+     * peer went away
+     */
+    int wait(std::atomic<uint32_t> *word, uint32_t old, std::atomic<uint32_t> *sleeping,
+             long timeout_us);
+
+    /**
+     * @brief Indicates if the socket of the peer was closed
+     */
+    bool peer_gone();
+};
+
+/**
+ * @brief Client side of the handshake: create a segment, pass it
+ * to the server over a connected Unix domain socket and bind it to
+ * the socket once the server accepted it
+ *
+ * @param[in] sockfd The socket
+ * @param[in] timeout_ms The longest wait for the server
+ *
+ * @return 0 if the connection now uses the rings, else -1
+ */
+int shm_connect(int sockfd, int timeout_ms);
+
+/**
+ * @brief Server side of the handshake, after a `req_shm_attach_t`
+ * message was read: receive and map the segment. The caller acks
+ * the message on the socket, and then binds the channel.
+ *
+ * @param[in] sockfd The socket
+ *
+ * @return the channel, NULL if the segment could not be used
+ */
+ShmChannel *shm_accept(int sockfd);
+
+/**
+ * @brief Send the messages of a descriptor through a channel
+ *
+ * @param[in] fd The socket descriptor
+ * @param[in] ch The channel, owned by the binding from now on
+ *
+ * @return 0 if bound, -1 if the descriptor is too large
+ */
+int shm_bind(int fd, ShmChannel *ch);
+
+/**
+ * @brief The channel bound to a descriptor
+ *
+ * @param[in] fd The descriptor
+ *
+ * @return the channel, NULL if there is none
+ */
+ShmChannel *shm_channel(int fd);
+
+/**
+ * @brief Unbind and delete the channel of a descriptor, before
+ * the descriptor is closed. Nothing is done if it has none.
+ *
+ * @param[in] fd The descriptor
+ */
+void shm_close(int fd);
+
+/**
+ * @brief Like `poll()` for `POLLIN`, also for descriptors bound
+ * to a channel
+ *
+ * @param[in,out] fds The descriptors, negative ones are skipped
+ * @param[in] nfds Number of descriptors
+ * @param[in] timeout_us The longest wait, -1 for no limit
+ *
+ * @return the number of descriptors ready, 0 on a timeout, -1
+ * on an error
+ */
+int poll_msgs(struct pollfd *fds, nfds_t nfds, long timeout_us);
+
+#endif
@@ -0,0 +1,109 @@
+/**
+ * @file /src/utils/spscqueue.hpp
+ *
+ * @brief This file contains the `SpscQueue` class template, a bounded
+ * queue between exactly one producer thread and one consumer thread.
+ * Neither side takes a lock or runs a locked instruction: each index
+ * is written by one side only, and each side keeps a copy of the
+ * index of the other one so it only reads the shared cache line when
+ * the queue looks full or empty.
+ */
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+/**
+ * @brief A bounded single-producer single-consumer queue
+ *
+ * @tparam T Type of the elements, cheap to copy
+ */
+template <typename T>
+class SpscQueue
+{
+public:
+    /**
+     * @brief Create an empty queue
+     *
+     * @param[in] capacity Number of elements it holds, rounded up
+     * to a power of two
+     */
+    SpscQueue(size_t capacity)
+    {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        slots.resize(n);
+        mask = n - 1;
+    }
+
+    /**
+     * @brief Add an element at the tail, producer only
+     *
+     * @param[in] elem The element
+     *
+     * @return true if added, false if the queue is full
+     */
+    bool push(const T &elem)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head_cache > mask)
+        {
+            head_cache = head.load(std::memory_order_acquire);
+            if (t - head_cache > mask)
+                return false;
+        }
+        slots[t & mask] = elem;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Remove the element at the head, consumer only
+     *
+     * @param[out] elem Location where the element is copied
+     *
+     * @return true if removed, false if the queue is empty
+     */
+    bool pop(T &elem)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail_cache)
+        {
+            tail_cache = tail.load(std::memory_order_acquire);
+            if (h == tail_cache)
+                return false;
+        }
+        elem = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Indicates if the queue holds no element, as last
+     * published by the producer, consumer only
+     *
+     * @return true if so, else false
+     */
+    bool empty()
+    {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> slots;
+    size_t mask;
+
+    // read and written by the consumer
+    alignas(64) std::atomic<size_t> head = {0};
+    size_t tail_cache = 0;
+
+    // read and written by the producer
+    alignas(64) std::atomic<size_t> tail = {0};
+    size_t head_cache = 0;
+};
+
+#endif
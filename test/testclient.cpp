@@ -7,10 +7,18 @@
 #include <unistd.h>
 #include <iostream>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <thread>
 #include <vector>
 #include "../src/client/client.hpp"
+#include "../src/proxy/proxy.hpp"
 #include "../src/server/server.hpp"
 #include "../src/utils/colors.hpp"
+#include "../src/utils/conn.hpp"
+#include "../src/utils/shmring.hpp"
 
 using namespace std;
 
@@ -50,6 +58,26 @@ public:
         return true;
     }
 
+    bool test_connected(int port)
+    {
+        for (Connection *s : server_pool)
+            if (s->get_port() == port)
+                return s->is_connected();
+        return false;
+    }
+
+    int primary_port(std::string key)
+    {
+        return select_replicas(key)[0]->get_port();
+    }
+
+    void test_warm_up(int port)
+    {
+        for (Connection *s : server_pool)
+            if (s->get_port() == port)
+                warm_up(s);
+    }
+
     bool test_put(std::string key, std::string val)
     {
         msg_t *resp = make_msg_ref();
@@ -72,6 +100,18 @@ public:
         return success;
     }
 
+    bool test_get_streamed(std::string key, std::string val)
+    {
+        msg_t *resp = make_msg_ref();
+        std::vector<char> buf(val.size());
+        bool success = send_get_req(key, resp) == val &&
+                       send_get_req(key, buf.data(), buf.size(), resp) == (long)val.size() &&
+                       std::string(buf.data(), buf.size()) == val &&
+                       send_get_req(key, buf.data(), buf.size() - 1, resp) == -1;
+        free(resp);
+        return success;
+    }
+
     bool test_get_miss(std::string key)
     {
         msg_t *resp = make_msg_ref();
@@ -121,13 +161,1059 @@ void testBasicClientOneServer()
     test("test_get_hit: (key1, expected: val1)", cl.test_get_hit("key1", "val1"));
     test("test_get_miss: (key1, expected: miss)", cl.test_get_miss("key2"));
 
+    // keys longer than the message holds are refused, not cut short
+    string longest(MAX_KSIZE - 1, 'k');
+    msg_t *too_long = create_put_msg(longest + "k", "v");
+    test("test_put: (longest key)", cl.test_put(longest, "v") && cl.test_get_hit(longest, "v"));
+    test("key_too_long_rejected", too_long == NULL);
+    msg_t *raw = create_get_msg(longest);
+    raw->key[MAX_KSIZE - 1] = 'k';
+    msg_t *resp = make_msg_ref();
+    int fd = connect_server(6060);
+    test("unterminated_key_closes_connection", write(fd, raw, MSG_HEADER_SIZE) == (ssize_t)MSG_HEADER_SIZE &&
+                                                   read_msg(fd, resp, 2000) < 0);
+    close(fd);
+    free(raw);
+    free(resp);
+
+    cl.close_client();
+    server.close_server();
+}
+
+void testTransports()
+{
+    server_opts_t uds_opts, v6_opts;
+    uds_opts.unix_path = "/tmp/memcached-mini-test.sock";
+    v6_opts.bind_addr = "::1";
+    Server uds(6060, false, uds_opts), v6(6061, false, v6_opts);
+    endpoint_t ep;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("parse_endpoint: (6060)", parse_endpoint("6060", &ep) == 0 && ep.transport == TRANSPORT_TCP &&
+                                       ep.host == LOCALHOST && ep.port == 6060);
+    test("parse_endpoint: ([::1]:6061)", parse_endpoint("[::1]:6061", &ep) == 0 && ep.host == "::1" &&
+                                             endpoint_str(ep) == "[::1]:6061");
+    test("parse_endpoint: (unix:/tmp/x.sock)", parse_endpoint("unix:/tmp/x.sock", &ep) == 0 &&
+                                                   ep.transport == TRANSPORT_UNIX && ep.path == "/tmp/x.sock");
+    test("parse_endpoint: (invalid)", parse_endpoint("host:", &ep) < 0 && parse_endpoint("unix:", &ep) < 0);
+
+    vector<endpoint_t> servers = {unix_endpoint(uds_opts.unix_path), tcp_endpoint(6061, "::1")};
+    TestClient cl(servers, false);
+    bool stored = true, hit = true;
+    for (int i = 0; i < 20; i++)
+        stored = stored && cl.test_put("key" + to_string(i), "val" + to_string(i));
+    for (int i = 0; i < 20; i++)
+        hit = hit && cl.test_get_hit("key" + to_string(i), "val" + to_string(i));
+    test("test_put: (over unix socket and IPv6)", stored);
+    test("test_get_hit: (over unix socket and IPv6)", hit);
+    // only some of the keys are on the IPv6 server
+    vector<endpoint_t> v6_only = {tcp_endpoint(6061, "::1")};
+    TestClient cl2(v6_only, false);
+    msg_t *resp = make_msg_ref();
+    int on_v6 = 0;
+    for (int i = 0; i < 20; i++)
+        on_v6 += cl2.send_get_req("key" + to_string(i), resp) != "";
+    test("both_servers_used", on_v6 > 0 && on_v6 < 20);
+
+    free(resp);
+    cl.close_client();
+    cl2.close_client();
+    uds.close_server();
+    v6.close_server();
+    test("socket_file_removed", access(uds_opts.unix_path.c_str(), F_OK) < 0);
+}
+
+void testShmTransport()
+{
+    server_opts_t opts;
+    opts.unix_path = "/tmp/memcached-mini-test.sock";
+    Server server(6060, false, opts);
+    endpoint_t ep;
+    parse_endpoint("shm:" + opts.unix_path, &ep);
+    vector<endpoint_t> servers = {ep};
+    client_opts_t copts;
+    copts.compress_min = 0;
+    TestClient cl(servers, false, copts);
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("shm_endpoint_parsed", ep.transport == TRANSPORT_SHM && endpoint_str(ep) == "shm:" + opts.unix_path);
+    test("test_put: (key1, val1)", cl.test_put("key1", "val1"));
+    test("test_get_hit: (key1, expected: val1)", cl.test_get_hit("key1", "val1"));
+    test("test_get_miss: (key2, expected: miss)", cl.test_get_miss("key2"));
+
+    // a value larger than a ring is streamed through it in parts
+    string large(SHM_RING_BYTES * 3 + 7, 'x');
+    for (size_t i = 0; i < large.size(); i += 4096)
+        large[i] = 'a' + i % 26;
+    test("test_put: (large, 3 rings)", cl.test_put("large", large));
+    test("test_get_streamed: (large, 3 rings)", cl.test_get_streamed("large", large));
+
+    cl.close_client();
+    server.close_server();
+}
+
+void testReusePortListeners()
+{
+    server_opts_t opts;
+    opts.listeners = 4;
+    opts.pin_cpus = true;
+    Server server(6060, false, opts);
+    vector<int> ports = {6060};
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+
+    // clients connecting together are all accepted and served
+    vector<thread> threads;
+    atomic<int> served(0);
+    for (int t = 0; t < 16; t++)
+        threads.emplace_back([&ports, &served, t]()
+                             {
+                                 TestClient c(ports, false);
+                                 string key = "client" + to_string(t);
+                                 served += c.test_put(key, key) && c.test_get_hit(key, key);
+                                 c.close_client(); });
+    for (thread &th : threads)
+        th.join();
+    test("all_clients_served", served == 16);
+
+    server.close_server();
+    test("no_listener_after_close", connect_server(6060) < 0);
+}
+
+void testStorePerCore()
+{
+    server_opts_t opts;
+    opts.cores = 4;
+    opts.pin_cpus = true;
+    Server server(6060, false, opts);
+    vector<int> ports = {6060};
+    TestClient cl(ports, false);
+    msg_t *resp = make_msg_ref();
+    uint64_t n = 0, lease = 0;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+
+    // most keys are owned by another core than the one serving
+    // the connection
+    bool all = true;
+    for (int i = 0; i < 100; i++)
+        all = all && cl.test_put("core" + to_string(i), "v" + to_string(i));
+    for (int i = 0; i < 100; i++)
+        all = all && cl.test_get_hit("core" + to_string(i), "v" + to_string(i));
+    test("keys_of_every_core", all);
+    test("test_get_miss: (nocore, expected: miss)", cl.test_get_miss("nocore"));
+
+    // a request sent in parts does not hold up its core, and is
+    // served once whole
+    int raw = connect_server(6060);
+    msg_t *part = create_get_msg("core1");
+    bool sent = write(raw, part, 10) == 10;
+    usleep(20000);
+    auto start = chrono::steady_clock::now();
+    all = true;
+    for (int i = 0; i < 100; i++)
+        all = all && cl.test_get_hit("core" + to_string(i), "v" + to_string(i));
+    test("partial_request_does_not_stall", sent && all &&
+                                               chrono::steady_clock::now() - start < chrono::milliseconds(500));
+    sent = write(raw, (char *)part + 10, MSG_HEADER_SIZE - 10) == (ssize_t)(MSG_HEADER_SIZE - 10);
+    test("partial_request_served", sent && read_msg(raw, resp, 1000) == 1 && resp->type == resp_hit_t &&
+                                       string(resp->value, resp->vlen) == "v1");
+    free(part);
+    close(raw);
+
+    // streamed values arrive over several reads of the core
+    string big(300000, '\0');
+    for (char &c : big)
+        c = 'a' + rand() % 26;
+    test("streamed_value_on_core", cl.test_put("big", big) && cl.test_get_streamed("big", big));
+
+    string report = cl.send_stats_req(6060, resp);
+    test("stats_of_every_core", resp->type == resp_stats_t &&
+                                    report.find("key sizes\n  [") != string::npos);
+
+    test("incr_on_owner", cl.test_put("counter", "1") && cl.send_incr_req("counter", 2, &n, resp) && n == 3);
+    test("lease_on_owner", cl.send_lease_get_req("filled", &lease, resp) == "" && lease != 0 &&
+                               cl.send_lease_put_req("filled", "yes", lease, resp) &&
+                               cl.test_get_hit("filled", "yes"));
+
+    // connections on every core see the updates of each other
+    vector<thread> threads;
+    atomic<int> served(0);
+    for (int t = 0; t < 8; t++)
+        threads.emplace_back([&ports, &served]()
+                             {
+                                 TestClient c(ports, false);
+                                 msg_t *r = make_msg_ref();
+                                 uint64_t v;
+                                 bool ok = true;
+                                 for (int i = 0; i < 100; i++)
+                                     ok = ok && c.send_incr_req("counter", 1, &v, r);
+                                 served += ok;
+                                 free(r);
+                                 c.close_client(); });
+    for (thread &th : threads)
+        th.join();
+    test("concurrent_incr_not_lost", served == 8 && cl.test_get_hit("counter", "803"));
+
+    test("flush_all_cores", cl.send_flush_all_req(resp));
+    all = true;
+    for (int i = 0; i < 100; i++)
+        all = all && cl.test_get_miss("core" + to_string(i));
+    test("flushed_keys_miss", all && cl.test_put("core0", "new") && cl.test_get_hit("core0", "new"));
+
+    free(resp);
+    cl.close_client();
+    server.close_server();
+    test("no_listener_after_close", connect_server(6060) < 0);
+}
+
+void testSnapshotWarmStart()
+{
+    server_opts_t opts;
+    opts.snapshot_path = "/tmp/memcached-mini-test.snap";
+    unlink(opts.snapshot_path.c_str());
+
+    Server server(6060, false, opts);
+    vector<int> ports = {6060};
+    TestClient cl(ports, false);
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("test_put: (key1, val1)", cl.test_put("key1", "val1"));
+    test("test_put: (key2, val2)", cl.test_put("key2", "val2"));
+    test("save_snapshot", server.save_snapshot() == 2);
+    cl.close_client();
+    server.close_server();
+
+    // a new server on another port starts warm from the snapshot
+    Server restarted(6061, false, opts);
+    vector<int> new_ports = {6061};
+    TestClient cl2(new_ports, false);
+    test("test_get_hit: (key1, expected: val1)", cl2.test_get_hit("key1", "val1"));
+    test("test_get_hit: (key2, expected: val2)", cl2.test_get_hit("key2", "val2"));
+    test("test_get_miss: (key3, expected: miss)", cl2.test_get_miss("key3"));
+
+    cl2.close_client();
+    restarted.close_server();
+    unlink(opts.snapshot_path.c_str());
+}
+
+void testRestartableSegment()
+{
+    server_opts_t opts;
+    opts.store.memory_bytes = 16 << 20;
+    opts.store.segment_path = "/tmp/memcached-mini-test.seg";
+    unlink(opts.store.segment_path.c_str());
+
+    Server server(6060, false, opts);
+    vector<int> ports = {6060};
+    TestClient cl(ports, false);
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("test_put: (key1, val1)", cl.test_put("key1", "val1"));
+    cl.close_client();
+    server.close_server();
+
+    // a new server attaches to the items left in the segment
+    Server restarted(6061, false, opts);
+    vector<int> new_ports = {6061};
+    TestClient cl2(new_ports, false);
+    test("test_get_hit: (key1, expected: val1)", cl2.test_get_hit("key1", "val1"));
+    test("test_get_miss: (key2, expected: miss)", cl2.test_get_miss("key2"));
+    cl2.close_client();
+    restarted.close_server();
+
+    // a different memory size is an incompatible layout
+    opts.store.memory_bytes = 32 << 20;
+    Store resized(opts.store);
+    test("incompatible_segment_rejected", !resized.attached() && resized.size() == 0);
+    unlink(opts.store.segment_path.c_str());
+}
+
+void testLargeValues()
+{
+    Server server(6060, false);
+    vector<int> ports = {6060};
+    client_opts_t opts;
+    opts.compress_min = 0;
+    TestClient cl(ports, false, opts);
+    string large(300000, 'x'), too_large(MAX_STREAM_VSIZE + 1, 'y');
+    for (size_t i = 0; i < large.size(); i += 4096)
+        large[i] = 'a' + i % 26;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("test_put: (big, 300 KB)", cl.test_put("big", large));
+    test("test_get_streamed: (big, expected: 300 KB)", cl.test_get_streamed("big", large));
+    test("test_put: (huge, over limit)", !cl.test_put("huge", too_large));
+    test("test_get_hit: (after rejected value)", cl.test_put("key1", "val1") && cl.test_get_hit("key1", "val1"));
+
+    cl.close_client();
+    server.close_server();
+}
+
+void testCompressedValues()
+{
+    Server server(6060, false);
+    vector<int> ports = {6060};
+    TestClient cl(ports, false);
+    string json, small(100, 's');
+    for (int i = 0; json.size() < 200000; i++)
+        json += "{\"id\": " + to_string(i) + ", \"name\": \"item\", \"tags\": [\"a\", \"b\"]},";
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("test_put: (json, 200 KB)", cl.test_put("json", json));
+    test("test_put: (small, 100 B)", cl.test_put("small", small));
+    test("test_get_streamed: (json, expected: 200 KB)", cl.test_get_streamed("json", json));
+    test("test_get_hit: (small, expected: 100 B)", cl.test_get_hit("small", small));
+
+    client_stats_t st = cl.stats();
+    test("only_large_values_compressed", st.compress_attempts == 1 && st.values_compressed == 1);
+    test("compression_ratio", st.compression_ratio > 3 && st.values_decompressed == 3);
+
+    cl.close_client();
+    server.close_server();
+}
+
+void testReplicaFailover()
+{
+    map<int, Server *> servers;
+    vector<int> ports = {6060, 6061, 6062};
+    for (int port : ports)
+        servers[port] = new Server(port, false);
+    client_opts_t opts;
+    opts.replicas = 2;
+    TestClient cl(ports, false, opts);
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("test_put: (key1, val1)", cl.test_put("key1", "val1"));
+
+    // the primary goes away, the replica answers without a timeout
+    int primary = cl.primary_port("key1");
+    delete servers[primary];
+    servers.erase(primary);
+    auto start = chrono::steady_clock::now();
+    test("test_get_hit: (key1, from replica)", cl.test_get_hit("key1", "val1"));
+    test("failover_without_timeout", chrono::steady_clock::now() - start < chrono::milliseconds(500));
+    test("test_get_hit: (key1, replica is new primary)",
+         cl.primary_port("key1") != primary && cl.test_get_hit("key1", "val1"));
+
+    cl.close_client();
+    for (auto &s : servers)
+        delete s.second;
+}
+
+void testHedgedGets()
+{
+    Server s1(6060, false), s2(6061, false);
+    vector<int> ports = {6060, 6061};
+    TestClient cl(ports, false);
+    int gets = 400;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    bool stored = true, hit = true;
+    for (int i = 0; i < 20; i++)
+        stored = stored && cl.test_put("key" + to_string(i), "val" + to_string(i));
+    // past the warm-up, slow gets are hedged to the successor which
+    // misses, so every answer still comes from the primary
+    for (int i = 0; i < gets; i++)
+        hit = hit && cl.test_get_hit("key" + to_string(i % 20), "val" + to_string(i % 20));
+    test("test_get_hit: (hedged gets, all hit)", stored && hit);
+
+    client_stats_t st = cl.stats();
+    test("hedges_within_budget", st.hedges_sent <= gets * client_opts_t().hedge_budget);
+    test("hedge_miss_not_taken", st.hedges_won == 0);
+
+    cl.close_client();
+    s1.close_server();
+    s2.close_server();
+}
+
+/**
+ * @brief poll `cond` every 10 ms for at most `ms` milliseconds
+ */
+static bool eventually(int ms, function<bool()> cond)
+{
+    for (int i = 0; i < ms / 10 && !cond(); i++)
+        usleep(10000);
+    return cond();
+}
+
+void testWarmHandoff()
+{
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+
+    // servers with a store per core refuse scans, so their keys
+    // are only found through the migration window
+    for (bool scans : {true, false})
+    {
+        server_opts_t sopts;
+        sopts.cores = scans ? 0 : 2;
+        map<int, Server *> servers;
+        vector<int> ports = {6060, 6061};
+        for (int port : ports)
+            servers[port] = new Server(port, false, sopts);
+        // a hedged get answered by the previous owner would not
+        // count as a handoff hit
+        client_opts_t opts;
+        opts.hedge_budget = 0;
+        TestClient cl(ports, false, opts);
+        string mode = scans ? "copied" : "migration window";
+
+        int owner = cl.primary_port("handoff0");
+        delete servers[owner];
+        test("owner_down (" + mode + ")", eventually(3000, [&]
+                                                      { return !cl.test_connected(owner); }));
+
+        // written while the owner is away, so they land on the other server
+        bool stored = true;
+        for (int i = 0; i < 200; i++)
+            stored = stored && cl.test_put("handoff" + to_string(i), "val" + to_string(i));
+        test("test_put: (200 keys, owner down)", stored);
+
+        servers[owner] = new Server(owner, false, sopts);
+        test("owner_rejoined (" + mode + ")", eventually(3000, [&]
+                                                          { return cl.primary_port("handoff0") == owner; }));
+        bool hits = true;
+        int owned = 0;
+        for (int i = 0; i < 200; i++)
+        {
+            hits = hits && cl.test_get_hit("handoff" + to_string(i), "val" + to_string(i));
+            owned += cl.primary_port("handoff" + to_string(i)) == owner;
+        }
+        test("test_get_hit: (200 keys after rejoin, " + mode + ")", hits);
+        client_stats_t st = cl.stats();
+        test("keys_handed_off", scans ? st.handoff_keys >= (uint64_t)owned && st.handoff_hits == 0
+                                      : st.handoff_keys == 0 && st.handoff_hits >= (uint64_t)owned);
+
+        // a delete reaches the previous owner too, so the key is not
+        // served from there again
+        msg_t *resp = make_msg_ref();
+        cl.send_delete_req("handoff0", resp);
+        free(resp);
+        test("test_get_miss: (deleted during migration window)", cl.test_get_miss("handoff0"));
+
+        cl.close_client();
+        for (auto &s : servers)
+            delete s.second;
+    }
+}
+
+void testHandoffByTwoClients()
+{
+    map<int, Server *> servers;
+    vector<int> ports = {6060, 6061};
+    for (int port : ports)
+        servers[port] = new Server(port, false);
+    // a hedged get could be answered by the previous owner
+    client_opts_t opts;
+    opts.hedge_budget = 0;
+    TestClient first(ports, false, opts), second(ports, false, opts);
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    int owner = first.primary_port("handoff0");
+    delete servers[owner];
+    test("owner_down (both clients)", eventually(3000, [&]
+                                                 { return !first.test_connected(owner) &&
+                                                          !second.test_connected(owner); }));
+    test("test_put: (owner down)", first.test_put("handoff0", "old"));
+
+    servers[owner] = new Server(owner, false);
+    test("owner_rejoined (both clients)", eventually(3000, [&]
+                                                     { return first.primary_port("handoff0") == owner &&
+                                                              second.primary_port("handoff0") == owner; }));
+
+    // the second client copies the keys again after the first one
+    // wrote to the new owner, as when it reconnected later
+    test("test_put: (new owner)", first.test_put("handoff0", "new"));
+    second.test_warm_up(owner);
+    test("later_handoff_keeps_newer_value", first.test_get_hit("handoff0", "new") &&
+                                                second.test_get_hit("handoff0", "new"));
+
+    first.close_client();
+    second.close_client();
+    for (auto &s : servers)
+        delete s.second;
+}
+
+void testHotKeys()
+{
+    Server s1(6060, false), s2(6061, false);
+    vector<int> ports = {6060, 6061};
+    client_opts_t opts;
+    opts.replicas = 2;
+    opts.hot_key_min = 50;
+    opts.hot_key_ttl_ms = 200;
+    TestClient cl(ports, false, opts), cl2(ports, false, opts);
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    bool stored = cl.test_put("viral", "v1"), hit = true;
+    for (int i = 0; i < 10; i++)
+        stored = stored && cl.test_put("cold" + to_string(i), "c");
+    for (int i = 0; i < 200; i++)
+        hit = hit && cl.test_get_hit("viral", "v1") && cl.test_get_hit("cold" + to_string(i % 10), "c");
+    test("test_get_hit: (viral and cold keys)", stored && hit);
+
+    vector<hot_key_t> hot = cl.hot_keys();
+    client_stats_t st = cl.stats();
+    test("hottest_key_reported", !hot.empty() && hot[0].key == "viral" && hot[0].count >= 200);
+    test("hot_key_served_locally", st.hot_gets > 0 && st.local_hits > 0 && st.local_hits < st.hot_gets);
+
+    test("own_put_drops_local_copy", cl.test_put("viral", "v2") && cl.test_get_hit("viral", "v2"));
+    test("other_put_seen_after_ttl", cl2.test_put("viral", "v3") && cl.test_get_hit("viral", "v2"));
+    usleep(250000);
+    test("test_get_hit: (viral, expected: v3)", cl.test_get_hit("viral", "v3"));
+
+    cl.close_client();
+    cl2.close_client();
+    s1.close_server();
+    s2.close_server();
+}
+
+void testCoalescedGets()
+{
+    Server server(6060, false);
+    vector<int> ports = {6060};
+    TestClient cl(ports, false);
+    string big(64 * 1024, 'x');
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("test_put: (shared, big value)", cl.test_put("shared", big));
+
+    // threads of one client getting the same key share requests
+    vector<thread> threads;
+    atomic<int> wrong(0);
+    for (int t = 0; t < 8; t++)
+        threads.emplace_back([&cl, &big, &wrong]()
+                             {
+                                 msg_t *r = make_msg_ref();
+                                 char buf[128];
+                                 for (int i = 0; i < 100; i++)
+                                 {
+                                     if (cl.send_get_req("shared", r) != big)
+                                         wrong++;
+                                     if (cl.send_get_req("missing", buf, sizeof(buf), r) != -1 ||
+                                         r->type != resp_miss_t)
+                                         wrong++;
+                                 }
+                                 free(r); });
+    for (thread &th : threads)
+        th.join();
+    client_stats_t st = cl.stats();
+    test("coalesced_gets_correct", wrong == 0);
+    test("gets_coalesced", st.gets == 1600 && st.gets_coalesced > 0 && st.coalesce_rate > 0);
+
+    test("put_not_hidden_by_flight", cl.test_put("shared", "new") && cl.test_get_hit("shared", "new"));
+
+    cl.close_client();
+    server.close_server();
+}
+
+void testProxy()
+{
+    Server s1(6060, false), s2(6061, false);
+    Proxy proxy(6070, {tcp_endpoint(6060), tcp_endpoint(6061)}, false);
+    // applications see the proxy as their only server
+    vector<int> ports = {6070};
+    TestClient cl(ports, false);
+    msg_t *resp = make_msg_ref();
+    string big(64 * 1024, 'x');
+    uint64_t n = 0;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    bool all = true;
+    for (int i = 0; i < 50; i++)
+        all = all && cl.test_put("proxied" + to_string(i), "val" + to_string(i));
+    for (int i = 0; i < 50; i++)
+        all = all && cl.test_get_hit("proxied" + to_string(i), "val" + to_string(i));
+    test("test_put/test_get_hit: (50 keys through proxy)", all);
+    test("test_get_miss: (through proxy)", cl.test_get_miss("notproxied"));
+    test("compressed_value_passed_through", cl.test_put("big", big) && cl.test_get_streamed("big", big) &&
+                                                cl.stats().values_compressed == 1);
+
+    test("incr_through_proxy", cl.test_put("count", "41") && cl.send_incr_req("count", 1, &n, resp) &&
+                                   n == 42);
+    test("delete_through_proxy", cl.send_delete_req("count", resp) && cl.test_get_miss("count"));
+    test("stats_from_proxy", cl.send_stats_req(6070, resp).find("proxy requests") == 0);
+
+    // gets sent without waiting are forwarded together, and the
+    // second get of a key is answered by the first
+    int fd = connect_server(6070);
+    vector<string> keys = {"proxied1", "proxied2", "proxied1", "notproxied", "proxied3"};
+    string burst;
+    for (string &key : keys)
+    {
+        msg_t *get = create_get_msg(key);
+        burst.append((char *)get, MSG_HEADER_SIZE);
+        free(get);
+    }
+    test("pipelined_gets_sent", write(fd, burst.data(), burst.size()) == (ssize_t)burst.size());
+    all = true;
+    for (string &key : keys)
+    {
+        all = all && read_msg(fd, resp, 2000) > 0;
+        if (key == "notproxied")
+            all = all && resp->type == resp_miss_t;
+        else
+            all = all && resp->type == resp_hit_t && "val" + key.substr(7) == resp->value;
+    }
+    close(fd);
+    proxy_stats_t st = proxy.stats();
+    test("pipelined_gets_in_order", all);
+    test("gets_batched_and_merged", st.gets_batched >= 4 && st.gets_merged >= 1);
+
+    free(resp);
+    cl.close_client();
+    proxy.close_proxy();
+}
+
+void testBatchedGets()
+{
+    Store store;
+    string got;
+    uint32_t flags;
+    uint64_t cas;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    // more keys than one prefetch group, every other one missing
+    for (int i = 0; i < 100; i += 2)
+        store.put("key" + to_string(i), "val" + to_string(i), i);
+    vector<store_lookup_t> lookups(100);
+    for (int i = 0; i < 100; i++)
+        lookups[i].key = "key" + to_string(i);
+    store.get_batch(lookups);
+    bool same = lookups[0].hit && !lookups[1].hit;
+    for (store_lookup_t &l : lookups)
+    {
+        bool hit = store.get(l.key, got, &flags, &cas);
+        same = same && l.hit == hit && (!hit || (l.value == got && l.flags == flags && l.cas == cas));
+    }
+    store_stats_t st = store.stats();
+    test("batch_matches_single_gets", same);
+    test("batch_hits_and_misses_counted", st.ram_hits == 100 && st.misses == 100);
+
+    // the server looks up gets sent back to back together, a put
+    // among them is applied before the gets behind it
+    Server server(6060, false);
+    vector<int> ports = {6060};
+    TestClient cl(ports, false);
+    msg_t *resp = make_msg_ref();
+    bool stored = cl.test_put("a", "1") && cl.test_put("b", "2");
+    vector<msg_t *> reqs = {create_get_msg("a"), create_get_msg("missing"), create_get_msg("b"),
+                            create_put_msg("a", "3"), create_get_msg("a")};
+    string burst;
+    for (msg_t *req : reqs)
+    {
+        burst.append((char *)req, MSG_HEADER_SIZE + req->vlen);
+        free(req);
+    }
+    int fd = connect_server(6060);
+    test("pipelined_burst_sent", stored && write(fd, burst.data(), burst.size()) == (ssize_t)burst.size());
+    bool ordered = read_msg(fd, resp, 2000) > 0 && resp->type == resp_hit_t && string(resp->value, resp->vlen) == "1";
+    ordered = ordered && read_msg(fd, resp, 2000) > 0 && resp->type == resp_miss_t;
+    ordered = ordered && read_msg(fd, resp, 2000) > 0 && resp->type == resp_hit_t && string(resp->value, resp->vlen) == "2";
+    ordered = ordered && read_msg(fd, resp, 2000) > 0 && resp->type == resp_ack_t;
+    ordered = ordered && read_msg(fd, resp, 2000) > 0 && resp->type == resp_hit_t && string(resp->value, resp->vlen) == "3";
+    test("pipelined_responses_in_order", ordered);
+    close(fd);
+
+    free(resp);
+    cl.close_client();
+    server.close_server();
+}
+
+void testServerKeyStats()
+{
+    Server server(6060, false);
+    vector<int> ports = {6060};
+    client_opts_t opts;
+    opts.compress_min = 0;
+    TestClient cl(ports, false, opts);
+    msg_t *resp = make_msg_ref();
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    bool stored = cl.test_put("popular", "p") && cl.test_put("large", string(5000, 'l'));
+    for (int i = 0; i < 320; i++)
+        cl.send_get_req("popular", resp);
+    for (int i = 0; i < 16; i++)
+        cl.send_get_req("large", resp);
+    for (int i = 0; i < 64; i++)
+        cl.send_get_req("cold" + to_string(i), resp);
+
+    string report = cl.send_stats_req(6060, resp);
+    test("stats_report_received", stored && resp->type == resp_stats_t && !report.empty());
+    test("top_key_by_requests", report.find("top keys by requests\n  popular ") != string::npos);
+    test("top_key_by_value_bytes", report.find("top keys by value bytes\n  large ") != string::npos);
+    test("value_size_histogram", report.find("[4096, 8192) ") != string::npos);
+
+    free(resp);
+    cl.close_client();
+    server.close_server();
+}
+
+void testAtomicOps()
+{
+    Server server(6060, false);
+    vector<int> ports = {6060};
+    TestClient cl(ports, false);
+    msg_t *resp = make_msg_ref();
+    uint64_t n = 0;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("test_put: (counter, 10)", cl.test_put("counter", "10"));
+    test("incr: (counter, 5, expected: 15)", cl.send_incr_req("counter", 5, &n, resp) && n == 15);
+    test("decr_stops_at_zero", cl.send_decr_req("counter", 20, &n, resp) && n == 0);
+    test("incr_missing_key", !cl.send_incr_req("missing", 1, &n, resp) && resp->type == resp_miss_t);
+    test("incr_not_a_number", cl.test_put("text", "abc") && !cl.send_incr_req("text", 1, &n, resp));
+
+    // every update is applied, none is lost to a concurrent one
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.emplace_back([&ports]()
+                             {
+                                 TestClient c(ports, false);
+                                 msg_t *r = make_msg_ref();
+                                 uint64_t v;
+                                 for (int i = 0; i < 250; i++)
+                                     c.send_incr_req("counter", 1, &v, r);
+                                 free(r);
+                                 c.close_client(); });
+    for (thread &th : threads)
+        th.join();
+    test("concurrent_incr_not_lost", cl.test_get_hit("counter", "1000"));
+
+    test("append_and_prepend", cl.test_put("word", "b") && cl.send_append_req("word", "c", resp) &&
+                                   cl.send_prepend_req("word", "a", resp) && cl.test_get_hit("word", "abc"));
+
+    cl.send_get_req("word", resp);
+    uint64_t version = resp->cas;
+    test("cas_at_read_version", version != 0 && cl.send_cas_req("word", "abcd", version, resp) &&
+                                    resp->cas != version);
+    test("cas_at_old_version", !cl.send_cas_req("word", "lost", version, resp) &&
+                                   resp->type == resp_exists_t && cl.test_get_hit("word", "abcd"));
+
+    free(resp);
+    cl.close_client();
+    server.close_server();
+}
+
+void testLeases()
+{
+    server_opts_t opts;
+    opts.store.memory_bytes = 2 << 20;
+    opts.lease_ms = 500;
+    Server server(6060, false, opts);
+    vector<int> ports = {6060};
+    client_opts_t copts;
+    copts.compress_min = 0;
+    TestClient a(ports, false, copts), b(ports, false, copts);
+    msg_t *resp = make_msg_ref();
+    uint64_t lease = 0, other = 0;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    a.send_lease_get_req("leased", &lease, resp);
+    test("lease_on_first_miss", resp->type == resp_lease_t && lease != 0);
+    b.send_lease_get_req("leased", &other, resp);
+    test("second_miss_told_to_wait", resp->type == resp_lease_wait_t && other == 0);
+    test("put_without_lease_rejected", !b.send_put_req("leased", "x", resp) && resp->type == resp_exists_t);
+    test("put_with_wrong_lease_rejected", !b.send_lease_put_req("leased", "x", lease + 1, resp));
+
+    // a waiting client is served the value once the lease holder stores it
+    string waited;
+    thread waiter([&b, &waited]()
+                  {
+                      msg_t *r = make_msg_ref();
+                      uint64_t l;
+                      waited = b.send_lease_get_req("leased", &l, r);
+                      free(r); });
+    this_thread::sleep_for(chrono::milliseconds(50));
+    test("put_with_lease", a.send_lease_put_req("leased", "filled", lease, resp));
+    waiter.join();
+    test("waiter_gets_filled_value", waited == "filled");
+    test("lease_used_only_once", !a.send_lease_put_req("leased", "again", lease, resp));
+
+    a.send_lease_get_req("abandoned", &lease, resp);
+    this_thread::sleep_for(chrono::milliseconds(600));
+    b.send_lease_get_req("abandoned", &other, resp);
+    test("expired_lease_handed_on", other != 0 && other != lease &&
+                                        !a.send_lease_put_req("abandoned", "late", lease, resp));
+
+    // the value of an evicted key is served stale while it is refilled
+    string old(900, 'v');
+    a.test_put("victim", old);
+    for (int i = 0; i < 3000; i++)
+        a.test_put("filler" + to_string(i), string(900, 'f'));
+    a.send_lease_get_req("victim", &lease, resp);
+    test("evicted_key_leased", a.test_get_miss("victim") && lease != 0);
+    test("stale_hit_while_leased", b.send_lease_get_req("victim", &other, resp) == old &&
+                                       resp->type == resp_stale_hit_t && other == 0);
+
+    free(resp);
+    a.close_client();
+    b.close_client();
+    server.close_server();
+}
+
+void testDeleteAndFlushAll()
+{
+    Server server(6060, false);
+    vector<int> ports = {6060};
+    TestClient a(ports, false), b(ports, false);
+    msg_t *resp = make_msg_ref();
+    uint64_t lease = 0, other = 0;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    test("delete_present_key", a.test_put("gone", "1") && a.send_delete_req("gone", resp) &&
+                                   a.test_get_miss("gone"));
+    test("delete_missing_key", !a.send_delete_req("gone", resp) && resp->type == resp_miss_t);
+
+    // a delete ends the lease taken before it, and its value is
+    // served stale while the key is refilled
+    a.send_lease_get_req("refill", &lease, resp);
+    b.send_delete_req("refill", resp);
+    test("delete_invalidates_lease", lease != 0 && !a.send_lease_put_req("refill", "old", lease, resp));
+    a.test_put("refill", "before");
+    b.send_delete_req("refill", resp);
+    a.send_lease_get_req("refill", &lease, resp);
+    test("deleted_value_served_stale", b.send_lease_get_req("refill", &other, resp) == "before" &&
+                                           resp->type == resp_stale_hit_t);
+
+    for (int i = 0; i < 200; i++)
+        a.test_put("flushed" + to_string(i), "v");
+    auto start = chrono::steady_clock::now();
+    bool flushed = a.send_flush_all_req(resp);
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    test("flush_all_acked", flushed && ms < 100);
+    bool gone = true;
+    for (int i = 0; i < 200; i++)
+        gone = gone && a.test_get_miss("flushed" + to_string(i));
+    test("flushed_keys_miss", gone);
+    test("put_after_flush", a.test_put("flushed0", "new") && a.test_get_hit("flushed0", "new"));
+
+    free(resp);
+    a.close_client();
+    b.close_client();
+    server.close_server();
+}
+
+void testFailureDetection()
+{
+    Server server(6060, false);
+    // accepts connections into its backlog, never responds
+    int hung = start_listener(6061);
+    vector<int> ports = {6060, 6061, 6062};
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    auto start = chrono::steady_clock::now();
+    TestClient cl(ports, false);
+    test("connect_in_parallel", chrono::steady_clock::now() - start < chrono::milliseconds(200) &&
+                                    cl.test_connected(6060) && cl.test_connected(6061) &&
+                                    !cl.test_connected(6062));
+
+    Server late(6062, false);
+    test("reconnect_after_backoff", eventually(1000, [&]
+                                               { return cl.test_connected(6062); }));
+    test("hung_server_detected_by_heartbeat", eventually(3000, [&]
+                                                         { return !cl.test_connected(6061); }));
+
     cl.close_client();
+    close(hung);
+    late.close_server();
     server.close_server();
 }
 
+void testHungServerDoesNotStall()
+{
+    Server server(6060, false);
+    // accepts connections into its backlog, never responds
+    int hung = start_listener(6061);
+    vector<int> ports = {6060, 6061};
+    TestClient cl(ports, false);
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    string live_key, hung_key;
+    for (int i = 0; live_key.empty() || hung_key.empty(); i++)
+        (cl.primary_port("key" + to_string(i)) == 6060 ? live_key : hung_key) = "key" + to_string(i);
+
+    // a get waits for the hung server while other threads keep
+    // using the live one
+    thread waiter([&cl, &hung_key]()
+                  {
+                      msg_t *r = make_msg_ref();
+                      cl.send_get_req(hung_key, r);
+                      free(r); });
+    usleep(50000);
+    auto start = chrono::steady_clock::now();
+    bool served = cl.test_put(live_key, "val") && cl.test_get_hit(live_key, "val");
+    test("live_server_not_stalled", served && chrono::steady_clock::now() - start < chrono::milliseconds(500));
+    waiter.join();
+
+    cl.close_client();
+    close(hung);
+    server.close_server();
+}
+
+void testStoreGrowth()
+{
+    Store store;
+    string got;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    // every key stays reachable while buckets are split under it
+    bool found = true;
+    for (int i = 0; i < 200000; i++)
+    {
+        store.put("key" + to_string(i), to_string(i));
+        if (i % 997 == 0)
+            for (int j = 0; j <= i; j += 101)
+                found = found && store.get("key" + to_string(j), got) && got == to_string(j);
+    }
+    test("keys_found_while_growing", found && store.size() == 200000);
+    bool removed = true;
+    for (int i = 0; i < 200000; i += 2)
+        removed = removed && store.remove("key" + to_string(i));
+    test("keys_removed_after_growth", removed && store.size() == 100000 &&
+                                          !store.get("key0", got) && store.get("key1", got));
+}
+
+void testStoreEviction()
+{
+    store_opts_t opts;
+    opts.memory_bytes = 2 << 20;
+    Store store(opts);
+    string value(200, 'v'), got;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    bool stored = true;
+    for (int i = 0; i < 20000; i++)
+        stored = stored && store.put("key" + to_string(i), value);
+    test("put_beyond_memory_limit", stored && store.evictions() > 0);
+    test("recent_key_kept", store.get("key19999", got) && got == value);
+    test("oldest_key_evicted", !store.get("key0", got));
+}
+
+void testStoreClassReassignment()
+{
+    store_opts_t opts;
+    opts.memory_bytes = 4 << 20;
+    Store store(opts);
+    string small(20, 's'), got;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    for (int i = 0; i < 200000; i++)
+        store.put("small" + to_string(i), small);
+    test("small_values_fill_store", store.evictions() > 0);
+
+    // every chunk went to one class, the others take memory from it
+    bool stored = true;
+    for (int i = 0; i < 100; i++)
+        stored = stored && store.put("medium" + to_string(i), string(600, 'm'));
+    test("put_to_empty_class", stored && store.get("medium99", got) && got == string(600, 'm'));
+    stored = true;
+    for (int i = 0; i < 10; i++)
+        stored = stored && store.put("large" + to_string(i), string(100 * 1024, 'l'));
+    test("put_chained_to_empty_class", stored && store.get("large9", got) && got == string(100 * 1024, 'l'));
+    test("small_values_still_stored", store.put("small0", small) && store.get("small0", got) && got == small);
+
+    // a replace that finds no memory keeps the old value
+    test("failed_replace_keeps_value", store.put("kept", "old") &&
+                                           !store.put("kept", string(1 << 20, 'x')) &&
+                                           store.get("kept", got) && got == "old");
+}
+
+void testStoreAdmission()
+{
+    store_opts_t opts;
+    opts.memory_bytes = 2 << 20;
+    opts.admission = true;
+    Store store(opts);
+    string value(200, 'v'), got;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    for (int i = 0; i < 1000; i++)
+        store.put("hot" + to_string(i), value);
+    for (int round = 0; round < 5; round++)
+        for (int i = 0; i < 1000; i++)
+            store.get("hot" + to_string(i), got);
+
+    // a scan of keys read once, many times larger than the store
+    bool stored = true;
+    for (int i = 0; i < 20000; i++)
+        stored = stored && store.put("scan" + to_string(i), value);
+    int kept = 0;
+    for (int i = 0; i < 1000; i++)
+        kept += store.get("hot" + to_string(i), got);
+    test("scan_stored", stored && store.evictions() > 0);
+    test("hot_keys_survive_scan", kept >= 950);
+    test("scan_keys_rejected", store.stats().admission_rejects > 0);
+    test("recent_scan_key_kept", store.get("scan19999", got) && got == value);
+}
+
+void testStoreFlushAll()
+{
+    Store store;
+    string got;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    for (int i = 0; i < 10000; i++)
+        store.put("key" + to_string(i), "value");
+    store.flush_all();
+    test("flushed_key_misses", !store.get("key0", got) && !store.get("key9999", got));
+    test("put_after_flush", store.put("key0", "new") && store.get("key0", got) && got == "new");
+    test("dead_items_reclaimed", eventually(2000, [&store]()
+                                            { return store.stats().reclaimed == 10000 && store.size() == 1; }));
+}
+
+void testExtStoreTier()
+{
+    store_opts_t opts;
+    opts.memory_bytes = 2 << 20;
+    opts.ext_path = "/tmp/memcached-mini-test.ext";
+    opts.ext_bytes = 64 << 20;
+    Store store(opts);
+    string got;
+
+    cout << "\nTEST: " << __FUNCTION__ << endl;
+    bool stored = true;
+    for (int i = 0; i < 10000; i++)
+        stored = stored && store.put("key" + to_string(i), string(600, 'a' + i % 26));
+    store_stats_t st = store.stats();
+    test("values_moved_to_ext", stored && st.ext_flushes > 0 && st.evictions == 0);
+    test("ext_value_read_back", store.get("key0", got) && got == string(600, 'a'));
+    test("ext_hit_counted", store.stats().ext_hits == 1);
+    test("small_values_not_moved", store.put("small", "v") && store.get("small", got) && got == "v");
+    unlink(opts.ext_path.c_str());
+}
+
 int main(int argc, char const *argv[])
 {
     testBasicClientNoServer();
     testBasicClientOneServer();
+    testTransports();
+    testShmTransport();
+    testReusePortListeners();
+    testStorePerCore();
+    testSnapshotWarmStart();
+    testRestartableSegment();
+    testLargeValues();
+    testCompressedValues();
+    testReplicaFailover();
+    testHedgedGets();
+    testWarmHandoff();
+    testHandoffByTwoClients();
+    testHotKeys();
+    testCoalescedGets();
+    testProxy();
+    testBatchedGets();
+    testServerKeyStats();
+    testAtomicOps();
+    testLeases();
+    testDeleteAndFlushAll();
+    testFailureDetection();
+    testHungServerDoesNotStall();
+    testStoreGrowth();
+    testStoreEviction();
+    testStoreClassReassignment();
+    testStoreAdmission();
+    testStoreFlushAll();
+    testExtStoreTier();
     return 0;
 }
\ No newline at end of file
@@ -1,3 +1,3 @@
 clear
-g++ -std=c++17 -o temp2 ./testclient.cpp ../src/utils/message.cpp ../src/utils/logger.cpp ../src/utils/conn.cpp ../src/client/client.cpp ../src/hash/hash.cpp ../src/client/connection.cpp ../src/server/server.cpp
+g++ -std=c++17 -o temp2 ./testclient.cpp ../src/utils/message.cpp ../src/utils/logger.cpp ../src/utils/conn.cpp ../src/utils/shmring.cpp ../src/client/client.cpp ../src/utils/compress.cpp ../src/hash/hash.cpp ../src/client/connection.cpp ../src/client/hotkeys.cpp ../src/proxy/proxy.cpp ../src/server/server.cpp ../src/server/keysampler.cpp ../src/server/leases.cpp ../src/store/store.cpp ../src/store/snapshot.cpp ../src/store/extstore.cpp
 ./temp2 "$@"
\ No newline at end of file